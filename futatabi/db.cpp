@@ -1,14 +1,69 @@
 #include "db.h"
 
 #include "frame.pb.h"
+#include "shared/metrics.h"
 
+#include <pthread.h>
 #include <string>
 #include <unordered_set>
 
 using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// There can be multiple DB classes, so make all the metrics static.
+once_flag db_metrics_inited;
+
+atomic<int64_t> metric_db_writes{ 0 };
+atomic<int64_t> metric_db_coalesced_writes{ 0 };
+
+Summary metric_db_write_seconds;  // Time spent in the transaction.
+Summary metric_db_write_latency_seconds;  // From store_*() until committed.
+
+sqlite3_stmt *prepare_statement(sqlite3 *db, const char *sql, const char *what)
+{
+	sqlite3_stmt *stmt;
+	int ret = sqlite3_prepare_v2(db, sql, -1, &stmt, 0);
+	if (ret != SQLITE_OK) {
+		fprintf(stderr, "%s prepare: %s\n", what, sqlite3_errmsg(db));
+		exit(1);
+	}
+	return stmt;
+}
+
+// Runs a statement that returns no rows, and makes it ready for reuse.
+void run_statement(sqlite3 *db, sqlite3_stmt *stmt, const char *what)
+{
+	int ret = sqlite3_step(stmt);
+	if (ret != SQLITE_DONE) {
+		fprintf(stderr, "%s step: %s\n", what, sqlite3_errmsg(db));
+		exit(1);
+	}
+
+	ret = sqlite3_reset(stmt);
+	if (ret != SQLITE_OK) {
+		fprintf(stderr, "%s reset: %s\n", what, sqlite3_errmsg(db));
+		exit(1);
+	}
+	sqlite3_clear_bindings(stmt);
+}
+
+}  // namespace
 
 DB::DB(const string &filename)
 {
+	call_once(db_metrics_inited, [] {
+		global_metrics.add("db_writes", &metric_db_writes);
+		global_metrics.add("db_coalesced_writes", &metric_db_coalesced_writes);
+
+		vector<double> quantiles{ 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99 };
+		metric_db_write_seconds.init(quantiles, 60.0);
+		global_metrics.add("db_write_seconds", &metric_db_write_seconds);
+		metric_db_write_latency_seconds.init(quantiles, 60.0);
+		global_metrics.add("db_write_latency_seconds", &metric_db_write_latency_seconds);
+	});
+
 	int ret = sqlite3_open(filename.c_str(), &db);
 	if (ret != SQLITE_OK) {
 		fprintf(stderr, "%s: %s\n", filename.c_str(), sqlite3_errmsg(db));
@@ -49,8 +104,24 @@ DB::DB(const string &filename)
 	sqlite3_exec(db, "PRAGMA synchronous=NORMAL", nullptr, nullptr, nullptr);  // Ignore errors.
 }
 
+DB::~DB()
+{
+	{
+		lock_guard<mutex> lock(queue_mu);
+		should_quit = true;
+		queue_changed.notify_all();
+	}
+	if (writer_thread.joinable()) {
+		writer_thread.join();
+	}
+	sqlite3_close(db);
+}
+
 StateProto DB::get_state()
 {
+	flush();
+	lock_guard<mutex> lock(db_mu);
+
 	StateProto state;
 
 	sqlite3_stmt *stmt;
@@ -85,49 +156,14 @@ void DB::store_state(const StateProto &state)
 {
 	string serialized;
 	state.SerializeToString(&serialized);
-
-	int ret = sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr);
-	if (ret != SQLITE_OK) {
-		fprintf(stderr, "BEGIN: %s\n", sqlite3_errmsg(db));
-		exit(1);
-	}
-
-	ret = sqlite3_exec(db, "DELETE FROM state", nullptr, nullptr, nullptr);
-	if (ret != SQLITE_OK) {
-		fprintf(stderr, "DELETE: %s\n", sqlite3_errmsg(db));
-		exit(1);
-	}
-
-	sqlite3_stmt *stmt;
-	ret = sqlite3_prepare_v2(db, "INSERT INTO state VALUES (?)", -1, &stmt, 0);
-	if (ret != SQLITE_OK) {
-		fprintf(stderr, "INSERT prepare: %s\n", sqlite3_errmsg(db));
-		exit(1);
-	}
-
-	sqlite3_bind_blob(stmt, 1, serialized.data(), serialized.size(), SQLITE_STATIC);
-
-	ret = sqlite3_step(stmt);
-	if (ret == SQLITE_ROW) {
-		fprintf(stderr, "INSERT step: %s\n", sqlite3_errmsg(db));
-		exit(1);
-	}
-
-	ret = sqlite3_finalize(stmt);
-	if (ret != SQLITE_OK) {
-		fprintf(stderr, "INSERT finalize: %s\n", sqlite3_errmsg(db));
-		exit(1);
-	}
-
-	ret = sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr);
-	if (ret != SQLITE_OK) {
-		fprintf(stderr, "COMMIT: %s\n", sqlite3_errmsg(db));
-		exit(1);
-	}
+	queue_write(&pending_state, move(serialized));
 }
 
 SettingsProto DB::get_settings()
 {
+	flush();
+	lock_guard<mutex> lock(db_mu);
+
 	SettingsProto settings;
 
 	sqlite3_stmt *stmt;
@@ -162,49 +198,106 @@ void DB::store_settings(const SettingsProto &settings)
 {
 	string serialized;
 	settings.SerializeToString(&serialized);
+	queue_write(&pending_settings, move(serialized));
+}
 
-	int ret = sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr);
-	if (ret != SQLITE_OK) {
-		fprintf(stderr, "BEGIN: %s\n", sqlite3_errmsg(db));
-		exit(1);
+void DB::queue_write(PendingWrite *pending, string serialized)
+{
+	lock_guard<mutex> lock(queue_mu);
+	if (pending->valid) {
+		// Not written yet, so just replace it.
+		++metric_db_coalesced_writes;
+	} else {
+		pending->valid = true;
+		pending->queued = steady_clock::now();
 	}
+	pending->serialized = move(serialized);
 
-	ret = sqlite3_exec(db, "DELETE FROM settings", nullptr, nullptr, nullptr);
-	if (ret != SQLITE_OK) {
-		fprintf(stderr, "DELETE: %s\n", sqlite3_errmsg(db));
-		exit(1);
+	if (!writer_thread.joinable()) {
+		writer_thread = thread(&DB::writer_thread_func, this);
 	}
+	queue_changed.notify_all();
+}
 
-	sqlite3_stmt *stmt;
-	ret = sqlite3_prepare_v2(db, "INSERT INTO settings VALUES (?)", -1, &stmt, 0);
-	if (ret != SQLITE_OK) {
-		fprintf(stderr, "INSERT prepare: %s\n", sqlite3_errmsg(db));
-		exit(1);
-	}
+void DB::flush()
+{
+	unique_lock<mutex> lock(queue_mu);
+	queue_changed.wait(lock, [this] { return !pending_state.valid && !pending_settings.valid && !writing; });
+}
 
-	sqlite3_bind_blob(stmt, 1, serialized.data(), serialized.size(), SQLITE_STATIC);
+void DB::writer_thread_func()
+{
+	pthread_setname_np(pthread_self(), "DBWriter");
+
+	// Prepared once, and then reused for every write.
+	sqlite3_stmt *begin_stmt, *commit_stmt;
+	sqlite3_stmt *delete_state_stmt, *insert_state_stmt;
+	sqlite3_stmt *delete_settings_stmt, *insert_settings_stmt;
+	{
+		lock_guard<mutex> lock(db_mu);
+		begin_stmt = prepare_statement(db, "BEGIN", "BEGIN");
+		commit_stmt = prepare_statement(db, "COMMIT", "COMMIT");
+		delete_state_stmt = prepare_statement(db, "DELETE FROM state", "DELETE");
+		insert_state_stmt = prepare_statement(db, "INSERT INTO state VALUES (?)", "INSERT");
+		delete_settings_stmt = prepare_statement(db, "DELETE FROM settings", "DELETE");
+		insert_settings_stmt = prepare_statement(db, "INSERT INTO settings VALUES (?)", "INSERT");
+	}
+
+	for (;;) {
+		PendingWrite state, settings;
+		{
+			unique_lock<mutex> lock(queue_mu);
+			queue_changed.wait(lock, [this] { return should_quit || pending_state.valid || pending_settings.valid; });
+			if (!pending_state.valid && !pending_settings.valid) {
+				break;  // Asked to quit, and everything is written.
+			}
+			swap(state, pending_state);
+			swap(settings, pending_settings);
+			writing = true;
+		}
 
-	ret = sqlite3_step(stmt);
-	if (ret == SQLITE_ROW) {
-		fprintf(stderr, "INSERT step: %s\n", sqlite3_errmsg(db));
-		exit(1);
-	}
+		steady_clock::time_point start = steady_clock::now();
+		{
+			lock_guard<mutex> lock(db_mu);
+			run_statement(db, begin_stmt, "BEGIN");
+			if (state.valid) {
+				run_statement(db, delete_state_stmt, "DELETE");
+				sqlite3_bind_blob(insert_state_stmt, 1, state.serialized.data(), state.serialized.size(), SQLITE_STATIC);
+				run_statement(db, insert_state_stmt, "INSERT");
+			}
+			if (settings.valid) {
+				run_statement(db, delete_settings_stmt, "DELETE");
+				sqlite3_bind_blob(insert_settings_stmt, 1, settings.serialized.data(), settings.serialized.size(), SQLITE_STATIC);
+				run_statement(db, insert_settings_stmt, "INSERT");
+			}
+			run_statement(db, commit_stmt, "COMMIT");
+		}
+		steady_clock::time_point now = steady_clock::now();
 
-	ret = sqlite3_finalize(stmt);
-	if (ret != SQLITE_OK) {
-		fprintf(stderr, "INSERT finalize: %s\n", sqlite3_errmsg(db));
-		exit(1);
+		++metric_db_writes;
+		metric_db_write_seconds.count_event(duration<double>(now - start).count());
+		if (state.valid) {
+			metric_db_write_latency_seconds.count_event(duration<double>(now - state.queued).count());
+		}
+		if (settings.valid) {
+			metric_db_write_latency_seconds.count_event(duration<double>(now - settings.queued).count());
+		}
+
+		lock_guard<mutex> lock(queue_mu);
+		writing = false;
+		queue_changed.notify_all();  // Wake up flush().
 	}
 
-	ret = sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr);
-	if (ret != SQLITE_OK) {
-		fprintf(stderr, "COMMIT: %s\n", sqlite3_errmsg(db));
-		exit(1);
+	lock_guard<mutex> lock(db_mu);
+	for (sqlite3_stmt *stmt : { begin_stmt, commit_stmt, delete_state_stmt, insert_state_stmt, delete_settings_stmt, insert_settings_stmt }) {
+		sqlite3_finalize(stmt);
 	}
 }
 
 vector<DB::FrameOnDiskAndStreamIdx> DB::load_frame_file(const string &filename, size_t size, unsigned filename_idx)
 {
+	lock_guard<mutex> lock(db_mu);
+
 	FileContentsProto file_contents;
 
 	sqlite3_stmt *stmt;
@@ -244,6 +337,7 @@ vector<DB::FrameOnDiskAndStreamIdx> DB::load_frame_file(const string &filename,
 			frame.frame.pts = stream.pts(i);
 			frame.frame.offset = stream.offset(i);
 			frame.frame.size = stream.file_size(i);
+			frame.frame.proxy_size = (stream.proxy_size_size() == 0) ? 0 : stream.proxy_size(i);
 			frames.push_back(frame);
 		}
 	}
@@ -253,6 +347,8 @@ vector<DB::FrameOnDiskAndStreamIdx> DB::load_frame_file(const string &filename,
 
 void DB::store_frame_file(const string &filename, size_t size, const vector<FrameOnDiskAndStreamIdx> &frames)
 {
+	lock_guard<mutex> lock(db_mu);
+
 	int ret = sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr);
 	if (ret != SQLITE_OK) {
 		fprintf(stderr, "BEGIN: %s\n", sqlite3_errmsg(db));
@@ -285,8 +381,10 @@ void DB::store_frame_file(const string &filename, size_t size, const vector<Fram
 	// Create the protobuf blob for the new row.
 	FileContentsProto file_contents;
 	unordered_set<unsigned> seen_stream_idx;  // Usually only one.
+	bool any_proxies = false;
 	for (const FrameOnDiskAndStreamIdx &frame : frames) {
 		seen_stream_idx.insert(frame.stream_idx);
+		any_proxies |= (frame.frame.proxy_size != 0);
 	}
 	for (unsigned stream_idx : seen_stream_idx) {
 		StreamContentsProto *stream = file_contents.add_stream();
@@ -301,6 +399,9 @@ void DB::store_frame_file(const string &filename, size_t size, const vector<Fram
 			stream->add_pts(frame.frame.pts);
 			stream->add_offset(frame.frame.offset);
 			stream->add_file_size(frame.frame.size);
+			if (any_proxies) {
+				stream->add_proxy_size(frame.frame.proxy_size);
+			}
 		}
 	}
 	string serialized;
@@ -339,6 +440,8 @@ void DB::store_frame_file(const string &filename, size_t size, const vector<Fram
 
 void DB::clean_unused_frame_files(const vector<string> &used_filenames)
 {
+	lock_guard<mutex> lock(db_mu);
+
 	int ret = sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr);
 	if (ret != SQLITE_OK) {
 		fprintf(stderr, "BEGIN: %s\n", sqlite3_errmsg(db));
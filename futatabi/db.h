@@ -4,21 +4,35 @@
 #include "frame_on_disk.h"
 #include "state.pb.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <sqlite3.h>
 #include <string>
+#include <thread>
 #include <vector>
 
 class DB {
 public:
 	explicit DB(const std::string &filename);
 	DB(const DB &) = delete;
+	~DB();  // Flushes any pending writes.
 
+	// The store functions return immediately; the actual writing is done
+	// by a background thread (started on first use), so that the GUI
+	// never has to wait for the disk. If a new state (or new settings)
+	// comes in before the previous one has been written, only the newest
+	// one is written. The get functions flush first.
 	StateProto get_state();
 	void store_state(const StateProto &state);
 
 	SettingsProto get_settings();
 	void store_settings(const SettingsProto &settings);
 
+	// Waits until everything given to store_state() and store_settings()
+	// so far has been committed.
+	void flush();
+
 	struct FrameOnDiskAndStreamIdx {
 		FrameOnDisk frame;
 		unsigned stream_idx;
@@ -28,8 +42,25 @@ public:
 	void clean_unused_frame_files(const std::vector<std::string> &used_filenames);
 
 private:
+	struct PendingWrite {
+		bool valid = false;
+		std::string serialized;
+		std::chrono::steady_clock::time_point queued;  // For the oldest write that was coalesced into this one.
+	};
+
+	void queue_write(PendingWrite *pending, std::string serialized);
+	void writer_thread_func();
+
 	StateProto state;
 	sqlite3 *db;
+	std::mutex db_mu;  // Held while using <db>, since the writer thread runs transactions on it.
+
+	std::mutex queue_mu;
+	std::condition_variable queue_changed;
+	PendingWrite pending_state, pending_settings;  // Under <queue_mu>.
+	bool writing = false;  // Under <queue_mu>.
+	bool should_quit = false;  // Under <queue_mu>.
+	std::thread writer_thread;  // Under <queue_mu>.
 };
 
 #endif  // !defined(DB_H)
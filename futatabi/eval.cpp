@@ -1,41 +1,568 @@
 // Evaluate a .flo file against ground truth,
 // outputting the average end-point error.
+//
+// Usage: eval [--max-epe PIXELS] FLOW GT [FLOW GT ...]
+//        eval --cpu [--operating-point N] [--max-epe PIXELS] IMAGE0 IMAGE1 GT [IMAGE0 IMAGE1 GT ...]
+//        eval --benchmark [--cpu] [--operating-point N] [--repeat N] [--max-epe PIXELS] DIR
+//
+// With --cpu, the flow is computed from the images by CPUDISComputeFlow
+// instead of being read from a file. With --max-epe, we exit with an error
+// if the average end-point error is above the given threshold; e.g.,
+// comparing the output of “flow” and “flow --cpu” against each other
+// with --max-epe 0.25 checks that they agree within cpu_gpu_flow_tolerance
+// (a guess, not yet verified against real GPU output; see flow_cpu.h).
+//
+// With --benchmark, every pair in DIR (NAME.flo is the ground truth, and
+// NAME-0.* and NAME-1.* the two frames, in any format SDL_image understands)
+// is run through each operating point (or only the one given), on the GPU
+// (unless --cpu is given, or we cannot get an OpenGL 4.5 context) and then
+// on the CPU. The results go to stdout as JSON: The end-point error,
+// the percentage of outliers (pixels where the end-point error is above
+// both 3 pixels and 5% of the ground truth's length, like KITTI's Fl metric),
+// and the time spent in each stage of the flow computation (from GPUTimers,
+// or the CPU equivalent), averaged over the pairs. Each measurement is
+// preceded by one warmup run; --repeat averages over more than one run.
+//
+// --cpu and --benchmark need to load images (and, for the GPU, an OpenGL
+// context), so they are only available if eval was built with SDL2 and
+// SDL2_image (HAVE_SDL2); without them, only .flo files can be compared.
 
 #include "util.h"
 
+#ifdef HAVE_SDL2
+#define NO_SDL_GLEXT 1
+
+#include "flow.h"
+#include "flow_cpu.h"
+#include "gpu_timers.h"
+#include "load_image.h"
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_error.h>
+#include <SDL2/SDL_video.h>
+#include <dirent.h>
+#include <epoxy/gl.h>
+#endif
+
+#include <algorithm>
 #include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
 #include <memory>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <utility>
+#include <vector>
 
 using namespace std;
 
-double eval_flow(const char *filename1, const char *filename2);
+struct FlowError {
+	double epe;  // Average, in pixels.
+	double outlier_fraction;
+};
+
+FlowError eval_flow(const Flow &flow, const Flow &gt);
+
+#ifdef HAVE_SDL2
+struct BenchmarkPair {
+	string name;
+	unsigned width, height;
+	unique_ptr<uint8_t[]> pix0, pix1;
+	Flow gt;
+};
+
+// Stage name and total time in milliseconds, in the order the stages were first seen.
+typedef vector<pair<string, double>> StageTimes;
+
+struct BenchmarkResult {
+	const char *backend;
+	int operating_point;
+	vector<FlowError> errors;  // One per pair.
+	vector<double> total_ms;  // One per pair, averaged over the runs.
+	StageTimes stage_ms;  // Summed over all pairs and runs.
+};
+
+Flow compute_flow_cpu(const char *filename0, const char *filename1, const OperatingPoint &op);
+int run_benchmark(const char *dirname, bool use_gpu, int only_operating_point, int num_runs, double max_epe);
+
+static const OperatingPoint operating_points[] = {
+	operating_point1, operating_point2, operating_point3, operating_point4
+};
+#endif
 
 int main(int argc, char **argv)
 {
+	static const option long_options[] = {
+		{ "cpu", no_argument, 0, 1000 },
+		{ "operating-point", required_argument, 0, 1001 },
+		{ "max-epe", required_argument, 0, 1002 },
+		{ "benchmark", no_argument, 0, 1003 },
+		{ "repeat", required_argument, 0, 1004 },
+		{ 0, 0, 0, 0 }
+	};
+
+	bool use_cpu = false;
+	bool benchmark = false;
+	int operating_point = -1;
+	int num_runs = 1;
+	double max_epe = -1.0;
+	for (;;) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "", long_options, &option_index);
+
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 1000:
+			use_cpu = true;
+			break;
+		case 1001:
+			operating_point = atoi(optarg);
+			if (operating_point < 1 || operating_point > 4) {
+				fprintf(stderr, "--operating-point must be 1, 2, 3 or 4\n");
+				exit(1);
+			}
+			break;
+		case 1002:
+			max_epe = atof(optarg);
+			break;
+		case 1003:
+			benchmark = true;
+			break;
+		case 1004:
+			num_runs = atoi(optarg);
+			if (num_runs < 1) {
+				fprintf(stderr, "--repeat must be at least 1\n");
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr, "Unknown option '%s'\n", argv[option_index]);
+			exit(1);
+		};
+	}
+
+#ifndef HAVE_SDL2
+	if (use_cpu || benchmark) {
+		fprintf(stderr, "%s: --cpu and --benchmark need eval to be built with SDL2 and SDL2_image\n", argv[0]);
+		exit(1);
+	}
+	(void)operating_point;
+	(void)num_runs;
+#else
+	if (benchmark) {
+		if (argc - optind != 1) {
+			fprintf(stderr, "Usage: %s --benchmark [--cpu] [--operating-point N] [--repeat N] [--max-epe PIXELS] DIR\n", argv[0]);
+			exit(1);
+		}
+		return run_benchmark(argv[optind], !use_cpu, operating_point, num_runs, max_epe);
+	}
+
+	const OperatingPoint &op = operating_points[(operating_point == -1 ? 3 : operating_point) - 1];
+#endif
+
+	int files_per_flow = use_cpu ? 3 : 2;
+	if (argc - optind < files_per_flow || (argc - optind) % files_per_flow != 0) {
+		fprintf(stderr, "Usage: %s [--max-epe PIXELS] FLOW GT [FLOW GT ...]\n", argv[0]);
+		fprintf(stderr, "       %s --cpu [--operating-point N] [--max-epe PIXELS] IMAGE0 IMAGE1 GT [...]\n", argv[0]);
+		fprintf(stderr, "       %s --benchmark [--cpu] [--operating-point N] [--repeat N] [--max-epe PIXELS] DIR\n", argv[0]);
+		exit(1);
+	}
+
 	double sum_epe = 0.0;
 	int num_flows = 0;
-	for (int i = 1; i < argc; i += 2) {
-		sum_epe += eval_flow(argv[i], argv[i + 1]);
+	for (int i = optind; i < argc; i += files_per_flow) {
+#ifdef HAVE_SDL2
+		Flow flow = use_cpu ? compute_flow_cpu(argv[i], argv[i + 1], op) : read_flow(argv[i]);
+#else
+		Flow flow = read_flow(argv[i]);
+#endif
+		Flow gt = read_flow(argv[i + files_per_flow - 1]);
+		if (flow.width != gt.width || flow.height != gt.height) {
+			fprintf(stderr, "%s: Flow dimensions don't match (%dx%d versus %dx%d)\n",
+			        argv[i + files_per_flow - 1], flow.width, flow.height, gt.width, gt.height);
+			exit(1);
+		}
+		sum_epe += eval_flow(flow, gt).epe;
 		++num_flows;
 	}
-	printf("Average EPE: %.2f pixels\n", sum_epe / num_flows);
+	double avg_epe = sum_epe / num_flows;
+	printf("Average EPE: %.2f pixels\n", avg_epe);
+
+	if (max_epe >= 0.0 && avg_epe > max_epe) {
+		fprintf(stderr, "Average EPE is above %.2f pixels\n", max_epe);
+		return 1;
+	}
+	return 0;
 }
 
-double eval_flow(const char *filename1, const char *filename2)
+FlowError eval_flow(const Flow &flow, const Flow &gt)
 {
-	Flow flow = read_flow(filename1);
-	Flow gt = read_flow(filename2);
-
 	double sum = 0.0;
+	size_t num_pixels = 0, num_outliers = 0;
 	for (unsigned y = 0; y < unsigned(flow.height); ++y) {
 		for (unsigned x = 0; x < unsigned(flow.width); ++x) {
 			float du = flow.flow[y * flow.width + x].du;
 			float dv = flow.flow[y * flow.width + x].dv;
 			float gt_du = gt.flow[y * flow.width + x].du;
 			float gt_dv = gt.flow[y * flow.width + x].dv;
-			sum += hypot(du - gt_du, dv - gt_dv);
+			if (!(fabs(gt_du) < 1e9f && fabs(gt_dv) < 1e9f)) {
+				// Unknown flow, by Middlebury convention.
+				continue;
+			}
+			double epe = hypot(du - gt_du, dv - gt_dv);
+			sum += epe;
+			if (epe > 3.0 && epe > 0.05 * hypot(gt_du, gt_dv)) {
+				++num_outliers;
+			}
+			++num_pixels;
+		}
+	}
+	if (num_pixels == 0) {
+		return FlowError{ 0.0, 0.0 };
+	}
+	return FlowError{ sum / num_pixels, double(num_outliers) / num_pixels };
+}
+
+#ifdef HAVE_SDL2
+
+// Convert from the bottom-left coordinate system used by the flow code
+// to the top-left one used by .flo files.
+Flow flow_from_bottom_left(const float *src, unsigned width, unsigned height)
+{
+	Flow ret;
+	ret.width = width;
+	ret.height = height;
+	ret.flow.reset(new Vec2[width * height]);
+	for (unsigned y = 0; y < height; ++y) {
+		const float *row = src + (height - 1 - y) * width * 2;
+		for (unsigned x = 0; x < width; ++x) {
+			ret.flow[y * width + x].du = row[x * 2 + 0];
+			ret.flow[y * width + x].dv = -row[x * 2 + 1];
+		}
+	}
+	return ret;
+}
+
+Flow compute_flow_cpu(const char *filename0, const char *filename1, const OperatingPoint &op)
+{
+	unsigned width, height, width1, height1;
+	unique_ptr<uint8_t[]> pix0 = load_image_rgba(filename0, &width, &height);
+	unique_ptr<uint8_t[]> pix1 = load_image_rgba(filename1, &width1, &height1);
+	if (width != width1 || height != height1) {
+		fprintf(stderr, "Image dimensions don't match (%dx%d versus %dx%d)\n",
+		        width, height, width1, height1);
+		exit(1);
+	}
+
+	CPUGrayPyramid gray(pix0.get(), pix1.get(), width, height);
+	CPUDISComputeFlow compute_flow(width, height, op);
+	CPUFlow cpu_flow = compute_flow.exec(gray, CPUDISComputeFlow::FORWARD, CPUDISComputeFlow::RESIZE_FLOW_TO_FULL_SIZE);
+	return flow_from_bottom_left(cpu_flow.get_layer(0), width, height);
+}
+
+// Finds NAME.flo, NAME-0.* and NAME-1.* in the given directory,
+// and loads them all, sorted by name.
+vector<BenchmarkPair> load_benchmark_pairs(const char *dirname)
+{
+	DIR *dir = opendir(dirname);
+	if (dir == nullptr) {
+		perror(dirname);
+		exit(1);
+	}
+
+	vector<string> filenames;
+	for (;;) {
+		errno = 0;
+		dirent *de = readdir(dir);
+		if (de == nullptr) {
+			if (errno != 0) {
+				perror("readdir");
+				exit(1);
+			}
+			break;
+		}
+		filenames.push_back(de->d_name);
+	}
+	closedir(dir);
+	sort(filenames.begin(), filenames.end());
+
+	auto find_frame = [&filenames](const string &prefix) -> string {
+		for (const string &filename : filenames) {
+			if (filename.compare(0, prefix.size(), prefix) == 0) {
+				return filename;
+			}
+		}
+		return "";
+	};
+
+	vector<BenchmarkPair> pairs;
+	for (const string &filename : filenames) {
+		if (filename.size() <= 4 || filename.compare(filename.size() - 4, 4, ".flo") != 0) {
+			continue;
+		}
+		string name = filename.substr(0, filename.size() - 4);
+		string frame0 = find_frame(name + "-0.");
+		string frame1 = find_frame(name + "-1.");
+		if (frame0.empty() || frame1.empty()) {
+			fprintf(stderr, "%s/%s: Could not find %s-0.* and %s-1.*; skipping.\n",
+			        dirname, filename.c_str(), name.c_str(), name.c_str());
+			continue;
+		}
+
+		BenchmarkPair pair;
+		pair.name = name;
+		unsigned width1, height1;
+		pair.pix0 = load_image_rgba((string(dirname) + "/" + frame0).c_str(), &pair.width, &pair.height);
+		pair.pix1 = load_image_rgba((string(dirname) + "/" + frame1).c_str(), &width1, &height1);
+		pair.gt = read_flow((string(dirname) + "/" + filename).c_str());
+		if (width1 != pair.width || height1 != pair.height ||
+		    pair.gt.width != pair.width || pair.gt.height != pair.height) {
+			fprintf(stderr, "%s/%s: Image and flow dimensions don't match (%dx%d, %dx%d, %dx%d)\n",
+			        dirname, name.c_str(), pair.width, pair.height, width1, height1, pair.gt.width, pair.gt.height);
+			exit(1);
+		}
+		pairs.push_back(move(pair));
+	}
+	if (pairs.empty()) {
+		fprintf(stderr, "%s: No NAME.flo with NAME-0.* and NAME-1.* found\n", dirname);
+		exit(1);
+	}
+	return pairs;
+}
+
+// Adds the given timings to <stage_ms>, merging the levels of the pyramid
+// (“Level 3 (160 x 90)” becomes “Level 3”, so that pairs of different sizes
+// can be averaged). Returns the total time, from the outermost timer.
+double add_stage_times(const vector<StageTiming> &timings, StageTimes *stage_ms)
+{
+	double total_ms = 0.0;
+	for (const StageTiming &timing : timings) {
+		if (timing.level >= 4) {
+			// Only the SOR sub-timers; see GPUTimers::print().
+			continue;
+		}
+		if (timing.level == 0) {
+			total_ms += timing.ms;
+		}
+		string name = timing.name;
+		if (name.compare(0, 6, "Level ") == 0) {
+			name = name.substr(0, name.find(' ', 6));
+		}
+		auto it = find_if(stage_ms->begin(), stage_ms->end(),
+		                  [&name](const pair<string, double> &stage) { return stage.first == name; });
+		if (it == stage_ms->end()) {
+			stage_ms->emplace_back(name, timing.ms);
+		} else {
+			it->second += timing.ms;
+		}
+	}
+	return total_ms;
+}
+
+bool init_gl()
+{
+	if (SDL_Init(SDL_INIT_VIDEO) == -1) {
+		fprintf(stderr, "SDL_Init failed (%s); benchmarking only on the CPU.\n", SDL_GetError());
+		return false;
+	}
+	SDL_GL_SetAttribute(SDL_GL_ALPHA_SIZE, 8);
+	SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 0);
+	SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 0);
+	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 5);
+	SDL_Window *window = SDL_CreateWindow("OpenGL window",
+	                                      SDL_WINDOWPOS_UNDEFINED,
+	                                      SDL_WINDOWPOS_UNDEFINED,
+	                                      64, 64,
+	                                      SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+	if (window == nullptr || SDL_GL_CreateContext(window) == nullptr) {
+		fprintf(stderr, "Could not create an OpenGL 4.5 context (%s); benchmarking only on the CPU.\n", SDL_GetError());
+		return false;
+	}
+	return true;
+}
+
+// Computes the flow for <pair> num_runs times (after one warmup run),
+// adding the timings to <result>. Returns the flow from the last run.
+Flow benchmark_gpu(const BenchmarkPair &pair, const OperatingPoint &op, int num_runs, BenchmarkResult *result)
+{
+	unsigned width = pair.width, height = pair.height;
+
+	GLuint image_tex;
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &image_tex);
+	glTextureStorage3D(image_tex, 1, GL_RGBA8, width, height, 2);
+	glTextureSubImage3D(image_tex, 0, 0, 0, 0, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, pair.pix0.get());
+	glTextureSubImage3D(image_tex, 0, 0, 0, 1, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, pair.pix1.get());
+
+	GLuint tex_gray;
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &tex_gray);
+	glTextureStorage3D(tex_gray, find_num_levels(width, height), GL_R8, width, height, 2);
+
+	DISComputeFlow compute_flow(width, height, op);  // Must be initialized before gray.
+	GrayscaleConversion gray;
+	gray.exec(image_tex, tex_gray, width, height, /*num_layers=*/2);
+	glGenerateTextureMipmap(tex_gray);
+
+	unique_ptr<float[]> flow(new float[width * height * 2]);
+	double total_ms = 0.0;
+	for (int run = -1; run < num_runs; ++run) {
+		in_warmup = (run == -1);
+		GLuint final_tex = compute_flow.exec(tex_gray, DISComputeFlow::FORWARD, DISComputeFlow::RESIZE_FLOW_TO_FULL_SIZE);
+		if (run == num_runs - 1) {
+			glGetTextureImage(final_tex, 0, GL_RG, GL_FLOAT, width * height * 2 * sizeof(float), flow.get());
+		}
+		compute_flow.release_texture(final_tex);
+		if (!in_warmup) {
+			total_ms += add_stage_times(compute_flow.get_last_timings(), &result->stage_ms);
 		}
 	}
-	return sum / (flow.width * flow.height);
+	in_warmup = false;
+	result->total_ms.push_back(total_ms / num_runs);
+
+	glDeleteTextures(1, &tex_gray);
+	glDeleteTextures(1, &image_tex);
+
+	return flow_from_bottom_left(flow.get(), width, height);
 }
+
+// Same, for CPUDISComputeFlow.
+Flow benchmark_cpu(const BenchmarkPair &pair, const OperatingPoint &op, int num_runs, BenchmarkResult *result)
+{
+	CPUGrayPyramid gray(pair.pix0.get(), pair.pix1.get(), pair.width, pair.height);
+	CPUDISComputeFlow compute_flow(pair.width, pair.height, op);
+
+	CPUFlow flow;
+	double total_ms = 0.0;
+	for (int run = -1; run < num_runs; ++run) {
+		flow = compute_flow.exec(gray, CPUDISComputeFlow::FORWARD, CPUDISComputeFlow::RESIZE_FLOW_TO_FULL_SIZE);
+		if (run != -1) {
+			total_ms += add_stage_times(compute_flow.get_last_timings(), &result->stage_ms);
+		}
+	}
+	result->total_ms.push_back(total_ms / num_runs);
+
+	return flow_from_bottom_left(flow.get_layer(0), pair.width, pair.height);
+}
+
+string json_string(const string &str)
+{
+	string ret = "\"";
+	for (char ch : str) {
+		if (ch == '"' || ch == '\\') {
+			ret += '\\';
+			ret += ch;
+		} else if (uint8_t(ch) < 0x20) {
+			char buf[16];
+			snprintf(buf, sizeof(buf), "\\u%04x", ch);
+			ret += buf;
+		} else {
+			ret += ch;
+		}
+	}
+	return ret + "\"";
+}
+
+double average(const vector<double> &values)
+{
+	double sum = 0.0;
+	for (double value : values) {
+		sum += value;
+	}
+	return sum / values.size();
+}
+
+void print_benchmark_json(const vector<BenchmarkPair> &pairs, const vector<BenchmarkResult> &results, int num_runs)
+{
+	printf("{\n");
+	printf("  \"runs_per_pair\": %d,\n", num_runs);
+	printf("  \"results\": [\n");
+	for (size_t i = 0; i < results.size(); ++i) {
+		const BenchmarkResult &result = results[i];
+		vector<double> epe, outliers;
+		for (const FlowError &error : result.errors) {
+			epe.push_back(error.epe);
+			outliers.push_back(error.outlier_fraction * 100.0);
+		}
+
+		printf("    {\n");
+		printf("      \"backend\": \"%s\",\n", result.backend);
+		printf("      \"operating_point\": %d,\n", result.operating_point);
+		printf("      \"epe\": %.4f,\n", average(epe));
+		printf("      \"outliers_percent\": %.4f,\n", average(outliers));
+		printf("      \"total_ms\": %.3f,\n", average(result.total_ms));
+		printf("      \"stages_ms\": {");
+		for (size_t j = 0; j < result.stage_ms.size(); ++j) {
+			printf("%s\n        %s: %.3f", (j == 0) ? "" : ",", json_string(result.stage_ms[j].first).c_str(),
+			       result.stage_ms[j].second / (pairs.size() * num_runs));
+		}
+		printf("\n      },\n");
+		printf("      \"pairs\": [");
+		for (size_t j = 0; j < pairs.size(); ++j) {
+			printf("%s\n        { \"name\": %s, \"width\": %u, \"height\": %u, \"epe\": %.4f, \"outliers_percent\": %.4f, \"total_ms\": %.3f }",
+			       (j == 0) ? "" : ",", json_string(pairs[j].name).c_str(), pairs[j].width, pairs[j].height,
+			       epe[j], outliers[j], result.total_ms[j]);
+		}
+		printf("\n      ]\n");
+		printf("    }%s\n", (i == results.size() - 1) ? "" : ",");
+	}
+	printf("  ]\n");
+	printf("}\n");
+}
+
+int run_benchmark(const char *dirname, bool use_gpu, int only_operating_point, int num_runs, double max_epe)
+{
+	vector<BenchmarkPair> pairs = load_benchmark_pairs(dirname);
+
+	if (use_gpu) {
+		use_gpu = init_gl();
+	}
+	enable_timing = true;
+	print_timing = false;
+
+	vector<BenchmarkResult> results;
+	for (int backend = use_gpu ? 0 : 1; backend < 2; ++backend) {
+		for (int operating_point = 1; operating_point <= 4; ++operating_point) {
+			if (only_operating_point != -1 && operating_point != only_operating_point) {
+				continue;
+			}
+			const OperatingPoint &op = operating_points[operating_point - 1];
+
+			BenchmarkResult result;
+			result.backend = (backend == 0) ? "gpu" : "cpu";
+			result.operating_point = operating_point;
+			for (const BenchmarkPair &pair : pairs) {
+				fprintf(stderr, "%s, operating point %d: %s...\n", result.backend, operating_point, pair.name.c_str());
+				Flow flow = (backend == 0) ? benchmark_gpu(pair, op, num_runs, &result) : benchmark_cpu(pair, op, num_runs, &result);
+				result.errors.push_back(eval_flow(flow, pair.gt));
+			}
+			results.push_back(move(result));
+		}
+	}
+
+	print_benchmark_json(pairs, results, num_runs);
+
+	int ret = 0;
+	if (max_epe >= 0.0) {
+		for (const BenchmarkResult &result : results) {
+			double sum_epe = 0.0;
+			for (const FlowError &error : result.errors) {
+				sum_epe += error.epe;
+			}
+			if (sum_epe / result.errors.size() > max_epe) {
+				fprintf(stderr, "%s, operating point %d: Average EPE is above %.2f pixels\n",
+				        result.backend, result.operating_point, max_epe);
+				ret = 1;
+			}
+		}
+	}
+	return ret;
+}
+
+#endif  // defined(HAVE_SDL2)
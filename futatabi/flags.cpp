@@ -18,7 +18,12 @@ enum LongOption {
 	OPTION_HTTP_PORT = 1002,
 	OPTION_TALLY_URL = 1003,
 	OPTION_CUE_POINT_PADDING = 1004,
-	OPTION_MIDI_MAPPING = 1005
+	OPTION_MIDI_MAPPING = 1005,
+	OPTION_JPEG_ENCODE_SLICES = 1006,
+	OPTION_JPEG_ENCODE_THREADS = 1007,
+	OPTION_INTERPOLATED_CACHE_MB = 1008,
+	OPTION_INTERPOLATED_CACHE_DISK_MB = 1009,
+	OPTION_PROXY_SCALE = 1010
 };
 
 void usage()
@@ -42,6 +47,15 @@ void usage()
 	fprintf(stderr, "      --http-port PORT            which port to listen on for output\n");
 	fprintf(stderr, "      --tally-url URL             URL to get tally color from (polled every 100 ms)\n");
 	fprintf(stderr, "      --midi-mapping=FILE         start with the given MIDI controller mapping\n");
+	fprintf(stderr, "      --jpeg-encode-slices N      encode output JPEGs in N slices in parallel (default 4)\n");
+	fprintf(stderr, "      --jpeg-encode-threads N     encode up to N output frames at the same time (default 2)\n");
+	fprintf(stderr, "      --interpolated-cache-mb MB  keep up to MB of interpolated output frames in memory,\n");
+	fprintf(stderr, "                                    so that replays do not need to compute them again\n");
+	fprintf(stderr, "                                    (default 512, 0 = off)\n");
+	fprintf(stderr, "      --interpolated-cache-disk-mb MB  keep up to MB more of them on disk, in the\n");
+	fprintf(stderr, "                                    working directory (default 0 = none)\n");
+	fprintf(stderr, "      --proxy-scale N             also store each incoming frame at 1/N size (N = 2, 4 or 8),\n");
+	fprintf(stderr, "                                    for the camera displays and scrubbing (default 0 = off)\n");
 }
 
 void parse_flags(int argc, char *const argv[])
@@ -58,6 +72,11 @@ void parse_flags(int argc, char *const argv[])
 		{ "tally-url", required_argument, 0, OPTION_TALLY_URL },
 		{ "cue-point-padding", required_argument, 0, OPTION_CUE_POINT_PADDING },
 		{ "midi-mapping", required_argument, 0, OPTION_MIDI_MAPPING },
+		{ "jpeg-encode-slices", required_argument, 0, OPTION_JPEG_ENCODE_SLICES },
+		{ "jpeg-encode-threads", required_argument, 0, OPTION_JPEG_ENCODE_THREADS },
+		{ "interpolated-cache-mb", required_argument, 0, OPTION_INTERPOLATED_CACHE_MB },
+		{ "interpolated-cache-disk-mb", required_argument, 0, OPTION_INTERPOLATED_CACHE_DISK_MB },
+		{ "proxy-scale", required_argument, 0, OPTION_PROXY_SCALE },
 		{ 0, 0, 0, 0 }
 	};
 	for (;;) {
@@ -109,6 +128,21 @@ void parse_flags(int argc, char *const argv[])
 		case OPTION_MIDI_MAPPING:
 			global_flags.midi_mapping_filename = optarg;
 			break;
+		case OPTION_JPEG_ENCODE_SLICES:
+			global_flags.jpeg_encode_slices = atoi(optarg);
+			break;
+		case OPTION_JPEG_ENCODE_THREADS:
+			global_flags.jpeg_encode_threads = atoi(optarg);
+			break;
+		case OPTION_INTERPOLATED_CACHE_MB:
+			global_flags.interpolated_cache_mb = atoi(optarg);
+			break;
+		case OPTION_INTERPOLATED_CACHE_DISK_MB:
+			global_flags.interpolated_cache_disk_mb = atoi(optarg);
+			break;
+		case OPTION_PROXY_SCALE:
+			global_flags.proxy_scale = atoi(optarg);
+			break;
 		case OPTION_HELP:
 			usage();
 			exit(0);
@@ -125,6 +159,27 @@ void parse_flags(int argc, char *const argv[])
 		usage();
 		exit(1);
 	}
+	if (global_flags.jpeg_encode_slices < 1) {
+		fprintf(stderr, "Number of JPEG encode slices must be at least 1.\n");
+		usage();
+		exit(1);
+	}
+	if (global_flags.jpeg_encode_threads < 1) {
+		fprintf(stderr, "Number of JPEG encode threads must be at least 1.\n");
+		usage();
+		exit(1);
+	}
+	if (global_flags.interpolated_cache_mb < 0 || global_flags.interpolated_cache_disk_mb < 0) {
+		fprintf(stderr, "Interpolated frame cache sizes cannot be negative.\n");
+		usage();
+		exit(1);
+	}
+	if (global_flags.proxy_scale != 0 && global_flags.proxy_scale != 2 &&
+	    global_flags.proxy_scale != 4 && global_flags.proxy_scale != 8) {
+		fprintf(stderr, "Proxy scale must be 0 (off), 2, 4 or 8.\n");
+		usage();
+		exit(1);
+	}
 	if (global_flags.cue_point_padding_seconds < 0.0) {
 		fprintf(stderr, "Cue point padding cannot be negative.\n");
 		usage();
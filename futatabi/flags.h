@@ -18,6 +18,11 @@ struct Flags {
 	double cue_point_padding_seconds = 0.0;  // Can be changed in the menus.
 	bool cue_point_padding_set = false;
 	std::string midi_mapping_filename;  // Empty for none.
+	int jpeg_encode_slices = 4;
+	int jpeg_encode_threads = 2;
+	int interpolated_cache_mb = 512;  // 0 = no caching of interpolated frames.
+	int interpolated_cache_disk_mb = 0;  // 0 = memory only.
+	int proxy_scale = 0;  // 0 = no proxies; otherwise 2, 4 or 8.
 };
 extern Flags global_flags;
 
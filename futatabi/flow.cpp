@@ -717,7 +717,10 @@ GLuint DISComputeFlow::exec(GLuint tex, FlowDirection flow_direction, ResizeStra
 	total_timer.end();
 
 	if (!in_warmup) {
-		timers.print();
+		last_timings = timers.get_results();
+		if (print_timing) {
+			timers.print();
+		}
 	}
 
 	// Scale up the flow to the final size (if needed).
@@ -999,7 +1002,7 @@ pair<GLuint, GLuint> Interpolate::exec(GLuint image_tex, GLuint gray_tex, GLuint
 	}
 	pool.release_texture(flow_tex);
 	total_timer.end();
-	if (!in_warmup) {
+	if (!in_warmup && print_timing) {
 		timers.print();
 	}
 
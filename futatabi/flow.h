@@ -13,71 +13,10 @@
 #include <utility>
 #include <vector>
 
-class ScopedTimer;
-
-// Predefined operating points from the paper.
-struct OperatingPoint {
-	unsigned coarsest_level;  // TODO: Adjust dynamically based on the resolution?
-	unsigned finest_level;
-	unsigned search_iterations;  // Halved from the paper.
-	unsigned patch_size_pixels;
-	float patch_overlap_ratio;
-	bool variational_refinement;
-
-	// Not part of the original paper; used for interpolation.
-	// NOTE: Values much larger than 1.0 seems to trigger Haswell's “PMA stall”;
-	// the problem is not present on Broadwell and higher (there's a mitigation
-	// in the hardware, but Mesa doesn't enable it at the time of writing).
-	// Since we have hole filling, the holes from 1.0 are not critical,
-	// but larger values seem to do better than hole filling for large
-	// motion, blurs etc. since we have more candidates.
-	float splat_size;
-};
-
-// Operating point 1 (600 Hz on CPU, excluding preprocessing).
-static constexpr OperatingPoint operating_point1 = {
-	5,      // Coarsest level.
-	3,      // Finest level.
-	8,      // Search iterations.
-	8,      // Patch size (pixels).
-	0.30f,  // Overlap ratio.
-	false,  // Variational refinement.
-	1.0f	// Splat size (pixels).
-};
-
-// Operating point 2 (300 Hz on CPU, excluding preprocessing).
-static constexpr OperatingPoint operating_point2 = {
-	5,      // Coarsest level.
-	3,      // Finest level.
-	6,      // Search iterations.
-	8,      // Patch size (pixels).
-	0.40f,  // Overlap ratio.
-	true,   // Variational refinement.
-	1.0f	// Splat size (pixels).
-};
+#include "operating_point.h"
+#include "stage_timing.h"
 
-// Operating point 3 (10 Hz on CPU, excluding preprocessing).
-// This is the only one that has been thorougly tested.
-static constexpr OperatingPoint operating_point3 = {
-	5,      // Coarsest level.
-	1,      // Finest level.
-	8,      // Search iterations.
-	12,     // Patch size (pixels).
-	0.75f,  // Overlap ratio.
-	true,   // Variational refinement.
-	4.0f	// Splat size (pixels).
-};
-
-// Operating point 4 (0.5 Hz on CPU, excluding preprocessing).
-static constexpr OperatingPoint operating_point4 = {
-	5,      // Coarsest level.
-	0,      // Finest level.
-	128,    // Search iterations.
-	12,     // Patch size (pixels).
-	0.75f,  // Overlap ratio.
-	true,   // Variational refinement.
-	8.0f	// Splat size (pixels).
-};
+class ScopedTimer;
 
 int find_num_levels(int width, int height);
 
@@ -434,6 +373,10 @@ public:
 		pool.release_texture(tex);
 	}
 
+	// The GPU timers from the last exec() outside warmup,
+	// if enable_timing was set.
+	const std::vector<StageTiming> &get_last_timings() const { return last_timings; }
+
 private:
 	int width, height;
 	GLuint initial_flow_tex;
@@ -452,6 +395,8 @@ private:
 	SOR sor;
 	AddBaseFlow add_base_flow;
 	ResizeFlow resize_flow;
+
+	std::vector<StageTiming> last_timings;
 };
 
 // Forward-warp the flow half-way (or rather, by alpha). A non-zero “splatting”
@@ -0,0 +1,1068 @@
+#include "flow_cpu.h"
+
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#if __SSE2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Runs loops over rows (or patches) on a fixed set of threads, so that
+// we don't have to start new ones for each of the many small passes.
+class FlowWorkerPool {
+public:
+	explicit FlowWorkerPool(unsigned num_threads);
+	~FlowWorkerPool();
+
+	unsigned get_num_threads() const { return workers.size() + 1; }
+
+	// Calls func(begin, end) for disjoint ranges covering [0, n), spread over
+	// all the threads (including the calling one), and waits for all of them.
+	void parallel_for(int n, const function<void(int, int)> &func);
+
+private:
+	void worker_thread_func(unsigned last_job_num);
+	void run_chunks();
+
+	vector<thread> workers;
+	mutex mu;
+	condition_variable job_ready, job_done;
+	unsigned job_num = 0;  // Protected by <mu>.
+	unsigned workers_left = 0;  // Protected by <mu>.
+	bool should_quit = false;  // Protected by <mu>.
+
+	// The current job. Set by parallel_for() (under <mu>) before waking up the workers.
+	const function<void(int, int)> *func = nullptr;
+	int num_items = 0, chunk_size = 1;
+	atomic<int> next_item{ 0 };
+};
+
+FlowWorkerPool::FlowWorkerPool(unsigned num_threads)
+{
+	if (num_threads == 0) {
+		num_threads = max(thread::hardware_concurrency(), 1u);
+	}
+	for (unsigned i = 1; i < num_threads; ++i) {
+		workers.emplace_back(&FlowWorkerPool::worker_thread_func, this, 0);
+	}
+}
+
+FlowWorkerPool::~FlowWorkerPool()
+{
+	{
+		lock_guard<mutex> lock(mu);
+		should_quit = true;
+		job_ready.notify_all();
+	}
+	for (thread &worker : workers) {
+		worker.join();
+	}
+}
+
+void FlowWorkerPool::parallel_for(int n, const function<void(int, int)> &func)
+{
+	if (n <= 0) {
+		return;
+	}
+	if (workers.empty() || n == 1) {
+		func(0, n);
+		return;
+	}
+	{
+		lock_guard<mutex> lock(mu);
+		this->func = &func;
+		num_items = n;
+		// A few chunks per thread, so that uneven work (e.g. rows that
+		// are mostly outside the patches) still gets spread out.
+		chunk_size = max<int>(n / (get_num_threads() * 4), 1);
+		next_item = 0;
+		workers_left = workers.size();
+		++job_num;
+		job_ready.notify_all();
+	}
+	run_chunks();
+	unique_lock<mutex> lock(mu);
+	job_done.wait(lock, [this] { return workers_left == 0; });
+}
+
+void FlowWorkerPool::run_chunks()
+{
+	for (;;) {
+		int begin = next_item.fetch_add(chunk_size);
+		if (begin >= num_items) {
+			return;
+		}
+		(*func)(begin, min(begin + chunk_size, num_items));
+	}
+}
+
+void FlowWorkerPool::worker_thread_func(unsigned last_job_num)
+{
+	pthread_setname_np(pthread_self(), "CPUFlow");
+
+	for (;;) {
+		{
+			unique_lock<mutex> lock(mu);
+			job_ready.wait(lock, [this, last_job_num] { return should_quit || job_num != last_job_num; });
+			if (should_quit) {
+				return;
+			}
+			last_job_num = job_num;
+		}
+		run_chunks();
+		{
+			lock_guard<mutex> lock(mu);
+			if (--workers_left == 0) {
+				job_done.notify_all();
+			}
+		}
+	}
+}
+
+namespace {
+
+// Largest patch size we have room for on the stack in the motion search.
+constexpr unsigned max_patch_size = 32;
+
+inline int clamp_coord(int x, int size)
+{
+	return min(max(x, 0), size - 1);
+}
+
+// Like texelFetch() of (x, y) with GL_CLAMP_TO_EDGE, as with textureOffset()
+// and a nearest sampler.
+template<int channels = 1>
+inline const float *fetch(const float *tex, int width, int height, int x, int y)
+{
+	return tex + (size_t(clamp_coord(y, height)) * width + clamp_coord(x, width)) * channels;
+}
+
+// Like texture() with GL_LINEAR and GL_CLAMP_TO_EDGE. <x> and <y> are in texels,
+// with (0, 0) being the center of the bottom-left texel (ie., tc * size - 0.5).
+template<int channels, class T>
+inline void sample_linear(const T *tex, int width, int height, float x, float y, float *out)
+{
+	// Keep garbage (e.g. NaN flow) from turning into out-of-range integers;
+	// anything outside the texture samples the edge anyway.
+	x = fminf(fmaxf(x, -1.0f), float(width));
+	y = fminf(fmaxf(y, -1.0f), float(height));
+	float x0f = floorf(x), y0f = floorf(y);
+	float fx = x - x0f, fy = y - y0f;
+	int x0 = int(x0f), y0 = int(y0f);
+	int x1 = clamp_coord(x0 + 1, width), y1 = clamp_coord(y0 + 1, height);
+	x0 = clamp_coord(x0, width);
+	y0 = clamp_coord(y0, height);
+
+	const T *p00 = tex + (size_t(y0) * width + x0) * channels;
+	const T *p01 = tex + (size_t(y0) * width + x1) * channels;
+	const T *p10 = tex + (size_t(y1) * width + x0) * channels;
+	const T *p11 = tex + (size_t(y1) * width + x1) * channels;
+	for (int c = 0; c < channels; ++c) {
+		float bottom = p00[c] + fx * (p01[c] - p00[c]);
+		float top = p10[c] + fx * (p11[c] - p10[c]);
+		out[c] = bottom + fy * (top - bottom);
+	}
+}
+
+inline float sample_linear(const float *tex, int width, int height, float x, float y)
+{
+	float ret;
+	sample_linear<1>(tex, width, height, x, y, &ret);
+	return ret;
+}
+
+// The pixels whose centers fall within [lo, hi) (in 0..1 coordinates),
+// which is what the rasterizer would cover for a quad with those edges.
+inline void covered_pixels(float lo, float hi, int size, int *begin, int *end)
+{
+	lo = fminf(fmaxf(lo * size - 0.5f, -1.0f), float(size));
+	hi = fminf(fmaxf(hi * size - 0.5f, -1.0f), float(size));
+	*begin = max(int(ceilf(lo)), 0);
+	*end = min(int(ceilf(hi)), size);
+}
+
+// Matches pack_gradients() in sobel.frag.
+inline float quantize_gradient(float g)
+{
+	g = min(max(g, -0.5f), 0.5f);
+	return roundf((g + 0.5f) * 4095.0f) * (1.0f / 4095.0f) - 0.5f;
+}
+
+// Like sobel.frag; <grad> gets x and y gradients interleaved.
+void sobel_row(const float *tex, int width, int height, int y, float *grad)
+{
+	const float *bottom = tex + size_t(clamp_coord(y - 1, height)) * width;
+	const float *center = tex + size_t(y) * width;
+	const float *top = tex + size_t(clamp_coord(y + 1, height)) * width;
+	for (int x = 0; x < width; ++x) {
+		int xl = clamp_coord(x - 1, width), xr = clamp_coord(x + 1, width);
+		float gx = (top[xr] + 2.0f * center[xr] + bottom[xr]) - (top[xl] + 2.0f * center[xl] + bottom[xl]);
+		float gy = (top[xl] + 2.0f * top[x] + top[xr]) - (bottom[xl] + 2.0f * bottom[x] + bottom[xr]);
+		grad[x * 2 + 0] = quantize_gradient(gx * 0.125f);
+		grad[x * 2 + 1] = quantize_gradient(gy * 0.125f);
+	}
+}
+
+// The inner loop of the motion search for the case where the entire warped
+// patch (starting at texel (sx, sy)) is inside the image, so that we can
+// read straight from the rows without clamping. The bilinear weights are
+// the same for every pixel, since the patch is only translated.
+void warp_patch_unclamped(const float *search, int width, float sx, float sy, unsigned patch_size,
+                          const float *t, const float *grad, float *du_x, float *du_y, float *warped_sum)
+{
+	float x0f = floorf(sx), y0f = floorf(sy);
+	float fx = sx - x0f, fy = sy - y0f;
+	const float *base = search + size_t(y0f) * width + int(x0f);
+
+	float sum_x = 0.0f, sum_y = 0.0f, sum_w = 0.0f;
+	for (unsigned y = 0; y < patch_size; ++y) {
+		const float *r0 = base + size_t(y) * width;
+		const float *r1 = r0 + width;
+		const float *t_row = t + y * patch_size;
+		const float *grad_row = grad + y * patch_size * 2;
+		unsigned x = 0;
+#if __SSE2__
+		__m128 fx4 = _mm_set1_ps(fx), fy4 = _mm_set1_ps(fy);
+		__m128 sum_x4 = _mm_setzero_ps(), sum_y4 = _mm_setzero_ps(), sum_w4 = _mm_setzero_ps();
+		for ( ; x + 4 <= patch_size; x += 4) {
+			__m128 a = _mm_loadu_ps(r0 + x), b = _mm_loadu_ps(r0 + x + 1);
+			__m128 c = _mm_loadu_ps(r1 + x), d = _mm_loadu_ps(r1 + x + 1);
+			__m128 bottom = _mm_add_ps(a, _mm_mul_ps(fx4, _mm_sub_ps(b, a)));
+			__m128 top = _mm_add_ps(c, _mm_mul_ps(fx4, _mm_sub_ps(d, c)));
+			__m128 warped = _mm_add_ps(bottom, _mm_mul_ps(fy4, _mm_sub_ps(top, bottom)));
+			__m128 diff = _mm_sub_ps(warped, _mm_loadu_ps(t_row + x));
+
+			// De-interleave the gradients.
+			__m128 g0 = _mm_loadu_ps(grad_row + x * 2), g1 = _mm_loadu_ps(grad_row + x * 2 + 4);
+			__m128 gx = _mm_shuffle_ps(g0, g1, _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 gy = _mm_shuffle_ps(g0, g1, _MM_SHUFFLE(3, 1, 3, 1));
+
+			sum_x4 = _mm_add_ps(sum_x4, _mm_mul_ps(gx, diff));
+			sum_y4 = _mm_add_ps(sum_y4, _mm_mul_ps(gy, diff));
+			sum_w4 = _mm_add_ps(sum_w4, warped);
+		}
+		alignas(16) float tmp[12];
+		_mm_store_ps(tmp, sum_x4);
+		_mm_store_ps(tmp + 4, sum_y4);
+		_mm_store_ps(tmp + 8, sum_w4);
+		sum_x += (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+		sum_y += (tmp[4] + tmp[5]) + (tmp[6] + tmp[7]);
+		sum_w += (tmp[8] + tmp[9]) + (tmp[10] + tmp[11]);
+#endif
+		for ( ; x < patch_size; ++x) {
+			float bottom = r0[x] + fx * (r0[x + 1] - r0[x]);
+			float top = r1[x] + fx * (r1[x + 1] - r1[x]);
+			float warped = bottom + fy * (top - bottom);
+			float diff = warped - t_row[x];
+			sum_x += grad_row[x * 2 + 0] * diff;
+			sum_y += grad_row[x * 2 + 1] * diff;
+			sum_w += warped;
+		}
+	}
+	*du_x = sum_x;
+	*du_y = sum_y;
+	*warped_sum = sum_w;
+}
+
+// Like motion_search.frag, for a single patch whose bottom-left texel
+// is at (x0, y0). Writes the flow (in 0..1 coordinates) and mean difference
+// to <out>.
+void search_patch(const float *ref, const float *grad_tex, const float *search, int width, int height,
+                  unsigned patch_size, unsigned num_iterations, int x0, int y0,
+                  float initial_u, float initial_v, float *out)
+{
+	alignas(16) float t[max_patch_size * max_patch_size];
+	alignas(16) float grad[max_patch_size * max_patch_size * 2];
+
+	float H00 = 0.0f, H01 = 0.0f, H11 = 0.0f;
+	float grad_sum_x = 0.0f, grad_sum_y = 0.0f;
+	float template_sum = 0.0f;
+	for (unsigned y = 0; y < patch_size; ++y) {
+		int yy = y0 + int(y);
+		for (unsigned x = 0; x < patch_size; ++x) {
+			int xx = x0 + int(x);
+			float gx = 0.0f, gy = 0.0f;
+			if (xx >= 0 && xx < width && yy >= 0 && yy < height) {
+				const float *g = fetch<2>(grad_tex, width, height, xx, yy);
+				gx = g[0];
+				gy = g[1];
+			}
+			float val = *fetch(ref, width, height, xx, yy);
+			t[y * patch_size + x] = val;
+			grad[(y * patch_size + x) * 2 + 0] = gx;
+			grad[(y * patch_size + x) * 2 + 1] = gy;
+			H00 += gx * gx;
+			H11 += gy * gy;
+			H01 += gx * gy;
+			template_sum += val;
+			grad_sum_x += gx;
+			grad_sum_y += gy;
+		}
+	}
+	if (H00 * H11 - H01 * H01 < 1e-6f) {
+		H00 += 1e-6f;
+		H11 += 1e-6f;
+	}
+	float inv_det = 1.0f / (H00 * H11 - H01 * H01);
+	float H_inv00 = H11 * inv_det, H_inv01 = -H01 * inv_det, H_inv11 = H00 * inv_det;
+
+	float u = initial_u, v = initial_v;
+	float mean_diff = 0.0f, first_mean_diff = 0.0f;
+	for (unsigned i = 0; i < num_iterations; ++i) {
+		float du_x, du_y, warped_sum;
+		float sx = x0 + u, sy = y0 + v;
+		if (sx >= 0.0f && sx + patch_size < width - 1 && sy >= 0.0f && sy + patch_size < height - 1) {
+			warp_patch_unclamped(search, width, sx, sy, patch_size, t, grad, &du_x, &du_y, &warped_sum);
+		} else {
+			du_x = du_y = warped_sum = 0.0f;
+			for (unsigned y = 0; y < patch_size; ++y) {
+				for (unsigned x = 0; x < patch_size; ++x) {
+					float warped = sample_linear(search, width, height, sx + x, sy + y);
+					float diff = warped - t[y * patch_size + x];
+					du_x += grad[(y * patch_size + x) * 2 + 0] * diff;
+					du_y += grad[(y * patch_size + x) * 2 + 1] * diff;
+					warped_sum += warped;
+				}
+			}
+		}
+		mean_diff = (warped_sum - template_sum) * (1.0f / float(patch_size * patch_size));
+		du_x -= grad_sum_x * mean_diff;
+		du_y -= grad_sum_y * mean_diff;
+		if (i == 0) {
+			first_mean_diff = mean_diff;
+		}
+		u -= H_inv00 * du_x + H_inv01 * du_y;
+		v -= H_inv01 * du_x + H_inv11 * du_y;
+	}
+
+	// Reject if we moved too far, or ended up outside the image
+	// (also catches NaNs, since the comparisons are the other way around).
+	float half_patch = patch_size * 0.5f;
+	float center_x = x0 + half_patch + u, center_y = y0 + half_patch + v;
+	if (!(hypotf(u - initial_u, v - initial_v) <= half_patch &&
+	      center_x >= -half_patch && width - center_x >= -half_patch &&
+	      center_y >= -half_patch && height - center_y >= -half_patch)) {
+		u = initial_u;
+		v = initial_v;
+		mean_diff = first_mean_diff;
+	}
+	out[0] = u / width;
+	out[1] = v / height;
+	out[2] = mean_diff;
+}
+
+// Like derivatives.frag (the x and y derivatives are interleaved in <I_x_y>).
+void derivatives_row(const float *I, int width, int height, int y, float *I_x_y, float *beta_0)
+{
+	const float *y_m2 = I + size_t(clamp_coord(y - 2, height)) * width;
+	const float *y_m1 = I + size_t(clamp_coord(y - 1, height)) * width;
+	const float *y_p1 = I + size_t(clamp_coord(y + 1, height)) * width;
+	const float *y_p2 = I + size_t(clamp_coord(y + 2, height)) * width;
+	const float *row = I + size_t(y) * width;
+	for (int x = 0; x < width; ++x) {
+		float x_m2 = row[clamp_coord(x - 2, width)];
+		float x_m1 = row[clamp_coord(x - 1, width)];
+		float x_p1 = row[clamp_coord(x + 1, width)];
+		float x_p2 = row[clamp_coord(x + 2, width)];
+		float I_x = (x_p1 - x_m1) * (2.0f / 3.0f) + (x_m2 - x_p2) * (1.0f / 12.0f);
+		float I_y = (y_p1[x] - y_m1[x]) * (2.0f / 3.0f) + (y_m2[x] - y_p2[x]) * (1.0f / 12.0f);
+		I_x_y[x * 2 + 0] = I_x;
+		I_x_y[x * 2 + 1] = I_y;
+		beta_0[x] = 1.0f / (I_x * I_x + I_y * I_y + 1e-7f);
+	}
+}
+
+// The smoothness weight between two neighboring pixels, as sampled halfway
+// between them with the zero border sampler (ie., zero at the image edges).
+inline float smoothness(const float *g, int width, int height, int x0, int y0, int x1, int y1)
+{
+	if (x1 < 0 || x1 >= width || y1 < 0 || y1 >= height) {
+		return 0.0f;
+	}
+	return 0.5f * (g[size_t(y0) * width + x0] + g[size_t(y1) * width + x1]);
+}
+
+// One equation (per pixel) from equations.frag. b is not packed.
+struct Equation {
+	float inv_A11, A12, inv_A22, b1, b2;
+};
+
+// Indexes for the planes of the variational refinement state, per layer.
+enum { I_X_Y, I_T, BETA_0, BASE_FLOW, DIFF_FLOW, DIFFUSIVITY };
+
+}  // namespace
+
+CPUGrayPyramid::CPUGrayPyramid(const uint8_t *rgba0, const uint8_t *rgba1, int width, int height)
+{
+	Level level0;
+	level0.width = width;
+	level0.height = height;
+	const uint8_t *rgba[2] = { rgba0, rgba1 };
+	for (unsigned layer = 0; layer < 2; ++layer) {
+		level0.pixels[layer].resize(size_t(width) * height);
+		for (size_t i = 0; i < size_t(width) * height; ++i) {
+			const uint8_t *pix = rgba[layer] + i * 4;
+			float gray = 0.2126f * pix[0] + 0.7152f * pix[1] + 0.0722f * pix[2];  // Rec. 709.
+			level0.pixels[layer][i] = roundf(gray) * (1.0f / 255.0f);
+		}
+	}
+	levels.push_back(move(level0));
+
+	while (levels.back().width > 1 || levels.back().height > 1) {
+		const Level &src = levels.back();
+		Level dst;
+		dst.width = max(src.width >> 1, 1);
+		dst.height = max(src.height >> 1, 1);
+		for (unsigned layer = 0; layer < 2; ++layer) {
+			const float *s = src.pixels[layer].data();
+			dst.pixels[layer].resize(size_t(dst.width) * dst.height);
+			for (int y = 0; y < dst.height; ++y) {
+				const float *r0 = s + size_t(clamp_coord(y * 2, src.height)) * src.width;
+				const float *r1 = s + size_t(clamp_coord(y * 2 + 1, src.height)) * src.width;
+				for (int x = 0; x < dst.width; ++x) {
+					int x0 = clamp_coord(x * 2, src.width), x1 = clamp_coord(x * 2 + 1, src.width);
+					float avg = 0.25f * ((r0[x0] + r0[x1]) + (r1[x0] + r1[x1]));
+					dst.pixels[layer][size_t(y) * dst.width + x] = roundf(avg * 255.0f) * (1.0f / 255.0f);
+				}
+			}
+		}
+		levels.push_back(move(dst));
+	}
+}
+
+CPUDISComputeFlow::CPUDISComputeFlow(int width, int height, const OperatingPoint &op, unsigned num_threads)
+	: width(width), height(height), op(op), pool(new FlowWorkerPool(num_threads))
+{
+	assert(op.patch_size_pixels % 2 == 0 && op.patch_size_pixels <= max_patch_size);
+}
+
+CPUDISComputeFlow::~CPUDISComputeFlow() {}
+
+CPUFlow CPUDISComputeFlow::exec(const CPUGrayPyramid &gray, FlowDirection flow_direction, ResizeStrategy resize_strategy)
+{
+	assert(gray.get_width(0) == width && gray.get_height(0) == height);
+	assert(int(op.coarsest_level) < gray.get_num_levels());
+	int num_layers = (flow_direction == FORWARD_AND_BACKWARD) ? 2 : 1;
+
+	// The initial 1x1 zero flow.
+	CPUFlow prev_level_flow;
+	prev_level_flow.width = prev_level_flow.height = 1;
+	prev_level_flow.num_layers = num_layers;
+	prev_level_flow.flow.assign(num_layers * 2, 0.0f);
+
+	last_timings.clear();
+	CPUScopedTimer total_timer("Compute flow", &last_timings);
+	for (int level = op.coarsest_level; level >= int(op.finest_level); --level) {
+		char timer_name[256];
+		snprintf(timer_name, sizeof(timer_name), "Level %d (%d x %d)", level, width >> level, height >> level);
+		CPUScopedTimer level_timer(timer_name, &total_timer);
+
+		int level_width = width >> level;
+		int level_height = height >> level;
+		float patch_spacing_pixels = op.patch_size_pixels * (1.0f - op.patch_overlap_ratio);
+
+		// Same patch layout as DISComputeFlow.
+		int width_patches = 1 + ceil(level_width / patch_spacing_pixels);
+		int height_patches = 1 + ceil(level_height / patch_spacing_pixels);
+
+		// Find the derivative.
+		CPUScopedTimer sobel_timer("Sobel", &level_timer);
+		vector<float> grad(size_t(level_width) * level_height * 2 * num_layers);
+		pool->parallel_for(level_height * num_layers, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				int layer = i / level_height, y = i % level_height;
+				sobel_row(gray.get_level(level, layer), level_width, level_height, y,
+				          &grad[((size_t(layer) * level_height + y) * level_width) * 2]);
+			}
+		});
+
+		sobel_timer.end();
+
+		// Motion search to find the initial flow.
+		vector<float> patch_flow;
+		{
+			CPUScopedTimer timer("Motion search", &level_timer);
+			motion_search(gray, level, grad, prev_level_flow, width_patches, height_patches, num_layers, &patch_flow);
+		}
+
+		// Densification.
+		vector<float> dense_flow;
+		{
+			CPUScopedTimer timer("Densification", &level_timer);
+			densify(gray, level, patch_flow, width_patches, height_patches, num_layers, &dense_flow);
+		}
+
+		// Everything below here in the loop belongs to variational refinement.
+		CPUScopedTimer varref_timer("Variational refinement", &level_timer);
+
+		// Prewarping; create I and I_t, and a base flow in pixels.
+		CPUScopedTimer prewarp_timer("Prewarping", &varref_timer);
+		size_t layer_size = size_t(level_width) * level_height;
+		vector<float> I(layer_size * num_layers), I_t(layer_size * num_layers);
+		CPUFlow base_flow;
+		base_flow.width = level_width;
+		base_flow.height = level_height;
+		base_flow.num_layers = num_layers;
+		base_flow.flow.resize(layer_size * 2 * num_layers);
+		pool->parallel_for(level_height * num_layers, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				int layer = i / level_height, y = i % level_height;
+				const float *image0 = gray.get_level(level, layer);
+				const float *image1 = gray.get_level(level, 1 - layer);
+				size_t offset = size_t(layer) * layer_size + size_t(y) * level_width;
+				for (int x = 0; x < level_width; ++x) {
+					const float *flow = &dense_flow[(offset + x) * 3];
+					float u = 0.0f, v = 0.0f;
+					if (flow[2] > 0.0f) {  // The GPU would give NaN here, but it doesn't happen in practice.
+						u = flow[0] / flow[2] * level_width;
+						v = flow[1] / flow[2] * level_height;
+					}
+					float I_0 = image0[size_t(y) * level_width + x];
+					float I_w = sample_linear(image1, level_width, level_height, x + u, y + v);
+					I[offset + x] = 0.5f * (I_0 + I_w);
+					I_t[offset + x] = I_w - I_0;
+					base_flow.flow[(offset + x) * 2 + 0] = u;
+					base_flow.flow[(offset + x) * 2 + 1] = v;
+				}
+			}
+		});
+
+		prewarp_timer.end();
+
+		if (op.variational_refinement) {
+			variational_refinement(level, I, I_t, &base_flow, &varref_timer);
+		}
+
+		prev_level_flow = move(base_flow);
+	}
+	total_timer.end();
+
+	// Scale up the flow to the final size (if needed). Like ResizeFlow,
+	// this uses nearest sampling.
+	if (op.finest_level == 0 || resize_strategy == DO_NOT_RESIZE_FLOW) {
+		return prev_level_flow;
+	}
+	CPUFlow final_flow;
+	final_flow.width = width;
+	final_flow.height = height;
+	final_flow.num_layers = num_layers;
+	final_flow.flow.resize(size_t(width) * height * 2 * num_layers);
+	float scale_x = float(width) / prev_level_flow.width;
+	float scale_y = float(height) / prev_level_flow.height;
+	pool->parallel_for(height * num_layers, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			int layer = i / height, y = i % height;
+			const float *src = prev_level_flow.get_layer(layer);
+			float *dst = &final_flow.flow[((size_t(layer) * height + y) * width) * 2];
+			int src_y = min(int((y + 0.5f) / scale_y), prev_level_flow.height - 1);
+			for (int x = 0; x < width; ++x) {
+				int src_x = min(int((x + 0.5f) / scale_x), prev_level_flow.width - 1);
+				dst[x * 2 + 0] = src[(size_t(src_y) * prev_level_flow.width + src_x) * 2 + 0] * scale_x;
+				dst[x * 2 + 1] = src[(size_t(src_y) * prev_level_flow.width + src_x) * 2 + 1] * scale_y;
+			}
+		}
+	});
+	return final_flow;
+}
+
+void CPUDISComputeFlow::motion_search(const CPUGrayPyramid &gray, int level, const vector<float> &grad, const CPUFlow &prev_level_flow, int width_patches, int height_patches, int num_layers, vector<float> *flow_out)
+{
+	int level_width = width >> level;
+	int level_height = height >> level;
+	unsigned patch_size = op.patch_size_pixels;
+	flow_out->resize(size_t(width_patches) * height_patches * 3 * num_layers);
+
+	pool->parallel_for(height_patches * num_layers, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			int layer = i / height_patches, patch_y = i % height_patches;
+			const float *ref = gray.get_level(level, layer);
+			const float *search = gray.get_level(level, 1 - layer);
+			const float *grad_tex = &grad[size_t(layer) * level_width * level_height * 2];
+			const float *prev_flow = prev_level_flow.get_layer(layer);
+
+			// The patch centers are spread evenly from 0.0 to 1.0 (inclusive),
+			// then locked to the nearest pixel (see motion_search.vert and .frag).
+			float center_y = float(patch_y) / (height_patches - 1);
+			int y0 = int(floorf(center_y * level_height + 0.5f)) - int(patch_size / 2);
+			for (int patch_x = 0; patch_x < width_patches; ++patch_x) {
+				float center_x = float(patch_x) / (width_patches - 1);
+				int x0 = int(floorf(center_x * level_width + 0.5f)) - int(patch_size / 2);
+
+				// The previous level's flow, sampled bilinearly at the patch's
+				// position in the output grid, scaled up to this level's pixels.
+				float initial_flow[2];
+				sample_linear<2>(prev_flow, prev_level_flow.width, prev_level_flow.height,
+				                 (patch_x + 0.5f) / width_patches * prev_level_flow.width - 0.5f,
+				                 (patch_y + 0.5f) / height_patches * prev_level_flow.height - 0.5f,
+				                 initial_flow);
+				initial_flow[0] *= float(level_width) / prev_level_flow.width;
+				initial_flow[1] *= float(level_height) / prev_level_flow.height;
+
+				float *out = &(*flow_out)[((size_t(layer) * height_patches + patch_y) * width_patches + patch_x) * 3];
+				search_patch(ref, grad_tex, search, level_width, level_height, patch_size, op.search_iterations,
+				             x0, y0, initial_flow[0], initial_flow[1], out);
+			}
+		}
+	});
+}
+
+void CPUDISComputeFlow::densify(const CPUGrayPyramid &gray, int level, const vector<float> &patch_flow, int width_patches, int height_patches, int num_layers, vector<float> *dense_flow)
+{
+	int level_width = width >> level;
+	int level_height = height >> level;
+	dense_flow->assign(size_t(level_width) * level_height * 3 * num_layers, 0.0f);
+
+	// Each patch is grown by 25% in each direction (see densify.vert),
+	// so find which pixels each row and column of patches covers.
+	vector<int> x_begin(width_patches), x_end(width_patches), y_begin(height_patches), y_end(height_patches);
+	float patch_size_x = float(op.patch_size_pixels) / level_width;
+	float patch_size_y = float(op.patch_size_pixels) / level_height;
+	for (int patch_x = 0; patch_x < width_patches; ++patch_x) {
+		float center = float(patch_x) / (width_patches - 1);
+		covered_pixels(center - 0.75f * patch_size_x, center + 0.75f * patch_size_x, level_width, &x_begin[patch_x], &x_end[patch_x]);
+	}
+	for (int patch_y = 0; patch_y < height_patches; ++patch_y) {
+		float center = float(patch_y) / (height_patches - 1);
+		covered_pixels(center - 0.75f * patch_size_y, center + 0.75f * patch_size_y, level_height, &y_begin[patch_y], &y_end[patch_y]);
+	}
+
+	// Split by output row, so that each pixel gets its contributions
+	// added in the same order (patch order) no matter the threading.
+	pool->parallel_for(level_height * num_layers, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			int layer = i / level_height, y = i % level_height;
+			const float *image0 = gray.get_level(level, layer);
+			const float *image1 = gray.get_level(level, 1 - layer);
+			float *out = &(*dense_flow)[((size_t(layer) * level_height + y) * level_width) * 3];
+			for (int patch_y = 0; patch_y < height_patches; ++patch_y) {
+				if (y < y_begin[patch_y] || y >= y_end[patch_y]) {
+					continue;
+				}
+				for (int patch_x = 0; patch_x < width_patches; ++patch_x) {
+					const float *flow = &patch_flow[((size_t(layer) * height_patches + patch_y) * width_patches + patch_x) * 3];
+					float u = flow[0] * level_width, v = flow[1] * level_height;
+					for (int x = x_begin[patch_x]; x < x_end[patch_x]; ++x) {
+						float diff = image0[size_t(y) * level_width + x] - sample_linear(image1, level_width, level_height, x + u, y + v);
+						diff -= flow[2];
+						float weight = 1.0f / max(fabsf(diff), 2.0f / 255.0f);
+						out[x * 3 + 0] += flow[0] * weight;
+						out[x * 3 + 1] += flow[1] * weight;
+						out[x * 3 + 2] += weight;
+					}
+				}
+			}
+		}
+	});
+}
+
+void CPUDISComputeFlow::variational_refinement(int level, const vector<float> &I, const vector<float> &I_t, CPUFlow *base_flow, CPUScopedTimer *varref_timer)
+{
+	int level_width = base_flow->width;
+	int level_height = base_flow->height;
+	int num_layers = base_flow->num_layers;
+	size_t layer_size = size_t(level_width) * level_height;
+
+	// Calculate I_x and I_y (and beta_0).
+	CPUScopedTimer derivatives_timer("First derivatives", varref_timer);
+	vector<float> I_x_y(layer_size * 2 * num_layers), beta_0(layer_size * num_layers);
+	pool->parallel_for(level_height * num_layers, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			int layer = i / level_height, y = i % level_height;
+			size_t offset = size_t(layer) * layer_size + size_t(y) * level_width;
+			derivatives_row(&I[size_t(layer) * layer_size], level_width, level_height, y,
+			                &I_x_y[offset * 2], &beta_0[offset]);
+		}
+	});
+
+	derivatives_timer.end();
+
+	// du and dv, relative to the base flow.
+	vector<float> diff_flow(layer_size * 2 * num_layers, 0.0f);
+	vector<float> diffusivity(layer_size * num_layers);
+	vector<Equation> equations(layer_size * num_layers);
+
+	for (int outer_idx = 0; outer_idx < level + 1; ++outer_idx) {
+		bool zero_diff_flow = (outer_idx == 0);
+
+		// Calculate the diffusivity term for each pixel (like diffusivity.frag).
+		CPUScopedTimer diffusivity_timer("Compute diffusivity", varref_timer);
+		pool->parallel_for(level_height * num_layers, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				int layer = i / level_height, y = i % level_height;
+				const float *base = base_flow->get_layer(layer);
+				const float *diff = &diff_flow[size_t(layer) * layer_size * 2];
+				auto get_flow = [&](int x, int y, int c) {
+					float val = fetch<2>(base, level_width, level_height, x, y)[c];
+					if (!zero_diff_flow) {
+						val += fetch<2>(diff, level_width, level_height, x, y)[c];
+					}
+					return val;
+				};
+				for (int x = 0; x < level_width; ++x) {
+					float u_x = get_flow(x + 1, y, 0) - get_flow(x - 1, y, 0);
+					float v_x = get_flow(x + 1, y, 1) - get_flow(x - 1, y, 1);
+					float u_y = get_flow(x, y + 1, 0) - get_flow(x, y - 1, 0);
+					float v_y = get_flow(x, y + 1, 1) - get_flow(x, y - 1, 1);
+					diffusivity[size_t(layer) * layer_size + size_t(y) * level_width + x] =
+						vr_alpha / sqrtf(u_x * u_x + u_y * u_y + v_x * v_x + v_y * v_y + 1e-6f);
+				}
+			}
+		});
+
+		diffusivity_timer.end();
+
+		// Set up the 2x2 equation system for each pixel (like equations.frag).
+		CPUScopedTimer equations_timer("Set up equations", varref_timer);
+		pool->parallel_for(level_height * num_layers, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				int layer = i / level_height, y = i % level_height;
+				const float *I_x_y_tex = &I_x_y[size_t(layer) * layer_size * 2];
+				const float *I_t_tex = &I_t[size_t(layer) * layer_size];
+				const float *beta_0_tex = &beta_0[size_t(layer) * layer_size];
+				const float *base = base_flow->get_layer(layer);
+				const float *diff = &diff_flow[size_t(layer) * layer_size * 2];
+				const float *g = &diffusivity[size_t(layer) * layer_size];
+				for (int x = 0; x < level_width; ++x) {
+					size_t idx = size_t(y) * level_width + x;
+					float du = 0.0f, dv = 0.0f;
+					if (!zero_diff_flow) {
+						du = diff[idx * 2 + 0];
+						dv = diff[idx * 2 + 1];
+					}
+					float I_x = I_x_y_tex[idx * 2 + 0];
+					float I_y = I_x_y_tex[idx * 2 + 1];
+					float I_t = I_t_tex[idx];
+					float beta = beta_0_tex[idx];
+
+					// The brightness constancy term.
+					float k1 = vr_delta * beta / sqrtf(beta * (I_x * du + I_y * dv + I_t) * (I_x * du + I_y * dv + I_t) + 1e-6f);
+					float A11 = k1 * I_x * I_x;
+					float A12 = k1 * I_x * I_y;
+					float A22 = k1 * I_y * I_y;
+					float b1 = -k1 * I_t * I_x;
+					float b2 = -k1 * I_t * I_y;
+
+					// The gradient constancy term.
+					auto I_x_y_at = [&](int dx, int dy, int c) {
+						return fetch<2>(I_x_y_tex, level_width, level_height, x + dx, y + dy)[c];
+					};
+					auto I_t_at = [&](int dx) {
+						return *fetch(I_t_tex, level_width, level_height, x + dx, y);
+					};
+					float I_xx = (I_x_y_at(1, 0, 0) - I_x_y_at(-1, 0, 0)) * (2.0f / 3.0f) + (I_x_y_at(-2, 0, 0) - I_x_y_at(2, 0, 0)) * (1.0f / 12.0f);
+					float I_xy = (I_x_y_at(1, 0, 1) - I_x_y_at(-1, 0, 1)) * (2.0f / 3.0f) + (I_x_y_at(-2, 0, 1) - I_x_y_at(2, 0, 1)) * (1.0f / 12.0f);
+					float I_yy = (I_x_y_at(0, 1, 1) - I_x_y_at(0, -1, 1)) * (2.0f / 3.0f) + (I_x_y_at(0, -2, 1) - I_x_y_at(0, 2, 1)) * (1.0f / 12.0f);
+					float I_xt = (I_t_at(1) - I_t_at(-1)) * (2.0f / 3.0f) + (I_t_at(-2) - I_t_at(2)) * (1.0f / 12.0f);
+					float I_yt = 0.0f;  // equations.frag reads this as .y of a one-channel texture, which is always zero.
+
+					float beta_x = 1.0f / (I_xx * I_xx + I_xy * I_xy + 1e-7f);
+					float beta_y = 1.0f / (I_xy * I_xy + I_yy * I_yy + 1e-7f);
+					float k2 = vr_gamma / sqrtf(
+						beta_x * (I_xx * du + I_xy * dv + I_xt) * (I_xx * du + I_xy * dv + I_xt) +
+						beta_y * (I_xy * du + I_yy * dv + I_yt) * (I_xy * du + I_yy * dv + I_yt) +
+						1e-6f);
+					float k_x = k2 * beta_x;
+					float k_y = k2 * beta_y;
+					A11 += k_x * I_xx * I_xx + k_y * I_xy * I_xy;
+					A12 += k_x * I_xx * I_xy + k_y * I_xy * I_yy;
+					A22 += k_x * I_xy * I_xy + k_y * I_yy * I_yy;
+					b1 -= k_x * I_xx * I_xt + k_y * I_xy * I_yt;
+					b2 -= k_x * I_xy * I_xt + k_y * I_yy * I_yt;
+
+					// The smoothness term.
+					float smooth_l = smoothness(g, level_width, level_height, x, y, x - 1, y);
+					float smooth_r = smoothness(g, level_width, level_height, x, y, x + 1, y);
+					float smooth_d = smoothness(g, level_width, level_height, x, y, x, y - 1);
+					float smooth_u = smoothness(g, level_width, level_height, x, y, x, y + 1);
+					float smooth_sum = smooth_l + smooth_r + smooth_d + smooth_u;
+					A11 += smooth_sum;
+					A22 += smooth_sum;
+					for (int c = 0; c < 2; ++c) {
+						float laplacian =
+							smooth_l * fetch<2>(base, level_width, level_height, x - 1, y)[c] +
+							smooth_r * fetch<2>(base, level_width, level_height, x + 1, y)[c] +
+							smooth_d * fetch<2>(base, level_width, level_height, x, y - 1)[c] +
+							smooth_u * fetch<2>(base, level_width, level_height, x, y + 1)[c] -
+							smooth_sum * base[idx * 2 + c];
+						(c == 0 ? b1 : b2) += laplacian;
+					}
+
+					Equation &eq = equations[size_t(layer) * layer_size + idx];
+					eq.inv_A11 = 1.0f / A11;
+					eq.A12 = A12;
+					eq.inv_A22 = 1.0f / A22;
+					eq.b1 = b1;
+					eq.b2 = b2;
+				}
+			}
+		});
+
+		equations_timer.end();
+
+		// Run a few red-black SOR iterations (like sor.frag). Within a phase,
+		// each pixel only reads neighbors of the other color, so rows
+		// can be done in parallel.
+		CPUScopedTimer sor_timer("SOR", varref_timer);
+		const float omega = 1.8f;
+		for (int iter = 0; iter < 5; ++iter) {
+			for (int phase = 0; phase < 2; ++phase) {
+				int num_nonzero_phases = 2;
+				if (zero_diff_flow && iter == 0) {
+					num_nonzero_phases = phase;
+				}
+				pool->parallel_for(level_height * num_layers, [&](int begin, int end) {
+					for (int i = begin; i < end; ++i) {
+						int layer = i / level_height, y = i % level_height;
+						float *diff = &diff_flow[size_t(layer) * layer_size * 2];
+						const float *g = &diffusivity[size_t(layer) * layer_size];
+						for (int x = (y + phase) & 1; x < level_width; x += 2) {
+							size_t idx = size_t(y) * level_width + x;
+							const Equation &eq = equations[size_t(layer) * layer_size + idx];
+							float b1 = eq.b1, b2 = eq.b2;
+							if (num_nonzero_phases == 0) {
+								diff[idx * 2 + 0] = omega * b1 * eq.inv_A11;
+								diff[idx * 2 + 1] = omega * b2 * eq.inv_A22;
+								continue;
+							}
+							float smooth_l = smoothness(g, level_width, level_height, x, y, x - 1, y);
+							float smooth_r = smoothness(g, level_width, level_height, x, y, x + 1, y);
+							float smooth_d = smoothness(g, level_width, level_height, x, y, x, y - 1);
+							float smooth_u = smoothness(g, level_width, level_height, x, y, x, y + 1);
+							const float *l = fetch<2>(diff, level_width, level_height, x - 1, y);
+							const float *r = fetch<2>(diff, level_width, level_height, x + 1, y);
+							const float *d = fetch<2>(diff, level_width, level_height, x, y - 1);
+							const float *u = fetch<2>(diff, level_width, level_height, x, y + 1);
+							b1 += smooth_l * l[0] + smooth_r * r[0] + smooth_d * d[0] + smooth_u * u[0];
+							b2 += smooth_l * l[1] + smooth_r * r[1] + smooth_d * d[1] + smooth_u * u[1];
+
+							float du = 0.0f, dv = 0.0f;
+							if (num_nonzero_phases == 2) {
+								du = diff[idx * 2 + 0];
+								dv = diff[idx * 2 + 1];
+							}
+							du += omega * ((b1 - eq.A12 * dv) * eq.inv_A11 - du);
+							dv += omega * ((b2 - eq.A12 * du) * eq.inv_A22 - dv);
+							diff[idx * 2 + 0] = du;
+							diff[idx * 2 + 1] = dv;
+						}
+					}
+				});
+			}
+		}
+	}
+
+	// Add the differential flow to the base flow, giving the final flow
+	// estimate for this level.
+	CPUScopedTimer add_timer("Add differential flow", varref_timer);
+	for (size_t i = 0; i < base_flow->flow.size(); ++i) {
+		base_flow->flow[i] += diff_flow[i];
+	}
+}
+
+CPUInterpolate::CPUInterpolate(const OperatingPoint &op, unsigned num_threads)
+	: op(op), pool(new FlowWorkerPool(num_threads))
+{
+}
+
+CPUInterpolate::~CPUInterpolate() {}
+
+void CPUInterpolate::exec(const uint8_t *rgba0, const uint8_t *rgba1, const CPUGrayPyramid &gray, const CPUFlow &bidirectional_flow, int width, int height, float alpha, uint8_t *out)
+{
+	flow_width = width >> op.finest_level;
+	flow_height = height >> op.finest_level;
+	assert(bidirectional_flow.num_layers == 2);
+	assert(bidirectional_flow.width == flow_width && bidirectional_flow.height == flow_height);
+
+	splat(gray, bidirectional_flow, alpha);
+	fill_holes();
+	blend(rgba0, rgba1, width, height, alpha, out);
+}
+
+void CPUInterpolate::splat(const CPUGrayPyramid &gray, const CPUFlow &bidirectional_flow, float alpha)
+{
+	size_t num_pixels = size_t(flow_width) * flow_height;
+	flow.assign(num_pixels * 2, 1000.0f);  // Invalid flow.
+	depth.assign(num_pixels, 0xffff);  // Effectively infinity.
+
+	const float *gray0 = gray.get_level(op.finest_level, 0);
+	const float *gray1 = gray.get_level(op.finest_level, 1);
+	float splat_size_x = op.splat_size / flow_width, splat_size_y = op.splat_size / flow_height;
+
+	// Every pixel in both directions is splatted (in order) onto a small square
+	// around where it would be at time <alpha>; we keep the candidate where
+	// the two frames agree the most (ie., lowest depth, first one on ties).
+	// Each thread takes one band of output rows, and looks through all of the
+	// splats for those that touch it.
+	unsigned num_bands = min<unsigned>(pool->get_num_threads(), flow_height);
+	pool->parallel_for(num_bands, [&](int begin, int end) {
+		for (int band = begin; band < end; ++band) {
+			int band_y0 = flow_height * band / num_bands;
+			int band_y1 = flow_height * (band + 1) / num_bands;
+			for (int layer = 0; layer < 2; ++layer) {
+				const float *src = bidirectional_flow.get_layer(layer);
+				for (int src_y = 0; src_y < flow_height; ++src_y) {
+					for (int src_x = 0; src_x < flow_width; ++src_x) {
+						float flow_u = src[(size_t(src_y) * flow_width + src_x) * 2 + 0] / flow_width;
+						float flow_v = src[(size_t(src_y) * flow_width + src_x) * 2 + 1] / flow_height;
+						float splat_alpha = alpha;
+						if (layer == 1) {  // Reverse flow.
+							flow_u = -flow_u;
+							flow_v = -flow_v;
+							splat_alpha = 1.0f - alpha;
+						}
+						float center_y = (src_y + 0.5f) / flow_height + flow_v * splat_alpha;
+						int y_begin, y_end;
+						covered_pixels(center_y - 0.5f * splat_size_y, center_y + 0.5f * splat_size_y, flow_height, &y_begin, &y_end);
+						y_begin = max(y_begin, band_y0);
+						y_end = min(y_end, band_y1);
+						if (y_begin >= y_end) {
+							continue;
+						}
+						float center_x = (src_x + 0.5f) / flow_width + flow_u * splat_alpha;
+						int x_begin, x_end;
+						covered_pixels(center_x - 0.5f * splat_size_x, center_x + 0.5f * splat_size_x, flow_width, &x_begin, &x_end);
+
+						for (int y = y_begin; y < y_end; ++y) {
+							for (int x = x_begin; x < x_end; ++x) {
+								float I_0 = sample_linear(gray0, flow_width, flow_height,
+									x - alpha * flow_u * flow_width, y - alpha * flow_v * flow_height);
+								float I_1 = sample_linear(gray1, flow_width, flow_height,
+									x + (1.0f - alpha) * flow_u * flow_width, y + (1.0f - alpha) * flow_v * flow_height);
+								unsigned d = lrintf(0.125f * fabsf(I_1 - I_0) * 65535.0f);
+								size_t idx = size_t(y) * flow_width + x;
+								if (d < depth[idx]) {
+									depth[idx] = d;
+									flow[idx * 2 + 0] = flow_u;
+									flow[idx * 2 + 1] = flow_v;
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+	});
+}
+
+void CPUInterpolate::fill_holes()
+{
+	// Like HoleFill: Fill holes from each direction in turn, by copying from
+	// 1, 2, 4, 8, etc. pixels away. Each pass reads what the previous pass
+	// left, and depth keeps track of which pixels are holes (and which pass
+	// wrote them last), with the same 16-bit values as the GPU would use
+	// for z = 1 - n/1024.
+	size_t num_pixels = size_t(flow_width) * flow_height;
+	vector<float> prev_flow;
+	struct Direction {
+		int dx, dy;
+	} directions[] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+	for (unsigned dir = 0; dir < 4; ++dir) {
+		uint16_t z = 0xffff - 64 * (dir + 1);
+		int size = (directions[dir].dx != 0) ? flow_width : flow_height;
+		for (int offs = 1; offs < size; offs *= 2) {
+			prev_flow = flow;
+			int dx = directions[dir].dx * offs, dy = directions[dir].dy * offs;
+			pool->parallel_for(flow_height, [&](int begin, int end) {
+				for (int y = begin; y < end; ++y) {
+					int src_y = y + dy;
+					if (src_y < 0 || src_y >= flow_height) {
+						continue;
+					}
+					for (int x = 0; x < flow_width; ++x) {
+						int src_x = x + dx;
+						size_t idx = size_t(y) * flow_width + x;
+						if (src_x < 0 || src_x >= flow_width || z >= depth[idx]) {
+							continue;
+						}
+						const float *src = &prev_flow[(size_t(src_y) * flow_width + src_x) * 2];
+						if (src[0] > 100.0f) {
+							continue;  // Don't copy unset flows around.
+						}
+						flow[idx * 2 + 0] = src[0];
+						flow[idx * 2 + 1] = src[1];
+						depth[idx] = z;
+					}
+				}
+			});
+		}
+		if (dir < 3) {
+			temp_flow[dir].assign(flow.begin(), flow.begin() + num_pixels * 2);
+		}
+	}
+
+	// Like HoleBlend: Average the candidates from all four directions,
+	// for the pixels that were holes to begin with.
+	uint16_t z = 0xffff - 64 * 4;
+	pool->parallel_for(flow_height, [&](int begin, int end) {
+		for (size_t idx = size_t(begin) * flow_width; idx < size_t(end) * flow_width; ++idx) {
+			if (depth[idx] < z) {
+				continue;
+			}
+			const float *candidates[] = { &temp_flow[0][idx * 2], &temp_flow[1][idx * 2], &temp_flow[2][idx * 2], &flow[idx * 2] };
+			float sum_u = 0.0f, sum_v = 0.0f, num = 0.0f;
+			for (const float *candidate : candidates) {
+				if (candidate[0] < 100.0f) {
+					sum_u += candidate[0];
+					sum_v += candidate[1];
+					num += 1.0f;
+				}
+			}
+			if (num == 0.0f) {
+				flow[idx * 2 + 0] = flow[idx * 2 + 1] = 0.0f;
+			} else {
+				flow[idx * 2 + 0] = sum_u / num;
+				flow[idx * 2 + 1] = sum_v / num;
+			}
+		}
+	});
+}
+
+void CPUInterpolate::blend(const uint8_t *rgba0, const uint8_t *rgba1, int width, int height, float alpha, uint8_t *out)
+{
+	// Like blend.frag. The flow is upsampled bilinearly if needed.
+	pool->parallel_for(height, [&](int begin, int end) {
+		for (int y = begin; y < end; ++y) {
+			float tc_y = (y + 0.5f) / height;
+			for (int x = 0; x < width; ++x) {
+				float tc_x = (x + 0.5f) / width;
+				float f[2];
+				sample_linear<2>(flow.data(), flow_width, flow_height, tc_x * flow_width - 0.5f, tc_y * flow_height - 0.5f, f);
+
+				float tc0_x = tc_x - alpha * f[0], tc0_y = tc_y - alpha * f[1];
+				float tc1_x = tc_x + (1.0f - alpha) * f[0], tc1_y = tc_y + (1.0f - alpha) * f[1];
+				float I_0[4], I_1[4];
+				sample_linear<4>(rgba0, width, height, tc0_x * width - 0.5f, tc0_y * height - 0.5f, I_0);
+				sample_linear<4>(rgba1, width, height, tc1_x * width - 0.5f, tc1_y * height - 0.5f, I_1);
+
+				float f0[2], f1[2];
+				sample_linear<2>(flow.data(), flow_width, flow_height, tc0_x * flow_width - 0.5f, tc0_y * flow_height - 0.5f, f0);
+				sample_linear<2>(flow.data(), flow_width, flow_height, tc1_x * flow_width - 0.5f, tc1_y * flow_height - 0.5f, f1);
+				float d0 = alpha * hypotf(width * (f0[0] - f[0]), height * (f0[1] - f[1]));
+				float d1 = (1.0f - alpha) * hypotf(width * (f1[0] - f[0]), height * (f1[1] - f[1]));
+
+				uint8_t *dst = out + (size_t(y) * width + x) * 4;
+				for (int c = 0; c < 4; ++c) {
+					float result;
+					if (max(d0, d1) < 3.0f) {
+						result = I_0[c] + alpha * (I_1[c] - I_0[c]);
+					} else if (d0 < d1) {
+						result = I_0[c];
+					} else {
+						result = I_1[c];
+					}
+					dst[c] = lrintf(min(max(result, 0.0f), 255.0f));
+				}
+			}
+		}
+	});
+}
@@ -0,0 +1,143 @@
+#ifndef _FLOW_CPU_H
+#define _FLOW_CPU_H 1
+
+// A CPU implementation of DISComputeFlow and Interpolate (see flow.h),
+// for machines without OpenGL 4.5, and as a reference to check the shaders
+// against. It follows the shaders pass by pass, including how they sample
+// (nearest or bilinear, clamp-to-edge or zero border) and rasterize,
+// so the results should be directly comparable. The work is spread over
+// a pool of threads (row by row, or patch row by patch row), and the
+// inner loop of the motion search uses SSE2 when available.
+//
+// The output is not bit-exact with the GPU path: Everything here is fp32,
+// where the GPU stores most intermediate textures in fp16 and packs the
+// right-hand side of the equation system into shared-exponent 12-bit values,
+// and mipmap generation and texture filtering precision vary between GPUs.
+// Since the motion search is iterative, such small differences can now and
+// then make a patch converge somewhere else. How large the difference is
+// in practice has not been measured yet; cpu_gpu_flow_tolerance is only
+// a guess at what should be acceptable (well below the typical error against
+// ground truth), not an established criterion. Use e.g.
+// “eval --max-epe 0.25 cpu.flo gpu.flo” to compare the two on real footage.
+//
+// CPUDISComputeFlow times its passes with the same names and nesting as
+// the GPU timers in DISComputeFlow::exec(), so the two can be compared.
+//
+// Images and flow fields use the same bottom-left origin as the textures
+// on the GPU side (and thus need the same flipping when written to disk).
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include "operating_point.h"
+#include "stage_timing.h"
+
+// See above; unverified.
+static constexpr double cpu_gpu_flow_tolerance = 0.25;
+
+class FlowWorkerPool;
+
+// The two frames converted to grayscale (Rec. 709 luma, rounded to 8 bits,
+// like the GL_R8 texture from GrayscaleConversion), with a 2x2 box-filtered
+// mipmap chain, like glGenerateTextureMipmap() would make.
+class CPUGrayPyramid {
+public:
+	// <rgba0> and <rgba1> are 8-bit RGBA, bottom-left origin, no padding.
+	CPUGrayPyramid(const uint8_t *rgba0, const uint8_t *rgba1, int width, int height);
+
+	int get_num_levels() const { return levels.size(); }
+	int get_width(int level) const { return levels[level].width; }
+	int get_height(int level) const { return levels[level].height; }
+	const float *get_level(int level, int layer) const { return levels[level].pixels[layer].data(); }
+
+private:
+	struct Level {
+		int width, height;
+		std::vector<float> pixels[2];  // In 0..1.
+	};
+	std::vector<Level> levels;
+};
+
+// A flow field in pixels (du and dv interleaved), one layer per direction
+// (forward first, then backward if computed), one after the other.
+// The same layout you would get from reading back the RG16F texture
+// from DISComputeFlow.
+struct CPUFlow {
+	int width = 0, height = 0, num_layers = 0;
+	std::vector<float> flow;
+
+	const float *get_layer(int layer) const { return flow.data() + size_t(layer) * width * height * 2; }
+};
+
+class CPUDISComputeFlow {
+public:
+	// <num_threads> = 0 means one per CPU.
+	CPUDISComputeFlow(int width, int height, const OperatingPoint &op, unsigned num_threads = 0);
+	~CPUDISComputeFlow();
+
+	enum FlowDirection {
+		FORWARD,
+		FORWARD_AND_BACKWARD
+	};
+	enum ResizeStrategy {
+		DO_NOT_RESIZE_FLOW,
+		RESIZE_FLOW_TO_FULL_SIZE
+	};
+
+	// Same meaning (and defaults) as vr_alpha, vr_delta and vr_gamma in flow.cpp.
+	void set_variational_refinement_weights(float alpha, float delta, float gamma)
+	{
+		vr_alpha = alpha;
+		vr_delta = delta;
+		vr_gamma = gamma;
+	}
+
+	// Like DISComputeFlow::exec(). <gray> must be for frames of the size
+	// given to the constructor.
+	CPUFlow exec(const CPUGrayPyramid &gray, FlowDirection flow_direction, ResizeStrategy resize_strategy);
+
+	// Wall-clock time for each pass of the last exec().
+	const std::vector<StageTiming> &get_last_timings() const { return last_timings; }
+
+private:
+	void motion_search(const CPUGrayPyramid &gray, int level, const std::vector<float> &grad, const CPUFlow &prev_level_flow, int width_patches, int height_patches, int num_layers, std::vector<float> *flow_out);
+	void densify(const CPUGrayPyramid &gray, int level, const std::vector<float> &patch_flow, int width_patches, int height_patches, int num_layers, std::vector<float> *dense_flow);
+	void variational_refinement(int level, const std::vector<float> &I, const std::vector<float> &I_t, CPUFlow *base_flow, CPUScopedTimer *varref_timer);
+
+	int width, height;
+	OperatingPoint op;
+	float vr_alpha = 1.0f, vr_delta = 0.25f, vr_gamma = 0.25f;
+	std::unique_ptr<FlowWorkerPool> pool;
+	std::vector<StageTiming> last_timings;
+};
+
+class CPUInterpolate {
+public:
+	// <num_threads> = 0 means one per CPU.
+	CPUInterpolate(const OperatingPoint &op, unsigned num_threads = 0);
+	~CPUInterpolate();
+
+	// Like Interpolate::exec() (without split Y'CbCr output).
+	// <rgba0> and <rgba1> are the two frames, as given to CPUGrayPyramid,
+	// and <bidirectional_flow> is from CPUDISComputeFlow::exec() with
+	// FORWARD_AND_BACKWARD and DO_NOT_RESIZE_FLOW. Writes width x height
+	// RGBA pixels (bottom-left origin) to <out>.
+	void exec(const uint8_t *rgba0, const uint8_t *rgba1, const CPUGrayPyramid &gray, const CPUFlow &bidirectional_flow, int width, int height, float alpha, uint8_t *out);
+
+private:
+	void splat(const CPUGrayPyramid &gray, const CPUFlow &bidirectional_flow, float alpha);
+	void fill_holes();
+	void blend(const uint8_t *rgba0, const uint8_t *rgba1, int width, int height, float alpha, uint8_t *out);
+
+	OperatingPoint op;
+	std::unique_ptr<FlowWorkerPool> pool;
+
+	// At the flow level; reused between calls.
+	int flow_width = 0, flow_height = 0;
+	std::vector<float> flow;  // Normalized (0..1) coordinates, like the GL_RG16F texture.
+	std::vector<uint16_t> depth;  // Like the GL_DEPTH_COMPONENT16 renderbuffer.
+	std::vector<float> temp_flow[3];
+};
+
+#endif  // !defined(_FLOW_CPU_H)
@@ -1,7 +1,9 @@
 #define NO_SDL_GLEXT 1
 
 #include "flow.h"
+#include "flow_cpu.h"
 #include "gpu_timers.h"
+#include "load_image.h"
 #include "util.h"
 
 #include <SDL2/SDL.h>
@@ -13,6 +15,7 @@
 #include <SDL2/SDL_video.h>
 #include <algorithm>
 #include <assert.h>
+#include <chrono>
 #include <deque>
 #include <epoxy/gl.h>
 #include <getopt.h>
@@ -20,21 +23,37 @@
 #include <memory>
 #include <stack>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <vector>
 
 #define BUFFER_OFFSET(i) ((char *)nullptr + (i))
 
 using namespace std;
+using namespace std::chrono;
 
 SDL_Window *window;
 
 bool enable_warmup = false;
 bool enable_variational_refinement = true;  // Just for debugging.
 bool enable_interpolation = false;
+bool enable_cpu = false;
+int operating_point = 3;
 
 extern float vr_alpha, vr_delta, vr_gamma;
 
+OperatingPoint get_operating_point()
+{
+	static const OperatingPoint operating_points[] = {
+		operating_point1, operating_point2, operating_point3, operating_point4
+	};
+	OperatingPoint op = operating_points[operating_point - 1];
+	if (!enable_variational_refinement) {
+		op.variational_refinement = false;
+	}
+	return op;
+}
+
 // Structures for asynchronous readback. We assume everything is the same size (and GL_RG16F).
 struct ReadInProgress {
 	GLuint pbo;
@@ -51,32 +70,8 @@ enum MipmapPolicy {
 
 GLuint load_texture(const char *filename, unsigned *width_ret, unsigned *height_ret, MipmapPolicy mipmaps)
 {
-	SDL_Surface *surf = IMG_Load(filename);
-	if (surf == nullptr) {
-		fprintf(stderr, "IMG_Load(%s): %s\n", filename, IMG_GetError());
-		exit(1);
-	}
-
-	// For whatever reason, SDL doesn't support converting to YUV surfaces
-	// nor grayscale, so we'll do it ourselves.
-	SDL_Surface *rgb_surf = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGBA32, /*flags=*/0);
-	if (rgb_surf == nullptr) {
-		fprintf(stderr, "SDL_ConvertSurfaceFormat(%s): %s\n", filename, SDL_GetError());
-		exit(1);
-	}
-
-	SDL_FreeSurface(surf);
-
-	unsigned width = rgb_surf->w, height = rgb_surf->h;
-	const uint8_t *sptr = (uint8_t *)rgb_surf->pixels;
-	unique_ptr<uint8_t[]> pix(new uint8_t[width * height * 4]);
-
-	// Extract the Y component, and convert to bottom-left origin.
-	for (unsigned y = 0; y < height; ++y) {
-		unsigned y2 = height - 1 - y;
-		memcpy(pix.get() + y * width * 4, sptr + y2 * rgb_surf->pitch, width * 4);
-	}
-	SDL_FreeSurface(rgb_surf);
+	unsigned width, height;
+	unique_ptr<uint8_t[]> pix = load_image_rgba(filename, &width, &height);
 
 	int num_levels = (mipmaps == WITH_MIPMAPS) ? find_num_levels(width, height) : 1;
 
@@ -261,11 +256,7 @@ void compute_flow_only(int argc, char **argv, int optind)
 	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &tex_gray);
 	glTextureStorage3D(tex_gray, levels, GL_R8, width1, height1, 2);
 
-	OperatingPoint op = operating_point3;
-	if (!enable_variational_refinement) {
-		op.variational_refinement = false;
-	}
-
+	OperatingPoint op = get_operating_point();
 	DISComputeFlow compute_flow(width1, height1, op);  // Must be initialized before gray.
 	GrayscaleConversion gray;
 	gray.exec(image_tex, tex_gray, width1, height1, /*num_layers=*/2);
@@ -370,10 +361,7 @@ void interpolate_image(int argc, char **argv, int optind)
 		spare_pbos.push(pbos[i]);
 	}
 
-	OperatingPoint op = operating_point3;
-	if (!enable_variational_refinement) {
-		op.variational_refinement = false;
-	}
+	OperatingPoint op = get_operating_point();
 	DISComputeFlow compute_flow(width1, height1, op);
 	GrayscaleConversion gray;
 	Interpolate interpolate(op, /*split_ycbcr_output=*/false);
@@ -413,6 +401,109 @@ void interpolate_image(int argc, char **argv, int optind)
 	}
 }
 
+// The same as compute_flow_only() and interpolate_image(), but using
+// CPUDISComputeFlow and CPUInterpolate, so no OpenGL is needed.
+void compute_flow_only_cpu(int argc, char **argv, int optind)
+{
+	OperatingPoint op = get_operating_point();
+	unique_ptr<CPUDISComputeFlow> compute_flow;
+	unsigned width1 = 0, height1 = 0;
+
+	int num_flows = max((argc - optind) / 3, 1);
+	for (int i = 0; i < num_flows; ++i) {
+		const char *filename0 = argc >= (optind + i * 3 + 1) ? argv[optind + i * 3 + 0] : "test1499.png";
+		const char *filename1 = argc >= (optind + i * 3 + 2) ? argv[optind + i * 3 + 1] : "test1500.png";
+		const char *flow_filename = argc >= (optind + i * 3 + 3) ? argv[optind + i * 3 + 2] : "flow.flo";
+
+		unsigned width, height;
+		unique_ptr<uint8_t[]> pix0 = load_image_rgba(filename0, &width, &height);
+		if (i == 0) {
+			width1 = width;
+			height1 = height;
+			compute_flow.reset(new CPUDISComputeFlow(width1, height1, op));
+			compute_flow->set_variational_refinement_weights(vr_alpha, vr_delta, vr_gamma);
+		} else if (width != width1 || height != height1) {
+			fprintf(stderr, "%s: Image dimensions don't match (%dx%d versus %dx%d)\n",
+			        filename0, width, height, width1, height1);
+			exit(1);
+		}
+		unique_ptr<uint8_t[]> pix1 = load_image_rgba(filename1, &width, &height);
+		if (width != width1 || height != height1) {
+			fprintf(stderr, "%s: Image dimensions don't match (%dx%d versus %dx%d)\n",
+			        filename1, width, height, width1, height1);
+			exit(1);
+		}
+
+		CPUGrayPyramid gray(pix0.get(), pix1.get(), width1, height1);
+		if (enable_warmup && i == 0) {
+			for (int j = 0; j < 10; ++j) {
+				compute_flow->exec(gray, CPUDISComputeFlow::FORWARD, CPUDISComputeFlow::RESIZE_FLOW_TO_FULL_SIZE);
+			}
+		}
+
+		steady_clock::time_point start = steady_clock::now();
+		CPUFlow flow = compute_flow->exec(gray, CPUDISComputeFlow::FORWARD, CPUDISComputeFlow::RESIZE_FLOW_TO_FULL_SIZE);
+		if (enable_timing) {
+			fprintf(stderr, "Compute flow (CPU): %.1f ms\n", 1e3 * duration<double>(steady_clock::now() - start).count());
+		}
+
+		flip_coordinate_system(flow.flow.data(), width1, height1);
+		write_flow(flow_filename, flow.flow.data(), width1, height1);
+		fprintf(stderr, "%s %s -> %s\n", filename0, filename1, flow_filename);
+		if (i == 0) {
+			write_ppm("flow.ppm", flow.flow.data(), width1, height1);
+		}
+	}
+}
+
+void interpolate_image_cpu(int argc, char **argv, int optind)
+{
+	const char *filename0 = argc >= (optind + 1) ? argv[optind] : "test1499.png";
+	const char *filename1 = argc >= (optind + 2) ? argv[optind + 1] : "test1500.png";
+
+	unsigned width1, height1, width2, height2;
+	unique_ptr<uint8_t[]> pix0 = load_image_rgba(filename0, &width1, &height1);
+	unique_ptr<uint8_t[]> pix1 = load_image_rgba(filename1, &width2, &height2);
+	if (width1 != width2 || height1 != height2) {
+		fprintf(stderr, "Image dimensions don't match (%dx%d versus %dx%d)\n",
+		        width1, height1, width2, height2);
+		exit(1);
+	}
+
+	OperatingPoint op = get_operating_point();
+	CPUDISComputeFlow compute_flow(width1, height1, op);
+	compute_flow.set_variational_refinement_weights(vr_alpha, vr_delta, vr_gamma);
+	CPUInterpolate interpolate(op);
+	CPUGrayPyramid gray(pix0.get(), pix1.get(), width1, height1);
+	unique_ptr<uint8_t[]> rgba(new uint8_t[width1 * height1 * 4]);
+
+	if (enable_warmup) {
+		for (int i = 0; i < 10; ++i) {
+			CPUFlow bidirectional_flow = compute_flow.exec(gray, CPUDISComputeFlow::FORWARD_AND_BACKWARD, CPUDISComputeFlow::DO_NOT_RESIZE_FLOW);
+			interpolate.exec(pix0.get(), pix1.get(), gray, bidirectional_flow, width1, height1, 0.5f, rgba.get());
+		}
+	}
+
+	steady_clock::time_point start = steady_clock::now();
+	CPUFlow bidirectional_flow = compute_flow.exec(gray, CPUDISComputeFlow::FORWARD_AND_BACKWARD, CPUDISComputeFlow::DO_NOT_RESIZE_FLOW);
+	if (enable_timing) {
+		fprintf(stderr, "Compute flow (CPU): %.1f ms\n", 1e3 * duration<double>(steady_clock::now() - start).count());
+	}
+
+	for (int frameno = 1; frameno < 60; ++frameno) {
+		char ppm_filename[256];
+		snprintf(ppm_filename, sizeof(ppm_filename), "interp%04d.ppm", frameno);
+
+		float alpha = frameno / 60.0f;
+		start = steady_clock::now();
+		interpolate.exec(pix0.get(), pix1.get(), gray, bidirectional_flow, width1, height1, alpha, rgba.get());
+		if (enable_timing) {
+			fprintf(stderr, "Interpolate (CPU): %.1f ms\n", 1e3 * duration<double>(steady_clock::now() - start).count());
+		}
+		write_ppm(ppm_filename, rgba.get(), width1, height1);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	static const option long_options[] = {
@@ -423,7 +514,9 @@ int main(int argc, char **argv)
 		{ "detailed-timing", no_argument, 0, 1003 },
 		{ "disable-variational-refinement", no_argument, 0, 1001 },
 		{ "interpolate", no_argument, 0, 1002 },
-		{ "warmup", no_argument, 0, 1004 }
+		{ "warmup", no_argument, 0, 1004 },
+		{ "cpu", no_argument, 0, 1005 },
+		{ "operating-point", required_argument, 0, 1006 }
 	};
 
 	enable_timing = true;
@@ -460,12 +553,31 @@ int main(int argc, char **argv)
 		case 1004:
 			enable_warmup = true;
 			break;
+		case 1005:
+			enable_cpu = true;
+			break;
+		case 1006:
+			operating_point = atoi(optarg);
+			if (operating_point < 1 || operating_point > 4) {
+				fprintf(stderr, "--operating-point must be 1, 2, 3 or 4\n");
+				exit(1);
+			}
+			break;
 		default:
 			fprintf(stderr, "Unknown option '%s'\n", argv[option_index]);
 			exit(1);
 		};
 	}
 
+	if (enable_cpu) {
+		if (enable_interpolation) {
+			interpolate_image_cpu(argc, argv, optind);
+		} else {
+			compute_flow_only_cpu(argc, argv, optind);
+		}
+		return 0;
+	}
+
 	if (SDL_Init(SDL_INIT_EVERYTHING) == -1) {
 		fprintf(stderr, "SDL_Init failed: %s\n", SDL_GetError());
 		exit(1);
@@ -15,6 +15,7 @@ struct FrameOnDisk {
 	off_t offset;
 	unsigned filename_idx;
 	uint32_t size;  // Not using size_t saves a few bytes; we can have so many frames.
+	uint32_t proxy_size = 0;  // 0 means no proxy. If there is one, it is right after the frame.
 };
 extern std::vector<FrameOnDisk> frames[MAX_STREAMS];  // Under frame_mu.
 extern std::vector<std::string> frame_filenames;  // Under frame_mu.
@@ -24,7 +25,23 @@ static bool inline operator==(const FrameOnDisk &a, const FrameOnDisk &b)
 	return a.pts == b.pts &&
 		a.offset == b.offset &&
 		a.filename_idx == b.filename_idx &&
-		a.size == b.size;
+		a.size == b.size &&
+		a.proxy_size == b.proxy_size;
+}
+
+// The proxy (a smaller copy; see --proxy-scale) of the given frame, as a frame
+// of its own, so that it can be read and cached like any other.
+// Returns the frame itself if it has no proxy.
+static inline FrameOnDisk get_proxy_frame(const FrameOnDisk &frame)
+{
+	if (frame.proxy_size == 0) {
+		return frame;
+	}
+	FrameOnDisk proxy = frame;
+	proxy.offset = frame.offset + frame.size;
+	proxy.size = frame.proxy_size;
+	proxy.proxy_size = 0;
+	return proxy;
 }
 
 // A helper class to read frames from disk. It caches the file descriptor
@@ -7,6 +7,7 @@ using namespace std;
 bool enable_timing = false;
 bool detailed_timing = false;
 bool in_warmup = false;
+bool print_timing = true;
 
 pair<GLuint, GLuint> GPUTimers::begin_timer(const string &name, int level)
 {
@@ -70,3 +71,12 @@ void GPUTimers::print()
 		}
 	}
 }
+
+vector<StageTiming> GPUTimers::get_results()
+{
+	vector<StageTiming> results;
+	for (const Timer &timer : timers) {
+		results.push_back(StageTiming{ timer.name, timer.level, find_elapsed(timer.query) / 1e6 });
+	}
+	return results;
+}
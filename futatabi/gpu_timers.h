@@ -6,13 +6,17 @@
 #include <utility>
 #include <vector>
 
+#include "stage_timing.h"
+
 extern bool enable_timing;
 extern bool detailed_timing;
 extern bool in_warmup;
+extern bool print_timing;  // If false, timings are only collected, not printed to stderr.
 
 class GPUTimers {
 public:
 	void print();
+	std::vector<StageTiming> get_results();  // Includes the detailed timers.
 	std::pair<GLuint, GLuint> begin_timer(const std::string &name, int level);
 
 private:
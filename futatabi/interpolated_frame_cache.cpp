@@ -0,0 +1,301 @@
+#include "interpolated_frame_cache.h"
+
+#include "flags.h"
+#include "shared/metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+once_flag interpolated_cache_metrics_inited;
+atomic<int64_t> metric_interpolated_cache_memory_bytes{ 0 };
+atomic<int64_t> metric_interpolated_cache_disk_bytes{ 0 };
+atomic<int64_t> metric_interpolated_cache_memory_hit_frames{ 0 };
+atomic<int64_t> metric_interpolated_cache_disk_hit_frames{ 0 };
+atomic<int64_t> metric_interpolated_cache_miss_frames{ 0 };
+atomic<int64_t> metric_interpolated_cache_spilled_frames{ 0 };
+atomic<int64_t> metric_interpolated_cache_spill_dropped_frames{ 0 };
+
+}  // namespace
+
+InterpolatedFrameCache::Key InterpolatedFrameCache::make_key(const FrameOnDisk &frame1, const FrameOnDisk &frame2, float alpha, int interpolation_quality)
+{
+	Key key;
+	key.frame1 = frame1;
+	key.frame2 = frame2;
+	key.alpha_fixed = lrintf(alpha * ALPHA_STEPS);
+	key.interpolation_quality = interpolation_quality;
+	return key;
+}
+
+bool InterpolatedFrameCache::KeyLexicalOrder::operator()(const Key &a, const Key &b) const
+{
+	if (a.frame1.pts != b.frame1.pts)
+		return a.frame1.pts < b.frame1.pts;
+	if (a.frame2.pts != b.frame2.pts)
+		return a.frame2.pts < b.frame2.pts;
+	if (a.alpha_fixed != b.alpha_fixed)
+		return a.alpha_fixed < b.alpha_fixed;
+	if (a.frame1.offset != b.frame1.offset)
+		return a.frame1.offset < b.frame1.offset;
+	if (a.frame1.filename_idx != b.frame1.filename_idx)
+		return a.frame1.filename_idx < b.frame1.filename_idx;
+	if (a.frame2.offset != b.frame2.offset)
+		return a.frame2.offset < b.frame2.offset;
+	if (a.frame2.filename_idx != b.frame2.filename_idx)
+		return a.frame2.filename_idx < b.frame2.filename_idx;
+	return a.interpolation_quality < b.interpolation_quality;
+}
+
+InterpolatedFrameCache::DiskFile::~DiskFile()
+{
+	close(fd);
+}
+
+InterpolatedFrameCache::InterpolatedFrameCache(size_t memory_limit_bytes, size_t disk_limit_bytes)
+	: memory_limit_bytes(memory_limit_bytes), disk_limit_bytes(disk_limit_bytes)
+{
+	call_once(interpolated_cache_metrics_inited, [] {
+		global_metrics.add("interpolated_cache_used_bytes", { { "location", "memory" } }, &metric_interpolated_cache_memory_bytes, Metrics::TYPE_GAUGE);
+		global_metrics.add("interpolated_cache_used_bytes", { { "location", "disk" } }, &metric_interpolated_cache_disk_bytes, Metrics::TYPE_GAUGE);
+		global_metrics.add("interpolated_cache_frames", { { "action", "hit" }, { "location", "memory" } }, &metric_interpolated_cache_memory_hit_frames);
+		global_metrics.add("interpolated_cache_frames", { { "action", "hit" }, { "location", "disk" } }, &metric_interpolated_cache_disk_hit_frames);
+		global_metrics.add("interpolated_cache_frames", { { "action", "miss" } }, &metric_interpolated_cache_miss_frames);
+		global_metrics.add("interpolated_cache_frames", { { "action", "spill" } }, &metric_interpolated_cache_spilled_frames);
+		global_metrics.add("interpolated_cache_frames", { { "action", "spill_dropped" } }, &metric_interpolated_cache_spill_dropped_frames);
+	});
+	if (disk_limit_bytes > 0) {
+		spill_thread = thread(&InterpolatedFrameCache::spill_thread_func, this);
+	}
+}
+
+InterpolatedFrameCache::~InterpolatedFrameCache()
+{
+	if (spill_thread.joinable()) {
+		{
+			lock_guard<mutex> lock(mu);
+			should_quit = true;
+			frames_to_spill_changed.notify_all();
+		}
+		spill_thread.join();
+	}
+}
+
+shared_ptr<const string> InterpolatedFrameCache::lookup(const Key &key)
+{
+	DiskFrame disk_frame;
+	shared_ptr<const string> jpeg_to_reinsert;
+	{
+		lock_guard<mutex> lock(mu);
+		auto it = memory_frames.find(key);
+		if (it != memory_frames.end()) {
+			it->second.last_used = event_counter++;
+			++metric_interpolated_cache_memory_hit_frames;
+			return it->second.jpeg;
+		}
+		auto spill_it = frames_to_spill.find(key);
+		if (spill_it != frames_to_spill.end()) {
+			// Still waiting to go to disk; just put it back into memory.
+			// (The spill thread will still write it, which does no harm.)
+			jpeg_to_reinsert = spill_it->second;
+			++metric_interpolated_cache_memory_hit_frames;
+		}
+		auto disk_it = disk_frames.find(key);
+		if (jpeg_to_reinsert == nullptr && disk_it == disk_frames.end()) {
+			++metric_interpolated_cache_miss_frames;
+			return nullptr;
+		}
+		if (jpeg_to_reinsert == nullptr) {
+			disk_frame = disk_it->second;
+		}
+	}
+	if (jpeg_to_reinsert != nullptr) {
+		insert(key, jpeg_to_reinsert);
+		return jpeg_to_reinsert;
+	}
+
+	// Read it back from disk, without holding the lock. Holding on to
+	// disk_frame.file makes sure the file stays around while we do.
+	string jpeg;
+	jpeg.resize(disk_frame.size);
+	size_t bytes_read = 0;
+	while (bytes_read < disk_frame.size) {
+		ssize_t ret = pread(disk_frame.file->fd, &jpeg[bytes_read], disk_frame.size - bytes_read, disk_frame.offset + bytes_read);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			perror("pread (interpolated frame cache)");
+			++metric_interpolated_cache_miss_frames;
+			return nullptr;
+		}
+		bytes_read += ret;
+	}
+	++metric_interpolated_cache_disk_hit_frames;
+
+	// The rest of the clip is probably coming right after, so bring it back into memory.
+	shared_ptr<const string> ret = make_shared<const string>(move(jpeg));
+	insert(key, ret);
+	return ret;
+}
+
+void InterpolatedFrameCache::insert(const Key &key, shared_ptr<const string> jpeg)
+{
+	lock_guard<mutex> lock(mu);
+	auto it = memory_frames.find(key);
+	if (it != memory_frames.end()) {
+		it->second.last_used = event_counter++;
+		return;
+	}
+	memory_bytes_used += jpeg->size();
+	memory_frames.emplace(key, LRUFrame{ move(jpeg), event_counter++ });
+	queue_spill(prune_memory());
+	metric_interpolated_cache_memory_bytes = memory_bytes_used;
+}
+
+vector<pair<InterpolatedFrameCache::Key, shared_ptr<const string>>> InterpolatedFrameCache::prune_memory()
+{
+	vector<pair<Key, shared_ptr<const string>>> pruned_frames;
+	int64_t bytes_still_to_remove = memory_bytes_used - memory_limit_bytes * 9 / 10;
+	if (memory_bytes_used <= memory_limit_bytes || bytes_still_to_remove <= 0)
+		return pruned_frames;
+
+	vector<pair<size_t, size_t>> lru_timestamps_and_size;
+	for (const auto &key_and_value : memory_frames) {
+		lru_timestamps_and_size.emplace_back(
+			key_and_value.second.last_used,
+			key_and_value.second.jpeg->size());
+	}
+	sort(lru_timestamps_and_size.begin(), lru_timestamps_and_size.end());
+
+	// Remove the oldest ones until we are below 90% of the limit.
+	size_t lru_cutoff_point = 0;
+	for (const pair<size_t, size_t> &it : lru_timestamps_and_size) {
+		lru_cutoff_point = it.first;
+		bytes_still_to_remove -= it.second;
+		if (bytes_still_to_remove <= 0)
+			break;
+	}
+
+	for (auto it = memory_frames.begin(); it != memory_frames.end();) {
+		if (it->second.last_used <= lru_cutoff_point) {
+			memory_bytes_used -= it->second.jpeg->size();
+			if (disk_limit_bytes > 0 && !disk_frames.count(it->first) && !frames_to_spill.count(it->first)) {
+				pruned_frames.emplace_back(it->first, move(it->second.jpeg));
+			}
+			it = memory_frames.erase(it);
+		} else {
+			++it;
+		}
+	}
+	return pruned_frames;
+}
+
+void InterpolatedFrameCache::queue_spill(vector<pair<Key, shared_ptr<const string>>> frames)
+{
+	// If the disk can't keep up, don't let the frames waiting for it
+	// take more memory than a fraction of what the cache itself may use.
+	bool any_queued = false;
+	for (pair<Key, shared_ptr<const string>> &key_and_jpeg : frames) {
+		size_t size = key_and_jpeg.second->size();
+		if (size > disk_limit_bytes || frames_to_spill_bytes + size > memory_limit_bytes / 4) {
+			++metric_interpolated_cache_spill_dropped_frames;
+			continue;
+		}
+		frames_to_spill_bytes += size;
+		frames_to_spill.emplace(key_and_jpeg.first, move(key_and_jpeg.second));
+		any_queued = true;
+	}
+	if (any_queued) {
+		frames_to_spill_changed.notify_all();
+	}
+}
+
+void InterpolatedFrameCache::spill_thread_func()
+{
+	pthread_setname_np(pthread_self(), "SpillCache");
+
+	for ( ;; ) {
+		Key key;
+		shared_ptr<const string> jpeg;
+		{
+			unique_lock<mutex> lock(mu);
+			frames_to_spill_changed.wait(lock, [this] { return should_quit || !frames_to_spill.empty(); });
+			if (should_quit) {
+				// Whatever is left is just forgotten; the file goes away anyway.
+				return;
+			}
+			key = frames_to_spill.begin()->first;
+			jpeg = frames_to_spill.begin()->second;  // Stays in the map until written, so that lookup() can find it.
+		}
+
+		spill_to_disk(key, *jpeg);
+
+		lock_guard<mutex> lock(mu);
+		auto it = frames_to_spill.find(key);
+		if (it != frames_to_spill.end()) {
+			frames_to_spill_bytes -= it->second->size();
+			frames_to_spill.erase(it);
+		}
+	}
+}
+
+void InterpolatedFrameCache::spill_to_disk(const Key &key, const string &jpeg)
+{
+	// Find room for the frame. If the file is full, we simply start
+	// on a new one and forget everything in the old one; it's cheaper
+	// than keeping track of holes, and the frames we lose are the ones
+	// that have been out of memory for the longest.
+	DiskFrame disk_frame;
+	{
+		lock_guard<mutex> lock(mu);
+		if (disk_file == nullptr || disk_bytes_used + jpeg.size() > disk_limit_bytes) {
+			disk_frames.clear();
+			disk_file.reset();
+			disk_bytes_used = 0;
+
+			string filename = global_flags.working_directory + "/interpolated_cache.XXXXXX";
+			int fd = mkstemp(&filename[0]);
+			if (fd == -1) {
+				perror(filename.c_str());
+				return;
+			}
+			unlink(filename.c_str());
+			disk_file.reset(new DiskFile{ fd });
+		}
+		disk_frame.file = disk_file;
+		disk_frame.offset = disk_bytes_used;
+		disk_frame.size = jpeg.size();
+		disk_bytes_used += jpeg.size();
+		metric_interpolated_cache_disk_bytes = disk_bytes_used;
+	}
+
+	size_t bytes_written = 0;
+	while (bytes_written < jpeg.size()) {
+		ssize_t ret = pwrite(disk_frame.file->fd, jpeg.data() + bytes_written, jpeg.size() - bytes_written, disk_frame.offset + bytes_written);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret == -1) {
+			perror("pwrite (interpolated frame cache)");
+			return;
+		}
+		bytes_written += ret;
+	}
+
+	lock_guard<mutex> lock(mu);
+	if (disk_frame.file == disk_file) {  // Not started on a new file in the meantime.
+		disk_frames[key] = disk_frame;
+		++metric_interpolated_cache_spilled_frames;
+	}
+}
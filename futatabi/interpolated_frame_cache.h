@@ -0,0 +1,111 @@
+#ifndef _INTERPOLATED_FRAME_CACHE_H
+#define _INTERPOLATED_FRAME_CACHE_H 1
+
+#include "frame_on_disk.h"
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+// A cache of interpolated output frames, as encoded JPEGs, so that when
+// a slow-motion clip is played again, we don't need to compute the flow
+// and interpolation (and encode the result) for the same frames again;
+// instead, they cost about as much as an original frame. Frames that
+// fall out of memory go to a temporary file in the working directory,
+// if we're allowed to use disk (--interpolated-cache-disk-mb); the file
+// is unlinked right after it's created, so it goes away by itself when
+// we exit. The writing is done by a thread of our own, so that insert()
+// (called from the encoding thread) never waits for the disk.
+//
+// Only plain interpolated frames are cached, not those that are faded
+// against another clip, since the fades depend on too many other things
+// to be likely to repeat exactly.
+//
+// Thread-safe.
+class InterpolatedFrameCache {
+public:
+	struct Key {
+		FrameOnDisk frame1, frame2;
+		unsigned alpha_fixed = 0;  // alpha, in units of 1/ALPHA_STEPS.
+		int interpolation_quality = 0;  // Which operating point the frame was made with.
+	};
+	static constexpr unsigned ALPHA_STEPS = 4096;  // Far finer than anyone can see.
+	static Key make_key(const FrameOnDisk &frame1, const FrameOnDisk &frame2, float alpha, int interpolation_quality);
+
+	InterpolatedFrameCache(size_t memory_limit_bytes, size_t disk_limit_bytes);
+	~InterpolatedFrameCache();
+
+	// Returns nullptr if the frame is not in the cache. If the frame is on disk,
+	// it is read back synchronously, in the calling thread. This is a trade-off:
+	// it is a single read of one JPEG (often still in the page cache), which is
+	// much cheaper than the interpolation it saves, and the caller needs the
+	// answer right away to know whether to interpolate or not.
+	std::shared_ptr<const std::string> lookup(const Key &key);
+
+	// Never touches the disk itself; frames that need to be spilled
+	// are handed over to spill_thread_func().
+	void insert(const Key &key, std::shared_ptr<const std::string> jpeg);
+
+private:
+	// Just an arbitrary order for std::map.
+	struct KeyLexicalOrder {
+		bool operator()(const Key &a, const Key &b) const;
+	};
+
+	struct LRUFrame {
+		std::shared_ptr<const std::string> jpeg;
+		size_t last_used;
+	};
+
+	// A temporary file we've been spilling frames into. Closed when the last
+	// reference to it goes away, so that readers can finish using it
+	// even if we've started on a new one.
+	struct DiskFile {
+		int fd;
+		~DiskFile();
+	};
+	struct DiskFrame {
+		std::shared_ptr<DiskFile> file;
+		off_t offset;
+		size_t size;
+	};
+
+	// Assumes mu is held. Removes the least recently used frames
+	// from memory until we're below 90% of the limit, and returns them
+	// (if we have disk to put them on).
+	std::vector<std::pair<Key, std::shared_ptr<const std::string>>> prune_memory();
+
+	// Assumes mu is held. Queues the frames for spill_thread_func(), unless
+	// too much is already waiting (in which case they are simply forgotten).
+	void queue_spill(std::vector<std::pair<Key, std::shared_ptr<const std::string>>> frames);
+
+	// Does not need mu to be held.
+	void spill_to_disk(const Key &key, const std::string &jpeg);
+
+	void spill_thread_func();
+
+	const size_t memory_limit_bytes, disk_limit_bytes;
+
+	std::mutex mu;
+	std::map<Key, LRUFrame, KeyLexicalOrder> memory_frames;  // Under <mu>.
+	size_t memory_bytes_used = 0;  // Under <mu>.
+	size_t event_counter = 0;  // Under <mu>.
+	std::map<Key, DiskFrame, KeyLexicalOrder> disk_frames;  // Under <mu>.
+	std::shared_ptr<DiskFile> disk_file;  // Under <mu>. nullptr if none opened yet.
+	off_t disk_bytes_used = 0;  // Under <mu>. In disk_file.
+
+	// Frames out of memory, but not yet on disk; they can still be looked up.
+	std::map<Key, std::shared_ptr<const std::string>, KeyLexicalOrder> frames_to_spill;  // Under <mu>.
+	size_t frames_to_spill_bytes = 0;  // Under <mu>.
+	bool should_quit = false;  // Under <mu>.
+	std::condition_variable frames_to_spill_changed;
+	std::thread spill_thread;  // Only running if disk_limit_bytes > 0.
+};
+
+#endif  // !defined(_INTERPOLATED_FRAME_CACHE_H)
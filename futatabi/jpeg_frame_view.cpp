@@ -65,6 +65,7 @@ struct PendingDecode {
 	// For actual decodes (only if frame below is nullptr).
 	FrameOnDisk primary, secondary;
 	float fade_alpha;  // Irrelevant if secondary.stream_idx == -1.
+	bool use_proxies;
 
 	// Already-decoded frames are also sent through PendingDecode,
 	// so that they get drawn in the right order. If frame is nullptr,
@@ -305,11 +306,14 @@ void JPEGFrameView::jpeg_decoder_thread_func()
 		shared_ptr<Frame> primary_frame, secondary_frame;
 		bool drop = false;
 		for (int subframe_idx = 0; subframe_idx < 2; ++subframe_idx) {
-			const FrameOnDisk &frame_spec = (subframe_idx == 0 ? decode.primary : decode.secondary);
+			FrameOnDisk frame_spec = (subframe_idx == 0 ? decode.primary : decode.secondary);
 			if (frame_spec.pts == -1) {
 				// No secondary frame.
 				continue;
 			}
+			if (decode.use_proxies) {
+				frame_spec = get_proxy_frame(frame_spec);
+			}
 
 			bool found_in_cache;
 			shared_ptr<Frame> frame = decode_jpeg_with_cache(frame_spec, cache_miss_behavior, &decode.destination->frame_reader, &found_in_cache);
@@ -374,6 +378,7 @@ void JPEGFrameView::setFrame(unsigned stream_idx, FrameOnDisk frame, FrameOnDisk
 	decode.primary = frame;
 	decode.secondary = secondary_frame;
 	decode.fade_alpha = fade_alpha;
+	decode.use_proxies = use_proxies;
 	decode.destination = this;
 	pending_decodes.push_back(decode);
 	any_pending_decodes.notify_all();
@@ -425,6 +430,12 @@ void JPEGFrameView::resizeGL(int width, int height)
 	// Save these, as width() and height() will lie with DPI scaling.
 	gl_width = width;
 	gl_height = height;
+
+	// We don't know how large the frames are until we've decoded them,
+	// so assume they're the same size as the output.
+	use_proxies = global_flags.proxy_scale != 0 &&
+		width * global_flags.proxy_scale <= global_flags.width &&
+		height * global_flags.proxy_scale <= global_flags.height;
 }
 
 void JPEGFrameView::paintGL()
@@ -6,6 +6,7 @@
 #include "ycbcr_converter.h"
 
 #include <QGLWidget>
+#include <atomic>
 #include <epoxy/gl.h>
 #include <memory>
 #include <movit/effect_chain.h>
@@ -73,6 +74,10 @@ private:
 
 	int gl_width, gl_height;
 
+	// Whether the frames' proxies (see --proxy-scale) are large enough
+	// for us to show them instead of the frames themselves. Set in resizeGL().
+	std::atomic<bool> use_proxies{ false };
+
 	static std::thread jpeg_decoder_thread;
 };
 
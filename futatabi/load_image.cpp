@@ -0,0 +1,44 @@
+#include "load_image.h"
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_error.h>
+#include <SDL2/SDL_image.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+unique_ptr<uint8_t[]> load_image_rgba(const char *filename, unsigned *width_ret, unsigned *height_ret)
+{
+	SDL_Surface *surf = IMG_Load(filename);
+	if (surf == nullptr) {
+		fprintf(stderr, "IMG_Load(%s): %s\n", filename, IMG_GetError());
+		exit(1);
+	}
+
+	// For whatever reason, SDL doesn't support converting to YUV surfaces
+	// nor grayscale, so we'll do it ourselves.
+	SDL_Surface *rgb_surf = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGBA32, /*flags=*/0);
+	if (rgb_surf == nullptr) {
+		fprintf(stderr, "SDL_ConvertSurfaceFormat(%s): %s\n", filename, SDL_GetError());
+		exit(1);
+	}
+
+	SDL_FreeSurface(surf);
+
+	unsigned width = rgb_surf->w, height = rgb_surf->h;
+	const uint8_t *sptr = (uint8_t *)rgb_surf->pixels;
+	unique_ptr<uint8_t[]> pix(new uint8_t[width * height * 4]);
+
+	// Convert to bottom-left origin.
+	for (unsigned y = 0; y < height; ++y) {
+		unsigned y2 = height - 1 - y;
+		memcpy(pix.get() + y * width * 4, sptr + y2 * rgb_surf->pitch, width * 4);
+	}
+	SDL_FreeSurface(rgb_surf);
+
+	*width_ret = width;
+	*height_ret = height;
+	return pix;
+}
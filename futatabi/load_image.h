@@ -0,0 +1,12 @@
+#ifndef _LOAD_IMAGE_H
+#define _LOAD_IMAGE_H 1
+
+#include <memory>
+#include <stdint.h>
+
+// Loads an image file (anything SDL_image understands) as 8-bit RGBA,
+// flipped to bottom-left origin, like OpenGL wants it. Used by the test
+// binaries for the optical flow code; exits on error.
+std::unique_ptr<uint8_t[]> load_image_rgba(const char *filename, unsigned *width, unsigned *height);
+
+#endif  // !defined(_LOAD_IMAGE_H)
@@ -3,7 +3,9 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <memory>
 #include <mutex>
@@ -27,6 +29,7 @@ extern "C" {
 #include "frame_on_disk.h"
 #include "mainwindow.h"
 #include "player.h"
+#include "proxy_jpeg.h"
 #include "shared/context.h"
 #include "shared/disk_space_estimator.h"
 #include "shared/ffmpeg_raii.h"
@@ -34,6 +37,7 @@ extern "C" {
 #include "shared/metrics.h"
 #include "shared/post_to_main_thread.h"
 #include "shared/ref_counted_gl_sync.h"
+#include "shared/sliced_jpeg_encoder.h"
 #include "shared/timebase.h"
 #include "ui_mainwindow.h"
 #include "vaapi_jpeg_decoder.h"
@@ -60,11 +64,17 @@ int64_t start_pts = -1;
 int64_t current_pts = 0;
 
 struct FrameFile {
-	FILE *fp = nullptr;
+	int fd = -1;
 	unsigned filename_idx;
 	size_t frames_written_so_far = 0;
+	off_t size = 0;  // Bytes written so far.
+	off_t allocated_size = 0;  // Bytes reserved with fallocate().
+	bool can_fallocate = true;  // Cleared if the file system doesn't support it.
+
+	// Everything before this has been written back and dropped from the page cache.
+	off_t dropped_from_cache = 0;
 };
-std::map<int, FrameFile> open_frame_files;
+std::map<int, FrameFile> open_frame_files;  // Only accessed by the frame writer thread.
 
 mutex frame_mu;
 vector<FrameOnDisk> frames[MAX_STREAMS];  // Under frame_mu.
@@ -73,16 +83,153 @@ vector<string> frame_filenames;  // Under frame_mu.
 atomic<int64_t> metric_received_frames[MAX_STREAMS]{ { 0 } };
 Summary metric_received_frame_size_bytes;
 
+// Frames received but not yet written to disk. The receiving thread only copies
+// the JPEG; a separate thread makes the proxy (if any), serializes the entire
+// record (magic, length, header, JPEG, proxy) into one buffer and writes it out,
+// so that neither slow disks nor proxy encoding hold up reception of the stream
+// (up to a point; if the queue is full, we block). Frames are not made visible
+// to the rest of Futatabi before they have actually been written.
+struct QueuedFrameWrite {
+	int stream_idx;
+	int64_t pts;
+	string jpeg;
+	steady_clock::time_point received;
+};
+mutex frame_write_queue_mu;
+condition_variable frame_write_queue_changed;
+deque<QueuedFrameWrite> frame_write_queue;  // Under frame_write_queue_mu.
+bool frame_writer_should_quit = false;  // Under frame_write_queue_mu.
+constexpr size_t max_queued_frame_writes = 64;
+
+// We preallocate .frames files in chunks of this size (without changing
+// the file size), so that the file system has a chance to keep them contiguous.
+constexpr off_t frame_file_preallocation_bytes = 64 << 20;
+
+// Newly written data is kept in the page cache up to this many bytes behind
+// the end of each file, since it's likely to be read again soon (e.g. for
+// display of the live frames). Older data is written back and dropped,
+// so that 16 streams of recording don't push out the data that is being read.
+constexpr off_t frame_file_write_behind_bytes = 16 << 20;
+
+atomic<int64_t> metric_frame_write_queue_frames{ 0 };
+atomic<int64_t> metric_frame_write_bytes{ 0 };
+Summary metric_frame_write_seconds;  // Time spent in pwrite().
+Summary metric_frame_write_latency_seconds;  // From reception until the frame is visible.
+Summary metric_proxy_encode_seconds;
+atomic<int64_t> metric_proxy_encode_failed_frames{ 0 };
+
 namespace {
 
-FrameOnDisk write_frame(int stream_idx, int64_t pts, const uint8_t *data, size_t size, DB *db)
+void write_or_die(int fd, const char *data, size_t size, off_t offset)
+{
+	while (size > 0) {
+		ssize_t ret = pwrite(fd, data, size, offset);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret == -1) {
+			perror("pwrite");
+			exit(1);
+		}
+		data += ret;
+		size -= ret;
+		offset += ret;
+	}
+}
+
+void preallocate(FrameFile *file, off_t end)
 {
+	if (!file->can_fallocate || end <= file->allocated_size) {
+		return;
+	}
+	off_t new_allocated_size = end + frame_file_preallocation_bytes;
+	if (fallocate(file->fd, FALLOC_FL_KEEP_SIZE, file->allocated_size, new_allocated_size - file->allocated_size) == -1) {
+		// Not supported, or we're running out of space (in which case the write
+		// will tell us soon enough). Just write without preallocation.
+		file->can_fallocate = false;
+		return;
+	}
+	file->allocated_size = new_allocated_size;
+}
+
+// Start writeback of what we just wrote, and drop whatever is more than
+// frame_file_write_behind_bytes behind it from the page cache.
+// Errors are not fatal; this is only a hint.
+void write_behind(FrameFile *file, off_t start, off_t end)
+{
+	sync_file_range(file->fd, start, end - start, SYNC_FILE_RANGE_WRITE);
+
+	off_t drop_end = end - frame_file_write_behind_bytes;
+	if (drop_end <= file->dropped_from_cache) {
+		return;
+	}
+	// This should normally not block, since writeback was started long ago.
+	sync_file_range(file->fd, file->dropped_from_cache, drop_end - file->dropped_from_cache,
+	                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(file->fd, file->dropped_from_cache, drop_end - file->dropped_from_cache, POSIX_FADV_DONTNEED);
+	file->dropped_from_cache = drop_end;
+}
+
+void close_frame_file(FrameFile *file)
+{
+	// Give back any preallocated space we didn't use. (Truncating to the
+	// current size frees blocks allocated past the end of the file.)
+	if (file->allocated_size > file->size && ftruncate(file->fd, file->size) == -1) {
+		perror("ftruncate");
+	}
+	if (close(file->fd) != 0) {
+		perror("close");
+		exit(1);
+	}
+	file->fd = -1;
+}
+
+void queue_frame_write(int stream_idx, int64_t pts, const uint8_t *data, size_t size)
+{
+	QueuedFrameWrite qf;
+	qf.stream_idx = stream_idx;
+	qf.pts = pts;
+	qf.jpeg.assign(reinterpret_cast<const char *>(data), size);
+	qf.received = steady_clock::now();
+
+	unique_lock<mutex> lock(frame_write_queue_mu);
+	frame_write_queue_changed.wait(lock, [] { return frame_write_queue.size() < max_queued_frame_writes; });
+	frame_write_queue.push_back(move(qf));
+	metric_frame_write_queue_frames = frame_write_queue.size();
+	frame_write_queue_changed.notify_all();
+}
+
+FrameOnDisk write_frame(const QueuedFrameWrite &qf, const string &proxy, DB *db)
+{
+	FrameHeaderProto hdr;
+	hdr.set_stream_idx(qf.stream_idx);
+	hdr.set_pts(qf.pts);
+	hdr.set_file_size(qf.jpeg.size());
+	hdr.set_proxy_size(proxy.size());
+
+	string serialized;
+	if (!hdr.SerializeToString(&serialized)) {
+		fprintf(stderr, "Frame header serialization failed.\n");
+		exit(1);
+	}
+	uint32_t len = htonl(serialized.size());
+
+	size_t header_size = frame_magic_len + sizeof(len) + serialized.size();
+	string record;
+	record.reserve(header_size + qf.jpeg.size() + proxy.size());
+	record.append(frame_magic, frame_magic_len);
+	record.append(reinterpret_cast<const char *>(&len), sizeof(len));
+	record.append(serialized);
+	record.append(qf.jpeg);
+	record.append(proxy);
+
+	int stream_idx = qf.stream_idx;
 	if (open_frame_files.count(stream_idx) == 0) {
 		char filename[256];
 		snprintf(filename, sizeof(filename), "%s/frames/cam%d-pts%09ld.frames",
-		         global_flags.working_directory.c_str(), stream_idx, pts);
-		FILE *fp = fopen(filename, "wb");
-		if (fp == nullptr) {
+		         global_flags.working_directory.c_str(), stream_idx, qf.pts);
+		int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (fd == -1) {
 			perror(filename);
 			exit(1);
 		}
@@ -90,7 +237,10 @@ FrameOnDisk write_frame(int stream_idx, int64_t pts, const uint8_t *data, size_t
 		lock_guard<mutex> lock(frame_mu);
 		unsigned filename_idx = frame_filenames.size();
 		frame_filenames.push_back(filename);
-		open_frame_files[stream_idx] = FrameFile{ fp, filename_idx, 0 };
+		FrameFile file;
+		file.fd = fd;
+		file.filename_idx = filename_idx;
+		open_frame_files[stream_idx] = file;
 	}
 
 	FrameFile &file = open_frame_files[stream_idx];
@@ -101,43 +251,25 @@ FrameOnDisk write_frame(int stream_idx, int64_t pts, const uint8_t *data, size_t
 		filename = frame_filenames[filename_idx];
 	}
 
-	FrameHeaderProto hdr;
-	hdr.set_stream_idx(stream_idx);
-	hdr.set_pts(pts);
-	hdr.set_file_size(size);
+	off_t start = file.size;
+	off_t end = start + record.size();
+	preallocate(&file, end);
 
-	string serialized;
-	if (!hdr.SerializeToString(&serialized)) {
-		fprintf(stderr, "Frame header serialization failed.\n");
-		exit(1);
-	}
-	uint32_t len = htonl(serialized.size());
+	steady_clock::time_point write_start = steady_clock::now();
+	write_or_die(file.fd, record.data(), record.size(), start);  // No fsync(), though. We can accept losing a few frames.
+	metric_frame_write_seconds.count_event(duration<double>(steady_clock::now() - write_start).count());
+	metric_frame_write_bytes += record.size();
 
-	if (fwrite(frame_magic, frame_magic_len, 1, file.fp) != 1) {
-		perror("fwrite");
-		exit(1);
-	}
-	if (fwrite(&len, sizeof(len), 1, file.fp) != 1) {
-		perror("fwrite");
-		exit(1);
-	}
-	if (fwrite(serialized.data(), serialized.size(), 1, file.fp) != 1) {
-		perror("fwrite");
-		exit(1);
-	}
-	off_t offset = ftell(file.fp);
-	if (fwrite(data, size, 1, file.fp) != 1) {
-		perror("fwrite");
-		exit(1);
-	}
-	fflush(file.fp);  // No fsync(), though. We can accept losing a few frames.
-	global_disk_space_estimator->report_write(filename, 8 + sizeof(len) + serialized.size() + size, pts);
+	file.size = end;
+	write_behind(&file, start, end);
+	global_disk_space_estimator->report_write(filename, record.size(), qf.pts);
 
 	FrameOnDisk frame;
-	frame.pts = pts;
+	frame.pts = qf.pts;
 	frame.filename_idx = filename_idx;
-	frame.offset = offset;
-	frame.size = size;
+	frame.offset = start + header_size;
+	frame.size = qf.jpeg.size();
+	frame.proxy_size = proxy.size();
 
 	{
 		lock_guard<mutex> lock(frame_mu);
@@ -146,13 +278,10 @@ FrameOnDisk write_frame(int stream_idx, int64_t pts, const uint8_t *data, size_t
 	}
 
 	if (++file.frames_written_so_far >= 1000) {
-		size_t size = ftell(file.fp);
+		off_t size = file.size;
 
 		// Start a new file next time.
-		if (fclose(file.fp) != 0) {
-			perror("fclose");
-			exit(1);
-		}
+		close_frame_file(&file);
 		open_frame_files.erase(stream_idx);
 
 		// Write information about all frames in the finished file to SQLite.
@@ -182,6 +311,58 @@ FrameOnDisk write_frame(int stream_idx, int64_t pts, const uint8_t *data, size_t
 	return frame;
 }
 
+void frame_writer_thread_func(DB *db)
+{
+	pthread_setname_np(pthread_self(), "WriteFrames");
+
+	// Proxies are small, so we don't bother splitting them into slices.
+	unique_ptr<SlicedJPEGEncoder> proxy_encoder;
+	if (global_flags.proxy_scale != 0) {
+		proxy_encoder.reset(new SlicedJPEGEncoder(/*num_helper_threads=*/0));
+	}
+
+	for ( ;; ) {
+		QueuedFrameWrite qf;
+		{
+			unique_lock<mutex> lock(frame_write_queue_mu);
+			frame_write_queue_changed.wait(lock, [] { return frame_writer_should_quit || !frame_write_queue.empty(); });
+			if (frame_write_queue.empty()) {
+				// Quitting, and everything has been written.
+				break;
+			}
+			qf = move(frame_write_queue.front());
+			frame_write_queue.pop_front();
+			metric_frame_write_queue_frames = frame_write_queue.size();
+			frame_write_queue_changed.notify_all();
+		}
+
+		string proxy;
+		if (proxy_encoder != nullptr) {
+			steady_clock::time_point encode_start = steady_clock::now();
+			proxy = make_proxy_jpeg(reinterpret_cast<const uint8_t *>(qf.jpeg.data()), qf.jpeg.size(), global_flags.proxy_scale, proxy_encoder.get());
+			metric_proxy_encode_seconds.count_event(duration<double>(steady_clock::now() - encode_start).count());
+			if (proxy.empty()) {
+				// The frame is probably broken, but store it anyway, just without a proxy.
+				++metric_proxy_encode_failed_frames;
+			}
+		}
+
+		FrameOnDisk frame = write_frame(qf, proxy, db);
+		metric_frame_write_latency_seconds.count_event(duration<double>(steady_clock::now() - qf.received).count());
+
+		int stream_idx = qf.stream_idx;
+		post_to_main_thread([stream_idx, frame] {
+			global_mainwindow->display_frame(stream_idx, frame);
+		});
+	}
+
+	// These will be picked up by scanning on the next startup.
+	for (auto &stream_idx_and_file : open_frame_files) {
+		close_frame_file(&stream_idx_and_file.second);
+	}
+	open_frame_files.clear();
+}
+
 }  // namespace
 
 HTTPD *global_httpd;
@@ -354,8 +535,9 @@ void load_frame_file(const char *filename, const string &basename, unsigned file
 		}
 		frame.filename_idx = filename_idx;
 		frame.size = hdr.file_size();
+		frame.proxy_size = hdr.proxy_size();
 
-		if (fseek(fp, frame.offset + frame.size, SEEK_SET) == -1) {
+		if (fseek(fp, frame.offset + frame.size + frame.proxy_size, SEEK_SET) == -1) {
 			fprintf(stderr, "WARNING: %s: Could not seek past frame (probably truncated).\n", filename);
 			continue;
 		}
@@ -463,6 +645,16 @@ void record_thread_func()
 		global_metrics.add("received_frames", { { "stream", to_string(i) } }, &metric_received_frames[i]);
 	}
 	global_metrics.add("received_frame_size_bytes", &metric_received_frame_size_bytes);
+	global_metrics.add("frame_write_queue_frames", &metric_frame_write_queue_frames, Metrics::TYPE_GAUGE);
+	global_metrics.add("frame_write_bytes", &metric_frame_write_bytes);
+	vector<double> quantiles{ 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99 };
+	metric_frame_write_seconds.init(quantiles, 60.0);
+	global_metrics.add("frame_write_seconds", &metric_frame_write_seconds);
+	metric_frame_write_latency_seconds.init(quantiles, 60.0);
+	global_metrics.add("frame_write_latency_seconds", &metric_frame_write_latency_seconds);
+	metric_proxy_encode_seconds.init(quantiles, 60.0);
+	global_metrics.add("proxy_encode_seconds", &metric_proxy_encode_seconds);
+	global_metrics.add("proxy_encode_failed_frames", &metric_proxy_encode_failed_frames);
 
 	if (global_flags.stream_source.empty() || global_flags.stream_source == "/dev/null") {
 		// Save the user from some repetitive messages.
@@ -473,6 +665,7 @@ void record_thread_func()
 
 	int64_t pts_offset = 0;  // Needs to be initialized due to a spurious GCC warning.
 	DB db(global_flags.working_directory + "/futatabi.db");
+	thread frame_writer_thread(frame_writer_thread_func, &db);
 
 	while (!should_quit.load()) {
 		auto format_ctx = avformat_open_input_unique(global_flags.stream_source.c_str(), nullptr, nullptr);
@@ -516,11 +709,7 @@ void record_thread_func()
 
 			//fprintf(stderr, "Got a frame from camera %d, pts = %ld, size = %d\n",
 			//      pkt.stream_index, pts, pkt.size);
-			FrameOnDisk frame = write_frame(pkt.stream_index, pts, pkt.data, pkt.size, &db);
-
-			post_to_main_thread([pkt, frame] {
-				global_mainwindow->display_frame(pkt.stream_index, frame);
-			});
+			queue_frame_write(pkt.stream_index, pts, pkt.data, pkt.size);
 
 			if (last_pts != -1 && global_flags.slow_down_input) {
 				this_thread::sleep_for(microseconds((pts - last_pts) * 1000000 / TIMEBASE));
@@ -534,4 +723,11 @@ void record_thread_func()
 
 		start_pts = last_pts + TIMEBASE;
 	}
+
+	{
+		lock_guard<mutex> lock(frame_write_queue_mu);
+		frame_writer_should_quit = true;
+		frame_write_queue_changed.notify_all();
+	}
+	frame_writer_thread.join();
 }
@@ -0,0 +1,19 @@
+#ifndef _PROXY_JPEG_H
+#define _PROXY_JPEG_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+class SlicedJPEGEncoder;
+
+// Makes a small copy of the given JPEG, at 1/<scale_denom> of the size
+// in each direction (<scale_denom> must be 2, 4 or 8), for use when
+// showing frames in small windows. The scaling is done by libjpeg as part
+// of the decoding (by skipping the highest DCT coefficients), so it costs
+// much less than a full decode; the Huffman decoding is still there, though.
+//
+// Returns an empty string if the JPEG could not be decoded.
+std::string make_proxy_jpeg(const uint8_t *data, size_t size, unsigned scale_denom, SlicedJPEGEncoder *encoder);
+
+#endif  // !defined(_PROXY_JPEG_H)
@@ -0,0 +1,65 @@
+#ifndef _STAGE_TIMING_H
+#define _STAGE_TIMING_H 1
+
+// Per-stage timings for one run of the flow computation, for tools that want
+// them as data instead of printed to stderr (see GPUTimers::get_results() and
+// CPUDISComputeFlow::get_last_timings()). Kept separate from gpu_timers.h
+// so that it can be used without OpenGL.
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+struct StageTiming {
+	std::string name;  // The same on the GPU and CPU paths, e.g. “Motion search”.
+	int level;  // Nesting depth; 0 is the outermost timer.
+	double ms;
+};
+
+// Like ScopedTimer, but for wall-clock time on the CPU. Timers are appended
+// to the list in the order they are started, so children come after
+// their parent, like in GPUTimers.
+class CPUScopedTimer {
+public:
+	CPUScopedTimer(const std::string &name, std::vector<StageTiming> *timings)
+		: timings(timings), level(0)
+	{
+		begin(name);
+	}
+
+	CPUScopedTimer(const std::string &name, CPUScopedTimer *parent_timer)
+		: timings(parent_timer->timings),
+		  level(parent_timer->level + 1)
+	{
+		begin(name);
+	}
+
+	~CPUScopedTimer()
+	{
+		end();
+	}
+
+	void end()
+	{
+		if (!ended) {
+			(*timings)[index].ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			ended = true;
+		}
+	}
+
+private:
+	void begin(const std::string &name)
+	{
+		index = timings->size();
+		timings->push_back(StageTiming{ name, level, 0.0 });
+		start = std::chrono::steady_clock::now();
+	}
+
+	std::vector<StageTiming> *timings;
+	int level;
+	size_t index;
+	std::chrono::steady_clock::time_point start;
+	bool ended = false;
+};
+
+#endif  // !defined(_STAGE_TIMING_H)
@@ -13,10 +13,13 @@ extern "C" {
 #include "player.h"
 #include "shared/context.h"
 #include "shared/httpd.h"
+#include "shared/metrics.h"
 #include "shared/mux.h"
+#include "shared/sliced_jpeg_encoder.h"
 #include "util.h"
 #include "ycbcr_converter.h"
 
+#include <algorithm>
 #include <epoxy/glx.h>
 #include <jpeglib.h>
 #include <unistd.h>
@@ -26,113 +29,54 @@ using namespace std::chrono;
 
 extern HTTPD *global_httpd;
 
-struct VectorDestinationManager {
-	jpeg_destination_mgr pub;
-	std::vector<uint8_t> dest;
-
-	VectorDestinationManager()
-	{
-		pub.init_destination = init_destination_thunk;
-		pub.empty_output_buffer = empty_output_buffer_thunk;
-		pub.term_destination = term_destination_thunk;
-	}
-
-	static void init_destination_thunk(j_compress_ptr ptr)
-	{
-		((VectorDestinationManager *)(ptr->dest))->init_destination();
-	}
-
-	inline void init_destination()
-	{
-		make_room(0);
-	}
-
-	static boolean empty_output_buffer_thunk(j_compress_ptr ptr)
-	{
-		return ((VectorDestinationManager *)(ptr->dest))->empty_output_buffer();
-	}
-
-	inline bool empty_output_buffer()
-	{
-		make_room(dest.size());  // Should ignore pub.free_in_buffer!
-		return true;
-	}
+namespace {
 
-	inline void make_room(size_t bytes_used)
-	{
-		dest.resize(bytes_used + 4096);
-		dest.resize(dest.capacity());
-		pub.next_output_byte = dest.data() + bytes_used;
-		pub.free_in_buffer = dest.size() - bytes_used;
-	}
+once_flag video_stream_metrics_inited;
 
-	static void term_destination_thunk(j_compress_ptr ptr)
-	{
-		((VectorDestinationManager *)(ptr->dest))->term_destination();
-	}
+atomic<int64_t> metric_output_encode_queue_frames{ 0 };
+Summary metric_output_readback_seconds;
+Summary metric_output_encode_queue_seconds;
+Summary metric_output_encode_seconds;
+Summary metric_output_reorder_seconds;
+atomic<int64_t> metric_flow_cache_hit_frames{ 0 };
+atomic<int64_t> metric_flow_cache_miss_frames{ 0 };
 
-	inline void term_destination()
-	{
-		dest.resize(dest.size() - pub.free_in_buffer);
-	}
-};
-static_assert(std::is_standard_layout<VectorDestinationManager>::value, "");
+}  // namespace
 
-vector<uint8_t> encode_jpeg(const uint8_t *y_data, const uint8_t *cb_data, const uint8_t *cr_data, unsigned width, unsigned height)
+vector<uint8_t> encode_jpeg(SlicedJPEGEncoder *encoder, const uint8_t *y_data, const uint8_t *cb_data, const uint8_t *cr_data, unsigned width, unsigned height)
 {
-	VectorDestinationManager dest;
-
-	jpeg_compress_struct cinfo;
-	jpeg_error_mgr jerr;
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-
-	cinfo.dest = (jpeg_destination_mgr *)&dest;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_RGB;
-	jpeg_set_defaults(&cinfo);
 	constexpr int quality = 90;
-	jpeg_set_quality(&cinfo, quality, /*force_baseline=*/false);
-
-	cinfo.image_width = width;
-	cinfo.image_height = height;
-	cinfo.raw_data_in = true;
-	jpeg_set_colorspace(&cinfo, JCS_YCbCr);
-	cinfo.comp_info[0].h_samp_factor = 2;
-	cinfo.comp_info[0].v_samp_factor = 1;
-	cinfo.comp_info[1].h_samp_factor = 1;
-	cinfo.comp_info[1].v_samp_factor = 1;
-	cinfo.comp_info[2].h_samp_factor = 1;
-	cinfo.comp_info[2].v_samp_factor = 1;
-	cinfo.CCIR601_sampling = true;  // Seems to be mostly ignored by libjpeg, though.
-	jpeg_start_compress(&cinfo, true);
-
-	// This comment marker is private to FFmpeg. It signals limited Y'CbCr range
-	// (and nothing else).
-	jpeg_write_marker(&cinfo, JPEG_COM, (const JOCTET *)"CS=ITU601", strlen("CS=ITU601"));
-
-	JSAMPROW yptr[8], cbptr[8], crptr[8];
-	JSAMPARRAY data[3] = { yptr, cbptr, crptr };
-	for (unsigned y = 0; y < height; y += 8) {
-		for (unsigned yy = 0; yy < 8; ++yy) {
-			yptr[yy] = const_cast<JSAMPROW>(&y_data[(y + yy) * width]);
-			cbptr[yy] = const_cast<JSAMPROW>(&cb_data[(y + yy) * width / 2]);
-			crptr[yy] = const_cast<JSAMPROW>(&cr_data[(y + yy) * width / 2]);
-		}
-
-		jpeg_write_raw_data(&cinfo, data, /*num_lines=*/8);
-	}
-
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
-
-	return move(dest.dest);
+	return encoder->encode(width, height, global_flags.jpeg_encode_slices, quality,
+		[&](unsigned y, unsigned slice_idx, JSAMPROW *yptr, JSAMPROW *cbptr, JSAMPROW *crptr) {
+			for (unsigned yy = 0; yy < 8; ++yy) {
+				yptr[yy] = const_cast<JSAMPROW>(&y_data[(y + yy) * width]);
+				cbptr[yy] = const_cast<JSAMPROW>(&cb_data[(y + yy) * width / 2]);
+				crptr[yy] = const_cast<JSAMPROW>(&cr_data[(y + yy) * width / 2]);
+			}
+		});
 }
 
 VideoStream::VideoStream(AVFormatContext *file_avctx)
 	: avctx(file_avctx), output_fast_forward(file_avctx != nullptr)
 {
+	call_once(video_stream_metrics_inited, [] {
+		global_metrics.add("output_encode_queue_frames", &metric_output_encode_queue_frames, Metrics::TYPE_GAUGE);
+
+		vector<double> quantiles{ 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99 };
+		metric_output_readback_seconds.init(quantiles, 60.0);
+		metric_output_encode_queue_seconds.init(quantiles, 60.0);
+		metric_output_encode_seconds.init(quantiles, 60.0);
+		metric_output_reorder_seconds.init(quantiles, 60.0);
+		global_metrics.add("output_stage_seconds", {{ "stage", "readback" }}, &metric_output_readback_seconds);
+		global_metrics.add("output_stage_seconds", {{ "stage", "encode_queue" }}, &metric_output_encode_queue_seconds);
+		global_metrics.add("output_stage_seconds", {{ "stage", "encode" }}, &metric_output_encode_seconds);
+		global_metrics.add("output_stage_seconds", {{ "stage", "reorder" }}, &metric_output_reorder_seconds);
+		global_metrics.add("flow_cache_frames", {{ "action", "hit" }}, &metric_flow_cache_hit_frames);
+		global_metrics.add("flow_cache_frames", {{ "action", "miss" }}, &metric_flow_cache_miss_frames);
+	});
+
 	ycbcr_converter.reset(new YCbCrConverter(YCbCrConverter::OUTPUT_TO_DUAL_YCBCR, /*resource_pool=*/nullptr));
+	jpeg_encoder.reset(new SlicedJPEGEncoder(/*num_helper_threads=*/global_flags.jpeg_encode_slices - 1));
 	ycbcr_semiplanar_converter.reset(new YCbCrConverter(YCbCrConverter::OUTPUT_TO_SEMIPLANAR, /*resource_pool=*/nullptr));
 
 	GLuint input_tex[num_interpolate_slots], gray_tex[num_interpolate_slots];
@@ -233,13 +177,22 @@ VideoStream::VideoStream(AVFormatContext *file_avctx)
 	unique_ptr<uint8_t[]> cb_or_cr(new uint8_t[(global_flags.width / 2) * global_flags.height]);
 	memset(y.get(), 16, global_flags.width * global_flags.height);
 	memset(cb_or_cr.get(), 128, (global_flags.width / 2) * global_flags.height);
-	last_frame = encode_jpeg(y.get(), cb_or_cr.get(), cb_or_cr.get(), global_flags.width, global_flags.height);
+	last_frame = encode_jpeg(jpeg_encoder.get(), y.get(), cb_or_cr.get(), cb_or_cr.get(), global_flags.width, global_flags.height);
+
+	if (global_flags.interpolated_cache_mb > 0) {
+		interpolated_frame_cache.reset(new InterpolatedFrameCache(
+			size_t(global_flags.interpolated_cache_mb) * 1024 * 1024,
+			size_t(global_flags.interpolated_cache_disk_mb) * 1024 * 1024));
+	}
 }
 
 VideoStream::~VideoStream()
 {
-	if (last_flow_tex != 0) {
-		compute_flow->release_texture(last_flow_tex);
+	for (const CachedFlow &flow : flow_cache) {
+		compute_flow->release_texture(flow.flow_tex);
+	}
+	for (const CachedFlow &flow : evicted_flows) {
+		compute_flow->release_texture(flow.flow_tex);
 	}
 
 	for (const unique_ptr<InterpolatedFrameResources> &resource : interpolate_resources) {
@@ -291,6 +244,10 @@ void VideoStream::start()
 	                  AVCOL_SPC_BT709, COARSE_TIMEBASE, /*write_callback=*/nullptr, Mux::WRITE_FOREGROUND, {}, Mux::WITH_SUBTITLES));
 
 	encode_thread = thread(&VideoStream::encode_thread_func, this);
+	for (unsigned thread_idx = 0; thread_idx < unsigned(global_flags.jpeg_encode_threads); ++thread_idx) {
+		jpeg_encode_threads.emplace_back(&VideoStream::jpeg_encode_thread_func, this, thread_idx);
+	}
+	mux_thread = thread(&VideoStream::mux_thread_func, this);
 }
 
 void VideoStream::stop()
@@ -299,6 +256,16 @@ void VideoStream::stop()
 	queue_changed.notify_all();
 	clear_queue();
 	encode_thread.join();
+	{
+		lock_guard<mutex> lock(pipeline_lock);
+		frames_to_encode_changed.notify_all();
+		frames_to_mux_changed.notify_all();
+	}
+	for (thread &t : jpeg_encode_threads) {
+		t.join();
+	}
+	jpeg_encode_threads.clear();
+	mux_thread.join();
 }
 
 void VideoStream::clear_queue()
@@ -313,11 +280,13 @@ void VideoStream::clear_queue()
 	// These are not RAII-ed, unfortunately, so we'll need to clean them ourselves.
 	// Note that release_texture() is thread-safe.
 	for (const QueuedFrame &qf : q) {
+		if (qf.cached_jpeg != nullptr) {
+			// From interpolated_frame_cache; never had any textures.
+			continue;
+		}
 		if (qf.type == QueuedFrame::INTERPOLATED ||
 		    qf.type == QueuedFrame::FADED_INTERPOLATED) {
-			if (qf.flow_tex != 0) {
-				compute_flow->release_texture(qf.flow_tex);
-			}
+			release_flow(qf.flow_tex);
 		}
 		if (qf.type == QueuedFrame::INTERPOLATED) {
 			interpolate->release_texture(qf.output_tex);
@@ -430,6 +399,28 @@ void VideoStream::schedule_interpolated_frame(steady_clock::time_point local_pts
 		fprintf(stderr, "output_pts=%ld  interpolated  input_pts1=%ld input_pts2=%ld alpha=%.3f\n", output_pts, frame1.pts, frame2.pts, alpha);
 	}
 
+	// If we've made this very frame before (typically, because the same clip
+	// is being replayed), we can just send it again.
+	InterpolatedFrameCache::Key cache_key = InterpolatedFrameCache::make_key(frame1, frame2, alpha, flow_initialized_interpolation_quality);
+	if (interpolated_frame_cache != nullptr && secondary_frame.pts == -1) {
+		shared_ptr<const string> jpeg = interpolated_frame_cache->lookup(cache_key);
+		if (jpeg != nullptr) {
+			QueuedFrame qf;
+			qf.type = QueuedFrame::INTERPOLATED;
+			qf.output_pts = output_pts;
+			qf.display_decoded_func = move(display_func);
+			qf.queue_spot_holder = move(queue_spot_holder);
+			qf.local_pts = local_pts;
+			qf.subtitle = subtitle;
+			qf.cached_jpeg = move(jpeg);
+
+			lock_guard<mutex> lock(queue_lock);
+			frame_queue.push_back(move(qf));
+			queue_changed.notify_all();
+			return;
+		}
+	}
+
 	// Get the temporary OpenGL resources we need for doing the interpolation.
 	BorrowedInterpolatedFrameResources resources;
 	{
@@ -449,6 +440,8 @@ void VideoStream::schedule_interpolated_frame(steady_clock::time_point local_pts
 	qf.queue_spot_holder = move(queue_spot_holder);
 	qf.local_pts = local_pts;
 	qf.subtitle = subtitle;
+	qf.put_in_cache = (interpolated_frame_cache != nullptr && secondary_frame.pts == -1);
+	qf.cache_key = cache_key;
 
 	check_error();
 
@@ -465,26 +458,8 @@ void VideoStream::schedule_interpolated_frame(steady_clock::time_point local_pts
 	glGenerateTextureMipmap(resources->gray_tex);
 	check_error();
 
-	GLuint flow_tex;
-	if (last_flow_tex != 0 && frame1 == last_frame1 && frame2 == last_frame2) {
-		// Reuse the flow from previous computation. This frequently happens
-		// if we slow down by more than 2x, so that there are multiple interpolated
-		// frames between each original.
-		flow_tex = last_flow_tex;
-		qf.flow_tex = 0;
-	} else {
-		// Cache miss, so release last_flow_tex.
-		qf.flow_tex = last_flow_tex;
-
-		// Compute the flow.
-		flow_tex = compute_flow->exec(resources->gray_tex, DISComputeFlow::FORWARD_AND_BACKWARD, DISComputeFlow::DO_NOT_RESIZE_FLOW);
-		check_error();
-
-		// Store the flow texture for possible reuse next frame.
-		last_flow_tex = flow_tex;
-		last_frame1 = frame1;
-		last_frame2 = frame2;
-	}
+	GLuint flow_tex = get_flow(frame1, frame2, resources->gray_tex);
+	qf.flow_tex = flow_tex;
 
 	if (secondary_frame.pts != -1) {
 		// Fade. First kick off the interpolation.
@@ -511,11 +486,8 @@ void VideoStream::schedule_interpolated_frame(steady_clock::time_point local_pts
 	}
 
 	// We could have released qf.flow_tex here, but to make sure we don't cause a stall
-	// when trying to reuse it for the next frame, we can just as well hold on to it
+	// when the pool gives it out again for a new flow, we can just as well hold on to it
 	// and release it only when the readback is done.
-	//
-	// TODO: This is maybe less relevant now that qf.flow_tex contains the texture we used
-	// _last_ frame, not this one.
 
 	// Read it down (asynchronously) to the CPU.
 	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
@@ -545,6 +517,65 @@ void VideoStream::schedule_interpolated_frame(steady_clock::time_point local_pts
 	queue_changed.notify_all();
 }
 
+GLuint VideoStream::get_flow(const FrameOnDisk &frame1, const FrameOnDisk &frame2, GLuint gray_tex)
+{
+	{
+		lock_guard<mutex> lock(flow_cache_lock);
+		for (CachedFlow &flow : flow_cache) {
+			if (flow.frame1 == frame1 && flow.frame2 == frame2) {
+				flow.last_used = flow_cache_counter++;
+				++flow.num_users;
+				++metric_flow_cache_hit_frames;
+				return flow.flow_tex;
+			}
+		}
+	}
+
+	// Cache miss, so compute the flow. Only this thread ever adds to the cache,
+	// so we don't need to hold the lock while doing so.
+	GLuint flow_tex = compute_flow->exec(gray_tex, DISComputeFlow::FORWARD_AND_BACKWARD, DISComputeFlow::DO_NOT_RESIZE_FLOW);
+	check_error();
+	++metric_flow_cache_miss_frames;
+
+	lock_guard<mutex> lock(flow_cache_lock);
+	if (flow_cache.size() >= flow_cache_size) {
+		auto lru_it = min_element(flow_cache.begin(), flow_cache.end(), [](const CachedFlow &a, const CachedFlow &b) {
+			return a.last_used < b.last_used;
+		});
+		if (lru_it->num_users == 0) {
+			compute_flow->release_texture(lru_it->flow_tex);
+		} else {
+			evicted_flows.push_back(*lru_it);
+		}
+		flow_cache.erase(lru_it);
+	}
+	flow_cache.push_back(CachedFlow{ frame1, frame2, flow_tex, flow_cache_counter++, /*num_users=*/1 });
+	return flow_tex;
+}
+
+void VideoStream::release_flow(GLuint flow_tex)
+{
+	lock_guard<mutex> lock(flow_cache_lock);
+	for (CachedFlow &flow : flow_cache) {
+		if (flow.flow_tex == flow_tex) {
+			assert(flow.num_users > 0);
+			--flow.num_users;
+			return;
+		}
+	}
+	for (auto it = evicted_flows.begin(); it != evicted_flows.end(); ++it) {
+		if (it->flow_tex == flow_tex) {
+			assert(it->num_users > 0);
+			if (--it->num_users == 0) {
+				compute_flow->release_texture(flow_tex);
+				evicted_flows.erase(it);
+			}
+			return;
+		}
+	}
+	assert(false);
+}
+
 void VideoStream::schedule_refresh_frame(steady_clock::time_point local_pts,
                                          int64_t output_pts, function<void()> &&display_func,
                                          QueueSpotHolder &&queue_spot_holder, const string &subtitle)
@@ -635,88 +666,182 @@ void VideoStream::encode_thread_func()
 			frame_queue.pop_front();
 		}
 
-		// Hack: We mux the subtitle packet one time unit before the actual frame,
-		// so that Nageru is sure to get it first.
-		if (!qf.subtitle.empty()) {
-			AVPacket pkt;
-			av_init_packet(&pkt);
-			pkt.stream_index = mux->get_subtitle_stream_idx();
-			assert(pkt.stream_index != -1);
-			pkt.data = (uint8_t *)qf.subtitle.data();
-			pkt.size = qf.subtitle.size();
-			pkt.flags = 0;
-			pkt.duration = lrint(TIMEBASE / global_flags.output_framerate);  // Doesn't really matter for Nageru.
-			mux->add_packet(pkt, qf.output_pts - 1, qf.output_pts - 1);
-		}
+		steady_clock::time_point readback_start = steady_clock::now();
 
-		if (qf.type == QueuedFrame::ORIGINAL) {
-			// Send the JPEG frame on, unchanged.
-			string jpeg = move(*qf.encoded_jpeg);
-			AVPacket pkt;
-			av_init_packet(&pkt);
-			pkt.stream_index = 0;
-			pkt.data = (uint8_t *)jpeg.data();
-			pkt.size = jpeg.size();
-			pkt.flags = AV_PKT_FLAG_KEY;
-			mux->add_packet(pkt, qf.output_pts, qf.output_pts);
+		PipelinedFrame pf;
+		pf.seqnum = next_seqnum++;
+		pf.type = qf.type;
+		pf.output_pts = qf.output_pts;
+		pf.subtitle = move(qf.subtitle);
+		pf.display_func = move(qf.display_func);
+		pf.queue_spot_holder = move(qf.queue_spot_holder);
 
-			last_frame.assign(&jpeg[0], &jpeg[0] + jpeg.size());
+		if (qf.type == QueuedFrame::ORIGINAL) {
+			pf.encoded_jpeg = move(qf.encoded_jpeg);
 		} else if (qf.type == QueuedFrame::FADED) {
 			glClientWaitSync(qf.fence.get(), /*flags=*/0, GL_TIMEOUT_IGNORED);
 
-			shared_ptr<Frame> frame = frame_from_pbo(qf.resources->pbo_contents, global_flags.width, global_flags.height);
-
-			// Now JPEG encode it, and send it on to the stream.
-			vector<uint8_t> jpeg = encode_jpeg(frame->y.get(), frame->cb.get(), frame->cr.get(), global_flags.width, global_flags.height);
-
-			AVPacket pkt;
-			av_init_packet(&pkt);
-			pkt.stream_index = 0;
-			pkt.data = (uint8_t *)jpeg.data();
-			pkt.size = jpeg.size();
-			pkt.flags = AV_PKT_FLAG_KEY;
-			mux->add_packet(pkt, qf.output_pts, qf.output_pts);
-			last_frame = move(jpeg);
+			pf.frame = frame_from_pbo(qf.resources->pbo_contents, global_flags.width, global_flags.height);
+		} else if (qf.type == QueuedFrame::INTERPOLATED && qf.cached_jpeg != nullptr) {
+			// Already encoded; the encoder pool will decode it for display instead.
+			pf.jpeg.assign(qf.cached_jpeg->begin(), qf.cached_jpeg->end());
+			pf.display_decoded_func = move(qf.display_decoded_func);
 		} else if (qf.type == QueuedFrame::INTERPOLATED || qf.type == QueuedFrame::FADED_INTERPOLATED) {
+			pf.put_in_cache = qf.put_in_cache;
+			pf.cache_key = qf.cache_key;
 			glClientWaitSync(qf.fence.get(), /*flags=*/0, GL_TIMEOUT_IGNORED);
 
 			// Send it on to display.
-			shared_ptr<Frame> frame = frame_from_pbo(qf.resources->pbo_contents, global_flags.width, global_flags.height);
+			pf.frame = frame_from_pbo(qf.resources->pbo_contents, global_flags.width, global_flags.height);
 			if (qf.display_decoded_func != nullptr) {
-				qf.display_decoded_func(frame);
+				qf.display_decoded_func(pf.frame);
 			}
 
-			// Now JPEG encode it, and send it on to the stream.
-			vector<uint8_t> jpeg = encode_jpeg(frame->y.get(), frame->cb.get(), frame->cr.get(), global_flags.width, global_flags.height);
-			if (qf.flow_tex != 0) {
-				compute_flow->release_texture(qf.flow_tex);
-			}
+			release_flow(qf.flow_tex);
 			if (qf.type != QueuedFrame::FADED_INTERPOLATED) {
 				interpolate->release_texture(qf.output_tex);
 				interpolate->release_texture(qf.cbcr_tex);
 			}
+		} else if (qf.type == QueuedFrame::REFRESH) {
+			// Will reuse the last frame in the mux stage.
+		} else {
+			assert(false);
+		}
+
+		// The PBO (in qf.resources) is free for reuse as soon as we've copied out of it.
+		qf.resources.reset();
+
+		pf.ready_time = steady_clock::now();
+		metric_output_readback_seconds.count_event(duration<double>(pf.ready_time - readback_start).count());
+
+		lock_guard<mutex> lock(pipeline_lock);
+		if (pf.frame != nullptr || pf.display_decoded_func != nullptr) {
+			frames_to_encode.push_back(move(pf));
+			metric_output_encode_queue_frames = frames_to_encode.size();
+			frames_to_encode_changed.notify_one();
+		} else {
+			uint64_t seqnum = pf.seqnum;
+			frames_to_mux.emplace(seqnum, move(pf));
+			frames_to_mux_changed.notify_all();
+		}
+	}
+}
+
+void VideoStream::jpeg_encode_thread_func(unsigned thread_idx)
+{
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "JPEGEncode_%u", thread_idx);
+	pthread_setname_np(pthread_self(), thread_name);
+
+	for ( ;; ) {
+		PipelinedFrame pf;
+		{
+			unique_lock<mutex> lock(pipeline_lock);
+			frames_to_encode_changed.wait(lock, [this] {
+				return !frames_to_encode.empty() || should_quit;
+			});
+			if (should_quit) {
+				return;
+			}
+			pf = move(frames_to_encode.front());
+			frames_to_encode.pop_front();
+			metric_output_encode_queue_frames = frames_to_encode.size();
+		}
+
+		steady_clock::time_point encode_start = steady_clock::now();
+		metric_output_encode_queue_seconds.count_event(duration<double>(encode_start - pf.ready_time).count());
+
+		if (pf.frame == nullptr) {
+			// From interpolated_frame_cache, so only needs decoding for display.
+			pf.display_decoded_func(decode_jpeg(string(pf.jpeg.begin(), pf.jpeg.end())));
+			pf.display_decoded_func = nullptr;
+		} else {
+			pf.jpeg = encode_jpeg(jpeg_encoder.get(), pf.frame->y.get(), pf.frame->cb.get(), pf.frame->cr.get(), global_flags.width, global_flags.height);
+			pf.frame.reset();
+			if (pf.put_in_cache) {
+				interpolated_frame_cache->insert(pf.cache_key, make_shared<const string>(pf.jpeg.begin(), pf.jpeg.end()));
+			}
+		}
+
+		pf.ready_time = steady_clock::now();
+		metric_output_encode_seconds.count_event(duration<double>(pf.ready_time - encode_start).count());
+
+		lock_guard<mutex> lock(pipeline_lock);
+		uint64_t seqnum = pf.seqnum;
+		frames_to_mux.emplace(seqnum, move(pf));
+		frames_to_mux_changed.notify_all();
+	}
+}
+
+void VideoStream::mux_thread_func()
+{
+	pthread_setname_np(pthread_self(), "VideoStreamMux");
+
+	for ( ;; ) {
+		PipelinedFrame pf;
+		{
+			unique_lock<mutex> lock(pipeline_lock);
+			frames_to_mux_changed.wait(lock, [this] {
+				return (!frames_to_mux.empty() && frames_to_mux.begin()->first == next_seqnum_to_mux) || should_quit;
+			});
+			if (should_quit) {
+				return;
+			}
+			pf = move(frames_to_mux.begin()->second);
+			frames_to_mux.erase(frames_to_mux.begin());
+			++next_seqnum_to_mux;
+		}
+
+		// How long the frame had to wait for earlier frames to be done.
+		metric_output_reorder_seconds.count_event(duration<double>(steady_clock::now() - pf.ready_time).count());
 
+		// Hack: We mux the subtitle packet one time unit before the actual frame,
+		// so that Nageru is sure to get it first.
+		if (!pf.subtitle.empty()) {
+			AVPacket pkt;
+			av_init_packet(&pkt);
+			pkt.stream_index = mux->get_subtitle_stream_idx();
+			assert(pkt.stream_index != -1);
+			pkt.data = (uint8_t *)pf.subtitle.data();
+			pkt.size = pf.subtitle.size();
+			pkt.flags = 0;
+			pkt.duration = lrint(TIMEBASE / global_flags.output_framerate);  // Doesn't really matter for Nageru.
+			mux->add_packet(pkt, pf.output_pts - 1, pf.output_pts - 1);
+		}
+
+		if (pf.type == QueuedFrame::ORIGINAL) {
+			// Send the JPEG frame on, unchanged.
+			string jpeg = move(*pf.encoded_jpeg);
 			AVPacket pkt;
 			av_init_packet(&pkt);
 			pkt.stream_index = 0;
 			pkt.data = (uint8_t *)jpeg.data();
 			pkt.size = jpeg.size();
 			pkt.flags = AV_PKT_FLAG_KEY;
-			mux->add_packet(pkt, qf.output_pts, qf.output_pts);
-			last_frame = move(jpeg);
-		} else if (qf.type == QueuedFrame::REFRESH) {
+			mux->add_packet(pkt, pf.output_pts, pf.output_pts);
+
+			last_frame.assign(&jpeg[0], &jpeg[0] + jpeg.size());
+		} else if (pf.type == QueuedFrame::REFRESH) {
 			AVPacket pkt;
 			av_init_packet(&pkt);
 			pkt.stream_index = 0;
 			pkt.data = (uint8_t *)last_frame.data();
 			pkt.size = last_frame.size();
 			pkt.flags = AV_PKT_FLAG_KEY;
-			mux->add_packet(pkt, qf.output_pts, qf.output_pts);
+			mux->add_packet(pkt, pf.output_pts, pf.output_pts);
 		} else {
-			assert(false);
+			// Newly encoded (faded and/or interpolated) frame.
+			AVPacket pkt;
+			av_init_packet(&pkt);
+			pkt.stream_index = 0;
+			pkt.data = (uint8_t *)pf.jpeg.data();
+			pkt.size = pf.jpeg.size();
+			pkt.flags = AV_PKT_FLAG_KEY;
+			mux->add_packet(pkt, pf.output_pts, pf.output_pts);
+			last_frame = move(pf.jpeg);
 		}
-		if (qf.display_func != nullptr) {
-			qf.display_func();
+		if (pf.display_func != nullptr) {
+			pf.display_func();
 		}
 	}
 }
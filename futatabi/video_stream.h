@@ -10,6 +10,7 @@ extern "C" {
 }
 
 #include "frame_on_disk.h"
+#include "interpolated_frame_cache.h"
 #include "jpeg_frame_view.h"
 #include "queue_spot_holder.h"
 #include "shared/ref_counted_gl_sync.h"
@@ -19,12 +20,15 @@ extern "C" {
 #include <condition_variable>
 #include <deque>
 #include <functional>
+#include <map>
+#include <memory>
 #include <movit/effect_chain.h>
 #include <movit/mix_effect.h>
 #include <movit/ycbcr_input.h>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 class ChromaSubsampler;
 class DISComputeFlow;
@@ -32,6 +36,7 @@ class Interpolate;
 class Mux;
 class QSurface;
 class QSurfaceFormat;
+class SlicedJPEGEncoder;
 class YCbCrConverter;
 
 class VideoStream {
@@ -66,8 +71,17 @@ public:
 private:
 	FrameReader frame_reader;
 
+	// The CPU side of the output is a pipeline of three stages: The readback
+	// stage (encode_thread_func(), which owns the OpenGL context) waits until
+	// the frame is due, waits for the GPU and copies the image out of the PBO.
+	// A pool of JPEG encoder threads then encodes the image, and finally,
+	// the mux stage puts the frames back in order and sends them out.
+	// Original and refresh frames skip the encoder pool.
 	void encode_thread_func();
-	std::thread encode_thread;
+	void jpeg_encode_thread_func(unsigned thread_idx);
+	void mux_thread_func();
+	std::thread encode_thread, mux_thread;
+	std::vector<std::thread> jpeg_encode_threads;
 	std::atomic<bool> should_quit{ false };
 
 	static int write_packet2_thunk(void *opaque, uint8_t *buf, int buf_size, AVIODataMarkerType type, int64_t time);
@@ -127,9 +141,12 @@ private:
 		// For interpolated frames only.
 		FrameOnDisk frame2;
 		float alpha;
+		std::shared_ptr<const std::string> cached_jpeg;  // If set, the frame was in interpolated_frame_cache, and there's no GPU work to wait for.
+		bool put_in_cache = false;  // If set, the frame should go into interpolated_frame_cache (under <cache_key>) once it's encoded.
+		InterpolatedFrameCache::Key cache_key;
 		BorrowedInterpolatedFrameResources resources;
 		RefCountedGLsync fence;  // Set when the interpolated image is read back to the CPU.
-		GLuint flow_tex, output_tex, cbcr_tex;  // Released in the receiving thread; not really used for anything else. flow_tex will typically even be from a previous frame.
+		GLuint flow_tex, output_tex, cbcr_tex;  // Released in the receiving thread (flow_tex through release_flow()); not really used for anything else.
 		FrameOnDisk id;
 
 		std::function<void()> display_func;  // Called when the image is done decoding.
@@ -142,6 +159,36 @@ private:
 	std::deque<QueuedFrame> frame_queue;  // Under <queue_lock>.
 	std::condition_variable queue_changed;
 
+	// A frame that has been read back from the GPU (or needed no GPU work),
+	// on its way through the encoder pool to the mux stage.
+	struct PipelinedFrame {
+		uint64_t seqnum;
+		QueuedFrame::Type type;
+		int64_t output_pts;
+		std::string subtitle;  // Blank for none.
+
+		std::unique_ptr<std::string> encoded_jpeg;  // For original frames only.
+		std::shared_ptr<Frame> frame;  // For FADED, INTERPOLATED and FADED_INTERPOLATED; input to the encoder.
+		std::vector<uint8_t> jpeg;  // Output from the encoder.
+
+		// For interpolated frames from interpolated_frame_cache, which have
+		// <jpeg> set already; the encoder pool decodes them for display instead.
+		std::function<void(std::shared_ptr<Frame>)> display_decoded_func;
+		bool put_in_cache = false;  // See QueuedFrame.
+		InterpolatedFrameCache::Key cache_key;
+
+		std::function<void()> display_func;
+		QueueSpotHolder queue_spot_holder;
+
+		std::chrono::steady_clock::time_point ready_time;  // When it was put into its current queue.
+	};
+	std::mutex pipeline_lock;
+	std::deque<PipelinedFrame> frames_to_encode;  // Under <pipeline_lock>.
+	std::map<uint64_t, PipelinedFrame> frames_to_mux;  // Under <pipeline_lock>. Keyed by seqnum.
+	std::condition_variable frames_to_encode_changed, frames_to_mux_changed;
+	uint64_t next_seqnum = 0;  // Only used by the readback stage.
+	uint64_t next_seqnum_to_mux = 0;  // Only used by the mux stage.
+
 	AVFormatContext *avctx;
 	std::unique_ptr<Mux> mux;  // To HTTP, or to file.
 	std::string stream_mux_header;  // Only used in HTTP.
@@ -156,9 +203,29 @@ private:
 	std::unique_ptr<Interpolate> interpolate, interpolate_no_split;
 	std::unique_ptr<ChromaSubsampler> chroma_subsampler;
 
-	// Cached flow computation from previous frame, if any.
-	GLuint last_flow_tex = 0;
-	FrameOnDisk last_frame1, last_frame2;
+	std::unique_ptr<SlicedJPEGEncoder> jpeg_encoder;
+
+	std::unique_ptr<InterpolatedFrameCache> interpolated_frame_cache;  // nullptr if turned off.
+
+	// Flow fields we've computed recently, keyed on the pair of input frames.
+	// In slow motion, many output frames in a row interpolate between the same
+	// two input frames (in whatever interpolation slots they happen to get),
+	// and the flow is the expensive part, so we compute it only once for each pair.
+	// A texture goes back to compute_flow when it is both out of the cache
+	// and done being used by all the frames that got it from get_flow().
+	struct CachedFlow {
+		FrameOnDisk frame1, frame2;
+		GLuint flow_tex;
+		size_t last_used;
+		unsigned num_users;  // Frames that have not called release_flow() yet.
+	};
+	static constexpr size_t flow_cache_size = 4;
+	GLuint get_flow(const FrameOnDisk &frame1, const FrameOnDisk &frame2, GLuint gray_tex);
+	void release_flow(GLuint flow_tex);  // Thread-safe.
+	std::mutex flow_cache_lock;
+	std::vector<CachedFlow> flow_cache;  // Under <flow_cache_lock>.
+	std::vector<CachedFlow> evicted_flows;  // Under <flow_cache_lock>. Out of the cache, but still in use.
+	size_t flow_cache_counter = 0;  // Under <flow_cache_lock>.
 
 	std::vector<uint8_t> last_frame;
 };
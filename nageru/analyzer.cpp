@@ -243,6 +243,17 @@ void Analyzer::signal_changed()
 {
 	Mixer::Output channel = static_cast<Mixer::Output>(ui->input_box->currentData().value<int>());
 	ui->display->set_output(channel);
+	if (isVisible()) {
+		// We analyze the full-resolution frame, not just what fits in a preview.
+		global_mixer->remove_display_size(full_size_output, this);
+		global_mixer->remove_consumer(full_size_output, this);
+		global_mixer->set_display_size(channel, this, global_flags.width, global_flags.height);
+		global_mixer->add_consumer(channel, this);
+		full_size_output = channel;
+
+		// The channel might not have been rendered while nobody was looking at it.
+		global_mixer->wait_for_next_frame();
+	}
 	grab_clicked();
 }
 
@@ -299,9 +310,20 @@ void Analyzer::resizeEvent(QResizeEvent* event)
 
 void Analyzer::showEvent(QShowEvent *event)
 {
+	Mixer::Output channel = static_cast<Mixer::Output>(ui->input_box->currentData().value<int>());
+	global_mixer->set_display_size(channel, this, global_flags.width, global_flags.height);
+	global_mixer->add_consumer(channel, this);
+	full_size_output = channel;
+	global_mixer->wait_for_next_frame();  // See signal_changed().
 	grab_clicked();
 }
 
+void Analyzer::hideEvent(QHideEvent *event)
+{
+	global_mixer->remove_display_size(full_size_output, this);
+	global_mixer->remove_consumer(full_size_output, this);
+}
+
 void Analyzer::relayout()
 {
 	double aspect = double(global_flags.width) / global_flags.height;
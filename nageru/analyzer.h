@@ -44,6 +44,7 @@ private:
 	bool eventFilter(QObject *watched, QEvent *event) override;
 	void resizeEvent(QResizeEvent *event) override;
 	void showEvent(QShowEvent *event) override;
+	void hideEvent(QHideEvent *event) override;
 
 	Ui::Analyzer *ui;
 	QSurface *surface;
@@ -53,6 +54,10 @@ private:
 	QImage grabbed_image;
 	QTimer grab_timer;
 	int last_x = -1, last_y = -1;
+
+	// The channel we've asked the mixer to render at full resolution
+	// for us, if we're visible.
+	Mixer::Output full_size_output = Mixer::OUTPUT_LIVE;
 };
 
 #endif  // !defined(_ANALYZER_H)
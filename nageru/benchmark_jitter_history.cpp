@@ -0,0 +1,179 @@
+// Times JitterHistory (insertion, expiry and estimation), and checks it
+// against the original multiset-based estimator it replaced, on random input
+// with lots of duplicated jitter values. Exits with a nonzero status if the
+// two ever disagree.
+//
+// Usage: benchmark_jitter_history [NUM_FRAMES]
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <deque>
+#include <iterator>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "queue_length_policy.h"
+#include "shared/timebase.h"
+
+#define NUM_ESTIMATES 1000000
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// The estimator as it was before JitterHistory was split into two sets;
+// same window, percentile and multiplier.
+class MultisetJitterHistory {
+private:
+	static constexpr size_t history_length = 5000;
+	static constexpr double percentile = 0.999;
+	static constexpr double multiplier = 2.0;
+
+public:
+	void frame_arrived(steady_clock::time_point now, int64_t frame_duration, size_t dropped_frames)
+	{
+		if (expected_timestamp > steady_clock::time_point::min()) {
+			expected_timestamp += dropped_frames * nanoseconds(frame_duration * 1000000000 / TIMEBASE);
+			double jitter_seconds = fabs(duration<double>(expected_timestamp - now).count());
+			history.push_back(orders.insert(jitter_seconds));
+			if (history.size() > history_length) {
+				orders.erase(history.front());
+				history.pop_front();
+			}
+		}
+		expected_timestamp = now + nanoseconds(frame_duration * 1000000000 / TIMEBASE);
+	}
+
+	double estimate_max_jitter() const
+	{
+		if (orders.empty()) {
+			return 0.0;
+		}
+		size_t elem_idx = lrint((orders.size() - 1) * percentile);
+		if (percentile <= 0.5) {
+			return *next(orders.begin(), elem_idx) * multiplier;
+		} else {
+			return *prev(orders.end(), orders.size() - elem_idx) * multiplier;
+		}
+	}
+
+private:
+	multiset<double> orders;
+	deque<multiset<double>::iterator> history;
+	steady_clock::time_point expected_timestamp = steady_clock::time_point::min();
+};
+
+struct Arrival {
+	steady_clock::time_point now;
+	size_t dropped_frames;
+};
+
+// 60 fps with jitter in whole 100 µs steps, so that most values are repeated
+// many times over; every now and then, a much later frame or a dropped one.
+vector<Arrival> make_arrivals(size_t num_frames, int64_t frame_duration)
+{
+	mt19937 rng(1234);
+	uniform_int_distribution<int> small_jitter(-20, 20);
+	uniform_int_distribution<int> large_jitter(0, 200);
+	uniform_int_distribution<int> event(0, 999);
+
+	vector<Arrival> arrivals;
+	steady_clock::time_point ideal = steady_clock::time_point() + hours(1);
+	for (size_t i = 0; i < num_frames; ++i) {
+		Arrival arrival;
+		arrival.dropped_frames = 0;
+		int e = event(rng);
+		if (e == 0) {
+			arrival.dropped_frames = 1;
+			ideal += nanoseconds(frame_duration * 1000000000 / TIMEBASE);
+		}
+		int jitter_steps = (e < 5) ? large_jitter(rng) : small_jitter(rng);
+		arrival.now = ideal + microseconds(jitter_steps * 100);
+		arrivals.push_back(arrival);
+		ideal += nanoseconds(frame_duration * 1000000000 / TIMEBASE);
+	}
+	return arrivals;
+}
+
+template<class History>
+double time_frames(History *history, const vector<Arrival> &arrivals, size_t begin, size_t end, int64_t frame_duration)
+{
+	steady_clock::time_point start = steady_clock::now();
+	for (size_t i = begin; i < end; ++i) {
+		history->frame_arrived(arrivals[i].now, frame_duration, arrivals[i].dropped_frames);
+	}
+	return duration<double>(steady_clock::now() - start).count();
+}
+
+template<class History>
+double time_estimates(const History &history)
+{
+	double sum = 0.0;
+	steady_clock::time_point start = steady_clock::now();
+	for (unsigned i = 0; i < NUM_ESTIMATES; ++i) {
+		sum += history.estimate_max_jitter();
+	}
+	double elapsed = duration<double>(steady_clock::now() - start).count();
+	if (sum < 0.0) {  // Never true; just keeps the loop from being optimized away.
+		printf("%f\n", sum);
+	}
+	return elapsed;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	size_t num_frames = (argc >= 2) ? atoi(argv[1]) : 300000;
+	constexpr size_t window = 5000;  // Same as JitterHistory::history_length.
+	if (num_frames <= window * 2) {
+		fprintf(stderr, "Need more than %zu frames.\n", window * 2);
+		exit(1);
+	}
+	const int64_t frame_duration = TIMEBASE / 60;
+	vector<Arrival> arrivals = make_arrivals(num_frames, frame_duration);
+
+	// Correctness first: compare after every single frame.
+	{
+		JitterHistory history;
+		MultisetJitterHistory reference;
+		for (size_t i = 0; i < num_frames; ++i) {
+			history.frame_arrived(arrivals[i].now, frame_duration, arrivals[i].dropped_frames);
+			reference.frame_arrived(arrivals[i].now, frame_duration, arrivals[i].dropped_frames);
+			double estimate = history.estimate_max_jitter();
+			double expected = reference.estimate_max_jitter();
+			if (estimate != expected) {
+				fprintf(stderr, "Mismatch after frame %zu: got %.9f, expected %.9f\n", i, estimate, expected);
+				exit(1);
+			}
+		}
+		printf("%zu frames: estimates identical to the multiset version after every frame.\n\n", num_frames);
+	}
+
+	// Then timing. The first <window> frames are only insertions; after that,
+	// every frame is an insertion plus an expiry. (JitterHistory also makes
+	// an estimate for its metrics on every frame; the multiset version doesn't.)
+	{
+		JitterHistory history;
+		MultisetJitterHistory reference;
+		double fill_new = time_frames(&history, arrivals, 0, window, frame_duration);
+		double fill_old = time_frames(&reference, arrivals, 0, window, frame_duration);
+		double steady_new = time_frames(&history, arrivals, window, num_frames, frame_duration);
+		double steady_old = time_frames(&reference, arrivals, window, num_frames, frame_duration);
+		double estimate_new = time_estimates(history);
+		double estimate_old = time_estimates(reference);
+
+		size_t num_steady = num_frames - window;
+		printf("%-22s %12s %12s\n", "", "two sets", "multiset");
+		printf("%-22s %9.1f ns %9.1f ns\n", "insert", 1e9 * fill_new / window, 1e9 * fill_old / window);
+		printf("%-22s %9.1f ns %9.1f ns\n", "insert + expire", 1e9 * steady_new / num_steady, 1e9 * steady_old / num_steady);
+		printf("%-22s %9.1f ns %9.1f ns\n", "estimate", 1e9 * estimate_new / NUM_ESTIMATES, 1e9 * estimate_old / NUM_ESTIMATES);
+	}
+
+	return 0;
+}
@@ -0,0 +1,149 @@
+// Compares SlicedScaler (as used by FFmpegCapture) against the single
+// sws_scale() call it replaces, for a few common input and output formats
+// and sizes. Also checks that the output is the same for both.
+//
+// Usage: benchmark_sliced_scaler [MAX_SLICES]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+#include "shared/ffmpeg_raii.h"
+#include "sliced_scaler.h"
+
+#define NUM_WARMUP_FRAMES 10
+#define NUM_BENCHMARK_FRAMES 200
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+struct Picture {
+	vector<uint8_t> planes[4];
+	uint8_t *data[4] = { nullptr, nullptr, nullptr, nullptr };
+	int linesize[4] = { 0, 0, 0, 0 };
+};
+
+// Allocates a picture with no padding between lines. If <fill> is set,
+// fills it with deterministic noise; we use our own generator instead of
+// rand() to get the same pictures every run.
+void make_picture(int width, int height, AVPixelFormat format, bool fill, Picture *pic)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+	int bytes_per_component = (desc->comp[0].depth + 7) / 8;
+	uint32_t seed = 1234;
+	for (unsigned plane = 0; plane < 4; ++plane) {
+		int plane_width = width, plane_height = height;
+		unsigned num_components = 0;
+		for (unsigned i = 0; i < desc->nb_components; ++i) {
+			if (desc->comp[i].plane == int(plane)) {
+				++num_components;
+				if (i == 1 || i == 2) {
+					plane_width = (width + (1 << desc->log2_chroma_w) - 1) >> desc->log2_chroma_w;
+					plane_height = (height + (1 << desc->log2_chroma_h) - 1) >> desc->log2_chroma_h;
+				}
+			}
+		}
+		if (num_components == 0) {
+			continue;
+		}
+		pic->linesize[plane] = plane_width * num_components * bytes_per_component;
+		pic->planes[plane].resize(pic->linesize[plane] * plane_height);
+		pic->data[plane] = pic->planes[plane].data();
+		if (fill) {
+			for (uint8_t &x : pic->planes[plane]) {
+				seed = seed * 1103515245 + 12345;
+				x = seed >> 24;
+			}
+			if (bytes_per_component == 2) {
+				// Keep high-bit-depth samples within range.
+				uint16_t *ptr = (uint16_t *)pic->data[plane];
+				for (size_t i = 0; i < pic->planes[plane].size() / 2; ++i) {
+					ptr[i] &= (1 << desc->comp[0].depth) - 1;
+				}
+			}
+		}
+	}
+}
+
+void benchmark(int width, int height, AVPixelFormat src_format, AVPixelFormat dst_format, unsigned max_slices)
+{
+	Picture src, dst_single, dst_sliced;
+	make_picture(width, height, src_format, /*fill=*/true, &src);
+	make_picture(width, height, dst_format, /*fill=*/false, &dst_single);
+	make_picture(width, height, dst_format, /*fill=*/false, &dst_sliced);
+
+	SwsContextWithDeleter sws_ctx(
+		sws_getContext(width, height, src_format, width, height, dst_format,
+			SWS_BICUBIC, nullptr, nullptr, nullptr));
+	SlicedScaler scaler(max_slices);
+	if (sws_ctx == nullptr) {
+		fprintf(stderr, "Could not create scaler context\n");
+		exit(1);
+	}
+
+	for (unsigned i = 0; i < NUM_WARMUP_FRAMES; ++i) {
+		sws_scale(sws_ctx.get(), src.data, src.linesize, 0, height, dst_single.data, dst_single.linesize);
+		scaler.scale(src.data, src.linesize, width, height, src_format, dst_sliced.data, dst_sliced.linesize, width, height, dst_format);
+	}
+
+	steady_clock::time_point start = steady_clock::now();
+	for (unsigned i = 0; i < NUM_BENCHMARK_FRAMES; ++i) {
+		sws_scale(sws_ctx.get(), src.data, src.linesize, 0, height, dst_single.data, dst_single.linesize);
+	}
+	double single_ms = 1e3 * duration<double>(steady_clock::now() - start).count() / NUM_BENCHMARK_FRAMES;
+
+	start = steady_clock::now();
+	for (unsigned i = 0; i < NUM_BENCHMARK_FRAMES; ++i) {
+		scaler.scale(src.data, src.linesize, width, height, src_format, dst_sliced.data, dst_sliced.linesize, width, height, dst_format);
+	}
+	double sliced_ms = 1e3 * duration<double>(steady_clock::now() - start).count() / NUM_BENCHMARK_FRAMES;
+
+	bool same = true;
+	for (unsigned plane = 0; plane < 4; ++plane) {
+		if (dst_single.planes[plane] != dst_sliced.planes[plane]) {
+			same = false;
+		}
+	}
+
+	static const char *method_names[] = { "copy", "yuv420p->nv12", "sliced swscale", "single swscale" };
+	printf("%4dx%-4d  %-12s -> %-8s  %-15s %u slice(s)  %7.3f ms -> %7.3f ms (%5.2fx)%s\n",
+		width, height, av_get_pix_fmt_name(src_format), av_get_pix_fmt_name(dst_format),
+		method_names[scaler.get_method()], scaler.get_num_slices(),
+		single_ms, sliced_ms, single_ms / sliced_ms,
+		same ? "" : "  OUTPUT DIFFERS");
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	unsigned max_slices = (argc >= 2) ? atoi(argv[1]) : 0;
+
+	struct {
+		AVPixelFormat src_format, dst_format;
+	} conversions[] = {
+		{ AV_PIX_FMT_YUV420P, AV_PIX_FMT_YUV420P },
+		{ AV_PIX_FMT_YUV422P, AV_PIX_FMT_YUV422P },
+		{ AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12 },
+		{ AV_PIX_FMT_YUV420P10LE, AV_PIX_FMT_YUV420P },
+		{ AV_PIX_FMT_YUV422P10LE, AV_PIX_FMT_YUV422P },
+		{ AV_PIX_FMT_RGB24, AV_PIX_FMT_YUV444P },
+		{ AV_PIX_FMT_YUV420P, AV_PIX_FMT_BGRA },
+	};
+	for (int height : { 720, 1080, 2160 }) {
+		int width = height * 16 / 9;
+		for (const auto &conversion : conversions) {
+			benchmark(width, height, conversion.src_format, conversion.dst_format, max_slices);
+		}
+	}
+}
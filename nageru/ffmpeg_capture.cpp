@@ -19,9 +19,9 @@ extern "C" {
 #include <libavutil/mem.h>
 #include <libavutil/pixfmt.h>
 #include <libavutil/opt.h>
-#include <libswscale/swscale.h>
 }
 
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <utility>
@@ -33,6 +33,8 @@ extern "C" {
 #include "flags.h"
 #include "image_input.h"
 #include "ref_counted_frame.h"
+#include "sliced_scaler.h"
+#include "shared/metrics.h"
 #include "shared/timebase.h"
 
 #define FRAME_SIZE (8 << 20)  // 8 MB.
@@ -232,6 +234,11 @@ FFmpegCapture::~FFmpegCapture()
 		dequeue_cleanup_callback();
 	}
 	swr_free(&resampler);
+	if (!metric_labels.empty()) {
+		global_metrics.remove("ffmpeg_decode_queue_frames", metric_labels);
+		global_metrics.remove("ffmpeg_late_frames", metric_labels);
+		global_metrics.remove("ffmpeg_loop_cache_bytes", metric_labels);
+	}
 }
 
 void FFmpegCapture::configure_card()
@@ -253,6 +260,12 @@ void FFmpegCapture::start_bm_capture()
 		return;
 	}
 	running = true;
+	if (metric_labels.empty()) {
+		metric_labels = {{ "card", to_string(card_index) }};
+		global_metrics.add("ffmpeg_decode_queue_frames", metric_labels, &metric_decode_queue_frames, Metrics::TYPE_GAUGE);
+		global_metrics.add("ffmpeg_late_frames", metric_labels, &metric_late_frames);
+		global_metrics.add("ffmpeg_loop_cache_bytes", metric_labels, &metric_loop_cache_bytes, Metrics::TYPE_GAUGE);
+	}
 	producer_thread_should_quit.unquit();
 	producer_thread = thread(&FFmpegCapture::producer_thread_func, this);
 }
@@ -264,6 +277,10 @@ void FFmpegCapture::stop_dequeue_thread()
 	}
 	running = false;
 	producer_thread_should_quit.quit();
+	{
+		lock_guard<mutex> lock(queue_mu);
+		decoded_frames_changed.notify_all();
+	}
 	producer_thread.join();
 }
 
@@ -410,6 +427,8 @@ bool FFmpegCapture::play_video(const string &pathname)
 		fprintf(stderr, "%s: Cannot find video decoder\n", pathname.c_str());
 		return false;
 	}
+	video_codec_ctx->thread_count = global_flags.ffmpeg_decoder_threads;  // 0 = automatic.
+	video_codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
 	if (avcodec_open2(video_codec_ctx.get(), video_codec, nullptr) < 0) {
 		fprintf(stderr, "%s: Cannot open video decoder\n", pathname.c_str());
 		return false;
@@ -445,56 +464,67 @@ bool FFmpegCapture::play_video(const string &pathname)
 
 	internal_rewind();
 
-	// Main loop.
+	// Start decoding ahead of time in a separate thread.
+	{
+		lock_guard<mutex> lock(queue_mu);
+		decoded_frames.clear();
+		decoder_should_quit = decoder_should_rewind = false;
+		metric_decode_queue_frames = 0;
+	}
+	thread decoder_thread(&FFmpegCapture::decoder_thread_func, this, format_ctx.get(), video_codec_ctx.get(), audio_codec_ctx.get(),
+		pathname, video_stream_index, audio_stream_index, subtitle_stream_index, last_modified);
+
+	bool ok = deliver_frames(pathname);
+
+	{
+		lock_guard<mutex> lock(queue_mu);
+		decoder_should_quit = true;
+		decoder_wakeup.notify_all();
+	}
+	should_interrupt = true;  // In case the decoder is stuck in blocking I/O. Reset by our caller.
+	decoder_thread.join();
+	{
+		// Give any frames we didn't get to back to the allocators.
+		lock_guard<mutex> lock(queue_mu);
+		decoded_frames.clear();
+		metric_decode_queue_frames = 0;
+	}
+	return ok;
+}
+
+bool FFmpegCapture::deliver_frames(const string &pathname)
+{
 	bool first_frame = true;
 	while (!producer_thread_should_quit.should_quit()) {
-		if (process_queued_commands(format_ctx.get(), pathname, last_modified, /*rewound=*/nullptr)) {
-			return true;
-		}
-		UniqueFrame audio_frame = audio_frame_allocator->alloc_frame();
-		AudioFormat audio_format;
+		process_queued_commands(/*rewound=*/nullptr);
 
-		int64_t audio_pts;
-		bool error;
-		AVFrameWithDeleter frame = decode_frame(format_ctx.get(), video_codec_ctx.get(), audio_codec_ctx.get(),
-			pathname, video_stream_index, audio_stream_index, subtitle_stream_index, audio_frame.get(), &audio_format, &audio_pts, &error);
-		if (error) {
+		DecodedFrame decoded;
+		bool decoder_was_behind = false;
+		if (!get_decoded_frame(&decoded, &decoder_was_behind)) {
+			continue;
+		}
+		if (decoded.type == DecodedFrame::ERROR) {
 			return false;
 		}
-		if (frame == nullptr) {
-			// EOF. Loop back to the start if we can.
-			if (av_seek_frame(format_ctx.get(), /*stream_index=*/-1, /*timestamp=*/0, /*flags=*/0) < 0) {
-				fprintf(stderr, "%s: Rewind failed, not looping.\n", pathname.c_str());
-				return true;
-			}
-			if (video_codec_ctx != nullptr) {
-				avcodec_flush_buffers(video_codec_ctx.get());
-			}
-			if (audio_codec_ctx != nullptr) {
-				avcodec_flush_buffers(audio_codec_ctx.get());
-			}
-			// If the file has changed since last time, return to get it reloaded.
-			// Note that depending on how you move the file into place, you might
-			// end up corrupting the one you're already playing, so this path
-			// might not trigger.
-			if (changed_since(pathname, last_modified)) {
-				return true;
-			}
+		if (decoded.type == DecodedFrame::END) {
+			return true;
+		}
+		if (decoded.type == DecodedFrame::LOOPED) {
 			internal_rewind();
 			continue;
 		}
 
-		VideoFormat video_format = construct_video_format(frame.get(), video_timebase);
-		UniqueFrame video_frame = make_video_frame(frame.get(), pathname, &error);
-		if (error) {
-			return false;
-		}
+		VideoFormat video_format = decoded.video_format;
+		AudioFormat audio_format = decoded.audio_format;
+		UniqueFrame video_frame = move(decoded.video_frame);
+		UniqueFrame audio_frame = move(decoded.audio_frame);
+		int64_t audio_pts = decoded.audio_pts;
 
 		for ( ;; ) {
 			if (last_pts == 0 && pts_origin == 0) {
-				pts_origin = frame->pts;	
+				pts_origin = decoded.pts;
 			}
-			next_frame_start = compute_frame_start(frame->pts, pts_origin, video_timebase, start, rate);
+			next_frame_start = compute_frame_start(decoded.pts, pts_origin, video_timebase, start, rate);
 			if (first_frame && last_frame_was_connected) {
 				// If reconnect took more than one second, this is probably a live feed,
 				// and we should reset the resampler. (Or the rate is really, really low,
@@ -531,6 +561,12 @@ bool FFmpegCapture::play_video(const string &pathname)
 			}
 
 			steady_clock::time_point now = steady_clock::now();
+			if (decoder_was_behind && !time_scale_was_reset && now > next_frame_start) {
+				// The decoder didn't manage to stay ahead of us. (If it did, but we're
+				// still a bit late, it's just scheduling noise, or our own sending
+				// of the previous frame, which the decode-ahead can't help with.)
+				++metric_late_frames;
+			}
 			if (duration<double>(now - next_frame_start).count() >= 0.1) {
 				// If we don't have enough CPU to keep up, or if we have a live stream
 				// where the initial origin was somehow wrong, we could be behind indefinitely.
@@ -539,8 +575,9 @@ bool FFmpegCapture::play_video(const string &pathname)
 				fprintf(stderr, "%s: Playback %.0f ms behind, resetting time scale\n",
 					pathname.c_str(),
 					1e3 * duration<double>(now - next_frame_start).count());
-				pts_origin = frame->pts;
+				pts_origin = decoded.pts;
 				start = next_frame_start = now;
+				time_scale_was_reset = true;
 				timecode += MAX_FPS * 2 + 1;
 			}
 			bool finished_wakeup = producer_thread_should_quit.sleep_until(next_frame_start);
@@ -555,10 +592,14 @@ bool FFmpegCapture::play_video(const string &pathname)
 					// audio discontinuity.)
 					timecode += MAX_FPS * 2 + 1;
 				}
-				frame_callback(frame->pts, video_timebase, audio_pts, audio_timebase, timecode++,
+				current_frame_ycbcr_format = decoded.ycbcr_format;
+				has_last_subtitle = decoded.has_last_subtitle;
+				last_subtitle = move(decoded.last_subtitle);
+				frame_callback(decoded.pts, video_timebase, audio_pts, audio_timebase, timecode++,
 					video_frame.get_and_release(), 0, video_format,
 					audio_frame.get_and_release(), 0, audio_format);
 				first_frame = false;
+				time_scale_was_reset = false;
 				last_frame = steady_clock::now();
 				last_frame_was_connected = true;
 				break;
@@ -566,9 +607,7 @@ bool FFmpegCapture::play_video(const string &pathname)
 				if (producer_thread_should_quit.should_quit()) break;
 
 				bool rewound = false;
-				if (process_queued_commands(format_ctx.get(), pathname, last_modified, &rewound)) {
-					return true;
-				}
+				process_queued_commands(&rewound);
 				// If we just rewound, drop this frame on the floor and be done.
 				if (rewound) {
 					break;
@@ -576,26 +615,295 @@ bool FFmpegCapture::play_video(const string &pathname)
 				// OK, we didn't, so probably a rate change. Recalculate next_frame_start,
 				// but if it's now in the past, we'll reset the origin, so that we don't
 				// generate a huge backlog of frames that we need to run through quickly.
-				next_frame_start = compute_frame_start(frame->pts, pts_origin, video_timebase, start, rate);
+				next_frame_start = compute_frame_start(decoded.pts, pts_origin, video_timebase, start, rate);
 				steady_clock::time_point now = steady_clock::now();
 				if (next_frame_start < now) {
-					pts_origin = frame->pts;
+					pts_origin = decoded.pts;
 					start = next_frame_start = now;
+					time_scale_was_reset = true;
+				}
+			}
+		}
+		last_pts = decoded.pts;
+	}
+	return true;
+}
+
+bool FFmpegCapture::get_decoded_frame(DecodedFrame *frame, bool *had_to_wait)
+{
+	unique_lock<mutex> lock(queue_mu);
+	for ( ;; ) {
+		if (decoded_frames.empty()) {
+			*had_to_wait = true;
+		}
+		decoded_frames_changed.wait(lock, [this]{
+			return !decoded_frames.empty() || !command_queue.empty() || producer_thread_should_quit.should_quit();
+		});
+
+		// Throw away anything decoded from before the last rewind.
+		while (!decoded_frames.empty() && decoded_frames.front().generation != decode_generation &&
+		       !decoded_frames.front().ends_stream()) {
+			decoded_frames.pop_front();
+		}
+		if (!decoded_frames.empty()) {
+			*frame = move(decoded_frames.front());
+			decoded_frames.pop_front();
+			metric_decode_queue_frames = decoded_frames.size();
+			decoder_wakeup.notify_all();
+			return true;
+		}
+		if (!command_queue.empty() || producer_thread_should_quit.should_quit()) {
+			return false;
+		}
+	}
+}
+
+void FFmpegCapture::decoder_thread_func(AVFormatContext *format_ctx, AVCodecContext *video_codec_ctx, AVCodecContext *audio_codec_ctx,
+                                        const string &pathname, int video_stream_index, int audio_stream_index, int subtitle_stream_index,
+                                        timespec last_modified)
+{
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "FFmpeg_D_%d", card_index);
+	pthread_setname_np(pthread_self(), thread_name);
+
+	decoder_has_last_subtitle = false;
+	decoder_last_subtitle.clear();
+
+	// We are at the start of a freshly opened file, so whatever was in the
+	// cache is stale, but we can start filling it right away.
+	clear_loop_cache();
+	loop_cache_state = LOOP_CACHE_DISABLED;
+	{
+		lock_guard<mutex> lock(queue_mu);
+		if (loop_cache_budget > 0 && audio_callback == nullptr) {
+			loop_cache_state = LOOP_CACHE_FILLING;
+		}
+	}
+
+	for ( ;; ) {
+		unsigned generation;
+		bool should_rewind;
+		size_t budget;
+		{
+			unique_lock<mutex> lock(queue_mu);
+			decoder_wakeup.wait(lock, [this]{
+				return decoder_should_quit || decoder_should_rewind || decoded_frames.size() < max_decoded_frames_queued;
+			});
+			if (decoder_should_quit) {
+				return;
+			}
+			should_rewind = decoder_should_rewind;
+			decoder_should_rewind = false;
+			generation = decode_generation;
+			budget = loop_cache_budget;
+		}
+
+		if (should_rewind) {
+			if (!restart_clip(format_ctx, video_codec_ctx, audio_codec_ctx, budget)) {
+				fprintf(stderr, "%s: Rewind failed, stopping play.\n", pathname.c_str());
+			}
+			// If the file has changed since last time, return to get it reloaded.
+			// Note that depending on how you move the file into place, you might
+			// end up corrupting the one you're already playing, so this path
+			// might not trigger.
+			if (changed_since(pathname, last_modified)) {
+				push_decoded_marker(DecodedFrame::END, generation);
+				return;
+			}
+			continue;
+		}
+
+		if (replaying_loop_cache && loop_cache_pos < loop_cache.size()) {
+			push_decoded_frame(replay_cached_frame(generation));
+			continue;
+		}
+
+		DecodedFrame decoded;
+		bool eof;
+		if (replaying_loop_cache) {
+			eof = true;
+		} else {
+			decoded.generation = generation;
+			decoded.audio_frame = UniqueFrame(audio_frame_allocator->alloc_frame());
+
+			bool error;
+			AVFrameWithDeleter frame = decode_frame(format_ctx, video_codec_ctx, audio_codec_ctx,
+				pathname, video_stream_index, audio_stream_index, subtitle_stream_index, decoded.audio_frame.get(), &decoded.audio_format, &decoded.audio_pts, &error);
+			if (error) {
+				push_decoded_marker(DecodedFrame::ERROR, generation);
+				return;
+			}
+			eof = (frame == nullptr);
+			if (!eof) {
+				decoded.pts = frame->pts;
+				decoded.video_format = construct_video_format(frame.get(), video_timebase);
+				decoded.video_frame = make_video_frame(frame.get(), pathname, &decoded.ycbcr_format, &error);
+				if (error) {
+					push_decoded_marker(DecodedFrame::ERROR, generation);
+					return;
 				}
+				decoded.has_last_subtitle = decoder_has_last_subtitle;
+				decoded.last_subtitle = decoder_last_subtitle;
 			}
 		}
-		last_pts = frame->pts;
+
+		if (!eof) {
+			if (loop_cache_state == LOOP_CACHE_FILLING) {
+				add_to_loop_cache(decoded, budget);
+			}
+			push_decoded_frame(move(decoded));
+			continue;
+		}
+
+		// EOF. Loop back to the start if we can.
+		if (loop_cache_state == LOOP_CACHE_FILLING) {
+			loop_cache_state = LOOP_CACHE_COMPLETE;
+		}
+		if (!restart_clip(format_ctx, video_codec_ctx, audio_codec_ctx, budget)) {
+			fprintf(stderr, "%s: Rewind failed, not looping.\n", pathname.c_str());
+			push_decoded_marker(DecodedFrame::END, generation);
+			return;
+		}
+		// If the file has changed since last time, return to get it reloaded.
+		if (changed_since(pathname, last_modified)) {
+			push_decoded_marker(DecodedFrame::END, generation);
+			return;
+		}
+		push_decoded_marker(DecodedFrame::LOOPED, generation);
+	}
+}
+
+bool FFmpegCapture::restart_clip(AVFormatContext *format_ctx, AVCodecContext *video_codec_ctx, AVCodecContext *audio_codec_ctx, size_t budget)
+{
+	if (loop_cache_state == LOOP_CACHE_COMPLETE && !loop_cache.empty() && loop_cache_bytes <= budget) {
+		// No need to touch the demuxer; if we ever need to decode again,
+		// we'll come back here and seek then.
+		replaying_loop_cache = true;
+		loop_cache_pos = 0;
+		return true;
+	}
+
+	replaying_loop_cache = false;
+	if (loop_cache_state == LOOP_CACHE_TOO_BIG && budget != loop_cache_too_big_budget) {
+		loop_cache_state = LOOP_CACHE_DISABLED;  // Give it another try.
+	}
+	if (loop_cache_state != LOOP_CACHE_TOO_BIG) {
+		clear_loop_cache();
+		if (budget > 0 && audio_callback == nullptr) {
+			loop_cache_state = LOOP_CACHE_FILLING;
+		} else {
+			loop_cache_state = LOOP_CACHE_DISABLED;
+		}
+	}
+
+	if (av_seek_frame(format_ctx, /*stream_index=*/-1, /*timestamp=*/0, /*flags=*/0) < 0) {
+		clear_loop_cache();
+		loop_cache_state = LOOP_CACHE_DISABLED;
+		return false;
+	}
+	if (video_codec_ctx != nullptr) {
+		avcodec_flush_buffers(video_codec_ctx);
+	}
+	if (audio_codec_ctx != nullptr) {
+		avcodec_flush_buffers(audio_codec_ctx);
 	}
 	return true;
 }
 
+void FFmpegCapture::add_to_loop_cache(const DecodedFrame &frame, size_t budget)
+{
+	size_t video_len = (frame.video_frame->data == nullptr) ? 0 : frame.video_frame->len;
+	size_t audio_len = (frame.audio_frame->data == nullptr) ? 0 : frame.audio_frame->len;
+	if (video_len == 0 || loop_cache_bytes + video_len + audio_len > budget) {
+		// Either it doesn't fit, or we didn't get a buffer for this frame
+		// (so we don't know what it looks like). Either way, we can't cache
+		// the entire clip.
+		clear_loop_cache();
+		loop_cache_state = LOOP_CACHE_TOO_BIG;
+		loop_cache_too_big_budget = budget;
+		return;
+	}
+
+	CachedFrame cached;
+	cached.pts = frame.pts;
+	cached.video_data.assign(frame.video_frame->data, frame.video_frame->data + video_len);
+	if (audio_len > 0) {
+		cached.audio_data.assign(frame.audio_frame->data, frame.audio_frame->data + audio_len);
+	}
+	cached.video_format = frame.video_format;
+	cached.audio_format = frame.audio_format;
+	cached.audio_pts = frame.audio_pts;
+	cached.ycbcr_format = frame.ycbcr_format;
+	cached.has_last_subtitle = frame.has_last_subtitle;
+	cached.last_subtitle = frame.last_subtitle;
+	loop_cache.push_back(move(cached));
+
+	loop_cache_bytes += video_len + audio_len;
+	metric_loop_cache_bytes = loop_cache_bytes;
+}
+
+void FFmpegCapture::clear_loop_cache()
+{
+	loop_cache.clear();
+	loop_cache.shrink_to_fit();
+	loop_cache_bytes = 0;
+	metric_loop_cache_bytes = 0;
+	replaying_loop_cache = false;
+}
+
+FFmpegCapture::DecodedFrame FFmpegCapture::replay_cached_frame(unsigned generation)
+{
+	const CachedFrame &cached = loop_cache[loop_cache_pos++];
+
+	DecodedFrame decoded;
+	decoded.generation = generation;
+	decoded.pts = cached.pts;
+	decoded.video_format = cached.video_format;
+	decoded.audio_format = cached.audio_format;
+	decoded.audio_pts = cached.audio_pts;
+	decoded.ycbcr_format = cached.ycbcr_format;
+	decoded.has_last_subtitle = cached.has_last_subtitle;
+	decoded.last_subtitle = cached.last_subtitle;
+
+	decoded.video_frame = UniqueFrame(video_frame_allocator->alloc_frame());
+	if (decoded.video_frame->data != nullptr) {
+		assert(cached.video_data.size() <= decoded.video_frame->size);
+		memcpy(decoded.video_frame->data, cached.video_data.data(), cached.video_data.size());
+		decoded.video_frame->len = cached.video_data.size();
+	}
+	decoded.audio_frame = UniqueFrame(audio_frame_allocator->alloc_frame());
+	if (decoded.audio_frame->data != nullptr && !cached.audio_data.empty()) {
+		assert(cached.audio_data.size() <= decoded.audio_frame->size);
+		memcpy(decoded.audio_frame->data, cached.audio_data.data(), cached.audio_data.size());
+		decoded.audio_frame->len = cached.audio_data.size();
+	}
+	return decoded;
+}
+
+void FFmpegCapture::push_decoded_frame(DecodedFrame &&frame)
+{
+	lock_guard<mutex> lock(queue_mu);
+	decoded_frames.push_back(move(frame));
+	metric_decode_queue_frames = decoded_frames.size();
+	decoded_frames_changed.notify_all();
+}
+
+void FFmpegCapture::push_decoded_marker(DecodedFrame::Type type, unsigned generation)
+{
+	DecodedFrame marker;
+	marker.type = type;
+	marker.generation = generation;
+	push_decoded_frame(move(marker));
+}
+
 void FFmpegCapture::internal_rewind()
 {				
 	pts_origin = last_pts = 0;
 	start = next_frame_start = steady_clock::now();
+	time_scale_was_reset = true;
 }
 
-bool FFmpegCapture::process_queued_commands(AVFormatContext *format_ctx, const std::string &pathname, timespec last_modified, bool *rewound)
+void FFmpegCapture::process_queued_commands(bool *rewound)
 {
 	// Process any queued commands from other threads.
 	vector<QueuedCommand> commands;
@@ -605,22 +913,24 @@ bool FFmpegCapture::process_queued_commands(AVFormatContext *format_ctx, const s
 	}
 	for (const QueuedCommand &cmd : commands) {
 		switch (cmd.command) {
-		case QueuedCommand::REWIND:
-			if (av_seek_frame(format_ctx, /*stream_index=*/-1, /*timestamp=*/0, /*flags=*/0) < 0) {
-				fprintf(stderr, "%s: Rewind failed, stopping play.\n", pathname.c_str());
-			}
-			// If the file has changed since last time, return to get it reloaded.
-			// Note that depending on how you move the file into place, you might
-			// end up corrupting the one you're already playing, so this path
-			// might not trigger.
-			if (changed_since(pathname, last_modified)) {
-				return true;
-			}
+		case QueuedCommand::REWIND: {
+			// The actual seek happens in the decoder thread; anything it has
+			// decoded so far is now useless.
+			lock_guard<mutex> lock(queue_mu);
+			decoded_frames.erase(
+				remove_if(decoded_frames.begin(), decoded_frames.end(),
+					[](const DecodedFrame &frame) { return !frame.ends_stream(); }),
+				decoded_frames.end());
+			metric_decode_queue_frames = decoded_frames.size();
+			++decode_generation;
+			decoder_should_rewind = true;
+			decoder_wakeup.notify_all();
 			internal_rewind();
 			if (rewound != nullptr) {
 				*rewound = true;
 			}
 			break;
+		}
 
 		case QueuedCommand::CHANGE_RATE:
 			// Change the origin to the last played frame.
@@ -630,13 +940,8 @@ bool FFmpegCapture::process_queued_commands(AVFormatContext *format_ctx, const s
 			break;
 		}
 	}
-	return false;
 }
 
-namespace {
-
-}  // namespace
-
 AVFrameWithDeleter FFmpegCapture::decode_frame(AVFormatContext *format_ctx, AVCodecContext *video_codec_ctx, AVCodecContext *audio_codec_ctx,
 	const std::string &pathname, int video_stream_index, int audio_stream_index, int subtitle_stream_index,
 	FrameAllocator::Frame *audio_frame, AudioFormat *audio_format, int64_t *audio_pts, bool *error)
@@ -675,8 +980,8 @@ AVFrameWithDeleter FFmpegCapture::decode_frame(AVFormatContext *format_ctx, AVCo
 					return AVFrameWithDeleter(nullptr);
 				}
 			} else if (pkt.stream_index == subtitle_stream_index) {
-				last_subtitle = string(reinterpret_cast<const char *>(pkt.data), pkt.size);
-				has_last_subtitle = true;
+				decoder_last_subtitle = string(reinterpret_cast<const char *>(pkt.data), pkt.size);
+				decoder_has_last_subtitle = true;
 			}
 		} else {
 			eof = true;  // Or error, but ignore that for the time being.
@@ -825,7 +1130,7 @@ VideoFormat FFmpegCapture::construct_video_format(const AVFrame *frame, AVRation
 	return video_format;
 }
 
-UniqueFrame FFmpegCapture::make_video_frame(const AVFrame *frame, const string &pathname, bool *error)
+UniqueFrame FFmpegCapture::make_video_frame(const AVFrame *frame, const string &pathname, YCbCrFormat *ycbcr_format, bool *error)
 {
 	*error = false;
 
@@ -834,23 +1139,16 @@ UniqueFrame FFmpegCapture::make_video_frame(const AVFrame *frame, const string &
 		return video_frame;
 	}
 
-	if (sws_ctx == nullptr ||
-	    sws_last_width != frame->width ||
+	if (sws_last_width != frame->width ||
 	    sws_last_height != frame->height ||
 	    sws_last_src_format != frame->format) {
 		sws_dst_format = decide_dst_format(AVPixelFormat(frame->format), pixel_format);
-		sws_ctx.reset(
-			sws_getContext(frame->width, frame->height, AVPixelFormat(frame->format),
-				width, height, sws_dst_format,
-				SWS_BICUBIC, nullptr, nullptr, nullptr));
 		sws_last_width = frame->width;
 		sws_last_height = frame->height;
 		sws_last_src_format = frame->format;
 	}
-	if (sws_ctx == nullptr) {
-		fprintf(stderr, "%s: Could not create scaler context\n", pathname.c_str());
-		*error = true;
-		return video_frame;
+	if (scaler == nullptr) {
+		scaler.reset(new SlicedScaler(global_flags.ffmpeg_conversion_slices));
 	}
 
 	uint8_t *pic_data[4] = { nullptr, nullptr, nullptr, nullptr };
@@ -869,7 +1167,7 @@ UniqueFrame FFmpegCapture::make_video_frame(const AVFrame *frame, const string &
 		video_frame->len = (width * 2) * height;
 
 		const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(sws_dst_format);
-		current_frame_ycbcr_format = decode_ycbcr_format(desc, frame, is_mjpeg);
+		*ycbcr_format = decode_ycbcr_format(desc, frame, is_mjpeg);
 	} else {
 		assert(pixel_format == bmusb::PixelFormat_8BitYCbCrPlanar);
 		const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(sws_dst_format);
@@ -888,9 +1186,14 @@ UniqueFrame FFmpegCapture::make_video_frame(const AVFrame *frame, const string &
 
 		video_frame->len = width * height + 2 * chroma_width * chroma_height;
 
-		current_frame_ycbcr_format = decode_ycbcr_format(desc, frame, is_mjpeg);
+		*ycbcr_format = decode_ycbcr_format(desc, frame, is_mjpeg);
+	}
+	if (!scaler->scale(frame->data, frame->linesize, frame->width, frame->height, AVPixelFormat(frame->format),
+	                   pic_data, linesizes, width, height, sws_dst_format)) {
+		fprintf(stderr, "%s: Could not create scaler context\n", pathname.c_str());
+		*error = true;
+		return video_frame;
 	}
-	sws_scale(sws_ctx.get(), frame->data, frame->linesize, 0, frame->height, pic_data, linesizes);
 
 	return video_frame;
 }
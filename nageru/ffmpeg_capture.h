@@ -22,9 +22,22 @@
 // point of the frame. Note that once we get a video frame, we don't look for
 // subtitle, so if subtitles and a frame comes at the same time, you might not
 // see the subtitle until the next frame.
+//
+// Demuxing, decoding and conversion happen in a separate decoder thread,
+// which stays a few frames ahead of the producer thread (which just paces
+// the frames out at the right time), so that a frame that is slow to decode
+// (e.g. at the start of a GOP) doesn't immediately make us late.
+//
+// Optionally, short clips that loop (stingers, background loops and the like)
+// can be kept in memory after conversion, so that after the first pass,
+// playing them costs nothing but a memcpy per frame; see
+// set_loop_cache_budget().
 
 #include <assert.h>
 #include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <map>
 #include <memory>
@@ -32,6 +45,7 @@
 #include <set>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <movit/ycbcr.h>
 
@@ -51,6 +65,7 @@ struct AVFormatContext;
 struct AVFrame;
 struct AVRational;
 struct AVPacket;
+class SlicedScaler;
 
 class FFmpegCapture : public bmusb::CaptureInterface
 {
@@ -72,6 +87,7 @@ public:
 	{
 		std::lock_guard<std::mutex> lock(queue_mu);
 		command_queue.push_back(QueuedCommand { QueuedCommand::REWIND });
+		decoded_frames_changed.notify_all();
 		producer_thread_should_quit.wakeup();
 	}
 
@@ -79,9 +95,21 @@ public:
 	{
 		std::lock_guard<std::mutex> lock(queue_mu);
 		command_queue.push_back(QueuedCommand { QueuedCommand::CHANGE_RATE, new_rate });
+		decoded_frames_changed.notify_all();
 		producer_thread_should_quit.wakeup();
 	}
 
+	// Keep all frames of the clip (after conversion) in memory, as long as
+	// they fit in the given number of bytes, and replay them from there
+	// instead of decoding the clip again every time it loops. 0 disables
+	// the cache (the default). Takes effect the next time the clip loops
+	// or is rewound. Not used if there is a raw audio callback.
+	void set_loop_cache_budget(size_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(queue_mu);
+		loop_cache_budget = bytes;
+	}
+
 	std::string get_filename() const
 	{
 		std::lock_guard<std::mutex> lock(filename_mu);
@@ -225,13 +253,63 @@ public:
 	uint32_t get_current_audio_input() const override { return 0; }
 
 private:
+	// A frame that the decoder thread has made ready for the producer thread,
+	// or a marker telling it what happened to the stream.
+	struct DecodedFrame {
+		enum Type {
+			FRAME,
+			LOOPED,  // Hit EOF and went back to the start.
+			END,  // Stop playing this file (e.g. it changed on disk); not an error.
+			ERROR
+		} type = FRAME;
+		unsigned generation;  // See decode_generation.
+
+		// The decoder thread exits after sending one of these, so they are
+		// never thrown away, even if they are from before a rewind.
+		bool ends_stream() const { return type == END || type == ERROR; }
+
+		// For FRAME only.
+		int64_t pts;
+		UniqueFrame video_frame, audio_frame;
+		bmusb::VideoFormat video_format;
+		bmusb::AudioFormat audio_format;
+		int64_t audio_pts;
+		movit::YCbCrFormat ycbcr_format;
+		bool has_last_subtitle;
+		std::string last_subtitle;
+	};
+
 	void producer_thread_func();
 	void send_disconnected_frame();
 	bool play_video(const std::string &pathname);
 	void internal_rewind();
 
-	// Returns true if there was an error.
-	bool process_queued_commands(AVFormatContext *format_ctx, const std::string &pathname, timespec last_modified, bool *rewound);
+	// Runs in the producer thread, sending frames from the decoder thread
+	// out at the right time. Returns false on error.
+	bool deliver_frames(const std::string &pathname);
+
+	// Returns false if woken up by a command or by quitting before a frame was ready.
+	// <had_to_wait> is set to true if the decoder had nothing ready for us
+	// at some point during the call.
+	bool get_decoded_frame(DecodedFrame *frame, bool *had_to_wait);
+
+	void decoder_thread_func(AVFormatContext *format_ctx, AVCodecContext *video_codec_ctx, AVCodecContext *audio_codec_ctx,
+	                         const std::string &pathname, int video_stream_index, int audio_stream_index, int subtitle_stream_index,
+	                         timespec last_modified);
+	void push_decoded_frame(DecodedFrame &&frame);
+	void push_decoded_marker(DecodedFrame::Type type, unsigned generation);
+
+	// Called by the decoder thread when going back to the start of the clip.
+	// Either sets up for replaying from the loop cache, or seeks to the start
+	// (and starts filling the cache if it is enabled). Returns false if the
+	// seek failed.
+	bool restart_clip(AVFormatContext *format_ctx, AVCodecContext *video_codec_ctx, AVCodecContext *audio_codec_ctx, size_t budget);
+	void add_to_loop_cache(const DecodedFrame &frame, size_t budget);
+	void clear_loop_cache();
+	DecodedFrame replay_cached_frame(unsigned generation);
+
+	// Runs in the producer thread.
+	void process_queued_commands(bool *rewound);
 
 	// Returns nullptr if no frame was decoded (e.g. EOF).
 	AVFrameWithDeleter decode_frame(AVFormatContext *format_ctx, AVCodecContext *video_codec_ctx, AVCodecContext *audio_codec_ctx,
@@ -240,7 +318,7 @@ private:
 	void convert_audio(const AVFrame *audio_avframe, bmusb::FrameAllocator::Frame *audio_frame, bmusb::AudioFormat *audio_format);
 
 	bmusb::VideoFormat construct_video_format(const AVFrame *frame, AVRational video_timebase);
-	UniqueFrame make_video_frame(const AVFrame *frame, const std::string &pathname, bool *error);
+	UniqueFrame make_video_frame(const AVFrame *frame, const std::string &pathname, movit::YCbCrFormat *ycbcr_format, bool *error);
 
 	static int interrupt_cb_thunk(void *unique);
 	int interrupt_cb();
@@ -268,7 +346,7 @@ private:
 	frame_callback_t frame_callback = nullptr;
 	audio_callback_t audio_callback = nullptr;
 
-	SwsContextWithDeleter sws_ctx;
+	std::unique_ptr<SlicedScaler> scaler;  // Used by the decoder thread only.
 	int sws_last_width = -1, sws_last_height = -1, sws_last_src_format = -1;
 	AVPixelFormat sws_dst_format = AVPixelFormat(-1);  // In practice, always initialized.
 	AVRational video_timebase, audio_timebase;
@@ -280,6 +358,11 @@ private:
 	int64_t pts_origin, last_pts;
 	std::chrono::steady_clock::time_point start, next_frame_start, last_frame;
 
+	// Set whenever the time scale is reset (e.g. by a rewind), and cleared
+	// when the next frame has been sent. That frame is due right away,
+	// so it says nothing about whether the decoder is keeping up.
+	bool time_scale_was_reset = true;
+
 	std::mutex queue_mu;
 	struct QueuedCommand {
 		enum Command { REWIND, CHANGE_RATE } command;
@@ -287,13 +370,59 @@ private:
 	};
 	std::vector<QueuedCommand> command_queue;  // Protected by <queue_mu>.
 
+	// Frames decoded ahead of time by the decoder thread.
+	static constexpr size_t max_decoded_frames_queued = 4;
+	std::deque<DecodedFrame> decoded_frames;  // Protected by <queue_mu>.
+	std::condition_variable decoded_frames_changed;  // Also signaled on new commands and on quit.
+	std::condition_variable decoder_wakeup;  // Signaled when the decoder has room or something to do.
+	bool decoder_should_quit = false, decoder_should_rewind = false;  // Protected by <queue_mu>.
+
+	// Incremented on every rewind; frames decoded from before the rewind
+	// (which can show up after we've cleared the queue) are thrown away.
+	unsigned decode_generation = 0;  // Protected by <queue_mu>.
+
+	// Subtitle state as seen by the decoder thread; copied into each frame.
+	bool decoder_has_last_subtitle = false;
+	std::string decoder_last_subtitle;
+
+	// The loop cache. Everything except the budget is used by the decoder thread only.
+	struct CachedFrame {
+		int64_t pts;
+		std::vector<uint8_t> video_data, audio_data;
+		bmusb::VideoFormat video_format;
+		bmusb::AudioFormat audio_format;
+		int64_t audio_pts;
+		movit::YCbCrFormat ycbcr_format;
+		bool has_last_subtitle;
+		std::string last_subtitle;
+	};
+	enum LoopCacheState {
+		LOOP_CACHE_DISABLED,
+		LOOP_CACHE_FILLING,  // Decoding from the start of the clip, and everything so far fits.
+		LOOP_CACHE_COMPLETE,  // Holds the entire clip.
+		LOOP_CACHE_TOO_BIG,  // Gave up; don't try again unless the budget changes.
+	};
+	size_t loop_cache_budget = 0;  // Protected by <queue_mu>.
+	LoopCacheState loop_cache_state = LOOP_CACHE_DISABLED;
+	std::vector<CachedFrame> loop_cache;
+	size_t loop_cache_bytes = 0;
+	size_t loop_cache_too_big_budget = 0;  // The budget in effect when we went to LOOP_CACHE_TOO_BIG.
+	bool replaying_loop_cache = false;
+	size_t loop_cache_pos = 0;  // Next frame to replay.
+
+	std::vector<std::pair<std::string, std::string>> metric_labels;  // Empty if not registered.
+	std::atomic<int64_t> metric_decode_queue_frames{0};
+	std::atomic<int64_t> metric_late_frames{0};  // Due while the decoder had nothing ready; see deliver_frames().
+	std::atomic<int64_t> metric_loop_cache_bytes{0};
+
 	// Audio resampler.
 	SwrContext *resampler = nullptr;
 	AVSampleFormat last_src_format, last_dst_format;
 	int64_t last_channel_layout;
 	int last_sample_rate;
 
-	// Subtitles (no decoding done, really).
+	// Subtitles (no decoding done, really). These are set from the decoded
+	// frame just before the frame callback.
 	bool has_last_subtitle = false;
 	std::string last_subtitle;
 };
@@ -36,6 +36,8 @@ enum LongOption {
 	OPTION_HTTP_AUDIO_CODEC,
 	OPTION_HTTP_AUDIO_BITRATE,
 	OPTION_HTTP_PORT,
+	OPTION_FFMPEG_DECODER_THREADS,
+	OPTION_FFMPEG_CONVERSION_SLICES,
 	OPTION_NO_TRANSCODE_AUDIO,
 	OPTION_FLAT_AUDIO,
 	OPTION_GAIN_STAGING,
@@ -64,6 +66,13 @@ enum LongOption {
 	OPTION_10_BIT_OUTPUT,
 	OPTION_INPUT_YCBCR_INTERPRETATION,
 	OPTION_MJPEG_EXPORT_CARDS,
+	OPTION_MJPEG_ENCODER_THREADS,
+	OPTION_MJPEG_MAX_QUEUED_FRAMES,
+	OPTION_MJPEG_ENCODER_SLICES,
+	OPTION_RECORD_INPUT_TIMING,
+	OPTION_HIDDEN_CHANNEL_REFRESH_FRAMES,
+	OPTION_FRAME_TRACE_FRAMES,
+	OPTION_THEME_LUA_STATES,
 };
 
 map<unsigned, unsigned> parse_mjpeg_export_cards(char *optarg)
@@ -167,6 +176,10 @@ void usage(Program program)
 		DEFAULT_AUDIO_OUTPUT_BIT_RATE / 1000);
 	fprintf(stderr, "      --http-port=PORT            which port to use for the built-in HTTP server\n");
 	fprintf(stderr, "                                  (default is %d)\n", DEFAULT_HTTPD_PORT);
+	fprintf(stderr, "      --ffmpeg-decoder-threads=N  threads to use for decoding each FFmpeg input\n");
+	fprintf(stderr, "                                  (default 0 = automatic)\n");
+	fprintf(stderr, "      --ffmpeg-conversion-slices=N  convert frames from FFmpeg inputs in up to N slices\n");
+	fprintf(stderr, "                                  in parallel (default 0 = automatic, 1 = no threading)\n");
 	if (program == PROGRAM_KAERU) {
 		fprintf(stderr, "      --no-transcode-audio        copy encoded audio raw from the source stream\n");
 		fprintf(stderr, "                                    (requires --http-audio-codec= to be set)\n");
@@ -188,6 +201,15 @@ void usage(Program program)
 		fprintf(stderr, "      --print-video-latency       print out measurements of video latency on stdout\n");
 		fprintf(stderr, "      --max-input-queue-frames=FRAMES  never keep more than FRAMES frames for each card\n");
 		fprintf(stderr, "                                    (default 6, minimum 1)\n");
+		fprintf(stderr, "      --record-input-timing=FILE  log frame arrival times for all cards to FILE,\n");
+		fprintf(stderr, "                                    for offline tuning with replay_input_timing\n");
+		fprintf(stderr, "      --hidden-channel-refresh-frames=FRAMES  render channels that are not shown\n");
+		fprintf(stderr, "                                    anywhere only every FRAMES frames (default 0 = never)\n");
+		fprintf(stderr, "      --frame-trace-frames=FRAMES  keep timing of the last FRAMES frames, for export\n");
+		fprintf(stderr, "                                    as a Chrome trace from /frame_trace or on SIGUSR2\n");
+		fprintf(stderr, "      --theme-lua-states=NUM      run NUM copies of the theme, so that the live channel and\n");
+		fprintf(stderr, "                                    the previews can get their chains in parallel (default 1;\n");
+		fprintf(stderr, "                                    2 = one for live, one for the rest; needs a deterministic theme)\n");
 		fprintf(stderr, "      --audio-queue-length-ms=MS  length of audio resampling queue (default 100.0)\n");
 		fprintf(stderr, "      --output-ycbcr-coefficients={rec601,rec709,auto}\n");
 		fprintf(stderr, "                                  Y'CbCr coefficient standard of output (default auto)\n");
@@ -213,6 +235,13 @@ void usage(Program program)
 		fprintf(stderr, "                                  export the given cards in MJPEG format to /multicam.mp4,\n");
 		fprintf(stderr, "                                    in the given order (ranges can be either single card indexes\n");
 		fprintf(stderr, "                                    or pairs like 1-3 for camera 1,2,3; default is all cards)\n");
+		fprintf(stderr, "      --mjpeg-encoder-threads=NUM  number of threads for software MJPEG encoding\n");
+		fprintf(stderr, "                                    (default is one per CPU core, up to one per exported card;\n");
+		fprintf(stderr, "                                    not used if VA-API encoding is available)\n");
+		fprintf(stderr, "      --mjpeg-max-queued-frames=NUM  drop the oldest unencoded MJPEG frame if more than NUM\n");
+		fprintf(stderr, "                                    frames are waiting to be encoded (default 10)\n");
+		fprintf(stderr, "      --mjpeg-encoder-slices=NUM  split each software-encoded MJPEG frame into NUM slices\n");
+		fprintf(stderr, "                                    that are encoded in parallel, for lower latency (default 1)\n");
 	}
 }
 
@@ -251,6 +280,8 @@ void parse_flags(Program program, int argc, char * const argv[])
 		{ "http-audio-codec", required_argument, 0, OPTION_HTTP_AUDIO_CODEC },
 		{ "http-audio-bitrate", required_argument, 0, OPTION_HTTP_AUDIO_BITRATE },
 		{ "http-port", required_argument, 0, OPTION_HTTP_PORT },
+		{ "ffmpeg-decoder-threads", required_argument, 0, OPTION_FFMPEG_DECODER_THREADS },
+		{ "ffmpeg-conversion-slices", required_argument, 0, OPTION_FFMPEG_CONVERSION_SLICES },
 		{ "no-transcode-audio", no_argument, 0, OPTION_NO_TRANSCODE_AUDIO },
 		{ "flat-audio", no_argument, 0, OPTION_FLAT_AUDIO },
 		{ "gain-staging", required_argument, 0, OPTION_GAIN_STAGING },
@@ -268,6 +299,10 @@ void parse_flags(Program program, int argc, char * const argv[])
 		{ "no-flush-pbos", no_argument, 0, OPTION_NO_FLUSH_PBOS },
 		{ "print-video-latency", no_argument, 0, OPTION_PRINT_VIDEO_LATENCY },
 		{ "max-input-queue-frames", required_argument, 0, OPTION_MAX_INPUT_QUEUE_FRAMES },
+		{ "record-input-timing", required_argument, 0, OPTION_RECORD_INPUT_TIMING },
+		{ "hidden-channel-refresh-frames", required_argument, 0, OPTION_HIDDEN_CHANNEL_REFRESH_FRAMES },
+		{ "frame-trace-frames", required_argument, 0, OPTION_FRAME_TRACE_FRAMES },
+		{ "theme-lua-states", required_argument, 0, OPTION_THEME_LUA_STATES },
 		{ "audio-queue-length-ms", required_argument, 0, OPTION_AUDIO_QUEUE_LENGTH_MS },
 		{ "output-ycbcr-coefficients", required_argument, 0, OPTION_OUTPUT_YCBCR_COEFFICIENTS },
 		{ "output-buffer-frames", required_argument, 0, OPTION_OUTPUT_BUFFER_FRAMES },
@@ -279,6 +314,9 @@ void parse_flags(Program program, int argc, char * const argv[])
 		{ "10-bit-output", no_argument, 0, OPTION_10_BIT_OUTPUT },
 		{ "input-ycbcr-interpretation", required_argument, 0, OPTION_INPUT_YCBCR_INTERPRETATION },
 		{ "mjpeg-export-cards", required_argument, 0, OPTION_MJPEG_EXPORT_CARDS },
+		{ "mjpeg-encoder-threads", required_argument, 0, OPTION_MJPEG_ENCODER_THREADS },
+		{ "mjpeg-max-queued-frames", required_argument, 0, OPTION_MJPEG_MAX_QUEUED_FRAMES },
+		{ "mjpeg-encoder-slices", required_argument, 0, OPTION_MJPEG_ENCODER_SLICES },
 		{ 0, 0, 0, 0 }
 	};
 	vector<string> theme_dirs;
@@ -455,6 +493,24 @@ void parse_flags(Program program, int argc, char * const argv[])
 		case OPTION_MAX_INPUT_QUEUE_FRAMES:
 			global_flags.max_input_queue_frames = atoi(optarg);
 			break;
+		case OPTION_RECORD_INPUT_TIMING:
+			global_flags.input_timing_trace_filename = optarg;
+			break;
+		case OPTION_HIDDEN_CHANNEL_REFRESH_FRAMES:
+			global_flags.hidden_channel_refresh_frames = atoi(optarg);
+			break;
+		case OPTION_FRAME_TRACE_FRAMES:
+			global_flags.frame_trace_frames = atoi(optarg);
+			break;
+		case OPTION_THEME_LUA_STATES:
+			global_flags.theme_lua_states = atoi(optarg);
+			break;
+		case OPTION_FFMPEG_DECODER_THREADS:
+			global_flags.ffmpeg_decoder_threads = atoi(optarg);
+			break;
+		case OPTION_FFMPEG_CONVERSION_SLICES:
+			global_flags.ffmpeg_conversion_slices = atoi(optarg);
+			break;
 		case OPTION_AUDIO_QUEUE_LENGTH_MS:
 			global_flags.audio_queue_length_ms = atof(optarg);
 			break;
@@ -545,6 +601,15 @@ void parse_flags(Program program, int argc, char * const argv[])
 			card_to_mjpeg_stream_export_set = true;
 			break;
 		}
+		case OPTION_MJPEG_ENCODER_THREADS:
+			global_flags.mjpeg_encoder_threads = atoi(optarg);
+			break;
+		case OPTION_MJPEG_MAX_QUEUED_FRAMES:
+			global_flags.mjpeg_max_queued_frames = atoi(optarg);
+			break;
+		case OPTION_MJPEG_ENCODER_SLICES:
+			global_flags.mjpeg_encoder_slices = atoi(optarg);
+			break;
 		case OPTION_HELP:
 			usage(program);
 			exit(0);
@@ -653,6 +718,38 @@ void parse_flags(Program program, int argc, char * const argv[])
 	if (global_flags.max_input_queue_frames > 10) {
 		fprintf(stderr, "WARNING: --max-input-queue-frames has little effect over 10.\n");
 	}
+	if (global_flags.hidden_channel_refresh_frames < 0) {
+		fprintf(stderr, "ERROR: --hidden-channel-refresh-frames can't be negative.\n");
+		exit(1);
+	}
+	if (global_flags.theme_lua_states < 1) {
+		fprintf(stderr, "ERROR: --theme-lua-states must be at least 1.\n");
+		exit(1);
+	}
+	if (global_flags.frame_trace_frames < 0) {
+		fprintf(stderr, "ERROR: --frame-trace-frames can't be negative.\n");
+		exit(1);
+	}
+	if (global_flags.ffmpeg_decoder_threads < 0) {
+		fprintf(stderr, "ERROR: --ffmpeg-decoder-threads can't be negative.\n");
+		exit(1);
+	}
+	if (global_flags.ffmpeg_conversion_slices < 0) {
+		fprintf(stderr, "ERROR: --ffmpeg-conversion-slices can't be negative.\n");
+		exit(1);
+	}
+	if (global_flags.mjpeg_encoder_threads < 0) {
+		fprintf(stderr, "ERROR: --mjpeg-encoder-threads can't be negative.\n");
+		exit(1);
+	}
+	if (global_flags.mjpeg_encoder_slices < 1) {
+		fprintf(stderr, "ERROR: --mjpeg-encoder-slices must be at least 1.\n");
+		exit(1);
+	}
+	if (global_flags.mjpeg_max_queued_frames < 1) {
+		fprintf(stderr, "ERROR: --mjpeg-max-queued-frames must be at least 1.\n");
+		exit(1);
+	}
 
 	if (!isinf(global_flags.x264_crf)) {  // CRF mode is selected.
 		if (global_flags.x264_bitrate != -1) {
@@ -55,6 +55,12 @@ struct Flags {
 	double output_buffer_frames = 6.0;
 	double output_slop_frames = 0.5;
 	int max_input_queue_frames = 6;
+	std::string input_timing_trace_filename;  // Empty for none.
+	int hidden_channel_refresh_frames = 0;  // 0 = never render channels nobody is looking at.
+	int frame_trace_frames = 0;  // 0 = no trace ring buffer.
+	int theme_lua_states = 1;  // Number of Lua interpreters running the theme; see Theme.
+	int ffmpeg_decoder_threads = 0;  // 0 = let FFmpeg decide.
+	int ffmpeg_conversion_slices = 0;  // 0 = automatic.
 	int http_port = DEFAULT_HTTPD_PORT;
 	bool display_timecode_in_stream = false;
 	bool display_timecode_on_stdout = false;
@@ -68,6 +74,9 @@ struct Flags {
 	bool can_disable_srgb_decoder = false;  // Not user-settable.
 	bool fullscreen = false;
 	std::map<unsigned, unsigned> card_to_mjpeg_stream_export;  // If a card is not in the map, it is not exported.
+	int mjpeg_encoder_threads = 0;  // Only used for software encoding. 0 = autodetect.
+	int mjpeg_max_queued_frames = 10;  // Across all cards.
+	int mjpeg_encoder_slices = 1;  // Only used for software encoding.
 };
 extern Flags global_flags;
 
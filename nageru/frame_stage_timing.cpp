@@ -0,0 +1,101 @@
+#include "frame_stage_timing.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "shared/metrics.h"
+
+using namespace std;
+using namespace std::chrono;
+
+FrameStageTiming global_frame_stage_timing;
+
+namespace {
+
+// Roughly how many events a frame produces; one per stage,
+// and then one extra get_chain for every channel.
+constexpr unsigned trace_events_per_frame = 16;
+
+const char *stage_names[FrameStageTiming::NUM_STAGES] = {
+	"card_wait",
+	"upload",
+	"get_chain",
+	"render",
+	"chroma_subsampling",
+	"encoder_begin_frame",
+	"encoder_end_frame",
+	"fence_wait",
+};
+
+}  // namespace
+
+FrameStageTiming::FrameStageTiming()
+{
+	for (unsigned stage = 0; stage < NUM_STAGES; ++stage) {
+		stage_seconds[stage].init_geometric(0.0001, 1.0, 30);
+	}
+}
+
+void FrameStageTiming::init(unsigned trace_frames)
+{
+	for (unsigned stage = 0; stage < NUM_STAGES; ++stage) {
+		global_metrics.add("mixer_stage_seconds", {{ "stage", stage_names[stage] }}, &stage_seconds[stage]);
+	}
+
+	lock_guard<mutex> lock(mu);
+	trace_events.resize(trace_frames * trace_events_per_frame);
+}
+
+void FrameStageTiming::record(Stage stage, steady_clock::time_point start, steady_clock::time_point end, int64_t frame_num)
+{
+	stage_seconds[stage].count_event(duration<double>(end - start).count());
+
+	if (trace_events.empty()) {  // Never changes after init().
+		return;
+	}
+
+	pid_t tid = syscall(SYS_gettid);
+	lock_guard<mutex> lock(mu);
+	if (!thread_names.count(tid)) {
+		char name[16];
+		if (pthread_getname_np(pthread_self(), name, sizeof(name)) != 0) {
+			snprintf(name, sizeof(name), "%d", int(tid));
+		}
+		thread_names[tid] = name;
+	}
+	trace_events[next_trace_event] = TraceEvent{ stage, tid, frame_num, start, end };
+	next_trace_event = (next_trace_event + 1) % trace_events.size();
+	num_trace_events = min(num_trace_events + 1, trace_events.size());
+}
+
+string FrameStageTiming::get_chrome_trace_json()
+{
+	lock_guard<mutex> lock(mu);
+
+	string ret = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	char buf[256];
+	bool first = true;
+	for (const auto &tid_and_name : thread_names) {
+		snprintf(buf, sizeof(buf), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", int(tid_and_name.first), tid_and_name.second.c_str());
+		ret += buf;
+		first = false;
+	}
+
+	// Oldest event first.
+	size_t idx = (next_trace_event + trace_events.size() - num_trace_events) % max<size_t>(trace_events.size(), 1);
+	for (size_t i = 0; i < num_trace_events; ++i) {
+		const TraceEvent &event = trace_events[idx];
+		double ts_us = duration<double, micro>(event.start.time_since_epoch()).count();
+		double dur_us = duration<double, micro>(event.end - event.start).count();
+		snprintf(buf, sizeof(buf), "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%lld}}",
+			first ? "" : ",\n", stage_names[event.stage], int(event.tid), ts_us, dur_us, (long long)event.frame_num);
+		ret += buf;
+		first = false;
+		idx = (idx + 1) % trace_events.size();
+	}
+	ret += "\n]}\n";
+	return ret;
+}
@@ -0,0 +1,79 @@
+#ifndef _FRAME_STAGE_TIMING_H
+#define _FRAME_STAGE_TIMING_H 1
+
+// Timing of the different stages each output frame goes through in the mixer
+// (and the encoder thread right after it), so that when a frame misses its
+// deadline, it's possible to see where the time went. Each stage is exported
+// as a histogram metric (mixer_stage_seconds{stage="..."}). In addition,
+// if --frame-trace-frames is set, the last few frames' worth of stages are
+// kept in a ring buffer that can be exported as a Chrome trace (load it in
+// chrome://tracing or Perfetto), either from /frame_trace over HTTP or by
+// sending SIGUSR2, which writes it to a file in the current directory.
+//
+// Note that all of these are CPU times; since OpenGL is asynchronous,
+// “render” is mostly the time spent setting up and submitting the work,
+// and the GPU time will generally show up in “fence_wait” instead.
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "shared/metrics.h"
+
+class FrameStageTiming {
+public:
+	enum Stage {
+		STAGE_CARD_WAIT,  // Waiting for frames from the master card (and picking out frames from the others).
+		STAGE_UPLOAD,  // Uploading new input frames to the GPU.
+		STAGE_GET_CHAIN,  // Asking the theme for a chain (under the theme lock); once per channel.
+		STAGE_RENDER,  // Rendering the live chain (and the timecode, if any).
+		STAGE_CHROMA_SUBSAMPLING,
+		STAGE_ENCODER_BEGIN_FRAME,  // Getting a surface from the video encoder.
+		STAGE_ENCODER_END_FRAME,  // Giving the rendered frame to the video encoder.
+		STAGE_FENCE_WAIT,  // In the encoder thread, waiting for the GPU to finish the frame.
+		NUM_STAGES
+	};
+
+	FrameStageTiming();
+
+	// Registers the metrics, and sets up the trace ring buffer if trace_frames > 0.
+	// Must be called before any other thread calls record().
+	void init(unsigned trace_frames);
+
+	bool trace_enabled() const { return !trace_events.empty(); }
+
+	// Thread-safe. frame_num is just for display in the trace (-1 for unknown).
+	void record(Stage stage, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, int64_t frame_num = -1);
+
+	// Returns a JSON file in Chrome's trace event format. Thread-safe.
+	std::string get_chrome_trace_json();
+
+	// For the HTTP endpoint.
+	std::pair<std::string, std::string> get_chrome_trace_http()
+	{
+		return std::make_pair(get_chrome_trace_json(), "application/json");
+	}
+
+private:
+	struct TraceEvent {
+		Stage stage;
+		pid_t tid;
+		int64_t frame_num;
+		std::chrono::steady_clock::time_point start, end;
+	};
+
+	Histogram stage_seconds[NUM_STAGES];  // Each stage is only ever recorded from one thread.
+
+	std::mutex mu;
+	std::vector<TraceEvent> trace_events;  // Under <mu>. Ring buffer; empty if tracing is disabled.
+	size_t next_trace_event = 0, num_trace_events = 0;  // Under <mu>.
+	std::map<pid_t, std::string> thread_names;  // Under <mu>.
+};
+
+extern FrameStageTiming global_frame_stage_timing;
+
+#endif  // !defined(_FRAME_STAGE_TIMING_H)
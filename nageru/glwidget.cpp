@@ -59,6 +59,19 @@ GLWidget::~GLWidget()
 {
 }
 
+void GLWidget::set_output(Mixer::Output output)
+{
+	if (has_display_size) {
+		global_mixer->remove_display_size(this->output, this);
+		global_mixer->set_display_size(output, this, current_width, current_height);
+	}
+	if (global_mixer != nullptr && isVisible()) {
+		global_mixer->remove_consumer(this->output, this);
+		global_mixer->add_consumer(output, this);
+	}
+	this->output = output;
+}
+
 void GLWidget::shutdown()
 {
 	if (resource_pool != nullptr) {
@@ -66,10 +79,17 @@ void GLWidget::shutdown()
 		resource_pool->clean_context();
 	}
 	global_mixer->remove_frame_ready_callback(output, this);
+	global_mixer->remove_display_size(output, this);
+	global_mixer->remove_consumer(output, this);
 }
 
 void GLWidget::grab_white_balance(unsigned channel, unsigned x, unsigned y)
 {
+	// Make sure the channel gets rendered until we have our pixel,
+	// even if we were to be hidden in the meantime.
+	grab_output = Mixer::Output(Mixer::OUTPUT_INPUT0 + channel);
+	global_mixer->add_consumer(grab_output, &should_grab);
+
 	// Set the white balance to neutral for the grab. It's probably going to
 	// flicker a bit, but hopefully this display is not live anyway.
 	global_mixer->set_wb(output, 0.5, 0.5, 0.5);
@@ -78,7 +98,6 @@ void GLWidget::grab_white_balance(unsigned channel, unsigned x, unsigned y)
 	// Mark that the next paintGL() should grab the given pixel.
 	grab_x = x;
 	grab_y = y;
-	grab_output = Mixer::Output(Mixer::OUTPUT_INPUT0 + channel);
 	should_grab = true;
 
 	updateGL();
@@ -109,6 +128,10 @@ void GLWidget::initializeGL()
 			emit color_updated(output, color);
 		});
 	}
+	if (isVisible()) {
+		// We were shown before the mixer existed.
+		global_mixer->add_consumer(output, this);
+	}
 	setContextMenuPolicy(Qt::CustomContextMenu);
 	connect(this, &QWidget::customContextMenuRequested, bind(&GLWidget::show_context_menu, this, _1));
 
@@ -122,6 +145,10 @@ void GLWidget::resizeGL(int width, int height)
 	current_width = width;
 	current_height = height;
 	glViewport(0, 0, width, height);
+
+	// Let the mixer render previews at the size we're going to show them at.
+	global_mixer->set_display_size(output, this, width, height);
+	has_display_size = true;
 }
 
 void GLWidget::paintGL()
@@ -159,6 +186,7 @@ void GLWidget::paintGL()
 		double g = srgb_to_linear(reference_color[1]);
 		double b = srgb_to_linear(reference_color[0]);
 		global_mixer->set_wb(grab_output, r, g, b);
+		global_mixer->remove_consumer(grab_output, &should_grab);
 		should_grab = false;
 	}
 }
@@ -168,6 +196,22 @@ void GLWidget::mousePressEvent(QMouseEvent *event)
 	emit clicked();
 }
 
+void GLWidget::showEvent(QShowEvent *event)
+{
+	QGLWidget::showEvent(event);
+	if (global_mixer != nullptr) {
+		global_mixer->add_consumer(output, this);
+	}
+}
+
+void GLWidget::hideEvent(QHideEvent *event)
+{
+	QGLWidget::hideEvent(event);
+	if (global_mixer != nullptr) {
+		global_mixer->remove_consumer(output, this);
+	}
+}
+
 void GLWidget::show_context_menu(const QPoint &pos)
 {
 	if (output == Mixer::OUTPUT_LIVE) {
@@ -9,9 +9,11 @@
 
 #include "mixer.h"
 
+class QHideEvent;
 class QMouseEvent;
 class QObject;
 class QPoint;
+class QShowEvent;
 class QWidget;
 
 namespace movit {
@@ -32,10 +34,7 @@ public:
 	GLWidget(QWidget *parent = 0);
 	~GLWidget();
 
-	void set_output(Mixer::Output output)
-	{
-		this->output = output;
-	}
+	void set_output(Mixer::Output output);
 
 	void shutdown();
 
@@ -47,6 +46,8 @@ protected:
 	void resizeGL(int width, int height) override;
 	void paintGL() override;
 	void mousePressEvent(QMouseEvent *event) override;
+	void showEvent(QShowEvent *event) override;
+	void hideEvent(QHideEvent *event) override;
 
 signals:
 	void clicked();
@@ -66,6 +67,7 @@ private:
 	GLuint position_vbo, texcoord_vbo;
 	movit::ResourcePool *resource_pool = nullptr;
 	int current_width = 1, current_height = 1;
+	bool has_display_size = false;  // Whether we've told the mixer about current_width/current_height.
 	bool should_grab = false;
 	unsigned grab_x, grab_y;
 	Mixer::Output grab_output;  // Should nominally be the same as output.
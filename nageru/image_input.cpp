@@ -20,11 +20,16 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
+#include <assert.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
-#include <functional>
 #include <mutex>
 #include <thread>
 #include <utility>
@@ -37,13 +42,14 @@ extern "C" {
 struct SwsContext;
 
 using namespace std;
+using namespace std::chrono;
 
 ImageInput::ImageInput(const string &filename)
 	: movit::FlatInput({movit::COLORSPACE_sRGB, movit::GAMMA_sRGB}, movit::FORMAT_RGBA_POSTMULTIPLIED_ALPHA,
 	                   GL_UNSIGNED_BYTE, 1280, 720),  // Resolution will be overwritten.
 	  filename(filename),
 	  pathname(search_for_file_or_die(filename)),
-	  current_image(load_image(filename, pathname))
+	  current_image(load_image(pathname))
 {
 	if (current_image == nullptr) {  // Could happen even though search_for_file() returned.
 		fprintf(stderr, "Couldn't load image, exiting.\n");
@@ -72,7 +78,7 @@ void ImageInput::set_gl_state(GLuint glsl_program_num, const string& prefix, uns
 	movit::FlatInput::set_gl_state(glsl_program_num, prefix, sampler_num);
 }
 
-shared_ptr<const ImageInput::Image> ImageInput::load_image(const string &filename, const string &pathname)
+shared_ptr<const ImageInput::Image> ImageInput::load_image(const string &pathname)
 {
 	lock_guard<mutex> lock(all_images_lock);  // Held also during loading.
 	if (all_images.count(pathname)) {
@@ -80,9 +86,12 @@ shared_ptr<const ImageInput::Image> ImageInput::load_image(const string &filenam
 	}
 
 	all_images[pathname] = load_image_raw(pathname);
-	timespec first_modified = all_images[pathname]->last_modified;
-	update_threads[pathname] =
-		thread(bind(update_thread_func, filename, pathname, first_modified));
+	if (all_images[pathname] == nullptr) {
+		all_images.erase(pathname);
+		return nullptr;
+	}
+	start_updaters();
+	watch_file(pathname, all_images[pathname]->last_modified);
 
 	return all_images[pathname];
 }
@@ -199,26 +208,158 @@ shared_ptr<const ImageInput::Image> ImageInput::load_image_raw(const string &pat
 	return image;
 }
 
-// Fire up a thread to update the image every second.
-// We could do inotify, but this is good enough for now.
-void ImageInput::update_thread_func(const std::string &filename, const std::string &pathname, const timespec &first_modified)
+void ImageInput::start_updaters()
 {
-	char thread_name[16];
-	snprintf(thread_name, sizeof(thread_name), "Update_%s", filename.c_str());
-	pthread_setname_np(pthread_self(), thread_name);
+	if (updaters_started) {
+		return;
+	}
+	updaters_started = true;
 
-	timespec last_modified = first_modified;
-	struct stat buf;
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		perror("inotify_init1()");
+		fprintf(stderr, "Will check images for updates every second instead.\n");
+	}
+	should_quit_fd = eventfd(/*initval=*/0, /*flags=*/0);
+	assert(should_quit_fd != -1);
+
+	watcher_thread = thread(&ImageInput::watcher_thread_func);
+	for (unsigned loader_num = 0; loader_num < num_loader_threads; ++loader_num) {
+		loader_threads.emplace_back(&ImageInput::loader_thread_func, loader_num);
+	}
+}
+
+void ImageInput::watch_file(const string &pathname, const timespec &first_modified)
+{
+	// We watch the directory and not the file itself, since the common ways
+	// of updating a file (e.g. writing a new one and renaming it into place)
+	// would give us a different inode.
+	string dir, name;
+	size_t slash_pos = pathname.find_last_of('/');
+	if (slash_pos == string::npos) {
+		dir = ".";
+		name = pathname;
+	} else {
+		dir = (slash_pos == 0) ? "/" : pathname.substr(0, slash_pos);
+		name = pathname.substr(slash_pos + 1);
+	}
+
+	if (inotify_fd != -1) {
+		int wd = inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd != -1) {
+			watched_files[wd][name] = pathname;
+			return;
+		}
+		perror(dir.c_str());
+		fprintf(stderr, "%s: Could not watch for changes, will check every second instead.\n", pathname.c_str());
+	}
+	polled_files[pathname] = first_modified;
+}
+
+void ImageInput::watcher_thread_func()
+{
+	pthread_setname_np(pthread_self(), "Image_Watcher");
+
+	steady_clock::time_point next_poll = steady_clock::now() + seconds(1);
 	for ( ;; ) {
-		{
-			unique_lock<mutex> lock(threads_should_quit_mu);
-			threads_should_quit_modified.wait_for(lock, chrono::seconds(1), []() { return threads_should_quit; });
+		pollfd fds[2];
+		fds[0].fd = should_quit_fd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		fds[1].fd = inotify_fd;  // poll() ignores negative fds.
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		int timeout_ms = max<int>(duration_cast<milliseconds>(next_poll - steady_clock::now()).count(), 0);
+		int ret = poll(fds, 2, timeout_ms);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else {
+				perror("poll(inotify_fd)");
+				return;
+			}
 		}
 
-		if (threads_should_quit) {
+		if (fds[0].revents) break;  // should_quit_fd asserted.
+
+		if (fds[1].revents) {
+			handle_inotify_events();
+		}
+		if (steady_clock::now() >= next_poll) {
+			poll_files();
+			next_poll = steady_clock::now() + seconds(1);
+		}
+	}
+}
+
+void ImageInput::handle_inotify_events()
+{
+	alignas(inotify_event) char buf[4096];
+	for ( ;; ) {
+		int ret = read(inotify_fd, buf, sizeof(buf));
+		if (ret == -1) {
+			if (errno != EAGAIN && errno != EINTR) {
+				perror("read(inotify_fd)");
+			}
 			return;
 		}
 
+		for (int i = 0; i < ret; ) {
+			const inotify_event *event = reinterpret_cast<const inotify_event *>(&buf[i]);
+			i += sizeof(inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				// We don't know what we missed, so just reload everything.
+				fprintf(stderr, "WARNING: inotify overflowed, reloading all images.\n");
+				vector<string> pathnames;
+				{
+					lock_guard<mutex> lock(all_images_lock);
+					for (const auto &wd_and_files : watched_files) {
+						for (const auto &name_and_pathname : wd_and_files.second) {
+							pathnames.push_back(name_and_pathname.second);
+						}
+					}
+				}
+				for (const string &pathname : pathnames) {
+					queue_load(pathname);
+				}
+				continue;
+			}
+			if (event->len == 0) {
+				continue;
+			}
+
+			string pathname;
+			{
+				lock_guard<mutex> lock(all_images_lock);
+				auto files_it = watched_files.find(event->wd);
+				if (files_it == watched_files.end()) {
+					continue;
+				}
+				auto pathname_it = files_it->second.find(event->name);
+				if (pathname_it == files_it->second.end()) {
+					continue;  // Some other file in the same directory.
+				}
+				pathname = pathname_it->second;
+			}
+			queue_load(pathname);
+		}
+	}
+}
+
+void ImageInput::poll_files()
+{
+	map<string, timespec> files;
+	{
+		lock_guard<mutex> lock(all_images_lock);
+		files = polled_files;
+	}
+	for (const auto &pathname_and_modified : files) {
+		const string &pathname = pathname_and_modified.first;
+		const timespec &last_modified = pathname_and_modified.second;
+
+		struct stat buf;
 		if (stat(pathname.c_str(), &buf) != 0) {
 			fprintf(stderr, "%s: Couldn't check for new version, leaving the old in place.\n", pathname.c_str());
 			continue;
@@ -228,33 +369,104 @@ void ImageInput::update_thread_func(const std::string &filename, const std::stri
 			// Not changed.
 			continue;
 		}
+		{
+			lock_guard<mutex> lock(all_images_lock);
+			polled_files[pathname] = buf.st_mtim;
+		}
+		queue_load(pathname);
+	}
+}
+
+void ImageInput::queue_load(const string &pathname)
+{
+	lock_guard<mutex> lock(threads_should_quit_mu);
+	if (loads_in_progress.count(pathname)) {
+		reload_when_done.insert(pathname);
+	} else if (find(pending_loads.begin(), pending_loads.end(), pathname) == pending_loads.end()) {
+		pending_loads.push_back(pathname);
+		threads_should_quit_modified.notify_one();
+	}
+}
+
+void ImageInput::loader_thread_func(unsigned loader_num)
+{
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "Image_Loader_%u", loader_num);
+	pthread_setname_np(pthread_self(), thread_name);
+
+	for ( ;; ) {
+		string pathname;
+		{
+			unique_lock<mutex> lock(threads_should_quit_mu);
+			threads_should_quit_modified.wait(lock, []() { return threads_should_quit || !pending_loads.empty(); });
+			if (threads_should_quit) {
+				return;
+			}
+			pathname = move(pending_loads.front());
+			pending_loads.pop_front();
+			loads_in_progress.insert(pathname);
+		}
+
 		shared_ptr<const Image> image = load_image_raw(pathname);
 		if (image == nullptr) {
 			fprintf(stderr, "Couldn't load image, leaving the old in place.\n");
-			continue;
+		} else {
+			fprintf(stderr, "Loaded new version of %s from disk.\n", pathname.c_str());
+			lock_guard<mutex> lock(all_images_lock);
+			all_images[pathname] = image;
+		}
+
+		// Only now can anyone else start on this file; if it changed
+		// while we were loading, get the new version.
+		lock_guard<mutex> lock(threads_should_quit_mu);
+		loads_in_progress.erase(pathname);
+		if (reload_when_done.erase(pathname)) {
+			pending_loads.push_back(pathname);
+			threads_should_quit_modified.notify_one();
 		}
-		fprintf(stderr, "Loaded new version of %s from disk.\n", pathname.c_str());
-		lock_guard<mutex> lock(all_images_lock);
-		all_images[pathname] = image;
-		last_modified = image->last_modified;
 	}
 }
 
 void ImageInput::shutdown_updaters()
 {
+	{
+		lock_guard<mutex> lock(all_images_lock);
+		if (!updaters_started) {
+			return;
+		}
+	}
 	{
 		lock_guard<mutex> lock(threads_should_quit_mu);
 		threads_should_quit = true;
 		threads_should_quit_modified.notify_all();
 	}
-	for (auto &it : update_threads) {
-		it.second.join();
+	const uint64_t one = 1;
+	if (write(should_quit_fd, &one, sizeof(one)) != sizeof(one)) {
+		perror("write(should_quit_fd)");
+		exit(1);
+	}
+	watcher_thread.join();
+	for (thread &loader_thread : loader_threads) {
+		loader_thread.join();
+	}
+	if (inotify_fd != -1) {
+		close(inotify_fd);
 	}
+	close(should_quit_fd);
 }
 
 mutex ImageInput::all_images_lock;
 map<string, shared_ptr<const ImageInput::Image>> ImageInput::all_images;
-map<string, thread> ImageInput::update_threads;
+bool ImageInput::updaters_started = false;
+int ImageInput::inotify_fd = -1;
+map<int, map<string, string>> ImageInput::watched_files;
+map<string, timespec> ImageInput::polled_files;
+int ImageInput::should_quit_fd = -1;
+thread ImageInput::watcher_thread;
+vector<thread> ImageInput::loader_threads;
 mutex ImageInput::threads_should_quit_mu;
+deque<string> ImageInput::pending_loads;
+set<string> ImageInput::loads_in_progress;
+set<string> ImageInput::reload_when_done;
 bool ImageInput::threads_should_quit = false;
 condition_variable ImageInput::threads_should_quit_modified;
@@ -7,15 +7,21 @@
 #include <time.h>
 #include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <thread>
+#include <vector>
 
 // An output that takes its input from a static image, loaded with ffmpeg.
-// comes from a single 2D array with chunky pixels. The image is refreshed
-// from disk about every second.
+// comes from a single 2D array with chunky pixels. The image is reloaded
+// whenever it changes on disk; a single thread watches all images using
+// inotify (or, failing that, by checking every second), and hands them
+// to a small pool of loader threads. Each file is only loaded once,
+// no matter how many ImageInputs use it.
 class ImageInput : public movit::FlatInput {
 public:
 	ImageInput(const std::string &filename);
@@ -34,16 +40,42 @@ private:
 	std::string filename, pathname;
 	std::shared_ptr<const Image> current_image;
 
-	static std::shared_ptr<const Image> load_image(const std::string &filename, const std::string &pathname);
+	static std::shared_ptr<const Image> load_image(const std::string &pathname);
 	static std::shared_ptr<const Image> load_image_raw(const std::string &pathname);
-	static void update_thread_func(const std::string &filename, const std::string &pathname, const timespec &first_modified);
+	static void start_updaters();  // Under all_images_lock.
+	static void watch_file(const std::string &pathname, const timespec &first_modified);  // Under all_images_lock.
+	static void watcher_thread_func();
+	static void handle_inotify_events();
+	static void poll_files();
+	static void queue_load(const std::string &pathname);
+	static void loader_thread_func(unsigned loader_num);
+
 	static std::mutex all_images_lock;
 	static std::map<std::string, std::shared_ptr<const Image>> all_images;
-	static std::map<std::string, std::thread> update_threads;
 
+	// Watching for changes. All under all_images_lock.
+	static bool updaters_started;
+	static int inotify_fd;  // -1 if inotify is not available.
+	static std::map<int, std::map<std::string, std::string>> watched_files;  // Watch descriptor -> filename in directory -> pathname.
+	static std::map<std::string, timespec> polled_files;  // Files we couldn't watch with inotify, and when they were last modified.
+	static int should_quit_fd;  // An eventfd; wakes up the watcher thread when it's time to quit.
+	static std::thread watcher_thread;
+
+	// The loader pool.
+	static constexpr unsigned num_loader_threads = 2;
+	static std::vector<std::thread> loader_threads;
 	static std::mutex threads_should_quit_mu;
+	static std::deque<std::string> pending_loads;  // Under threads_should_quit_mu. Never has duplicates.
+
+	// Files a loader is working on right now. If one of them changes again
+	// in the meantime, it goes into <reload_when_done> instead of <pending_loads>,
+	// and is queued again when the current load is done, so that two loaders never
+	// work on the same file (and an older version could never win the race).
+	// Both under threads_should_quit_mu.
+	static std::set<std::string> loads_in_progress;
+	static std::set<std::string> reload_when_done;
 	static bool threads_should_quit;  // Under threads_should_quit_mu.
-	static std::condition_variable threads_should_quit_modified;  // Signals when threads_should_quit is set.
+	static std::condition_variable threads_should_quit_modified;  // Signals when threads_should_quit is set, or pending_loads gets something.
 };
 
 #endif // !defined(_IMAGE_INPUT_H)
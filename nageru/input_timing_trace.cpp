@@ -0,0 +1,99 @@
+#include "input_timing_trace.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+constexpr char trace_magic[] = "NgrTime1";
+constexpr size_t trace_magic_len = 8;
+
+}  // namespace
+
+InputTimingTraceWriter::InputTimingTraceWriter(const string &filename)
+	: filename(filename)
+{
+	fp = fopen(filename.c_str(), "wb");
+	if (fp == nullptr) {
+		perror(filename.c_str());
+		exit(1);
+	}
+	if (fwrite(trace_magic, trace_magic_len, 1, fp) != 1) {
+		perror("fwrite");
+		exit(1);
+	}
+}
+
+InputTimingTraceWriter::~InputTimingTraceWriter()
+{
+	if (fp != nullptr && fclose(fp) != 0) {
+		perror(filename.c_str());
+	}
+}
+
+void InputTimingTraceWriter::input_frame(unsigned card_index, steady_clock::time_point timestamp, int64_t frame_duration, size_t dropped_frames)
+{
+	write_event(InputTimingEvent::INPUT_FRAME, card_index, timestamp, frame_duration, dropped_frames);
+}
+
+void InputTimingTraceWriter::output_frame(int master_card_index, bool is_preroll, steady_clock::time_point timestamp, int64_t frame_duration, size_t dropped_frames)
+{
+	write_event(is_preroll ? InputTimingEvent::OUTPUT_FRAME_PREROLL : InputTimingEvent::OUTPUT_FRAME,
+		master_card_index == -1 ? InputTimingEvent::no_master_card : master_card_index,
+		timestamp, frame_duration, dropped_frames);
+}
+
+void InputTimingTraceWriter::write_event(InputTimingEvent::Type type, unsigned card_index, steady_clock::time_point timestamp, int64_t frame_duration, size_t dropped_frames)
+{
+	InputTimingEvent event;
+	event.type = type;
+	event.card_index = card_index;
+	event.dropped_frames = min<size_t>(dropped_frames, 65535);
+	event.frame_duration = frame_duration;
+	event.timestamp_ns = duration_cast<nanoseconds>(timestamp.time_since_epoch()).count();
+
+	// Buffered; we don't care if the last few events are lost on a crash.
+	lock_guard<mutex> lock(mu);
+	if (fp == nullptr) {
+		return;
+	}
+	if (fwrite(&event, sizeof(event), 1, fp) != 1) {
+		fprintf(stderr, "%s: %s; no more input timing will be recorded.\n", filename.c_str(), strerror(errno));
+		fclose(fp);  // Ignore errors; we already have one.
+		fp = nullptr;
+	}
+}
+
+bool read_input_timing_trace(const string &filename, vector<InputTimingEvent> *events)
+{
+	FILE *fp = fopen(filename.c_str(), "rb");
+	if (fp == nullptr) {
+		perror(filename.c_str());
+		return false;
+	}
+
+	char magic[trace_magic_len];
+	if (fread(magic, trace_magic_len, 1, fp) != 1 || memcmp(magic, trace_magic, trace_magic_len) != 0) {
+		fprintf(stderr, "%s: Not an input timing trace.\n", filename.c_str());
+		fclose(fp);
+		return false;
+	}
+
+	events->clear();
+	InputTimingEvent event;
+	while (fread(&event, sizeof(event), 1, fp) == 1) {
+		events->push_back(event);
+	}
+	if (ferror(fp)) {
+		fprintf(stderr, "%s: %s\n", filename.c_str(), strerror(errno));
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	return true;
+}
@@ -0,0 +1,62 @@
+#ifndef _INPUT_TIMING_TRACE_H
+#define _INPUT_TIMING_TRACE_H 1
+
+// A compact binary log of when frames arrived from each input card, and when
+// the mixer picked out frames for output, so that the queue length policy
+// (see queue_length_policy.h) can be evaluated and tuned offline on real
+// data, using replay_input_timing. Enabled with --record-input-timing.
+//
+// The file is simply a sequence of fixed-size InputTimingEvent records
+// in host byte order, after a short magic string.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct InputTimingEvent {
+	enum Type : uint8_t {
+		INPUT_FRAME = 0,  // A frame arrived on card <card_index>.
+		OUTPUT_FRAME = 1,  // The mixer picked out a frame from each card.
+		OUTPUT_FRAME_PREROLL = 2,  // Same, but the output card was still in preroll.
+	};
+	uint8_t type;
+
+	// For output frames, the master card, or no_master_card if clocked
+	// to the output card.
+	uint8_t card_index;
+	static constexpr uint8_t no_master_card = 0xff;
+
+	uint16_t dropped_frames;  // Clamped to 65535.
+	uint32_t frame_duration;  // In TIMEBASE units.
+	int64_t timestamp_ns;  // In steady_clock.
+};
+static_assert(sizeof(InputTimingEvent) == 16, "InputTimingEvent should be tightly packed");
+
+class InputTimingTraceWriter {
+public:
+	// Dies if the file cannot be created. Errors after that (e.g. a full disk)
+	// only stop the tracing, with a message, since a debugging aid should
+	// never take down a running production.
+	explicit InputTimingTraceWriter(const std::string &filename);
+	~InputTimingTraceWriter();
+
+	// Both are thread-safe.
+	void input_frame(unsigned card_index, std::chrono::steady_clock::time_point timestamp, int64_t frame_duration, size_t dropped_frames);
+	void output_frame(int master_card_index, bool is_preroll, std::chrono::steady_clock::time_point timestamp, int64_t frame_duration, size_t dropped_frames);
+
+private:
+	void write_event(InputTimingEvent::Type type, unsigned card_index, std::chrono::steady_clock::time_point timestamp, int64_t frame_duration, size_t dropped_frames);
+
+	const std::string filename;
+	std::mutex mu;
+	FILE *fp;  // Under <mu>. nullptr if tracing was stopped due to an error.
+};
+
+// Reads an entire trace into memory. Returns false (after printing an error)
+// if the file could not be read or is not an input timing trace.
+bool read_input_timing_trace(const std::string &filename, std::vector<InputTimingEvent> *events);
+
+#endif  // !defined(_INPUT_TIMING_TRACE_H)
@@ -88,6 +88,11 @@ void schedule_cut_signal(int ignored)
 	global_mixer->schedule_cut();
 }
 
+void frame_trace_signal(int ignored)
+{
+	global_mixer->schedule_frame_trace_dump();
+}
+
 void quit_signal(int ignored)
 {
 	global_mainwindow->close();
@@ -447,6 +452,11 @@ void MainWindow::mixer_created(Mixer *mixer)
 	act.sa_flags = SA_RESTART;
 	sigaction(SIGHUP, &act, nullptr);
 
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = frame_trace_signal;
+	act.sa_flags = SA_RESTART;
+	sigaction(SIGUSR2, &act, nullptr);
+
 	// Mostly for debugging. Don't override SIGINT, that's so evil if
 	// shutdown isn't instant.
 	memset(&act, 0, sizeof(act));
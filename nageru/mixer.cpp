@@ -14,6 +14,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <algorithm>
 #include <chrono>
 #include <condition_variable>
@@ -44,6 +45,7 @@
 #include "shared/disk_space_estimator.h"
 #include "ffmpeg_capture.h"
 #include "flags.h"
+#include "frame_stage_timing.h"
 #include "input_mapping.h"
 #include "shared/metrics.h"
 #include "mjpeg_encoder.h"
@@ -208,99 +210,6 @@ void upload_texture(GLuint tex, GLuint width, GLuint height, GLuint stride, bool
 
 }  // namespace
 
-void JitterHistory::register_metrics(const vector<pair<string, string>> &labels)
-{
-	global_metrics.add("input_underestimated_jitter_frames", labels, &metric_input_underestimated_jitter_frames);
-	global_metrics.add("input_estimated_max_jitter_seconds", labels, &metric_input_estimated_max_jitter_seconds, Metrics::TYPE_GAUGE);
-}
-
-void JitterHistory::unregister_metrics(const vector<pair<string, string>> &labels)
-{
-	global_metrics.remove("input_underestimated_jitter_frames", labels);
-	global_metrics.remove("input_estimated_max_jitter_seconds", labels);
-}
-
-void JitterHistory::frame_arrived(steady_clock::time_point now, int64_t frame_duration, size_t dropped_frames)
-{
-	if (expected_timestamp > steady_clock::time_point::min()) {
-		expected_timestamp += dropped_frames * nanoseconds(frame_duration * 1000000000 / TIMEBASE);
-		double jitter_seconds = fabs(duration<double>(expected_timestamp - now).count());
-		history.push_back(orders.insert(jitter_seconds));
-		if (jitter_seconds > estimate_max_jitter()) {
-			++metric_input_underestimated_jitter_frames;
-		}
-
-		metric_input_estimated_max_jitter_seconds = estimate_max_jitter();
-
-		if (history.size() > history_length) {
-			orders.erase(history.front());
-			history.pop_front();
-		}
-		assert(history.size() <= history_length);
-	}
-	expected_timestamp = now + nanoseconds(frame_duration * 1000000000 / TIMEBASE);
-}
-
-double JitterHistory::estimate_max_jitter() const
-{
-	if (orders.empty()) {
-		return 0.0;
-	}
-	size_t elem_idx = lrint((orders.size() - 1) * percentile);
-	if (percentile <= 0.5) {
-		return *next(orders.begin(), elem_idx) * multiplier;
-	} else {
-		return *prev(orders.end(), orders.size() - elem_idx) * multiplier;
-	}
-}
-
-void QueueLengthPolicy::register_metrics(const vector<pair<string, string>> &labels)
-{
-	global_metrics.add("input_queue_safe_length_frames", labels, &metric_input_queue_safe_length_frames, Metrics::TYPE_GAUGE);
-}
-
-void QueueLengthPolicy::unregister_metrics(const vector<pair<string, string>> &labels)
-{
-	global_metrics.remove("input_queue_safe_length_frames", labels);
-}
-
-void QueueLengthPolicy::update_policy(steady_clock::time_point now,
-                                      steady_clock::time_point expected_next_frame,
-                                      int64_t input_frame_duration,
-                                      int64_t master_frame_duration,
-                                      double max_input_card_jitter_seconds,
-                                      double max_master_card_jitter_seconds)
-{
-	double input_frame_duration_seconds = input_frame_duration / double(TIMEBASE);
-	double master_frame_duration_seconds = master_frame_duration / double(TIMEBASE);
-
-	// Figure out when we can expect the next frame for this card, assuming
-	// worst-case jitter (ie., the frame is maximally late).
-	double seconds_until_next_frame = max(duration<double>(expected_next_frame - now).count() + max_input_card_jitter_seconds, 0.0);
-
-	// How many times are the master card expected to tick in that time?
-	// We assume the master clock has worst-case jitter but not any rate
-	// discrepancy, ie., it ticks as early as possible every time, but not
-	// cumulatively.
-	double frames_needed = (seconds_until_next_frame + max_master_card_jitter_seconds) / master_frame_duration_seconds;
-
-	// As a special case, if the master card ticks faster than the input card,
-	// we expect the queue to drain by itself even without dropping. But if
-	// the difference is small (e.g. 60 Hz master and 59.94 input), it would
-	// go slowly enough that the effect wouldn't really be appreciable.
-	// We account for this by looking at the situation five frames ahead,
-	// assuming everything else is the same.
-	double frames_allowed;
-	if (master_frame_duration < input_frame_duration) {
-		frames_allowed = frames_needed + 5 * (input_frame_duration_seconds - master_frame_duration_seconds) / master_frame_duration_seconds;
-	} else {
-		frames_allowed = frames_needed;
-	}
-
-	safe_queue_length = max<int>(floor(frames_allowed), 0);
-	metric_input_queue_safe_length_frames = safe_queue_length;
-}
-
 Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 	: httpd(),
 	  num_cards(num_cards),
@@ -361,9 +270,13 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 	if (!global_flags.card_to_mjpeg_stream_export.empty()) {
 		mjpeg_encoder.reset(new MJPEGEncoder(&httpd, global_flags.va_display));
 	}
+	if (!global_flags.input_timing_trace_filename.empty()) {
+		input_timing_trace.reset(new InputTimingTraceWriter(global_flags.input_timing_trace_filename));
+	}
+	global_frame_stage_timing.init(global_flags.frame_trace_frames);
 
 	// Must be instantiated after VideoEncoder has initialized global_flags.use_zerocopy.
-	theme.reset(new Theme(global_flags.theme_filename, global_flags.theme_dirs, resource_pool.get(), num_cards));
+	theme.reset(new Theme(global_flags.theme_filename, global_flags.theme_dirs, resource_pool.get(), num_cards, global_flags.theme_lua_states));
 
 	// Must be instantiated after the theme, as the theme decides the number of FFmpeg inputs.
 	std::vector<FFmpegCapture *> video_inputs = theme->get_video_inputs();
@@ -375,6 +288,9 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 		snprintf(url, sizeof(url), "/channels/%d/color", channel_idx);
 		httpd.add_endpoint(url, bind(&Mixer::get_channel_color_http, this, unsigned(channel_idx)), HTTPD::ALLOW_ALL_ORIGINS);
 	}
+	if (global_frame_stage_timing.trace_enabled()) {
+		httpd.add_endpoint("/frame_trace", bind(&FrameStageTiming::get_chrome_trace_http, &global_frame_stage_timing), HTTPD::NO_CORS_POLICY);
+	}
 
 	// Start listening for clients only once VideoEncoder has written its header, if any.
 	httpd.start(global_flags.http_port);
@@ -500,6 +416,7 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 	}
 
 	output_jitter_history.register_metrics({{ "card", "output" }});
+	global_metrics.add("channel_renders_skipped", &metric_channel_renders_skipped);
 }
 
 Mixer::~Mixer()
@@ -594,6 +511,7 @@ void Mixer::configure_card(unsigned card_index, CaptureInterface *capture, CardT
 		global_metrics.remove("input_frame_rate_nom", labels);
 		global_metrics.remove("input_frame_rate_den", labels);
 		global_metrics.remove("input_sample_rate_hz", labels);
+		card->frame_allocator->unregister_metrics(labels);
 	}
 
 	// Register metrics.
@@ -635,6 +553,7 @@ void Mixer::configure_card(unsigned card_index, CaptureInterface *capture, CardT
 	global_metrics.add("input_frame_rate_nom", labels, &card->metric_input_frame_rate_nom, Metrics::TYPE_GAUGE);
 	global_metrics.add("input_frame_rate_den", labels, &card->metric_input_frame_rate_den, Metrics::TYPE_GAUGE);
 	global_metrics.add("input_sample_rate_hz", labels, &card->metric_input_sample_rate_hz, Metrics::TYPE_GAUGE);
+	card->frame_allocator->register_metrics(labels);
 	card->labels = labels;
 }
 
@@ -843,6 +762,9 @@ void Mixer::bm_frame(unsigned card_index, uint16_t timecode,
 			new_frame.received_timestamp = video_frame.received_timestamp;
 			card->new_frames.push_back(move(new_frame));
 			card->jitter_history.frame_arrived(video_frame.received_timestamp, frame_length, dropped_frames);
+			if (input_timing_trace != nullptr) {
+				input_timing_trace->input_frame(card_index, video_frame.received_timestamp, frame_length, dropped_frames);
+			}
 		}
 		card->new_frames_changed.notify_all();
 		return;
@@ -973,6 +895,9 @@ void Mixer::bm_frame(unsigned card_index, uint16_t timecode,
 			new_frame.cbcr_offset = cbcr_offset;
 			card->new_frames.push_back(move(new_frame));
 			card->jitter_history.frame_arrived(video_frame.received_timestamp, frame_length, dropped_frames);
+			if (input_timing_trace != nullptr) {
+				input_timing_trace->input_frame(card_index, video_frame.received_timestamp, frame_length, dropped_frames);
+			}
 			card->may_have_dropped_last_frame = false;
 		}
 		card->new_frames_changed.notify_all();
@@ -1038,7 +963,9 @@ void Mixer::thread_func()
 			assert(master_card_index < num_cards + num_video_inputs);
 		}
 
+		steady_clock::time_point card_wait_start = steady_clock::now();
 		OutputFrameInfo	output_frame_info = get_one_frame_from_each_card(master_card_index, master_card_is_output, new_frames, has_new_frame);
+		global_frame_stage_timing.record(FrameStageTiming::STAGE_CARD_WAIT, card_wait_start, steady_clock::now(), frame_num);
 		schedule_audio_resampling_tasks(output_frame_info.dropped_frames, output_frame_info.num_samples, output_frame_info.frame_duration, output_frame_info.is_preroll, output_frame_info.frame_timestamp);
 		stats_dropped_frames += output_frame_info.dropped_frames;
 
@@ -1066,6 +993,18 @@ void Mixer::thread_func()
 			continue;
 		}
 
+		// Only bother doing MJPEG encoding if there are any connected clients
+		// that want the stream. This also decides whether the exported cards
+		// need to take a CPU copy of their frames for the encoder in the first place.
+		const bool send_to_mjpeg = httpd.get_num_connected_multicam_clients() > 0;
+		for (const auto &card_and_stream : global_flags.card_to_mjpeg_stream_export) {
+			CaptureCard *card = &cards[card_and_stream.first];
+			if (card->frame_allocator != nullptr) {
+				card->frame_allocator->set_data_copy_enabled(send_to_mjpeg);
+			}
+		}
+
+		steady_clock::time_point upload_start = steady_clock::now();
 		for (unsigned card_index = 0; card_index < num_cards + num_video_inputs + num_html_inputs; ++card_index) {
 			if (!has_new_frame[card_index] || new_frames[card_index].frame->len == 0)
 				continue;
@@ -1081,9 +1020,8 @@ void Mixer::thread_func()
 				new_frame->upload_func = nullptr;
 			}
 
-			// Only bother doing MJPEG encoding if there are any connected clients
-			// that want the stream.
-			if (httpd.get_num_connected_multicam_clients() > 0) {
+			// Frames captured before the first client connected have no copy to encode from.
+			if (send_to_mjpeg && new_frame->frame->data_copy != nullptr) {
 				auto stream_it = global_flags.card_to_mjpeg_stream_export.find(card_index);
 				if (stream_it != global_flags.card_to_mjpeg_stream_export.end()) {
 					mjpeg_encoder->upload_frame(pts_int, stream_it->second, new_frame->frame, new_frame->video_format, new_frame->y_offset, new_frame->cbcr_offset);
@@ -1091,6 +1029,8 @@ void Mixer::thread_func()
 			}
 		}
 
+		global_frame_stage_timing.record(FrameStageTiming::STAGE_UPLOAD, upload_start, steady_clock::now(), frame_num);
+
 		int64_t frame_duration = output_frame_info.frame_duration;
 		render_one_frame(frame_duration);
 		{
@@ -1106,6 +1046,9 @@ void Mixer::thread_func()
 		if (should_cut.exchange(false)) {  // Test and clear.
 			video_encoder->do_cut(frame_num);
 		}
+		if (should_dump_frame_trace.exchange(false)) {  // Test and clear.
+			dump_frame_trace();
+		}
 
 #if 0
 		// Reset every 100 frames, so that local variations in frame times
@@ -1123,6 +1066,38 @@ void Mixer::thread_func()
 	resource_pool->clean_context();
 }
 
+void Mixer::dump_frame_trace()
+{
+	if (!global_frame_stage_timing.trace_enabled()) {
+		fprintf(stderr, "Got a request to dump the frame trace, but --frame-trace-frames is not set.\n");
+		return;
+	}
+
+	char filename[256];
+	time_t now = time(nullptr);
+	tm now_tm;
+	strftime(filename, sizeof(filename), "nageru-frame-trace-%Y%m%d-%H%M%S.json", localtime_r(&now, &now_tm));
+
+	// Don't hold up the mixer thread with disk I/O.
+	thread([filename{string(filename)}]{
+		pthread_setname_np(pthread_self(), "FrameTraceDump");
+		string json = global_frame_stage_timing.get_chrome_trace_json();
+		FILE *fp = fopen(filename.c_str(), "w");
+		if (fp == nullptr) {
+			perror(filename.c_str());
+			return;
+		}
+		if (fwrite(json.data(), json.size(), 1, fp) != 1) {
+			perror("fwrite");
+		}
+		if (fclose(fp) != 0) {
+			perror("fclose");
+			return;
+		}
+		fprintf(stderr, "Wrote frame timing trace to %s.\n", filename.c_str());
+	}).detach();
+}
+
 bool Mixer::input_card_is_master_clock(unsigned card_index, unsigned master_card_index) const
 {
 	if (output_card_index != -1) {
@@ -1135,36 +1110,10 @@ bool Mixer::input_card_is_master_clock(unsigned card_index, unsigned master_card
 
 void Mixer::trim_queue(CaptureCard *card, size_t safe_queue_length)
 {
-	// Count the number of frames in the queue, including any frames
-	// we dropped. It's hard to know exactly how we should deal with
-	// dropped (corrupted) input frames; they don't help our goal of
-	// avoiding starvation, but they still add to the problem of latency.
-	// Since dropped frames is going to mean a bump in the signal anyway,
-	// we err on the side of having more stable latency instead.
-	unsigned queue_length = 0;
-	for (const CaptureCard::NewFrame &frame : card->new_frames) {
-		queue_length += frame.dropped_frames + 1;
-	}
-
-	// If needed, drop frames until the queue is below the safe limit.
-	// We prefer to drop from the head, because all else being equal,
-	// we'd like more recent frames (less latency).
-	unsigned dropped_frames = 0;
-	while (queue_length > safe_queue_length) {
-		assert(!card->new_frames.empty());
-		assert(queue_length > card->new_frames.front().dropped_frames);
-		queue_length -= card->new_frames.front().dropped_frames;
-
-		if (queue_length <= safe_queue_length) {
-			// No need to drop anything.
-			break;
-		}
-
-		card->new_frames.pop_front();
+	unsigned queue_length;
+	unsigned dropped_frames = trim_queue_to_length(&card->new_frames, safe_queue_length, &queue_length);
+	if (dropped_frames > 0) {
 		card->new_frames_changed.notify_all();
-		--queue_length;
-		++dropped_frames;
-
 		if (queue_length == 0 && card->is_cef_capture) {
 			card->may_have_dropped_last_frame = true;
 		}
@@ -1256,6 +1205,10 @@ start:
 		output_frame_info.frame_duration = new_frames[master_card_index].length;
 	}
 
+	if (input_timing_trace != nullptr) {
+		input_timing_trace->output_frame(master_card_is_output ? -1 : master_card_index, output_frame_info.is_preroll,
+			output_frame_info.frame_timestamp, output_frame_info.frame_duration, output_frame_info.dropped_frames);
+	}
 	if (!output_frame_info.is_preroll) {
 		output_jitter_history.frame_arrived(output_frame_info.frame_timestamp, output_frame_info.frame_duration, output_frame_info.dropped_frames);
 	}
@@ -1388,7 +1341,9 @@ void Mixer::render_one_frame(int64_t duration)
 	}
 
 	// Get the main chain from the theme, and set its state immediately.
+	steady_clock::time_point get_chain_start = steady_clock::now();
 	Theme::Chain theme_main_chain = theme->get_chain(0, pts(), global_flags.width, global_flags.height, input_state);
+	global_frame_stage_timing.record(FrameStageTiming::STAGE_GET_CHAIN, get_chain_start, steady_clock::now(), frame_num);
 	EffectChain *chain = theme_main_chain.chain;
 	theme_main_chain.setup_chain();
 	//theme_main_chain.chain->enable_phase_timing(true);
@@ -1443,8 +1398,11 @@ void Mixer::render_one_frame(int64_t duration)
 	}
 
 	const int64_t av_delay = lrint(global_flags.audio_queue_length_ms * 0.001 * TIMEBASE);  // Corresponds to the delay in ResamplingQueue.
+	steady_clock::time_point begin_frame_start = steady_clock::now();
 	bool got_frame = video_encoder->begin_frame(pts_int + av_delay, duration, ycbcr_output_coefficients, theme_main_chain.input_frames, &y_tex, &cbcr_tex);
 	assert(got_frame);
+	steady_clock::time_point render_start = steady_clock::now();
+	global_frame_stage_timing.record(FrameStageTiming::STAGE_ENCODER_BEGIN_FRAME, begin_frame_start, render_start, frame_num);
 
 	GLuint fbo;
 	if (is_zerocopy) {
@@ -1462,11 +1420,14 @@ void Mixer::render_one_frame(int64_t duration)
 
 	resource_pool->release_fbo(fbo);
 
+	steady_clock::time_point subsample_start = steady_clock::now();
+	global_frame_stage_timing.record(FrameStageTiming::STAGE_RENDER, render_start, subsample_start, frame_num);
 	if (is_zerocopy) {
 		chroma_subsampler->subsample_chroma(cbcr_full_tex, global_flags.width, global_flags.height, cbcr_tex, cbcr_copy_tex);
 	} else {
 		chroma_subsampler->subsample_chroma(cbcr_full_tex, global_flags.width, global_flags.height, cbcr_tex);
 	}
+	global_frame_stage_timing.record(FrameStageTiming::STAGE_CHROMA_SUBSAMPLING, subsample_start, steady_clock::now(), frame_num);
 	if (output_card_index != -1) {
 		cards[output_card_index].output->send_frame(y_tex, cbcr_full_tex, ycbcr_output_coefficients, theme_main_chain.input_frames, pts_int, duration);
 	}
@@ -1484,7 +1445,9 @@ void Mixer::render_one_frame(int64_t duration)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
+	steady_clock::time_point end_frame_start = steady_clock::now();
 	RefCountedGLsync fence = video_encoder->end_frame();
+	global_frame_stage_timing.record(FrameStageTiming::STAGE_ENCODER_END_FRAME, end_frame_start, steady_clock::now(), frame_num);
 
 	// The live frame pieces the Y'CbCr texture copies back into RGB and displays them.
 	// It owns y_display_tex and cbcr_display_tex now (whichever textures they are).
@@ -1500,9 +1463,22 @@ void Mixer::render_one_frame(int64_t duration)
 	output_channel[OUTPUT_LIVE].output_frame(move(live_frame));
 
 	// Set up preview and any additional channels.
+	// These are rendered at the size they are displayed at, so that the theme
+	// doesn't need to spend time on pixels nobody will see, and channels
+	// that are not displayed anywhere are mostly not rendered at all.
 	for (int i = 1; i < theme->get_num_channels() + 2; ++i) {
+		if (!output_channel[i].should_render()) {
+			++metric_channel_renders_skipped;
+			continue;
+		}
 		DisplayFrame display_frame;
-		Theme::Chain chain = theme->get_chain(i, pts(), global_flags.width, global_flags.height, input_state);  // FIXME: dimensions
+		unsigned width = global_flags.width, height = global_flags.height;
+		if (!theme->get_channel_needs_full_resolution(i)) {
+			output_channel[i].get_render_size(global_flags.width, global_flags.height, &width, &height);
+		}
+		get_chain_start = steady_clock::now();
+		Theme::Chain chain = theme->get_chain(i, pts(), width, height, input_state);
+		global_frame_stage_timing.record(FrameStageTiming::STAGE_GET_CHAIN, get_chain_start, steady_clock::now(), frame_num);
 		display_frame.chain = move(chain.chain);
 		display_frame.setup_chain = move(chain.setup_chain);
 		display_frame.ready_fence = fence;
@@ -1742,6 +1718,85 @@ void Mixer::OutputChannel::remove_frame_ready_callback(void *key)
 	new_frame_ready_callbacks.erase(key);
 }
 
+void Mixer::OutputChannel::set_display_size(void *key, unsigned width, unsigned height)
+{
+	lock_guard<mutex> lock(frame_mutex);
+	display_sizes[key] = make_pair(width, height);
+}
+
+void Mixer::OutputChannel::remove_display_size(void *key)
+{
+	lock_guard<mutex> lock(frame_mutex);
+	display_sizes.erase(key);
+}
+
+void Mixer::OutputChannel::get_render_size(unsigned full_width, unsigned full_height, unsigned *width, unsigned *height)
+{
+	// Find the largest size anyone has asked for, by area. The aspect ratios
+	// may differ, so it only works if it covers all the others; taking the
+	// maximum of each dimension separately (e.g. 1280x720 from 1280x360 and 640x720)
+	// would give a size nobody asked for, in an aspect ratio nobody wants.
+	unsigned best_width = 0, best_height = 0;
+	bool covers_all = true;
+	{
+		lock_guard<mutex> lock(frame_mutex);
+		for (const auto &key_and_size : display_sizes) {
+			unsigned w = key_and_size.second.first, h = key_and_size.second.second;
+			if (uint64_t(w) * h > uint64_t(best_width) * best_height) {
+				best_width = w;
+				best_height = h;
+			}
+		}
+		for (const auto &key_and_size : display_sizes) {
+			if (key_and_size.second.first > best_width || key_and_size.second.second > best_height) {
+				covers_all = false;
+			}
+		}
+	}
+	if (!covers_all || best_width == 0 || best_height == 0 ||
+	    best_width >= full_width || best_height >= full_height) {
+		// Nobody has told us, no single size suits everybody,
+		// or someone wants it at full size anyway.
+		*width = full_width;
+		*height = full_height;
+	} else {
+		*width = best_width;
+		*height = best_height;
+	}
+}
+
+void Mixer::OutputChannel::add_consumer(void *key)
+{
+	lock_guard<mutex> lock(frame_mutex);
+	consumers.insert(key);
+}
+
+void Mixer::OutputChannel::remove_consumer(void *key)
+{
+	lock_guard<mutex> lock(frame_mutex);
+	consumers.erase(key);
+}
+
+bool Mixer::OutputChannel::should_render()
+{
+	lock_guard<mutex> lock(frame_mutex);
+	if (consumers.empty()) {
+		unsigned refresh_frames = global_flags.hidden_channel_refresh_frames;
+		if (refresh_frames == 0 || ++frames_since_render < refresh_frames) {
+			// Nobody is going to pick up the ready frame, so let go of
+			// the input frames it holds. (We keep the current one,
+			// so that there's something to show when a consumer comes back.)
+			if (has_ready_frame) {
+				parent->release_display_frame(&ready_frame);
+				has_ready_frame = false;
+			}
+			return false;
+		}
+	}
+	frames_since_render = 0;
+	return true;
+}
+
 void Mixer::OutputChannel::set_transition_names_updated_callback(Mixer::transition_names_updated_callback_t callback)
 {
 	transition_names_updated_callback = callback;
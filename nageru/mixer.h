@@ -14,13 +14,16 @@
 #include <chrono>
 #include <condition_variable>
 #include <cstddef>
+#include <deque>
 #include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <set>
 #include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include <movit/image_format.h>
@@ -31,7 +34,9 @@
 #include "shared/httpd.h"
 #include "input_state.h"
 #include "libusb.h"
+#include "input_timing_trace.h"
 #include "pbo_frame_allocator.h"
+#include "queue_length_policy.h"
 #include "ref_counted_frame.h"
 #include "shared/ref_counted_gl_sync.h"
 #include "theme.h"
@@ -55,105 +60,6 @@ class ResourcePool;
 class YCbCrInput;
 }  // namespace movit
 
-// A class to estimate the future jitter. Used in QueueLengthPolicy (see below).
-//
-// There are many ways to estimate jitter; I've tested a few ones (and also
-// some algorithms that don't explicitly model jitter) with different
-// parameters on some real-life data in experiments/queue_drop_policy.cpp.
-// This is one based on simple order statistics where I've added some margin in
-// the number of starvation events; I believe that about one every hour would
-// probably be acceptable, but this one typically goes lower than that, at the
-// cost of 2–3 ms extra latency. (If the queue is hard-limited to one frame, it's
-// possible to get ~10 ms further down, but this would mean framedrops every
-// second or so.) The general strategy is: Take the 99.9-percentile jitter over
-// last 5000 frames, multiply by two, and that's our worst-case jitter
-// estimate. The fact that we're not using the max value means that we could
-// actually even throw away very late frames immediately, which means we only
-// get one user-visible event instead of seeing something both when the frame
-// arrives late (duplicate frame) and then again when we drop.
-class JitterHistory {
-private:
-	static constexpr size_t history_length = 5000;
-	static constexpr double percentile = 0.999;
-	static constexpr double multiplier = 2.0;
-
-public:
-	void register_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
-	void unregister_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
-
-	void clear() {
-		history.clear();
-		orders.clear();
-	}
-	void frame_arrived(std::chrono::steady_clock::time_point now, int64_t frame_duration, size_t dropped_frames);
-	std::chrono::steady_clock::time_point get_expected_next_frame() const { return expected_timestamp; }
-	double estimate_max_jitter() const;
-
-private:
-	// A simple O(k) based algorithm for getting the k-th largest or
-	// smallest element from our window; we simply keep the multiset
-	// ordered (insertions and deletions are O(n) as always) and then
-	// iterate from one of the sides. If we had larger values of k,
-	// we could go for a more complicated setup with two sets or heaps
-	// (one increasing and one decreasing) that we keep balanced around
-	// the point, or it is possible to reimplement std::set with
-	// counts in each node. However, since k=5, we don't need this.
-	std::multiset<double> orders;
-	std::deque<std::multiset<double>::iterator> history;
-
-	std::chrono::steady_clock::time_point expected_timestamp = std::chrono::steady_clock::time_point::min();
-
-	// Metrics. There are no direct summaries for jitter, since we already have latency summaries.
-	std::atomic<int64_t> metric_input_underestimated_jitter_frames{0};
-	std::atomic<double> metric_input_estimated_max_jitter_seconds{0.0 / 0.0};
-};
-
-// For any card that's not the master (where we pick out the frames as they
-// come, as fast as we can process), there's going to be a queue. The question
-// is when we should drop frames from that queue (apart from the obvious
-// dropping if the 16-frame queue should become full), especially given that
-// the frame rate could be lower or higher than the master (either subtly or
-// dramatically). We have two (conflicting) demands:
-//
-//   1. We want to avoid starving the queue.
-//   2. We don't want to add more delay than is needed.
-//
-// Our general strategy is to drop as many frames as we can (helping for #2)
-// that we think is safe for #1 given jitter. To this end, we measure the
-// deviation from the expected arrival time for all cards, and use that for
-// continuous jitter estimation.
-//
-// We then drop everything from the queue that we're sure we won't need to
-// serve the output in the time before the next frame arrives. Typically,
-// this means the queue will contain 0 or 1 frames, although more is also
-// possible if the jitter is very high.
-class QueueLengthPolicy {
-public:
-	QueueLengthPolicy() {}
-	void reset(unsigned card_index) {
-		this->card_index = card_index;
-	}
-
-	void register_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
-	void unregister_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
-
-	// Call after picking out a frame, so 0 means starvation.
-	void update_policy(std::chrono::steady_clock::time_point now,
-	                   std::chrono::steady_clock::time_point expected_next_frame,
-			   int64_t input_frame_duration,
-	                   int64_t master_frame_duration,
-	                   double max_input_card_jitter_seconds,
-	                   double max_master_card_jitter_seconds);
-	unsigned get_safe_queue_length() const { return safe_queue_length; }
-
-private:
-	unsigned card_index;  // For debugging and metrics only.
-	unsigned safe_queue_length = 0;  // Can never go below zero.
-
-	// Metrics.
-	std::atomic<int64_t> metric_input_queue_safe_length_frames{1};
-};
-
 class Mixer {
 public:
 	// The surface format is used for offscreen destinations for OpenGL contexts we need.
@@ -211,6 +117,38 @@ public:
 		output_channel[output].remove_frame_ready_callback(key);
 	}
 
+	// Whoever displays frames from a channel should say how large they are
+	// going to render it, so that the preview channels can be rendered at
+	// that size instead of the full output resolution (unless the theme
+	// asks otherwise). If there are multiple consumers of the same channel,
+	// the largest size wins; if there are none, we use the full resolution.
+	// Does not affect the live channel.
+	void set_display_size(Output output, void *key, unsigned width, unsigned height)
+	{
+		output_channel[output].set_display_size(key, width, height);
+	}
+
+	void remove_display_size(Output output, void *key)
+	{
+		output_channel[output].remove_display_size(key);
+	}
+
+	// Anything that actually looks at the frames from a channel (a visible
+	// GLWidget, the analyzer, a white balance grab) should register itself
+	// as a consumer for as long as it does so. Channels other than live
+	// that have no consumers are not rendered at all, or only every
+	// --hidden-channel-refresh-frames frames, so that we don't spend
+	// time in the theme or hold on to input frames for nothing.
+	void add_consumer(Output output, void *key)
+	{
+		output_channel[output].add_consumer(key);
+	}
+
+	void remove_consumer(Output output, void *key)
+	{
+		output_channel[output].remove_consumer(key);
+	}
+
 	// TODO: Should this really be per-channel? Shouldn't it just be called for e.g. the live output?
 	typedef std::function<void(const std::vector<std::string> &)> transition_names_updated_callback_t;
 	void set_transition_names_updated_callback(Output output, transition_names_updated_callback_t callback)
@@ -297,6 +235,13 @@ public:
 		should_cut = true;
 	}
 
+	// Writes the frame timing trace (see frame_stage_timing.h) to a file,
+	// if --frame-trace-frames is set. Async-signal-safe.
+	void schedule_frame_trace_dump()
+	{
+		should_dump_frame_trace = true;
+	}
+
 	unsigned get_num_cards() const { return num_cards; }
 
 	std::string get_card_description(unsigned card_index) const {
@@ -450,6 +395,7 @@ private:
 	void release_display_frame(DisplayFrame *frame);
 	double pts() { return double(pts_int) / TIMEBASE; }
 	void trim_queue(CaptureCard *card, size_t safe_queue_length);
+	void dump_frame_trace();
 	std::pair<std::string, std::string> get_channels_json();
 	std::pair<std::string, std::string> get_channel_color_http(unsigned channel_idx);
 
@@ -567,6 +513,7 @@ private:
 		std::atomic<int64_t> metric_input_sample_rate_hz{-1};
 	};
 	JitterHistory output_jitter_history;
+	std::unique_ptr<InputTimingTraceWriter> input_timing_trace;  // nullptr if not enabled.
 	CaptureCard cards[MAX_VIDEO_CARDS];  // Protected by <card_mutex>.
 	YCbCrInterpretation ycbcr_interpretation[MAX_VIDEO_CARDS];  // Protected by <card_mutex>.
 	std::unique_ptr<AudioMixer> audio_mixer;  // Same as global_audio_mixer (see audio_mixer.h).
@@ -594,6 +541,18 @@ private:
 		bool get_display_frame(DisplayFrame *frame);
 		void add_frame_ready_callback(void *key, new_frame_ready_callback_t callback);
 		void remove_frame_ready_callback(void *key);
+		void set_display_size(void *key, unsigned width, unsigned height);
+		void remove_display_size(void *key);
+
+		// Returns the size the theme should render this channel at,
+		// given the full output size (see Mixer::set_display_size()).
+		void get_render_size(unsigned full_width, unsigned full_height, unsigned *width, unsigned *height);
+		void add_consumer(void *key);
+		void remove_consumer(void *key);
+
+		// Returns whether this channel should be rendered this frame,
+		// given its consumers. Called once per frame from the mixer thread.
+		bool should_render();
 		void set_transition_names_updated_callback(transition_names_updated_callback_t callback);
 		void set_name_updated_callback(name_updated_callback_t callback);
 		void set_color_updated_callback(color_updated_callback_t callback);
@@ -607,6 +566,9 @@ private:
 		DisplayFrame current_frame, ready_frame;  // protected by <frame_mutex>
 		bool has_current_frame = false, has_ready_frame = false;  // protected by <frame_mutex>
 		std::map<void *, new_frame_ready_callback_t> new_frame_ready_callbacks;  // protected by <frame_mutex>
+		std::map<void *, std::pair<unsigned, unsigned>> display_sizes;  // protected by <frame_mutex>
+		std::set<void *> consumers;  // protected by <frame_mutex>
+		unsigned frames_since_render = 0;  // Only accessed from the mixer thread.
 		transition_names_updated_callback_t transition_names_updated_callback;
 		name_updated_callback_t name_updated_callback;
 		color_updated_callback_t color_updated_callback;
@@ -615,11 +577,13 @@ private:
 		std::string last_name, last_color;
 	};
 	OutputChannel output_channel[NUM_OUTPUTS];
+	std::atomic<int64_t> metric_channel_renders_skipped{0};
 
 	std::thread mixer_thread;
 	std::thread audio_thread;
 	std::atomic<bool> should_quit{false};
 	std::atomic<bool> should_cut{false};
+	std::atomic<bool> should_dump_frame_trace{false};
 
 	std::unique_ptr<ALSAOutput> alsa;
 
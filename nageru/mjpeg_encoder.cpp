@@ -5,6 +5,7 @@
 #if __SSE2__
 #include <immintrin.h>
 #endif
+#include <algorithm>
 #include <list>
 
 extern "C" {
@@ -16,8 +17,11 @@ extern "C" {
 #include "flags.h"
 #include "shared/httpd.h"
 #include "shared/memcpy_interleaved.h"
+#include "shared/metrics.h"
+#include "shared/sliced_jpeg_encoder.h"
 #include "pbo_frame_allocator.h"
 #include "shared/timebase.h"
+#include "shared/vector_destination_manager.h"
 #include "va_display_with_cleanup.h"
 
 #include <va/va.h>
@@ -47,57 +51,32 @@ static const int jpeg_natural_order[DCTSIZE2] = {
 	53, 60, 61, 54, 47, 55, 62, 63,
 };
 
-struct VectorDestinationManager {
-	jpeg_destination_mgr pub;
-	std::vector<uint8_t> dest;
+namespace {
 
-	VectorDestinationManager()
-	{
-		pub.init_destination = init_destination_thunk;
-		pub.empty_output_buffer = empty_output_buffer_thunk;
-		pub.term_destination = term_destination_thunk;
-	}
-
-	static void init_destination_thunk(j_compress_ptr ptr)
-	{
-		((VectorDestinationManager *)(ptr->dest))->init_destination();
-	}
-
-	inline void init_destination()
-	{
-		make_room(0);
-	}
-
-	static boolean empty_output_buffer_thunk(j_compress_ptr ptr)
-	{
-		return ((VectorDestinationManager *)(ptr->dest))->empty_output_buffer();
-	}
+atomic<int64_t> metric_mjpeg_queued_frames{0};
+atomic<int64_t> metric_mjpeg_max_queued_frames{0};
+atomic<int64_t> metric_mjpeg_encoder_threads{0};
+atomic<int64_t> metric_mjpeg_encoded_frames{0};
+atomic<int64_t> metric_mjpeg_dropped_frames_queue_full{0};
+atomic<int64_t> metric_mjpeg_dropped_frames_overrun{0};
 
-	inline bool empty_output_buffer()
-	{
-		make_room(dest.size());  // Should ignore pub.free_in_buffer!
-		return true;
-	}
-
-	inline void make_room(size_t bytes_used)
-	{
-		dest.resize(bytes_used + 4096);
-		dest.resize(dest.capacity());
-		pub.next_output_byte = dest.data() + bytes_used;
-		pub.free_in_buffer = dest.size() - bytes_used;
-	}
+}  // namespace
 
-	static void term_destination_thunk(j_compress_ptr ptr)
-	{
-		((VectorDestinationManager *)(ptr->dest))->term_destination();
-	}
+MJPEGEncoder::ScratchBuffers::ScratchBuffers()
+{
+	posix_memalign((void **)&tmp_y, 4096, 4096 * 8);
+	posix_memalign((void **)&tmp_cbcr, 4096, 4096 * 8);
+	posix_memalign((void **)&tmp_cb, 4096, 4096 * 8);
+	posix_memalign((void **)&tmp_cr, 4096, 4096 * 8);
+}
 
-	inline void term_destination()
-	{
-		dest.resize(dest.size() - pub.free_in_buffer);
-	}
-};
-static_assert(std::is_standard_layout<VectorDestinationManager>::value, "");
+MJPEGEncoder::ScratchBuffers::~ScratchBuffers()
+{
+	free(tmp_y);
+	free(tmp_cbcr);
+	free(tmp_cb);
+	free(tmp_cr);
+}
 
 int MJPEGEncoder::write_packet2_thunk(void *opaque, uint8_t *buf, int buf_size, AVIODataMarkerType type, int64_t time)
 {
@@ -172,9 +151,33 @@ MJPEGEncoder::MJPEGEncoder(HTTPD *httpd, const string &va_display)
 		fprintf(stderr, "Could not initialize VA-API for MJPEG encoding: %s. JPEGs will be encoded in software if needed.\n", error.c_str());
 	}
 
-	encoder_thread = thread(&MJPEGEncoder::encoder_thread_func, this);
+	metric_mjpeg_max_queued_frames = global_flags.mjpeg_max_queued_frames;
+	global_metrics.add("mjpeg_queued_frames", &metric_mjpeg_queued_frames, Metrics::TYPE_GAUGE);
+	global_metrics.add("mjpeg_max_queued_frames", &metric_mjpeg_max_queued_frames, Metrics::TYPE_GAUGE);
+	global_metrics.add("mjpeg_encoder_threads", &metric_mjpeg_encoder_threads, Metrics::TYPE_GAUGE);
+	global_metrics.add("mjpeg_encoded_frames", &metric_mjpeg_encoded_frames);
+	global_metrics.add("mjpeg_dropped_frames", {{ "reason", "queue_full" }}, &metric_mjpeg_dropped_frames_queue_full);
+	global_metrics.add("mjpeg_dropped_frames", {{ "reason", "overrun" }}, &metric_mjpeg_dropped_frames_overrun);
+
 	if (va_dpy != nullptr) {
+		encoder_thread = thread(&MJPEGEncoder::encoder_thread_func, this);
 		va_receiver_thread = thread(&MJPEGEncoder::va_receiver_thread_func, this);
+		metric_mjpeg_encoder_threads = 1;
+	} else {
+		// Software encoding is slow enough that one thread can only keep up
+		// with a couple of 1080p cameras, so use several. There's no point in
+		// having more threads than there are cards, since there is rarely more
+		// than one frame per card in the queue at any given time.
+		unsigned num_threads = global_flags.mjpeg_encoder_threads;
+		if (num_threads == 0) {
+			num_threads = max<unsigned>(thread::hardware_concurrency(), 1);
+			num_threads = min<unsigned>(num_threads, max<size_t>(global_flags.card_to_mjpeg_stream_export.size(), 1));
+		}
+		sliced_encoder.reset(new SlicedJPEGEncoder(/*num_helper_threads=*/global_flags.mjpeg_encoder_slices - 1));
+		for (unsigned thread_idx = 0; thread_idx < num_threads; ++thread_idx) {
+			libjpeg_threads.emplace_back(&MJPEGEncoder::libjpeg_thread_func, this, thread_idx);
+		}
+		metric_mjpeg_encoder_threads = num_threads;
 	}
 
 	running = true;
@@ -193,9 +196,15 @@ void MJPEGEncoder::stop()
 	running = false;
 	should_quit = true;
 	any_frames_to_be_encoded.notify_all();
-	encoder_thread.join();
+	any_frames_encoding.notify_all();
 	if (va_dpy != nullptr) {
+		encoder_thread.join();
 		va_receiver_thread.join();
+	} else {
+		for (thread &t : libjpeg_threads) {
+			t.join();
+		}
+		libjpeg_threads.clear();
 	}
 }
 
@@ -263,22 +272,42 @@ void MJPEGEncoder::upload_frame(int64_t pts, unsigned card_index, RefCountedFram
 		return;
 	}
 
-	lock_guard<mutex> lock(mu);
-	if (frames_to_be_encoded.size() + frames_encoding.size() > 10) {
-		fprintf(stderr, "WARNING: MJPEG encoding doesn't keep up, discarding frame.\n");
-		return;
+	// If we can't keep up, drop the oldest frame that nobody has started
+	// encoding yet; it's the one that's least interesting for the clients
+	// by the time it would be done. (If everything is already being encoded
+	// by VA-API, there's nothing to drop but the new frame.)
+	QueuedFrame dropped_frame;
+	bool drop_oldest = false;
+	{
+		lock_guard<mutex> lock(mu);
+		if (frames_to_be_encoded.size() + frames_encoding.size() >= size_t(global_flags.mjpeg_max_queued_frames)) {
+			if (frames_to_be_encoded.empty()) {
+				fprintf(stderr, "WARNING: MJPEG encoding doesn't keep up, discarding frame.\n");
+				++metric_mjpeg_dropped_frames_overrun;
+				return;
+			}
+			dropped_frame = move(frames_to_be_encoded.front());
+			frames_to_be_encoded.pop_front();
+			drop_oldest = true;
+		}
+		frames_to_be_encoded.push_back(QueuedFrame{ next_seqnum++, pts, card_index, frame, video_format, y_offset, cbcr_offset });
+		metric_mjpeg_queued_frames = frames_to_be_encoded.size();
+		any_frames_to_be_encoded.notify_all();
+	}
+
+	if (drop_oldest) {
+		fprintf(stderr, "WARNING: MJPEG encoding doesn't keep up, discarding oldest queued frame.\n");
+		++metric_mjpeg_dropped_frames_queue_full;
+
+		// Let the writer skip over its slot.
+		finish_frame(dropped_frame.seqnum, dropped_frame.pts, dropped_frame.card_index, {});
 	}
-	frames_to_be_encoded.push(QueuedFrame{ pts, card_index, frame, video_format, y_offset, cbcr_offset });
-	any_frames_to_be_encoded.notify_all();
 }
 
 void MJPEGEncoder::encoder_thread_func()
 {
 	pthread_setname_np(pthread_self(), "MJPEG_Encode");
-	posix_memalign((void **)&tmp_y, 4096, 4096 * 8);
-	posix_memalign((void **)&tmp_cbcr, 4096, 4096 * 8);
-	posix_memalign((void **)&tmp_cb, 4096, 4096 * 8);
-	posix_memalign((void **)&tmp_cr, 4096, 4096 * 8);
+	va_scratch.reset(new ScratchBuffers);
 
 	for (;;) {
 		QueuedFrame qf;
@@ -287,23 +316,56 @@ void MJPEGEncoder::encoder_thread_func()
 			any_frames_to_be_encoded.wait(lock, [this] { return !frames_to_be_encoded.empty() || should_quit; });
 			if (should_quit) break;
 			qf = move(frames_to_be_encoded.front());
-			frames_to_be_encoded.pop();
+			frames_to_be_encoded.pop_front();
+			metric_mjpeg_queued_frames = frames_to_be_encoded.size();
 		}
 
-		if (va_dpy != nullptr) {
-			// Will call back in the receiver thread.
-			encode_jpeg_va(move(qf));
-		} else {
-			// Encode synchronously, in the same thread.
-			vector<uint8_t> jpeg = encode_jpeg_libjpeg(qf);
-			write_mjpeg_packet(qf.pts, qf.card_index, jpeg);
+		// Will call back in the receiver thread.
+		encode_jpeg_va(move(qf));
+	}
+
+	va_scratch.reset();
+}
+
+void MJPEGEncoder::libjpeg_thread_func(unsigned thread_idx)
+{
+	char thread_name[16];
+	snprintf(thread_name, sizeof(thread_name), "MJPEG_Enc_%u", thread_idx);
+	pthread_setname_np(pthread_self(), thread_name);
+
+	vector<unique_ptr<ScratchBuffers>> scratch;
+	for (;;) {
+		QueuedFrame qf;
+		{
+			unique_lock<mutex> lock(mu);
+			any_frames_to_be_encoded.wait(lock, [this] { return !frames_to_be_encoded.empty() || should_quit; });
+			if (should_quit) break;
+			qf = move(frames_to_be_encoded.front());
+			frames_to_be_encoded.pop_front();
+			metric_mjpeg_queued_frames = frames_to_be_encoded.size();
 		}
+
+		vector<uint8_t> jpeg = encode_jpeg_libjpeg(qf, &scratch);
+		finish_frame(qf.seqnum, qf.pts, qf.card_index, move(jpeg));
 	}
+}
 
-	free(tmp_y);
-	free(tmp_cbcr);
-	free(tmp_cb);
-	free(tmp_cr);
+void MJPEGEncoder::finish_frame(uint64_t seqnum, int64_t pts, unsigned card_index, vector<uint8_t> jpeg)
+{
+	lock_guard<mutex> lock(reorder_mu);
+	finished_frames.emplace(seqnum, EncodedFrame{ pts, card_index, move(jpeg) });
+
+	// Write out everything we can without leaving a gap; the mux wants
+	// increasing timestamps, and the clients want frames in order.
+	while (!finished_frames.empty() && finished_frames.begin()->first == next_seqnum_to_write) {
+		const EncodedFrame &ef = finished_frames.begin()->second;
+		if (!ef.jpeg.empty()) {
+			write_mjpeg_packet(ef.pts, ef.card_index, ef.jpeg);
+			++metric_mjpeg_encoded_frames;
+		}
+		finished_frames.erase(finished_frames.begin());
+		++next_seqnum_to_write;
+	}
 }
 
 void MJPEGEncoder::write_mjpeg_packet(int64_t pts, unsigned card_index, const vector<uint8_t> &jpeg)
@@ -428,7 +490,7 @@ void MJPEGEncoder::init_jpeg_422(unsigned width, unsigned height, VectorDestinat
 	jpeg_write_marker(cinfo, JPEG_COM, (const JOCTET *)"CS=ITU601", strlen("CS=ITU601"));
 }
 
-vector<uint8_t> MJPEGEncoder::get_jpeg_header(unsigned width, unsigned height, jpeg_compress_struct *cinfo)
+vector<uint8_t> MJPEGEncoder::get_jpeg_header(unsigned width, unsigned height, jpeg_compress_struct *cinfo, ScratchBuffers *scratch)
 {
 	VectorDestinationManager dest;
 	init_jpeg_422(width, height, &dest, cinfo);
@@ -437,13 +499,13 @@ vector<uint8_t> MJPEGEncoder::get_jpeg_header(unsigned width, unsigned height, j
 	// making libjpeg outputting all of its headers.
 	JSAMPROW yptr[8], cbptr[8], crptr[8];
 	JSAMPARRAY data[3] = { yptr, cbptr, crptr };
-	memset(tmp_y, 0, 4096);
-	memset(tmp_cb, 0, 4096);
-	memset(tmp_cr, 0, 4096);
+	memset(scratch->tmp_y, 0, 4096);
+	memset(scratch->tmp_cb, 0, 4096);
+	memset(scratch->tmp_cr, 0, 4096);
 	for (unsigned yy = 0; yy < 8; ++yy) {
-		yptr[yy] = tmp_y;
-		cbptr[yy] = tmp_cb;
-		crptr[yy] = tmp_cr;
+		yptr[yy] = scratch->tmp_y;
+		cbptr[yy] = scratch->tmp_cb;
+		crptr[yy] = scratch->tmp_cr;
 	}
 	for (unsigned y = 0; y < height; y += 8) {
 		jpeg_write_raw_data(cinfo, data, /*num_lines=*/8);
@@ -473,7 +535,7 @@ MJPEGEncoder::VAData MJPEGEncoder::get_va_data_for_resolution(unsigned width, un
 	// Use libjpeg to generate a header and set sane defaults for e.g.
 	// quantization tables. Then do the actual encode with VA-API.
 	jpeg_compress_struct cinfo;
-	vector<uint8_t> jpeg_header = get_jpeg_header(width, height, &cinfo);
+	vector<uint8_t> jpeg_header = get_jpeg_header(width, height, &cinfo, va_scratch.get());
 
 	// Picture parameters.
 	VAEncPictureParameterBufferJPEG pic_param;
@@ -691,37 +753,34 @@ void MJPEGEncoder::va_receiver_thread_func()
 		va_status = vaUnmapBuffer(va_dpy->va_dpy, qf.resources.data_buffer);
 		CHECK_VASTATUS(va_status, "vaUnmapBuffer");
 
-		write_mjpeg_packet(qf.pts, qf.card_index, jpeg);
+		finish_frame(qf.seqnum, qf.pts, qf.card_index, move(jpeg));
 	}
 }
 
-vector<uint8_t> MJPEGEncoder::encode_jpeg_libjpeg(const QueuedFrame &qf)
+vector<uint8_t> MJPEGEncoder::encode_jpeg_libjpeg(const QueuedFrame &qf, vector<unique_ptr<ScratchBuffers>> *scratch)
 {
 	unsigned width = qf.video_format.width;
 	unsigned height = qf.video_format.height;
 
-	VectorDestinationManager dest;
-	jpeg_compress_struct cinfo;
-	init_jpeg_422(width, height, &dest, &cinfo);
+	unsigned num_slices = SlicedJPEGEncoder::actual_num_slices(width, height, global_flags.mjpeg_encoder_slices);
+	while (scratch->size() < num_slices) {
+		scratch->emplace_back(new ScratchBuffers);
+	}
 
 	size_t field_start_line = qf.video_format.extra_lines_top;  // No interlacing support.
 	size_t field_start = qf.cbcr_offset * 2 + qf.video_format.width * field_start_line * 2;
 
-	JSAMPROW yptr[8], cbptr[8], crptr[8];
-	JSAMPARRAY data[3] = { yptr, cbptr, crptr };
-	for (unsigned y = 0; y < qf.video_format.height; y += 8) {
-	        const uint8_t *src = qf.frame->data_copy + field_start + y * qf.video_format.width * 2;
-
-	        memcpy_interleaved(tmp_y, tmp_cbcr, src, qf.video_format.width * 8 * 2);
-	        memcpy_interleaved(tmp_cb, tmp_cr, tmp_cbcr, qf.video_format.width * 8);
-	        for (unsigned yy = 0; yy < 8; ++yy) {
-	                yptr[yy] = tmp_y + yy * width;
-	                cbptr[yy] = tmp_cb + yy * width / 2;
-	                crptr[yy] = tmp_cr + yy * width / 2;
-		}
-	        jpeg_write_raw_data(&cinfo, data, /*num_lines=*/8);
-	}
-	jpeg_finish_compress(&cinfo);
-
-	return dest.dest;
+	return sliced_encoder->encode(width, height, global_flags.mjpeg_encoder_slices, quality,
+		[&](unsigned y, unsigned slice_idx, JSAMPROW *yptr, JSAMPROW *cbptr, JSAMPROW *crptr) {
+			ScratchBuffers *s = (*scratch)[slice_idx].get();
+			const uint8_t *src = qf.frame->data_copy + field_start + y * qf.video_format.width * 2;
+
+			memcpy_interleaved(s->tmp_y, s->tmp_cbcr, src, qf.video_format.width * 8 * 2);
+			memcpy_interleaved(s->tmp_cb, s->tmp_cr, s->tmp_cbcr, qf.video_format.width * 8);
+			for (unsigned yy = 0; yy < 8; ++yy) {
+				yptr[yy] = s->tmp_y + yy * width;
+				cbptr[yy] = s->tmp_cb + yy * width / 2;
+				crptr[yy] = s->tmp_cr + yy * width / 2;
+			}
+		});
 }
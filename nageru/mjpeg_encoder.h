@@ -13,16 +13,21 @@ extern "C" {
 #include <atomic>
 #include <bmusb/bmusb.h>
 #include <condition_variable>
+#include <deque>
 #include <list>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <stdint.h>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <va/va.h>
 
 class HTTPD;
+class SlicedJPEGEncoder;
 struct jpeg_compress_struct;
 struct VADisplayWithCleanup;
 struct VectorDestinationManager;
@@ -88,6 +93,7 @@ private:
 	};
 
 	struct QueuedFrame {
+		uint64_t seqnum;  // Assigned in upload_frame(); packets are written out in this order.
 		int64_t pts;
 		unsigned card_index;
 		RefCountedFrame frame;
@@ -99,26 +105,57 @@ private:
 		ReleaseVAResources resource_releaser;
 	};
 
+	// Scratch buffers for deinterleaving one row of 8x8 blocks before
+	// giving it to libjpeg. Each encoding thread has its own set,
+	// with one for each slice.
+	struct ScratchBuffers {
+		ScratchBuffers();
+		~ScratchBuffers();
+		ScratchBuffers(const ScratchBuffers &) = delete;
+		ScratchBuffers &operator= (const ScratchBuffers &) = delete;
+
+		uint8_t *tmp_y, *tmp_cbcr, *tmp_cb, *tmp_cr;
+	};
+
+	// A finished (or dropped) frame waiting for its turn to be muxed.
+	struct EncodedFrame {
+		int64_t pts;
+		unsigned card_index;
+		std::vector<uint8_t> jpeg;  // Empty if the frame was dropped.
+	};
+
 	void encoder_thread_func();
+	void libjpeg_thread_func(unsigned thread_idx);
 	void va_receiver_thread_func();
 	void encode_jpeg_va(QueuedFrame &&qf);
-	std::vector<uint8_t> encode_jpeg_libjpeg(const QueuedFrame &qf);
+	std::vector<uint8_t> encode_jpeg_libjpeg(const QueuedFrame &qf, std::vector<std::unique_ptr<ScratchBuffers>> *scratch);
+	void finish_frame(uint64_t seqnum, int64_t pts, unsigned card_index, std::vector<uint8_t> jpeg);
 	void write_mjpeg_packet(int64_t pts, unsigned card_index, const std::vector<uint8_t> &jpeg);
 	void init_jpeg_422(unsigned width, unsigned height, VectorDestinationManager *dest, jpeg_compress_struct *cinfo);
-	std::vector<uint8_t> get_jpeg_header(unsigned width, unsigned height, jpeg_compress_struct *cinfo);
+	std::vector<uint8_t> get_jpeg_header(unsigned width, unsigned height, jpeg_compress_struct *cinfo, ScratchBuffers *scratch);
 
 	static int write_packet2_thunk(void *opaque, uint8_t *buf, int buf_size, AVIODataMarkerType type, int64_t time);
 	int write_packet2(uint8_t *buf, int buf_size, AVIODataMarkerType type, int64_t time);
 
-	std::thread encoder_thread, va_receiver_thread;
+	std::thread encoder_thread, va_receiver_thread;  // VA-API only.
+	std::vector<std::thread> libjpeg_threads;  // Software encoding only.
+	std::unique_ptr<SlicedJPEGEncoder> sliced_encoder;  // Software encoding only. Shared between libjpeg_threads.
 
 	std::mutex mu;
-	std::queue<QueuedFrame> frames_to_be_encoded;  // Under mu.
+	std::deque<QueuedFrame> frames_to_be_encoded;  // Under mu.
 	std::condition_variable any_frames_to_be_encoded;  // Governs changes in both frames_to_be_encoded and frames_under_encoding
+	uint64_t next_seqnum = 0;  // Under mu.
 
 	std::queue<QueuedFrame> frames_encoding;  // Under mu. Used for VA-API only.
 	std::condition_variable any_frames_encoding;
 
+	// Frames are finished out-of-order when encoding on multiple threads,
+	// so they are held here until all earlier frames are done. Protects
+	// the mux, too.
+	std::mutex reorder_mu;
+	std::map<uint64_t, EncodedFrame> finished_frames;  // Under reorder_mu.
+	uint64_t next_seqnum_to_write = 0;  // Under reorder_mu.
+
 	AVFormatContextWithCloser avctx;
 	HTTPD *httpd;
 	std::string mux_header;
@@ -145,7 +182,7 @@ private:
 
 	static std::unique_ptr<VADisplayWithCleanup> try_open_va(const std::string &va_display, std::string *error, VAConfigID *config_id);
 
-	uint8_t *tmp_y, *tmp_cbcr, *tmp_cb, *tmp_cr;  // Private to the encoder thread. Used by the libjpeg backend only.
+	std::unique_ptr<ScratchBuffers> va_scratch;  // Private to the encoder thread. Used for making the JPEG headers only.
 };
 
 #endif  // !defined(_MJPEG_ENCODER_H)
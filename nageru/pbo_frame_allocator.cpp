@@ -8,6 +8,7 @@
 #include <cstddef>
 
 #include "flags.h"
+#include "shared/metrics.h"
 #include "v210_converter.h"
 
 using namespace std;
@@ -52,8 +53,9 @@ void PBOFrameAllocator::init_frame(size_t frame_idx, size_t frame_size, GLuint w
 	Frame frame;
 	frame.data = (uint8_t *)glMapBufferRange(buffer, 0, frame_size, permissions | map_bits | GL_MAP_PERSISTENT_BIT);
 	frame.data2 = frame.data + frame_size / 2;
-	frame.data_copy = new uint8_t[frame_size];
+	frame.data_copy = nullptr;  // See update_data_copy().
 	check_error();
+	metric_pbo_bytes += frame_size;
 	frame.size = frame_size;
 	frame.userdata = &userdata[frame_idx];
 	userdata[frame_idx].pbo = pbo;
@@ -213,9 +215,25 @@ PBOFrameAllocator::~PBOFrameAllocator()
 	}
 }
 
+void PBOFrameAllocator::register_metrics(const vector<pair<string, string>> &labels)
+{
+	global_metrics.add("input_frame_allocator_pbo_bytes", labels, &metric_pbo_bytes, Metrics::TYPE_GAUGE);
+	global_metrics.add("input_frame_allocator_data_copy_bytes", labels, &metric_data_copy_bytes, Metrics::TYPE_GAUGE);
+}
+
+void PBOFrameAllocator::unregister_metrics(const vector<pair<string, string>> &labels)
+{
+	global_metrics.remove("input_frame_allocator_pbo_bytes", labels);
+	global_metrics.remove("input_frame_allocator_data_copy_bytes", labels);
+}
+
 void PBOFrameAllocator::destroy_frame(Frame *frame)
 {
-	delete[] frame->data_copy;
+	if (frame->data_copy != nullptr) {
+		delete[] frame->data_copy;
+		metric_data_copy_bytes -= frame->size;
+	}
+	metric_pbo_bytes -= frame->size;
 
 	GLuint pbo = ((Userdata *)frame->userdata)->pbo;
 	glBindBuffer(buffer, pbo);
@@ -268,12 +286,27 @@ bmusb::FrameAllocator::Frame PBOFrameAllocator::alloc_frame()
 		//fprintf(stderr, "freelist has %d allocated\n", ++sumsum);
 		vf = freelist.front();
 		freelist.pop();  // Meh.
+		update_data_copy(&vf);
 	}
 	vf.len = 0;
 	vf.overflow = 0;
 	return vf;
 }
 
+void PBOFrameAllocator::update_data_copy(Frame *frame)
+{
+	if (data_copy_enabled) {
+		if (frame->data_copy == nullptr) {
+			frame->data_copy = new uint8_t[frame->size];
+			metric_data_copy_bytes += frame->size;
+		}
+	} else if (frame->data_copy != nullptr) {
+		delete[] frame->data_copy;
+		frame->data_copy = nullptr;
+		metric_data_copy_bytes -= frame->size;
+	}
+}
+
 void PBOFrameAllocator::release_frame(Frame frame)
 {
 	if (frame.overflow > 0) {
@@ -309,6 +342,11 @@ void PBOFrameAllocator::release_frame(Frame frame)
 	}
 #endif
 
+	if (!data_copy_enabled) {
+		// Don't keep the copy around while nobody wants it.
+		update_data_copy(&frame);
+	}
+
 	lock_guard<mutex> lock(freelist_mutex);
 	freelist.push(frame);
 	//--sumsum;
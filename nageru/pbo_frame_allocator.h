@@ -4,9 +4,14 @@
 #include <epoxy/gl.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <movit/ycbcr.h>
 
@@ -30,6 +35,16 @@ public:
 	Frame alloc_frame() override;
 	void release_frame(Frame frame) override;
 
+	// Whether frames handed out from now on should come with a CPU copy
+	// (data_copy) that the capture fills in alongside the PBO. Only MJPEG
+	// export needs it, so it is off by default. The copies are allocated
+	// as needed, and freed again as frames come back after it is turned off.
+	// Thread-safe.
+	void set_data_copy_enabled(bool enabled) { data_copy_enabled = enabled; }
+
+	void register_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
+	void unregister_metrics(const std::vector<std::pair<std::string, std::string>> &labels);
+
 	struct Userdata {
 		GLuint pbo;
 
@@ -60,11 +75,18 @@ private:
 	void init_frame(size_t frame_idx, size_t frame_size, GLuint width, GLuint height, GLenum permissions, GLenum map_bits);
 	void destroy_frame(Frame *frame);
 
+	// Allocates or frees frame->data_copy according to data_copy_enabled.
+	void update_data_copy(Frame *frame);
+
 	bmusb::PixelFormat pixel_format;
+	std::atomic<bool> data_copy_enabled{false};
 	std::mutex freelist_mutex;
 	std::queue<Frame> freelist;
 	GLenum buffer;
 	std::unique_ptr<Userdata[]> userdata;
+
+	std::atomic<int64_t> metric_pbo_bytes{0};
+	std::atomic<int64_t> metric_data_copy_bytes{0};
 };
 
 #endif  // !defined(_PBO_FRAME_ALLOCATOR)
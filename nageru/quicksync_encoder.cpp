@@ -50,6 +50,7 @@ extern "C" {
 #include "shared/disk_space_estimator.h"
 #include "shared/ffmpeg_raii.h"
 #include "flags.h"
+#include "frame_stage_timing.h"
 #include "shared/mux.h"
 #include "print_latency.h"
 #include "quicksync_encoder_impl.h"
@@ -1959,6 +1960,7 @@ void memcpy_with_pitch(uint8_t *dst, const uint8_t *src, size_t src_width, size_
 void QuickSyncEncoderImpl::pass_frame(QuickSyncEncoderImpl::PendingFrame frame, int display_frame_num, int64_t pts, int64_t duration)
 {
 	// Wait for the GPU to be done with the frame.
+	steady_clock::time_point fence_wait_start = steady_clock::now();
 	GLenum sync_status;
 	do {
 		sync_status = glClientWaitSync(frame.fence.get(), 0, 0);
@@ -1969,6 +1971,7 @@ void QuickSyncEncoderImpl::pass_frame(QuickSyncEncoderImpl::PendingFrame frame,
 		}
 	} while (sync_status == GL_TIMEOUT_EXPIRED);
 	assert(sync_status != GL_WAIT_FAILED);
+	global_frame_stage_timing.record(FrameStageTiming::STAGE_FENCE_WAIT, fence_wait_start, steady_clock::now(), display_frame_num);
 
 	ReceivedTimestamps received_ts = find_received_timestamp(frame.input_frames);
 	static int frameno = 0;
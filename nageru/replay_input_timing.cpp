@@ -0,0 +1,191 @@
+// Replays an input timing trace (recorded with --record-input-timing) through
+// the same JitterHistory/QueueLengthPolicy/queue trimming code that the mixer
+// uses, and reports what happened to each card: how many frames were dropped
+// to keep latency down, how many times we had no frame (underruns, shown as
+// duplicated frames), and how much latency the queue added. This makes it
+// possible to evaluate e.g. --max-input-queue-frames, or changes to the policy
+// itself, on real data without going live.
+//
+// Usage: replay_input_timing [--max-input-queue-frames=FRAMES] TRACE...
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "defs.h"
+#include "input_timing_trace.h"
+#include "queue_length_policy.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+struct ReplayFrame {
+	steady_clock::time_point received;
+	unsigned dropped_frames;
+};
+
+struct ReplayCard {
+	bool seen = false;
+	deque<ReplayFrame> frames;
+	JitterHistory jitter_history;
+	QueueLengthPolicy queue_length_policy;
+
+	// Statistics.
+	size_t received_frames = 0, output_frames = 0;
+	size_t underruns = 0, dropped_frames_jitter = 0;
+	vector<double> latency_ms;  // For each output frame, the time it spent in the queue.
+};
+
+double percentile(const vector<double> &sorted, double p)
+{
+	if (sorted.empty()) {
+		return 0.0 / 0.0;
+	}
+	return sorted[lrint((sorted.size() - 1) * p)];
+}
+
+void replay(const vector<InputTimingEvent> &events, unsigned max_input_queue_frames)
+{
+	ReplayCard cards[MAX_VIDEO_CARDS];
+	JitterHistory output_jitter_history;
+	for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+		cards[card_index].queue_length_policy.reset(card_index);
+	}
+
+	for (const InputTimingEvent &event : events) {
+		steady_clock::time_point timestamp{nanoseconds(event.timestamp_ns)};
+		if (event.type == InputTimingEvent::INPUT_FRAME) {
+			if (event.card_index >= MAX_VIDEO_CARDS) {
+				continue;
+			}
+			ReplayCard *card = &cards[event.card_index];
+			card->seen = true;
+			card->frames.push_back(ReplayFrame{ timestamp, event.dropped_frames });
+			card->jitter_history.frame_arrived(timestamp, event.frame_duration, event.dropped_frames);
+			++card->received_frames;
+			continue;
+		}
+
+		// The equivalent of Mixer::get_one_frame_from_each_card().
+		bool is_preroll = (event.type == InputTimingEvent::OUTPUT_FRAME_PREROLL);
+		bool has_new_frame[MAX_VIDEO_CARDS] = { false };
+		for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+			ReplayCard *card = &cards[card_index];
+			if (!card->seen) {
+				continue;
+			}
+			if (card->frames.empty()) {
+				++card->underruns;
+			} else {
+				card->latency_ms.push_back(duration<double, milli>(timestamp - card->frames.front().received).count());
+				card->frames.pop_front();
+				has_new_frame[card_index] = true;
+				++card->output_frames;
+			}
+		}
+
+		if (is_preroll) {
+			continue;
+		}
+		output_jitter_history.frame_arrived(timestamp, event.frame_duration, event.dropped_frames);
+
+		for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+			ReplayCard *card = &cards[card_index];
+			if (!has_new_frame[card_index] || card_index == event.card_index) {
+				continue;
+			}
+			// Like the mixer, we use the output frame duration for the input
+			// frame duration, too.
+			card->queue_length_policy.update_policy(
+				timestamp,
+				card->jitter_history.get_expected_next_frame(),
+				event.frame_duration,
+				event.frame_duration,
+				card->jitter_history.estimate_max_jitter(),
+				output_jitter_history.estimate_max_jitter());
+			unsigned queue_length;
+			card->dropped_frames_jitter += trim_queue_to_length(&card->frames,
+				min(max_input_queue_frames, card->queue_length_policy.get_safe_queue_length()),
+				&queue_length);
+		}
+	}
+
+	printf("card  received    output   dropped  underruns  latency ms (mean / p50 / p99 / max)\n");
+	for (unsigned card_index = 0; card_index < MAX_VIDEO_CARDS; ++card_index) {
+		ReplayCard *card = &cards[card_index];
+		if (!card->seen) {
+			continue;
+		}
+		vector<double> &latency = card->latency_ms;
+		sort(latency.begin(), latency.end());
+		double sum = 0.0;
+		for (double l : latency) {
+			sum += l;
+		}
+		printf("%4u  %8zu  %8zu  %8zu  %9zu  %6.2f / %6.2f / %6.2f / %6.2f\n",
+			card_index, card->received_frames, card->output_frames,
+			card->dropped_frames_jitter, card->underruns,
+			latency.empty() ? 0.0 : sum / latency.size(),
+			percentile(latency, 0.5), percentile(latency, 0.99),
+			latency.empty() ? 0.0 : latency.back());
+	}
+}
+
+void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [--max-input-queue-frames=FRAMES] TRACE...\n", program);
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	static const option long_options[] = {
+		{ "max-input-queue-frames", required_argument, 0, 'q' },
+		{ "help", no_argument, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	unsigned max_input_queue_frames = 6;  // Same default as Nageru.
+	for ( ;; ) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "q:h", long_options, &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'q':
+			max_input_queue_frames = max(atoi(optarg), 1);
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+	if (optind == argc) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	for (int i = optind; i < argc; ++i) {
+		vector<InputTimingEvent> events;
+		if (!read_input_timing_trace(argv[i], &events)) {
+			exit(1);
+		}
+		printf("%s (%zu events, --max-input-queue-frames=%u):\n", argv[i], events.size(), max_input_queue_frames);
+		replay(events, max_input_queue_frames);
+		if (i != argc - 1) {
+			printf("\n");
+		}
+	}
+}
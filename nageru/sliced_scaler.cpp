@@ -0,0 +1,283 @@
+#include "sliced_scaler.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <algorithm>
+#if __SSE2__
+#include <immintrin.h>
+#endif
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+
+using namespace std;
+
+namespace {
+
+// Slices smaller than this aren't worth the synchronization.
+constexpr int min_slice_height = 64;
+
+// Slice boundaries are multiples of this, so that chroma rows never straddle
+// two slices, and swscale's ordered dither pattern (which repeats every
+// eight lines) lines up with what it would be for the full picture.
+constexpr int slice_alignment = 16;
+
+int ceil_rshift(int x, int shift)
+{
+	return (x + (1 << shift) - 1) >> shift;
+}
+
+// Interleaves Cb and Cr into the second plane of NV12.
+void interleave_chroma(uint8_t *dst, const uint8_t *src_cb, const uint8_t *src_cr, size_t n)
+{
+	size_t i = 0;
+#if __AVX2__
+	for ( ; i + 32 <= n; i += 32) {
+		__m256i cb = _mm256_loadu_si256((const __m256i *)(src_cb + i));
+		__m256i cr = _mm256_loadu_si256((const __m256i *)(src_cr + i));
+		__m256i lo = _mm256_unpacklo_epi8(cb, cr);  // Pixels 0–7 and 16–23.
+		__m256i hi = _mm256_unpackhi_epi8(cb, cr);  // Pixels 8–15 and 24–31.
+		_mm256_storeu_si256((__m256i *)(dst + i * 2), _mm256_permute2x128_si256(lo, hi, 0b00100000));
+		_mm256_storeu_si256((__m256i *)(dst + i * 2 + 32), _mm256_permute2x128_si256(lo, hi, 0b00110001));
+	}
+#endif
+#if __SSE2__
+	for ( ; i + 16 <= n; i += 16) {
+		__m128i cb = _mm_loadu_si128((const __m128i *)(src_cb + i));
+		__m128i cr = _mm_loadu_si128((const __m128i *)(src_cr + i));
+		_mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi8(cb, cr));
+		_mm_storeu_si128((__m128i *)(dst + i * 2 + 16), _mm_unpackhi_epi8(cb, cr));
+	}
+#endif
+	for ( ; i < n; ++i) {
+		dst[i * 2] = src_cb[i];
+		dst[i * 2 + 1] = src_cr[i];
+	}
+}
+
+void copy_rows(uint8_t *dst, int dst_linesize, const uint8_t *src, int src_linesize, int bytes_per_row, int y_start, int y_end)
+{
+	dst += ptrdiff_t(y_start) * dst_linesize;
+	src += ptrdiff_t(y_start) * src_linesize;
+	if (dst_linesize == src_linesize && src_linesize == bytes_per_row) {
+		memcpy(dst, src, size_t(bytes_per_row) * (y_end - y_start));
+		return;
+	}
+	for (int y = y_start; y < y_end; ++y) {
+		memcpy(dst, src, bytes_per_row);
+		dst += dst_linesize;
+		src += src_linesize;
+	}
+}
+
+bool can_slice(const AVPixFmtDescriptor *desc)
+{
+	return !(desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL));
+}
+
+}  // namespace
+
+SlicedScaler::SlicedScaler(unsigned max_slices)
+	: max_slices(max_slices)
+{
+	if (this->max_slices == 0) {
+		this->max_slices = min(max(thread::hardware_concurrency(), 1u), 4u);
+	}
+}
+
+SlicedScaler::~SlicedScaler()
+{
+	{
+		lock_guard<mutex> lock(mu);
+		should_quit = true;
+		job_ready.notify_all();
+	}
+	for (thread &worker : workers) {
+		worker.join();
+	}
+}
+
+bool SlicedScaler::scale(const uint8_t *const src_data[4], const int src_linesize[4],
+                         int src_width, int src_height, AVPixelFormat src_format,
+                         uint8_t *const dst_data[4], const int dst_linesize[4],
+                         int dst_width, int dst_height, AVPixelFormat dst_format)
+{
+	if (src_width != last_src_width || src_height != last_src_height || src_format != last_src_format ||
+	    dst_width != last_dst_width || dst_height != last_dst_height || dst_format != last_dst_format) {
+		if (!reconfigure(src_width, src_height, src_format, dst_width, dst_height, dst_format)) {
+			last_src_width = -1;  // Try again next time.
+			return false;
+		}
+		last_src_width = src_width;
+		last_src_height = src_height;
+		last_src_format = src_format;
+		last_dst_width = dst_width;
+		last_dst_height = dst_height;
+		last_dst_format = dst_format;
+	}
+
+	for (unsigned plane = 0; plane < 4; ++plane) {
+		this->src_data[plane] = src_data[plane];
+		this->src_linesize[plane] = src_linesize[plane];
+		this->dst_data[plane] = dst_data[plane];
+		this->dst_linesize[plane] = dst_linesize[plane];
+	}
+	width = src_width;
+
+	if (slices.size() == 1) {
+		convert_slice(0);
+		return true;
+	}
+
+	{
+		lock_guard<mutex> lock(mu);
+		++job_num;
+		num_active_slices = slices.size();
+		slices_left = slices.size() - 1;
+		job_ready.notify_all();
+	}
+	convert_slice(0);
+	unique_lock<mutex> lock(mu);
+	job_done.wait(lock, [this]{ return slices_left == 0; });
+	return true;
+}
+
+bool SlicedScaler::reconfigure(int src_width, int src_height, AVPixelFormat src_format,
+                               int dst_width, int dst_height, AVPixelFormat dst_format)
+{
+	slices.clear();
+
+	const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(src_format);
+	const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(dst_format);
+	if (src_desc == nullptr || dst_desc == nullptr) {
+		return false;
+	}
+
+	bool same_size = (src_width == dst_width && src_height == dst_height);
+	if (same_size && src_format == dst_format &&
+	    (src_format == AV_PIX_FMT_YUV420P || src_format == AV_PIX_FMT_YUVJ420P ||
+	     src_format == AV_PIX_FMT_YUV422P || src_format == AV_PIX_FMT_YUVJ422P)) {
+		method = METHOD_COPY;
+	} else if (same_size && src_format == AV_PIX_FMT_YUV420P && dst_format == AV_PIX_FMT_NV12) {
+		// Note: Not YUVJ420P, since swscale would convert that to limited range.
+		method = METHOD_YUV420P_TO_NV12;
+	} else if (same_size && src_desc->log2_chroma_h == dst_desc->log2_chroma_h &&
+	           can_slice(src_desc) && can_slice(dst_desc)) {
+		method = METHOD_SLICED_SWS;
+	} else {
+		method = METHOD_SINGLE_SWS;
+	}
+	chroma_shift_y = src_desc->log2_chroma_h;
+
+	unsigned num_slices = 1;
+	if (method != METHOD_SINGLE_SWS) {
+		num_slices = max(min<int>(max_slices, src_height / min_slice_height), 1);
+	}
+	for (unsigned slice_num = 0; slice_num < num_slices; ++slice_num) {
+		Slice slice;
+		slice.y_start = (slice_num == 0) ? 0 : (src_height * slice_num / num_slices) / slice_alignment * slice_alignment;
+		slice.y_end = (slice_num == num_slices - 1) ? src_height : (src_height * (slice_num + 1) / num_slices) / slice_alignment * slice_alignment;
+		if (method == METHOD_SINGLE_SWS) {
+			slice.sws_ctx.reset(
+				sws_getContext(src_width, src_height, src_format,
+					dst_width, dst_height, dst_format,
+					SWS_BICUBIC, nullptr, nullptr, nullptr));
+		} else if (method == METHOD_SLICED_SWS) {
+			int slice_height = slice.y_end - slice.y_start;
+			slice.sws_ctx.reset(
+				sws_getContext(src_width, slice_height, src_format,
+					dst_width, slice_height, dst_format,
+					SWS_BICUBIC, nullptr, nullptr, nullptr));
+		}
+		if ((method == METHOD_SINGLE_SWS || method == METHOD_SLICED_SWS) && slice.sws_ctx == nullptr) {
+			slices.clear();
+			return false;
+		}
+		slices.push_back(move(slice));
+	}
+
+	// Start any extra workers we need. They stay around until we are destroyed.
+	unsigned current_job_num;
+	{
+		lock_guard<mutex> lock(mu);
+		current_job_num = job_num;
+	}
+	while (workers.size() + 1 < slices.size()) {
+		workers.emplace_back(&SlicedScaler::worker_thread_func, this, workers.size() + 1, current_job_num);
+	}
+	return true;
+}
+
+void SlicedScaler::convert_slice(unsigned slice_num)
+{
+	const Slice &slice = slices[slice_num];
+	switch (method) {
+	case METHOD_COPY: {
+		const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(last_src_format);
+		int chroma_width = ceil_rshift(width, desc->log2_chroma_w);
+		copy_rows(dst_data[0], dst_linesize[0], src_data[0], src_linesize[0], width, slice.y_start, slice.y_end);
+		for (unsigned plane = 1; plane < 3; ++plane) {
+			copy_rows(dst_data[plane], dst_linesize[plane], src_data[plane], src_linesize[plane], chroma_width,
+				slice.y_start >> chroma_shift_y, ceil_rshift(slice.y_end, chroma_shift_y));
+		}
+		break;
+	}
+	case METHOD_YUV420P_TO_NV12: {
+		copy_rows(dst_data[0], dst_linesize[0], src_data[0], src_linesize[0], width, slice.y_start, slice.y_end);
+		int chroma_width = ceil_rshift(width, 1);
+		for (int y = slice.y_start / 2; y < ceil_rshift(slice.y_end, 1); ++y) {
+			interleave_chroma(dst_data[1] + ptrdiff_t(y) * dst_linesize[1],
+				src_data[1] + ptrdiff_t(y) * src_linesize[1],
+				src_data[2] + ptrdiff_t(y) * src_linesize[2],
+				chroma_width);
+		}
+		break;
+	}
+	case METHOD_SLICED_SWS: {
+		const uint8_t *src_ptrs[4];
+		uint8_t *dst_ptrs[4];
+		for (unsigned plane = 0; plane < 4; ++plane) {
+			// Planes 1 and 2 are the chroma planes for all Y'CbCr formats
+			// (including NV12's combined plane); for RGB, the shift is zero anyway.
+			int shift = (plane == 1 || plane == 2) ? chroma_shift_y : 0;
+			src_ptrs[plane] = (src_data[plane] == nullptr) ? nullptr : src_data[plane] + ptrdiff_t(slice.y_start >> shift) * src_linesize[plane];
+			dst_ptrs[plane] = (dst_data[plane] == nullptr) ? nullptr : dst_data[plane] + ptrdiff_t(slice.y_start >> shift) * dst_linesize[plane];
+		}
+		sws_scale(slice.sws_ctx.get(), src_ptrs, src_linesize, 0, slice.y_end - slice.y_start, dst_ptrs, dst_linesize);
+		break;
+	}
+	case METHOD_SINGLE_SWS:
+		assert(slice_num == 0);
+		sws_scale(slice.sws_ctx.get(), src_data, src_linesize, 0, last_src_height, dst_data, dst_linesize);
+		break;
+	}
+}
+
+void SlicedScaler::worker_thread_func(unsigned slice_num, unsigned last_job_num)
+{
+	pthread_setname_np(pthread_self(), "SlicedScaler");
+
+	for ( ;; ) {
+		{
+			unique_lock<mutex> lock(mu);
+			job_ready.wait(lock, [this, last_job_num]{ return should_quit || job_num != last_job_num; });
+			if (should_quit) {
+				return;
+			}
+			last_job_num = job_num;
+			if (slice_num >= num_active_slices) {
+				continue;
+			}
+		}
+		convert_slice(slice_num);
+		{
+			lock_guard<mutex> lock(mu);
+			if (--slices_left == 0) {
+				job_done.notify_all();
+			}
+		}
+	}
+}
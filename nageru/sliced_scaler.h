@@ -0,0 +1,93 @@
+#ifndef _SLICED_SCALER_H
+#define _SLICED_SCALER_H 1
+
+// A drop-in for a single sws_scale() call over a full picture, for when that
+// call is too slow to keep up with (e.g. 4K inputs). The picture is split into
+// horizontal slices, each converted by its own SwsContext on its own thread
+// (the calling thread takes the first slice). This is only safe if no output
+// line depends on input lines outside its own slice, so slicing is only used
+// when the picture is not scaled and the vertical chroma subsampling stays
+// the same; everything else goes through a single SwsContext as before.
+//
+// In addition, the most common cases in practice (8-bit 4:2:0 or 4:2:2
+// planar Y'CbCr going to the same planar format, or 4:2:0 going to NV12)
+// don't need swscale at all, and have their own (sliced) fast paths.
+// These give bit-exact the same output as swscale.
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavutil/pixfmt.h>
+}
+
+#include "shared/ffmpeg_raii.h"
+
+class SlicedScaler {
+public:
+	// Uses up to <max_slices> slices (and thus max_slices - 1 extra threads).
+	// 0 means to pick based on the number of CPUs.
+	explicit SlicedScaler(unsigned max_slices);
+	~SlicedScaler();
+
+	// Like sws_scale() over the entire picture, on a context made with
+	// sws_getContext(..., SWS_BICUBIC, nullptr, nullptr, nullptr).
+	// Contexts are cached, so calling this with the same parameters over and
+	// over is cheap. Not thread-safe (use one SlicedScaler per thread).
+	// Returns false if swscale does not support the given conversion.
+	bool scale(const uint8_t *const src_data[4], const int src_linesize[4],
+	           int src_width, int src_height, AVPixelFormat src_format,
+	           uint8_t *const dst_data[4], const int dst_linesize[4],
+	           int dst_width, int dst_height, AVPixelFormat dst_format);
+
+	enum Method {
+		METHOD_COPY,  // Same format and size; just copy the planes.
+		METHOD_YUV420P_TO_NV12,
+		METHOD_SLICED_SWS,
+		METHOD_SINGLE_SWS,
+	};
+
+	// For the last call to scale(). Mostly useful for benchmarking.
+	Method get_method() const { return method; }
+	unsigned get_num_slices() const { return slices.size(); }
+
+private:
+	struct Slice {
+		int y_start, y_end;  // In the source (and destination) picture.
+		SwsContextWithDeleter sws_ctx;  // Only for METHOD_SLICED_SWS and METHOD_SINGLE_SWS.
+	};
+
+	bool reconfigure(int src_width, int src_height, AVPixelFormat src_format,
+	                 int dst_width, int dst_height, AVPixelFormat dst_format);
+	void convert_slice(unsigned slice_num);
+	void worker_thread_func(unsigned slice_num, unsigned last_job_num);
+
+	unsigned max_slices;
+
+	// The current configuration.
+	int last_src_width = -1, last_src_height = -1, last_dst_width = -1, last_dst_height = -1;
+	AVPixelFormat last_src_format = AV_PIX_FMT_NONE, last_dst_format = AV_PIX_FMT_NONE;
+	Method method = METHOD_SINGLE_SWS;
+	int chroma_shift_y = 0;  // For offsetting pointers into planes 1 and 2.
+	std::vector<Slice> slices;
+
+	// The current job. Set by scale() before waking up the workers.
+	const uint8_t *src_data[4];
+	int src_linesize[4];
+	uint8_t *dst_data[4];
+	int dst_linesize[4];
+	int width;  // Only used for the fast paths (source and destination are the same size).
+
+	std::vector<std::thread> workers;  // Worker i converts slice i + 1.
+	std::mutex mu;
+	std::condition_variable job_ready, job_done;
+	unsigned job_num = 0;  // Protected by <mu>.
+	unsigned num_active_slices = 0;  // Protected by <mu>.
+	unsigned slices_left = 0;  // Protected by <mu>.
+	bool should_quit = false;  // Protected by <mu>.
+};
+
+#endif  // !defined(_SLICED_SCALER_H)
@@ -0,0 +1,263 @@
+// Checks that a theme gives the same answers in all its Lua states
+// (see --theme-lua-states), beyond what the startup check in Theme can see:
+// Loads the theme into several states, replays a fixed pseudorandom sequence
+// of state changes (transitions, channel clicks, white balance, menu entries,
+// signal mappings) and changes in the input signals on all of them, as Nageru
+// would, and after each one compares the chain every state picks for every
+// channel at a few different times. Also checks that each channel's cached
+// choice (see get_chain() in theme.lua) is what the theme would pick if asked.
+// Exits with a nonzero status on the first mismatch.
+//
+// Needs OpenGL, like Nageru itself. Takes the same flags as Nageru,
+// e.g. test_theme_lua_states --theme=simple.lua --theme-lua-states=4;
+// with less than two Lua states, three are used.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <epoxy/gl.h>  // IWYU pragma: keep
+#include <QApplication>
+#include <QCoreApplication>
+#include <QGL>
+#include <QSurfaceFormat>
+#include <movit/init.h>
+#include <movit/resource_pool.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_CEF
+#include "nageru_cef_app.h"
+#endif
+#include "shared/context.h"
+#include "flags.h"
+#include "image_input.h"
+#include "input_state.h"
+#include "pbo_frame_allocator.h"
+#include "theme.h"
+
+#define NUM_STEPS 500
+
+using namespace movit;
+using namespace std;
+
+#ifdef HAVE_CEF
+CefRefPtr<NageruCefApp> cef_app;
+#endif
+
+namespace {
+
+// What each card looks like right now; the frames in the InputState
+// point here, and the theme reads it through them.
+PBOFrameAllocator::Userdata userdata[MAX_VIDEO_CARDS];
+
+void set_signal(unsigned card_index, unsigned width, unsigned height, bool interlaced, bool connected, unsigned frame_rate_nom, unsigned frame_rate_den)
+{
+	PBOFrameAllocator::Userdata *ud = &userdata[card_index];
+	ud->last_width[0] = ud->last_width[1] = width;
+	ud->last_height[0] = ud->last_height[1] = height;
+	ud->last_interlaced = interlaced;
+	ud->last_has_signal = connected;
+	ud->last_is_connected = connected;
+	ud->last_frame_rate_nom = frame_rate_nom;
+	ud->last_frame_rate_den = frame_rate_den;
+}
+
+InputState make_input_state(unsigned num_cards)
+{
+	InputState input_state;
+	for (unsigned card_index = 0; card_index < num_cards; ++card_index) {
+		bmusb::FrameAllocator::Frame frame;
+		frame.owner = nullptr;  // Nothing to give it back to.
+		frame.userdata = &userdata[card_index];
+		RefCountedFrame ref_frame(frame);
+		for (unsigned frame_num = 0; frame_num < FRAME_HISTORY_LENGTH; ++frame_num) {
+			input_state.buffered_frames[card_index][frame_num] = BufferedFrame{ ref_frame, 0 };
+		}
+		input_state.ycbcr_coefficients_auto[card_index] = true;
+		input_state.ycbcr_coefficients[card_index] = YCBCR_REC_709;
+		input_state.full_range[card_index] = false;
+	}
+	return input_state;
+}
+
+// Asks for the live channel the way the mixer does (the primary, through its
+// cache), then for every other channel from its own state (through the cache),
+// then for every channel from every state without the cache. All must agree.
+void check_chains(Theme *theme, float t, const InputState &input_state, unsigned step, const string &what)
+{
+	const unsigned width = global_flags.width, height = global_flags.height;
+	const int num_channels = theme->get_num_channels() + 2;
+
+	vector<unsigned> cached_chain_numbers;
+	for (int channel = 0; channel < num_channels; ++channel) {
+		cached_chain_numbers.push_back(theme->get_chain_number(
+			theme->get_lua_state_index_for_channel(channel), channel, t, width, height, input_state, /*use_cache=*/true));
+	}
+
+	for (int channel = 0; channel < num_channels; ++channel) {
+		unsigned own_state_index = theme->get_lua_state_index_for_channel(channel);
+		for (unsigned state_index = 0; state_index < theme->get_num_lua_states(); ++state_index) {
+			unsigned chain_number = theme->get_chain_number(state_index, channel, t, width, height, input_state, /*use_cache=*/false);
+			if (state_index == own_state_index && chain_number != cached_chain_numbers[channel]) {
+				fprintf(stderr, "Step %u (%s), t=%.2f: Lua state %u has cached chain %u for channel %d, but the theme now picks chain %u.\n",
+					step, what.c_str(), t, state_index, cached_chain_numbers[channel], channel, chain_number);
+				exit(1);
+			}
+			if (chain_number != cached_chain_numbers[channel]) {
+				fprintf(stderr, "Step %u (%s), t=%.2f: Lua state %u picks chain %u for channel %d, but Lua state %u picks chain %u.\n",
+					step, what.c_str(), t, state_index, chain_number, channel, own_state_index, cached_chain_numbers[channel]);
+				exit(1);
+			}
+		}
+	}
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	parse_flags(PROGRAM_NAGERU, argc, argv);
+	if (global_flags.theme_lua_states < 2) {
+		global_flags.theme_lua_states = 3;
+	}
+	const unsigned num_cards = global_flags.num_cards;
+
+	QCoreApplication::setAttribute(Qt::AA_ShareOpenGLContexts, true);
+
+	QSurfaceFormat fmt;
+	fmt.setDepthBufferSize(0);
+	fmt.setStencilBufferSize(0);
+	fmt.setProfile(QSurfaceFormat::CoreProfile);
+	fmt.setMajorVersion(3);
+	fmt.setMinorVersion(1);
+	QSurfaceFormat::setDefaultFormat(fmt);
+	QGLFormat::setDefaultFormat(QGLFormat::fromSurfaceFormat(fmt));
+
+	QApplication app(argc, argv);
+	global_share_widget = new QGLWidget();
+	if (!global_share_widget->isValid()) {
+		fprintf(stderr, "Failed to initialize OpenGL. The theme needs at least OpenGL 3.1 to run.\n");
+		exit(1);
+	}
+
+	QSurface *surface = create_surface(fmt);
+	QOpenGLContext *context = create_context(surface);
+	if (!make_current(context, surface)) {
+		fprintf(stderr, "Failed to make the OpenGL context current.\n");
+		exit(1);
+	}
+	if (!init_movit(MOVIT_SHADER_DIR, MOVIT_DEBUG_OFF)) {
+		fprintf(stderr, "Failed to initialize Movit.\n");
+		exit(1);
+	}
+
+	unique_ptr<ResourcePool> resource_pool(new ResourcePool);
+	unique_ptr<Theme> theme(new Theme(global_flags.theme_filename, global_flags.theme_dirs, resource_pool.get(), num_cards, global_flags.theme_lua_states));
+	const int num_channels = theme->get_num_channels() + 2;
+
+	for (unsigned card_index = 0; card_index < num_cards; ++card_index) {
+		set_signal(card_index, 1280, 720, /*interlaced=*/false, /*connected=*/true, 60, 1);
+	}
+	InputState input_state = make_input_state(num_cards);
+
+	mt19937 rng(1234);
+	float t = 0.0f;
+	unsigned num_checks = 0;
+	for (unsigned step = 0; step < NUM_STEPS; ++step) {
+		char what[256];
+		switch (uniform_int_distribution<int>(0, 6)(rng)) {
+		case 0: {
+			vector<string> names = theme->get_transition_names(t);
+			vector<int> usable;
+			for (unsigned i = 0; i < names.size(); ++i) {
+				if (!names[i].empty()) {
+					usable.push_back(i);
+				}
+			}
+			if (usable.empty()) {
+				snprintf(what, sizeof(what), "no transitions possible");
+				break;
+			}
+			int transition_num = usable[uniform_int_distribution<int>(0, usable.size() - 1)(rng)];
+			snprintf(what, sizeof(what), "transition %d (%s)", transition_num, names[transition_num].c_str());
+			theme->transition_clicked(transition_num, t);
+			break;
+		}
+		case 1: {
+			int preview_num = uniform_int_distribution<int>(0, num_channels - 3)(rng);
+			snprintf(what, sizeof(what), "clicked channel %d", preview_num + 2);
+			theme->channel_clicked(preview_num);
+			break;
+		}
+		case 2: {
+			unsigned channel = uniform_int_distribution<int>(2, num_channels - 1)(rng);
+			if (!theme->get_supports_set_wb(channel)) {
+				snprintf(what, sizeof(what), "channel %u has no white balance", channel);
+				break;
+			}
+			uniform_real_distribution<double> color(0.3, 0.7);
+			double r = color(rng), g = color(rng), b = color(rng);
+			snprintf(what, sizeof(what), "white balance for channel %u", channel);
+			theme->set_wb(channel, r, g, b);
+			break;
+		}
+		case 3: {
+			vector<Theme::MenuEntry> menu = theme->get_theme_menu();
+			if (menu.empty()) {
+				snprintf(what, sizeof(what), "no menu");
+				break;
+			}
+			const Theme::MenuEntry &entry = menu[uniform_int_distribution<int>(0, menu.size() - 1)(rng)];
+			snprintf(what, sizeof(what), "menu entry “%s”", entry.text.c_str());
+			theme->theme_menu_entry_clicked(entry.lua_ref);
+			break;
+		}
+		case 4: {
+			int signal_num = uniform_int_distribution<int>(0, 1)(rng);
+			int card_index = uniform_int_distribution<int>(0, num_cards - 1)(rng);
+			snprintf(what, sizeof(what), "mapped signal %d to card %d", signal_num, card_index);
+			theme->set_signal_mapping(signal_num, card_index);
+			break;
+		}
+		case 5: {
+			unsigned card_index = uniform_int_distribution<int>(0, num_cards - 1)(rng);
+			switch (uniform_int_distribution<int>(0, 3)(rng)) {
+			case 0:
+				set_signal(card_index, 1280, 720, /*interlaced=*/false, /*connected=*/true, 60, 1);
+				break;
+			case 1:
+				set_signal(card_index, 1920, 540, /*interlaced=*/true, /*connected=*/true, 30000, 1001);
+				break;
+			case 2:
+				set_signal(card_index, 640, 480, /*interlaced=*/false, /*connected=*/true, 25, 1);
+				break;
+			case 3:
+				set_signal(card_index, 0, 0, /*interlaced=*/false, /*connected=*/false, 60, 1);
+				break;
+			}
+			snprintf(what, sizeof(what), "card %u is now %ux%u%s", card_index,
+				userdata[card_index].last_width[0], userdata[card_index].last_height[0],
+				userdata[card_index].last_interlaced ? "i" : "p");
+			break;
+		}
+		default:
+			snprintf(what, sizeof(what), "time passes");
+			break;
+		}
+
+		// Look a few times after the change; transitions typically last about a second.
+		for (unsigned i = 0; i < 4; ++i) {
+			check_chains(theme.get(), t, input_state, step, what);
+			++num_checks;
+			t += uniform_real_distribution<float>(0.0f, 0.5f)(rng);
+		}
+	}
+
+	printf("%u steps, %u checks: all %u Lua states picked the same chains.\n",
+		NUM_STEPS, num_checks, theme->get_num_lua_states());
+
+	theme.reset();
+	ImageInput::shutdown_updaters();
+	return 0;
+}
@@ -0,0 +1,122 @@
+-- A small theme for test_theme_lua_states, covering what theme.lua does not:
+-- a menu, and a transition that ends by itself (a delayed cut), so that
+-- the theme changes its own state in get_chain(). Not meant for actual use;
+-- see simple.lua for a minimal theme that is.
+
+local input_neutral_color = {{0.5, 0.5, 0.5}, {0.5, 0.5, 0.5}}
+
+local live_signal_num = 0
+local preview_signal_num = 1
+local cut_at = nil  -- If set, live and preview are swapped at this time.
+local always_deinterlace = false
+local show_preview_on_live = false
+
+function make_chain(hq, deint)
+	local chain = EffectChain.new(16, 9)
+	local input = chain:add_live_input(not deint, deint)  -- Override bounce only if not deinterlacing.
+	input:connect_signal(0)
+	local wb_effect = chain:add_effect(WhiteBalanceEffect.new())
+	chain:finalize(hq)
+
+	return {
+		chain = chain,
+		input = input,
+		wb_effect = wb_effect,
+	}
+end
+
+-- Indexed by hq, then deint.
+local chains = {
+	[true] = { [true] = make_chain(true, true), [false] = make_chain(true, false) },
+	[false] = { [true] = make_chain(false, true), [false] = make_chain(false, false) }
+}
+
+ThemeMenu.set(
+	{ "Toggle deinterlacing of progressive inputs", function() always_deinterlace = not always_deinterlace end },
+	{ "Toggle preview on live", function() show_preview_on_live = not show_preview_on_live end }
+)
+
+function num_channels()
+	return 2
+end
+
+function channel_name(channel)
+	return "Input " .. (channel - 1)
+end
+
+function channel_signal(channel)
+	return channel - 2
+end
+
+function channel_color(channel)
+	return "transparent"
+end
+
+function supports_set_wb(channel)
+	return channel == 2 or channel == 3
+end
+
+function set_wb(channel, red, green, blue)
+	if channel == 2 or channel == 3 then
+		input_neutral_color[channel - 1] = { red, green, blue }
+	end
+end
+
+function finish_cut(t)
+	if cut_at ~= nil and t >= cut_at then
+		live_signal_num, preview_signal_num = preview_signal_num, live_signal_num
+		cut_at = nil
+	end
+end
+
+function get_transitions(t)
+	finish_cut(t)
+	if cut_at ~= nil then
+		return {"Cut"}
+	end
+	return {"Cut", "Delayed cut"}
+end
+
+function transition_clicked(num, t)
+	finish_cut(t)
+	if num == 0 then
+		live_signal_num, preview_signal_num = preview_signal_num, live_signal_num
+		cut_at = nil
+	elseif num == 1 and cut_at == nil then
+		cut_at = t + 1.0
+	end
+end
+
+function channel_clicked(num)
+	preview_signal_num = num
+end
+
+function get_chain(num, t, width, height, signals)
+	-- The cut changes the preview too, and the live channel only ever goes to
+	-- the first Lua state, so every channel must be able to finish it.
+	finish_cut(t)
+
+	local depends_on = { signals = { 0, 1 }, valid_until = cut_at }
+
+	local signal_num
+	if num == 0 then
+		if show_preview_on_live then
+			signal_num = preview_signal_num
+		else
+			signal_num = live_signal_num
+		end
+	elseif num == 1 then
+		signal_num = preview_signal_num
+	else
+		signal_num = num - 2
+	end
+
+	local deint = always_deinterlace or signals:get_interlaced(signal_num)
+	local chain = chains[num == 0][deint]
+	local color = input_neutral_color[signal_num + 1]
+	local prepare = function(t)
+		chain.input:connect_signal(signal_num)
+		chain.wb_effect:set_vec3("neutral_color", color[1], color[2], color[3])
+	end
+	return chain.chain, prepare, depends_on
+end
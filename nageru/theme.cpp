@@ -23,7 +23,9 @@
 #include <movit/ycbcr_input.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
 #include <cstddef>
+#include <limits>
 #include <memory>
 #include <new>
 #include <utility>
@@ -37,6 +39,7 @@
 #include "image_input.h"
 #include "input_state.h"
 #include "pbo_frame_allocator.h"
+#include "shared/metrics.h"
 
 class Mixer;
 
@@ -55,10 +58,24 @@ Theme *get_theme_updata(lua_State* L)
 	return (Theme *)lua_touserdata(L, lua_upvalueindex(1));
 }
 
+Theme::LuaState *get_lua_state_updata(lua_State* L)
+{
+	luaL_checktype(L, lua_upvalueindex(2), LUA_TLIGHTUSERDATA);
+	return (Theme::LuaState *)lua_touserdata(L, lua_upvalueindex(2));
+}
+
+// Inputs are shared between all the Lua states, so calls that change them
+// are only carried out when they come from the primary; the others are
+// just replaying the same calls (see Theme::LuaState).
+bool is_primary_lua_state(lua_State* L)
+{
+	return get_lua_state_updata(L)->index == 0;
+}
+
 int ThemeMenu_set(lua_State *L)
 {
 	Theme *theme = get_theme_updata(L);
-	return theme->set_theme_menu(L);
+	return theme->set_theme_menu(get_lua_state_updata(L), L);
 }
 
 namespace {
@@ -100,6 +117,29 @@ InputStateInfo::InputStateInfo(const InputState &input_state)
 	}
 }
 
+Theme::SignalProperties get_signal_properties(const InputState &input_state, unsigned card_index)
+{
+	Theme::SignalProperties properties;
+	BufferedFrame frame = input_state.buffered_frames[card_index][0];
+	if (frame.frame == nullptr) {
+		properties.width = properties.height = 0;
+		properties.interlaced = properties.has_signal = properties.is_connected = false;
+		properties.frame_rate_nom = properties.frame_rate_den = 0;
+		return properties;
+	}
+	const PBOFrameAllocator::Userdata *userdata = (const PBOFrameAllocator::Userdata *)frame.frame->userdata;
+	properties.width = userdata->last_width[frame.field_number];
+	properties.height = userdata->last_height[frame.field_number];
+	properties.interlaced = userdata->last_interlaced;
+	properties.has_signal = userdata->last_has_signal;
+	properties.is_connected = userdata->last_is_connected;
+	properties.frame_rate_nom = userdata->last_frame_rate_nom;
+	properties.frame_rate_den = userdata->last_frame_rate_den;
+	return properties;
+}
+
+}  // namespace
+
 class LuaRefWithDeleter {
 public:
 	LuaRefWithDeleter(mutex *m, lua_State *L, int ref) : m(m), L(L), ref(ref) {}
@@ -117,6 +157,8 @@ private:
 	int ref;
 };
 
+namespace {
+
 template<class T, class... Args>
 int wrap_lua_object(lua_State* L, const char *class_name, Args&&... args)
 {
@@ -153,6 +195,21 @@ int wrap_lua_object_nonowned(lua_State* L, const char *class_name, Args&&... arg
 	return 1;
 }
 
+// Like wrap_lua_object_nonowned, but for an object that already exists
+// (made by the primary Lua state).
+template<class T>
+int wrap_existing_lua_object_nonowned(lua_State* L, const char *class_name, T *obj)
+{
+	T **ptr = (T **)lua_newuserdata(L, sizeof(T *));
+	*ptr = obj;
+
+	// Look up the metatable named <class_name>, and set it on the new object.
+	luaL_getmetatable(L, class_name);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
 Effect *get_effect(lua_State *L, int idx)
 {
 	if (luaL_testudata(L, idx, "WhiteBalanceEffect") ||
@@ -200,13 +257,17 @@ int EffectChain_new(lua_State* L)
 	int aspect_w = luaL_checknumber(L, 1);
 	int aspect_h = luaL_checknumber(L, 2);
 
-	return wrap_lua_object<EffectChain>(L, "EffectChain", aspect_w, aspect_h, theme->get_resource_pool());
+	int ret = wrap_lua_object<EffectChain>(L, "EffectChain", aspect_w, aspect_h, theme->get_resource_pool());
+	Theme::LuaState *state = get_lua_state_updata(L);
+	state->chain_numbers[(EffectChain *)lua_touserdata(L, -1)] = state->num_chains_created++;
+	return ret;
 }
 
 int EffectChain_gc(lua_State* L)
 {
 	assert(lua_gettop(L) == 1);
 	EffectChain *chain = (EffectChain *)luaL_checkudata(L, 1, "EffectChain");
+	get_lua_state_updata(L)->chain_numbers.erase(chain);
 	chain->~EffectChain();
 	return 0;
 }
@@ -367,7 +428,7 @@ int LiveInputWrapper_connect_signal(lua_State* L)
 	assert(lua_gettop(L) == 2);
 	LiveInputWrapper **input = (LiveInputWrapper **)luaL_checkudata(L, 1, "LiveInputWrapper");
 	int signal_num = luaL_checknumber(L, 2);
-	bool success = (*input)->connect_signal(signal_num);
+	bool success = (*input)->connect_signal(signal_num, get_lua_state_updata(L)->input_state);
 	if (!success) {
 		lua_Debug ar;
 		lua_getstack(L, 1, &ar);
@@ -396,12 +457,22 @@ int VideoInput_new(lua_State* L)
 			pixel_format);
 		pixel_format = bmusb::PixelFormat_8BitYCbCrPlanar;
 	}
+	Theme *theme = get_theme_updata(L);
+	Theme::LuaState *state = get_lua_state_updata(L);
+	unsigned input_num = state->num_video_inputs++;
+	if (state->index != 0) {
+		vector<FFmpegCapture *> video_inputs = theme->get_video_inputs();
+		if (input_num >= video_inputs.size()) {
+			fprintf(stderr, "ERROR: The theme made more VideoInputs in Lua state %u than in the first one, so it cannot be used with --theme-lua-states.\n", state->index);
+			exit(1);
+		}
+		return wrap_existing_lua_object_nonowned<FFmpegCapture>(L, "VideoInput", video_inputs[input_num]);
+	}
 	int ret = wrap_lua_object_nonowned<FFmpegCapture>(L, "VideoInput", filename, global_flags.width, global_flags.height);
 	if (ret == 1) {
 		FFmpegCapture **capture = (FFmpegCapture **)lua_touserdata(L, -1);
 		(*capture)->set_pixel_format(bmusb::PixelFormat(pixel_format));
 
-		Theme *theme = get_theme_updata(L);
 		theme->register_video_input(*capture);
 	}
 	return ret;
@@ -411,7 +482,9 @@ int VideoInput_rewind(lua_State* L)
 {
 	assert(lua_gettop(L) == 1);
 	FFmpegCapture **video_input = (FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
-	(*video_input)->rewind();
+	if (is_primary_lua_state(L)) {
+		(*video_input)->rewind();
+	}
 	return 0;
 }
 
@@ -419,7 +492,9 @@ int VideoInput_disconnect(lua_State* L)
 {
 	assert(lua_gettop(L) == 1);
 	FFmpegCapture **video_input = (FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
-	(*video_input)->disconnect();
+	if (is_primary_lua_state(L)) {
+		(*video_input)->disconnect();
+	}
 	return 0;
 }
 
@@ -428,7 +503,24 @@ int VideoInput_change_rate(lua_State* L)
 	assert(lua_gettop(L) == 2);
 	FFmpegCapture **video_input = (FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
 	double new_rate = luaL_checknumber(L, 2);
-	(*video_input)->change_rate(new_rate);
+	if (is_primary_lua_state(L)) {
+		(*video_input)->change_rate(new_rate);
+	}
+	return 0;
+}
+
+int VideoInput_set_loop_cache_mb(lua_State* L)
+{
+	assert(lua_gettop(L) == 2);
+	FFmpegCapture **video_input = (FFmpegCapture **)luaL_checkudata(L, 1, "VideoInput");
+	double megabytes = luaL_checknumber(L, 2);
+	if (megabytes < 0.0) {
+		fprintf(stderr, "WARNING: Negative loop cache size %f, disabling the cache.\n", megabytes);
+		megabytes = 0.0;
+	}
+	if (is_primary_lua_state(L)) {
+		(*video_input)->set_loop_cache_budget(size_t(megabytes * 1048576.0));
+	}
 	return 0;
 }
 
@@ -445,10 +537,20 @@ int HTMLInput_new(lua_State* L)
 #ifdef HAVE_CEF
 	assert(lua_gettop(L) == 1);
 	string url = checkstdstring(L, 1);
+	Theme *theme = get_theme_updata(L);
+	Theme::LuaState *state = get_lua_state_updata(L);
+	unsigned input_num = state->num_html_inputs++;
+	if (state->index != 0) {
+		vector<CEFCapture *> html_inputs = theme->get_html_inputs();
+		if (input_num >= html_inputs.size()) {
+			fprintf(stderr, "ERROR: The theme made more HTMLInputs in Lua state %u than in the first one, so it cannot be used with --theme-lua-states.\n", state->index);
+			exit(1);
+		}
+		return wrap_existing_lua_object_nonowned<CEFCapture>(L, "HTMLInput", html_inputs[input_num]);
+	}
 	int ret = wrap_lua_object_nonowned<CEFCapture>(L, "HTMLInput", url, global_flags.width, global_flags.height);
 	if (ret == 1) {
 		CEFCapture **capture = (CEFCapture **)lua_touserdata(L, -1);
-		Theme *theme = get_theme_updata(L);
 		theme->register_html_input(*capture);
 	}
 	return ret;
@@ -465,7 +567,9 @@ int HTMLInput_set_url(lua_State* L)
 	assert(lua_gettop(L) == 2);
 	CEFCapture **video_input = (CEFCapture **)luaL_checkudata(L, 1, "HTMLInput");
 	string new_url = checkstdstring(L, 2);
-	(*video_input)->set_url(new_url);
+	if (is_primary_lua_state(L)) {
+		(*video_input)->set_url(new_url);
+	}
 	return 0;
 }
 
@@ -473,7 +577,9 @@ int HTMLInput_reload(lua_State* L)
 {
 	assert(lua_gettop(L) == 1);
 	CEFCapture **video_input = (CEFCapture **)luaL_checkudata(L, 1, "HTMLInput");
-	(*video_input)->reload();
+	if (is_primary_lua_state(L)) {
+		(*video_input)->reload();
+	}
 	return 0;
 }
 
@@ -482,7 +588,9 @@ int HTMLInput_set_max_fps(lua_State* L)
 	assert(lua_gettop(L) == 2);
 	CEFCapture **video_input = (CEFCapture **)luaL_checkudata(L, 1, "HTMLInput");
 	int max_fps = lrint(luaL_checknumber(L, 2));
-	(*video_input)->set_max_fps(max_fps);
+	if (is_primary_lua_state(L)) {
+		(*video_input)->set_max_fps(max_fps);
+	}
 	return 0;
 }
 
@@ -491,7 +599,9 @@ int HTMLInput_execute_javascript_async(lua_State* L)
 	assert(lua_gettop(L) == 2);
 	CEFCapture **video_input = (CEFCapture **)luaL_checkudata(L, 1, "HTMLInput");
 	string js = checkstdstring(L, 2);
-	(*video_input)->execute_javascript_async(js);
+	if (is_primary_lua_state(L)) {
+		(*video_input)->execute_javascript_async(js);
+	}
 	return 0;
 }
 
@@ -501,7 +611,9 @@ int HTMLInput_resize(lua_State* L)
 	CEFCapture **video_input = (CEFCapture **)luaL_checkudata(L, 1, "HTMLInput");
 	unsigned width = lrint(luaL_checknumber(L, 2));
 	unsigned height = lrint(luaL_checknumber(L, 3));
-	(*video_input)->resize(width, height);
+	if (is_primary_lua_state(L)) {
+		(*video_input)->resize(width, height);
+	}
 	return 0;
 }
 
@@ -741,6 +853,7 @@ const luaL_Reg VideoInput_funcs[] = {
 	{ "rewind", VideoInput_rewind },
 	{ "disconnect", VideoInput_disconnect },
 	{ "change_rate", VideoInput_change_rate },
+	{ "set_loop_cache_mb", VideoInput_set_loop_cache_mb },
 	{ "get_signal_num", VideoInput_get_signal_num },
 	{ NULL, NULL }
 };
@@ -954,7 +1067,7 @@ LiveInputWrapper::LiveInputWrapper(
 	}
 }
 
-bool LiveInputWrapper::connect_signal(int signal_num)
+bool LiveInputWrapper::connect_signal(int signal_num, const InputState *input_state)
 {
 	if (!user_connectable) {
 		return false;
@@ -966,7 +1079,7 @@ bool LiveInputWrapper::connect_signal(int signal_num)
 	}
 
 	signal_num = theme->map_signal(signal_num);
-	connect_signal_raw(signal_num, *theme->input_state);
+	connect_signal_raw(signal_num, *input_state);
 	return true;
 }
 
@@ -1088,13 +1201,41 @@ int call_num_channels(lua_State *L)
 	return num_channels;
 }
 
+// channel_needs_full_resolution() is optional; if the theme doesn't have it,
+// all channels are rendered at the size they are displayed at.
+bool call_channel_needs_full_resolution(lua_State *L, unsigned channel)
+{
+	lua_getglobal(L, "channel_needs_full_resolution");
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return false;
+	}
+	lua_pushnumber(L, channel);
+	if (lua_pcall(L, 1, 1, 0) != 0) {
+		fprintf(stderr, "error running function `channel_needs_full_resolution': %s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+
+	bool ret = checkbool(L, -1);
+	lua_pop(L, 1);
+	assert(lua_gettop(L) == 0);
+	return ret;
+}
+
 }  // namespace
 
-Theme::Theme(const string &filename, const vector<string> &search_dirs, ResourcePool *resource_pool, unsigned num_cards)
+Theme::Theme(const string &filename, const vector<string> &search_dirs, ResourcePool *resource_pool, unsigned num_cards, unsigned num_lua_states)
 	: resource_pool(resource_pool), num_cards(num_cards), signal_to_card_mapping(global_flags.default_stream_mapping)
 {
-	L = luaL_newstate();
-        luaL_openlibs(L);
+	assert(num_lua_states >= 1);
+	for (unsigned i = 0; i < num_lua_states; ++i) {
+		LuaState *state = new LuaState;
+		state->index = i;
+		state->L = luaL_newstate();
+		luaL_openlibs(state->L);
+		lua_states.emplace_back(state);
+	}
+	lua_State *L = lua_states[0]->L;
 
 	// Search through all directories until we find a file that will load
 	// (as in, does not return LUA_ERRFILE); then run it. We store load errors
@@ -1111,7 +1252,7 @@ Theme::Theme(const string &filename, const vector<string> &search_dirs, Resource
 	}
 
 	string path;
-	int theme_code_ref;
+	vector<int> theme_code_refs;  // One for each Lua state.
 	for (const string &dir : real_search_dirs) {
 		if (dir.empty()) {
 			path = filename;
@@ -1124,7 +1265,7 @@ Theme::Theme(const string &filename, const vector<string> &search_dirs, Resource
 			// (we need to set up the right environment below first,
 			// and we couldn't do that before, because we didn't know the
 			// path to put in Nageru.THEME_PATH).
-			theme_code_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+			theme_code_refs.push_back(luaL_ref(L, LUA_REGISTRYINDEX));
 			assert(lua_gettop(L) == 0);
 
 			success = true;
@@ -1146,6 +1287,17 @@ Theme::Theme(const string &filename, const vector<string> &search_dirs, Resource
 	}
 	assert(lua_gettop(L) == 0);
 
+	// Load the same file into the other Lua states, if any.
+	for (unsigned i = 1; i < lua_states.size(); ++i) {
+		lua_State *L = lua_states[i]->L;
+		if (luaL_loadfile(L, path.c_str()) != 0) {
+			fprintf(stderr, "%s\n", lua_tostring(L, -1));
+			exit(1);
+		}
+		theme_code_refs.push_back(luaL_ref(L, LUA_REGISTRYINDEX));
+		assert(lua_gettop(L) == 0);
+	}
+
 	// Make sure the path exposed to the theme (as Nageru.THEME_PATH;
 	// can be useful for locating files when talking to CEF) is absolute.
 	// In a sense, it would be nice if realpath() had a mode not to
@@ -1159,44 +1311,115 @@ Theme::Theme(const string &filename, const vector<string> &search_dirs, Resource
 		free(absolute_theme_path);
 	}
 
-	// Set up the API we provide.
-	register_constants();
-	register_class("EffectChain", EffectChain_funcs);
-	register_class("LiveInputWrapper", LiveInputWrapper_funcs);
-	register_class("ImageInput", ImageInput_funcs);
-	register_class("VideoInput", VideoInput_funcs);
-	register_class("HTMLInput", HTMLInput_funcs);
-	register_class("WhiteBalanceEffect", WhiteBalanceEffect_funcs);
-	register_class("ResampleEffect", ResampleEffect_funcs);
-	register_class("PaddingEffect", PaddingEffect_funcs);
-	register_class("IntegralPaddingEffect", IntegralPaddingEffect_funcs);
-	register_class("OverlayEffect", OverlayEffect_funcs);
-	register_class("ResizeEffect", ResizeEffect_funcs);
-	register_class("MultiplyEffect", MultiplyEffect_funcs);
-	register_class("MixEffect", MixEffect_funcs);
-	register_class("LiftGammaGainEffect", LiftGammaGainEffect_funcs);
-	register_class("InputStateInfo", InputStateInfo_funcs);
-	register_class("ThemeMenu", ThemeMenu_funcs);
-
-	// Now actually run the theme to get everything set up.
-	lua_rawgeti(L, LUA_REGISTRYINDEX, theme_code_ref);
-	luaL_unref(L, LUA_REGISTRYINDEX, theme_code_ref);
-	if (lua_pcall(L, 0, 0, 0)) {
-		fprintf(stderr, "Error when running %s: %s\n", path.c_str(), lua_tostring(L, -1));
-		exit(1);
+	for (unsigned i = 0; i < lua_states.size(); ++i) {
+		LuaState *state = lua_states[i].get();
+		lua_State *L = state->L;
+
+		// Set up the API we provide.
+		register_constants(L);
+		register_class(state, "EffectChain", EffectChain_funcs);
+		register_class(state, "LiveInputWrapper", LiveInputWrapper_funcs);
+		register_class(state, "ImageInput", ImageInput_funcs);
+		register_class(state, "VideoInput", VideoInput_funcs);
+		register_class(state, "HTMLInput", HTMLInput_funcs);
+		register_class(state, "WhiteBalanceEffect", WhiteBalanceEffect_funcs);
+		register_class(state, "ResampleEffect", ResampleEffect_funcs);
+		register_class(state, "PaddingEffect", PaddingEffect_funcs);
+		register_class(state, "IntegralPaddingEffect", IntegralPaddingEffect_funcs);
+		register_class(state, "OverlayEffect", OverlayEffect_funcs);
+		register_class(state, "ResizeEffect", ResizeEffect_funcs);
+		register_class(state, "MultiplyEffect", MultiplyEffect_funcs);
+		register_class(state, "MixEffect", MixEffect_funcs);
+		register_class(state, "LiftGammaGainEffect", LiftGammaGainEffect_funcs);
+		register_class(state, "InputStateInfo", InputStateInfo_funcs);
+		register_class(state, "ThemeMenu", ThemeMenu_funcs);
+
+		// Now actually run the theme to get everything set up.
+		lua_rawgeti(L, LUA_REGISTRYINDEX, theme_code_refs[i]);
+		luaL_unref(L, LUA_REGISTRYINDEX, theme_code_refs[i]);
+		if (lua_pcall(L, 0, 0, 0)) {
+			fprintf(stderr, "Error when running %s: %s\n", path.c_str(), lua_tostring(L, -1));
+			exit(1);
+		}
+		assert(lua_gettop(L) == 0);
 	}
-	assert(lua_gettop(L) == 0);
 
 	// Ask it for the number of channels.
 	num_channels = call_num_channels(L);
+
+	channel_needs_full_resolution.resize(num_channels + 2);
+	for (int channel = 1; channel < num_channels + 2; ++channel) {
+		channel_needs_full_resolution[channel] = call_channel_needs_full_resolution(L, channel);
+	}
+
+	if (lua_states.size() > 1) {
+		check_lua_states_agree();
+	}
+
+	global_metrics.add("theme_chain_decisions", {{ "source", "cache" }}, &metric_chain_decisions_cached);
+	global_metrics.add("theme_chain_decisions", {{ "source", "lua" }}, &metric_chain_decisions_lua);
 }
 
 Theme::~Theme()
 {
-	lua_close(L);
+	global_metrics.remove("theme_chain_decisions", {{ "source", "cache" }});
+	global_metrics.remove("theme_chain_decisions", {{ "source", "lua" }});
+	for (const unique_ptr<LuaState> &state : lua_states) {
+		// The cached decisions hold Lua references, which must be freed
+		// (without holding <m>, since the deleter takes it) before the state is closed.
+		{
+			map<unsigned, CachedChainDecision> old_decisions;  // Declared before the lock, so that it is freed after it.
+			lock_guard<mutex> lock(state->m);
+			swap(old_decisions, state->cached_chain_decisions);
+		}
+		lua_close(state->L);
+	}
+}
+
+// Check that all the Lua states have ended up the same way, and pick the same
+// chains for a given situation, so that it doesn't matter which one we ask.
+// This cannot catch everything (e.g. a theme that uses random numbers, or keeps
+// state that does not come from the calls we make), but it catches the most
+// likely problems early, instead of as subtly different previews later.
+void Theme::check_lua_states_agree()
+{
+	const LuaState *primary = lua_states[0].get();
+	for (const unique_ptr<LuaState> &state : lua_states) {
+		if (call_num_channels(state->L) != num_channels ||
+		    state->num_video_inputs != primary->num_video_inputs ||
+		    state->num_html_inputs != primary->num_html_inputs ||
+		    state->num_chains_created != primary->num_chains_created) {
+			fprintf(stderr, "ERROR: The theme did not set up the same way in all %zu Lua states, so it cannot be used with --theme-lua-states.\n",
+				lua_states.size());
+			exit(1);
+		}
+	}
+
+	// Ask every state for every channel's chain, as for the very first frame.
+	// (test_theme_lua_states goes further, with state changes and real signals.)
+	InputState input_state;
+	for (int channel = 0; channel < num_channels + 2; ++channel) {
+		unsigned primary_chain_number = get_chain_number(0, channel, 0.0f, global_flags.width, global_flags.height, input_state, /*use_cache=*/false);
+		for (unsigned state_index = 1; state_index < lua_states.size(); ++state_index) {
+			if (get_chain_number(state_index, channel, 0.0f, global_flags.width, global_flags.height, input_state, /*use_cache=*/false) != primary_chain_number) {
+				fprintf(stderr, "ERROR: Lua state %u chose a different chain for channel %d than the first one, so the theme cannot be used with --theme-lua-states.\n",
+					state_index, channel);
+				exit(1);
+			}
+		}
+	}
+}
+
+unsigned Theme::get_chain_number(unsigned state_index, unsigned num, float t, unsigned width, unsigned height, const InputState &input_state, bool use_cache)
+{
+	LuaState *state = lua_states[state_index].get();
+	Chain chain = get_chain(state, num, t, width, height, input_state, use_cache);  // Declared before the lock, so that it is freed after it.
+
+	lock_guard<mutex> lock(state->m);
+	return state->chain_numbers[chain.chain];
 }
 
-void Theme::register_constants()
+void Theme::register_constants(lua_State *L)
 {
 	// Set Nageru.VIDEO_FORMAT_BGRA = bmusb::PixelFormat_8BitBGRA, etc.
 	const vector<pair<string, int>> num_constants = {
@@ -1224,82 +1447,212 @@ void Theme::register_constants()
 	assert(lua_gettop(L) == 0);
 }
 
-void Theme::register_class(const char *class_name, const luaL_Reg *funcs)
+void Theme::register_class(LuaState *state, const char *class_name, const luaL_Reg *funcs)
 {
+	lua_State *L = state->L;
 	assert(lua_gettop(L) == 0);
 	luaL_newmetatable(L, class_name);  // mt = {}
 	lua_pushlightuserdata(L, this);
-	luaL_setfuncs(L, funcs, 1);        // for (name,f in funcs) { mt[name] = f, with upvalue {theme} }
+	lua_pushlightuserdata(L, state);
+	luaL_setfuncs(L, funcs, 2);        // for (name,f in funcs) { mt[name] = f, with upvalues {theme, state} }
 	lua_pushvalue(L, -1);
 	lua_setfield(L, -2, "__index");    // mt.__index = mt
 	lua_setglobal(L, class_name);      // ClassName = mt
 	assert(lua_gettop(L) == 0);
 }
 
-Theme::Chain Theme::get_chain(unsigned num, float t, unsigned width, unsigned height, const InputState &input_state) 
+Theme::LuaState *Theme::get_lua_state_for_channel(unsigned channel)
 {
-	Chain chain;
+	if (lua_states.size() == 1 || channel == 0) {
+		return lua_states[0].get();
+	}
+	return lua_states[1 + (channel - 1) % (lua_states.size() - 1)].get();
+}
 
-	lock_guard<mutex> lock(m);
-	assert(lua_gettop(L) == 0);
-	lua_getglobal(L, "get_chain");  /* function to be called */
-	lua_pushnumber(L, num);
-	lua_pushnumber(L, t);
-	lua_pushnumber(L, width);
-	lua_pushnumber(L, height);
-	wrap_lua_object<InputStateInfo>(L, "InputStateInfo", input_state);
+void Theme::for_each_lua_state(const function<void(LuaState *)> &func)
+{
+	for (const unique_ptr<LuaState> &state : lua_states) {
+		map<unsigned, CachedChainDecision> old_decisions;  // Declared before the lock, so that it is freed after it.
+		lock_guard<mutex> lock(state->m);
+		func(state.get());
+		swap(old_decisions, state->cached_chain_decisions);
+	}
+}
 
-	if (lua_pcall(L, 5, 2, 0) != 0) {
-		fprintf(stderr, "error running function `get_chain': %s\n", lua_tostring(L, -1));
-		exit(1);
+Theme::Chain Theme::get_chain(unsigned num, float t, unsigned width, unsigned height, const InputState &input_state)
+{
+	return get_chain(get_lua_state_for_channel(num), num, t, width, height, input_state, /*use_cache=*/true);
+}
+
+bool Theme::chain_decision_still_valid(const CachedChainDecision &decision, float t, unsigned width, unsigned height, const InputState &input_state)
+{
+	if (t >= decision.valid_until || width != decision.width || height != decision.height) {
+		return false;
 	}
+	for (const pair<unsigned, SignalProperties> &card_and_properties : decision.signals) {
+		if (!(get_signal_properties(input_state, card_and_properties.first) == card_and_properties.second)) {
+			return false;
+		}
+	}
+	return true;
+}
 
-	EffectChain *effect_chain = (EffectChain *)luaL_testudata(L, -2, "EffectChain");
-	if (effect_chain == nullptr) {
-		fprintf(stderr, "get_chain() for chain number %d did not return an EffectChain\n",
-			num);
+// Reads the table at the top of the stack (the third return value from get_chain()).
+void Theme::read_chain_dependencies(lua_State *L, unsigned num, const InputState &input_state, CachedChainDecision *decision)
+{
+	if (!lua_istable(L, -1)) {
+		fprintf(stderr, "get_chain() for chain number %d returned a third value that is not a table\n", num);
 		exit(1);
 	}
-	chain.chain = effect_chain;
-	if (!lua_isfunction(L, -1)) {
-		fprintf(stderr, "Argument #-1 should be a function\n");
-		exit(1);
+
+	lua_getfield(L, -1, "valid_until");
+	if (!lua_isnil(L, -1)) {
+		if (!lua_isnumber(L, -1)) {
+			fprintf(stderr, "get_chain() for chain number %d returned a valid_until that is not a number\n", num);
+			exit(1);
+		}
+		decision->valid_until = lua_tonumber(L, -1);
 	}
-	lua_pushvalue(L, -1);
-	shared_ptr<LuaRefWithDeleter> funcref(new LuaRefWithDeleter(&m, L, luaL_ref(L, LUA_REGISTRYINDEX)));
-	lua_pop(L, 2);
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "signals");
+	if (!lua_isnil(L, -1)) {
+		if (!lua_istable(L, -1)) {
+			fprintf(stderr, "get_chain() for chain number %d returned signals that are not a table\n", num);
+			exit(1);
+		}
+		for (int i = 1; ; ++i) {
+			lua_rawgeti(L, -1, i);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				break;
+			}
+			if (!lua_isnumber(L, -1)) {
+				fprintf(stderr, "get_chain() for chain number %d returned a signal that is not a number\n", num);
+				exit(1);
+			}
+			int card_index = map_signal(lua_tonumber(L, -1));
+			lua_pop(L, 1);
+			if (card_index < 0 || card_index >= MAX_VIDEO_CARDS) {
+				fprintf(stderr, "get_chain() for chain number %d depends on signal %d, which does not exist\n", num, card_index);
+				exit(1);
+			}
+			decision->signals.emplace_back(card_index, get_signal_properties(input_state, card_index));
+		}
+	}
+	lua_pop(L, 1);
+}
+
+Theme::Chain Theme::get_chain(LuaState *state, unsigned num, float t, unsigned width, unsigned height, const InputState &input_state, bool use_cache)
+{
+	Chain chain;
+	CachedChainDecision old_decision;  // Declared before the lock, so that it is freed after it.
+
+	lock_guard<mutex> lock(state->m);
+	lua_State *L = state->L;
 	assert(lua_gettop(L) == 0);
 
-	chain.setup_chain = [this, funcref, input_state, effect_chain]{
-		lock_guard<mutex> lock(m);
+	EffectChain *effect_chain;
+	shared_ptr<LuaRefWithDeleter> funcref;
+	auto cache_it = state->cached_chain_decisions.find(num);
+	if (use_cache && cache_it != state->cached_chain_decisions.end() &&
+	    chain_decision_still_valid(cache_it->second, t, width, height, input_state)) {
+		effect_chain = cache_it->second.chain;
+		funcref = cache_it->second.funcref;
+		++metric_chain_decisions_cached;
+	} else {
+		if (cache_it != state->cached_chain_decisions.end()) {
+			old_decision = move(cache_it->second);
+			state->cached_chain_decisions.erase(cache_it);
+		}
+
+		lua_getglobal(L, "get_chain");  /* function to be called */
+		lua_pushnumber(L, num);
+		lua_pushnumber(L, t);
+		lua_pushnumber(L, width);
+		lua_pushnumber(L, height);
+		wrap_lua_object<InputStateInfo>(L, "InputStateInfo", input_state);
 
-		assert(this->input_state == nullptr);
-		this->input_state = &input_state;
+		if (lua_pcall(L, 5, 3, 0) != 0) {
+			fprintf(stderr, "error running function `get_chain': %s\n", lua_tostring(L, -1));
+			exit(1);
+		}
 
-		// Set up state, including connecting signals.
+		effect_chain = (EffectChain *)luaL_testudata(L, -3, "EffectChain");
+		if (effect_chain == nullptr) {
+			fprintf(stderr, "get_chain() for chain number %d did not return an EffectChain\n",
+				num);
+			exit(1);
+		}
+		if (!lua_isfunction(L, -2)) {
+			fprintf(stderr, "Argument #-2 should be a function\n");
+			exit(1);
+		}
+		lua_pushvalue(L, -2);
+		funcref.reset(new LuaRefWithDeleter(&state->m, L, luaL_ref(L, LUA_REGISTRYINDEX)));
+
+		// If the theme told us what its choice depends on, remember it.
+		if (use_cache && !lua_isnil(L, -1)) {
+			CachedChainDecision decision;
+			decision.width = width;
+			decision.height = height;
+			decision.valid_until = numeric_limits<double>::infinity();
+			decision.chain = effect_chain;
+			decision.funcref = funcref;
+			read_chain_dependencies(L, num, input_state, &decision);
+			state->cached_chain_decisions[num] = move(decision);
+		}
+		lua_pop(L, 3);
+		++metric_chain_decisions_lua;
+	}
+	assert(lua_gettop(L) == 0);
+	chain.chain = effect_chain;
+
+	chain.setup_chain = [this, state, funcref, input_state, effect_chain, t]{
+		lock_guard<mutex> lock(state->m);
+		lua_State *L = state->L;
+
+		assert(state->input_state == nullptr);
+		state->input_state = &input_state;
+
+		// Set up state, including connecting signals. The prepare function
+		// gets the current time, since it may be reused for many frames.
 		lua_rawgeti(L, LUA_REGISTRYINDEX, funcref->get());
-		if (lua_pcall(L, 0, 0, 0) != 0) {
+		lua_pushnumber(L, t);
+		if (lua_pcall(L, 1, 0, 0) != 0) {
 			fprintf(stderr, "error running chain setup callback: %s\n", lua_tostring(L, -1));
 			exit(1);
 	}
 		assert(lua_gettop(L) == 0);
 
 		// The theme can't (or at least shouldn't!) call connect_signal() on
-		// each FFmpeg or CEF input, so we'll do it here.
-		if (video_signal_connections.count(effect_chain)) {
-			for (const VideoSignalConnection &conn : video_signal_connections[effect_chain]) {
-				conn.wrapper->connect_signal_raw(conn.source->get_card_index(), input_state);
+		// each FFmpeg or CEF input, so we'll do it here. (The connections are
+		// copied out, since other Lua states could be adding to them.)
+		vector<VideoSignalConnection> video_connections;
+#ifdef HAVE_CEF
+		vector<CEFSignalConnection> html_connections;
+#endif
+		{
+			lock_guard<mutex> lock(signal_connections_m);
+			if (video_signal_connections.count(effect_chain)) {
+				video_connections = video_signal_connections[effect_chain];
 			}
-		}
 #ifdef HAVE_CEF
-		if (html_signal_connections.count(effect_chain)) {
-			for (const CEFSignalConnection &conn : html_signal_connections[effect_chain]) {
-				conn.wrapper->connect_signal_raw(conn.source->get_card_index(), input_state);
+			if (html_signal_connections.count(effect_chain)) {
+				html_connections = html_signal_connections[effect_chain];
 			}
+#endif
+		}
+		for (const VideoSignalConnection &conn : video_connections) {
+			conn.wrapper->connect_signal_raw(conn.source->get_card_index(), input_state);
+		}
+#ifdef HAVE_CEF
+		for (const CEFSignalConnection &conn : html_connections) {
+			conn.wrapper->connect_signal_raw(conn.source->get_card_index(), input_state);
 		}
 #endif
 
-		this->input_state = nullptr;
+		state->input_state = nullptr;
 	};
 
 	// TODO: Can we do better, e.g. by running setup_chain() and seeing what it references?
@@ -1316,7 +1669,9 @@ Theme::Chain Theme::get_chain(unsigned num, float t, unsigned width, unsigned he
 
 string Theme::get_channel_name(unsigned channel)
 {
-	lock_guard<mutex> lock(m);
+	LuaState *state = get_lua_state_for_queries();
+	lock_guard<mutex> lock(state->m);
+	lua_State *L = state->L;
 	lua_getglobal(L, "channel_name");
 	lua_pushnumber(L, channel);
 	if (lua_pcall(L, 1, 1, 0) != 0) {
@@ -1337,7 +1692,9 @@ string Theme::get_channel_name(unsigned channel)
 
 int Theme::get_channel_signal(unsigned channel)
 {
-	lock_guard<mutex> lock(m);
+	LuaState *state = get_lua_state_for_queries();
+	lock_guard<mutex> lock(state->m);
+	lua_State *L = state->L;
 	lua_getglobal(L, "channel_signal");
 	lua_pushnumber(L, channel);
 	if (lua_pcall(L, 1, 1, 0) != 0) {
@@ -1353,7 +1710,9 @@ int Theme::get_channel_signal(unsigned channel)
 
 std::string Theme::get_channel_color(unsigned channel)
 {
-	lock_guard<mutex> lock(m);
+	LuaState *state = get_lua_state_for_queries();
+	lock_guard<mutex> lock(state->m);
+	lua_State *L = state->L;
 	lua_getglobal(L, "channel_color");
 	lua_pushnumber(L, channel);
 	if (lua_pcall(L, 1, 1, 0) != 0) {
@@ -1375,7 +1734,9 @@ std::string Theme::get_channel_color(unsigned channel)
 
 bool Theme::get_supports_set_wb(unsigned channel)
 {
-	lock_guard<mutex> lock(m);
+	LuaState *state = get_lua_state_for_queries();
+	lock_guard<mutex> lock(state->m);
+	lua_State *L = state->L;
 	lua_getglobal(L, "supports_set_wb");
 	lua_pushnumber(L, channel);
 	if (lua_pcall(L, 1, 1, 0) != 0) {
@@ -1391,23 +1752,27 @@ bool Theme::get_supports_set_wb(unsigned channel)
 
 void Theme::set_wb(unsigned channel, double r, double g, double b)
 {
-	lock_guard<mutex> lock(m);
-	lua_getglobal(L, "set_wb");
-	lua_pushnumber(L, channel);
-	lua_pushnumber(L, r);
-	lua_pushnumber(L, g);
-	lua_pushnumber(L, b);
-	if (lua_pcall(L, 4, 0, 0) != 0) {
-		fprintf(stderr, "error running function `set_wb': %s\n", lua_tostring(L, -1));
-		exit(1);
-	}
+	for_each_lua_state([channel, r, g, b](LuaState *state) {
+		lua_State *L = state->L;
+		lua_getglobal(L, "set_wb");
+		lua_pushnumber(L, channel);
+		lua_pushnumber(L, r);
+		lua_pushnumber(L, g);
+		lua_pushnumber(L, b);
+		if (lua_pcall(L, 4, 0, 0) != 0) {
+			fprintf(stderr, "error running function `set_wb': %s\n", lua_tostring(L, -1));
+			exit(1);
+		}
 
-	assert(lua_gettop(L) == 0);
+		assert(lua_gettop(L) == 0);
+	});
 }
 
 vector<string> Theme::get_transition_names(float t)
 {
-	lock_guard<mutex> lock(m);
+	LuaState *state = get_lua_state_for_queries();
+	lock_guard<mutex> lock(state->m);
+	lua_State *L = state->L;
 	lua_getglobal(L, "get_transitions");
 	lua_pushnumber(L, t);
 	if (lua_pcall(L, 1, 1, 0) != 0) {
@@ -1463,45 +1828,55 @@ int Theme::map_signal(int signal_num)
 
 void Theme::set_signal_mapping(int signal_num, int card_num)
 {
-	lock_guard<mutex> lock(map_m);
-	assert(card_num < int(num_cards));
-	signal_to_card_mapping[signal_num] = card_num;
+	{
+		lock_guard<mutex> lock(map_m);
+		assert(card_num < int(num_cards));
+		signal_to_card_mapping[signal_num] = card_num;
+	}
+
+	// Cached chain decisions may have looked at the old card.
+	for_each_lua_state([](LuaState *) {});
 }
 
 void Theme::transition_clicked(int transition_num, float t)
 {
-	lock_guard<mutex> lock(m);
-	lua_getglobal(L, "transition_clicked");
-	lua_pushnumber(L, transition_num);
-	lua_pushnumber(L, t);
+	for_each_lua_state([transition_num, t](LuaState *state) {
+		lua_State *L = state->L;
+		lua_getglobal(L, "transition_clicked");
+		lua_pushnumber(L, transition_num);
+		lua_pushnumber(L, t);
 
-	if (lua_pcall(L, 2, 0, 0) != 0) {
-		fprintf(stderr, "error running function `transition_clicked': %s\n", lua_tostring(L, -1));
-		exit(1);
-	}
-	assert(lua_gettop(L) == 0);
+		if (lua_pcall(L, 2, 0, 0) != 0) {
+			fprintf(stderr, "error running function `transition_clicked': %s\n", lua_tostring(L, -1));
+			exit(1);
+		}
+		assert(lua_gettop(L) == 0);
+	});
 }
 
 void Theme::channel_clicked(int preview_num)
 {
-	lock_guard<mutex> lock(m);
-	lua_getglobal(L, "channel_clicked");
-	lua_pushnumber(L, preview_num);
+	for_each_lua_state([preview_num](LuaState *state) {
+		lua_State *L = state->L;
+		lua_getglobal(L, "channel_clicked");
+		lua_pushnumber(L, preview_num);
 
-	if (lua_pcall(L, 1, 0, 0) != 0) {
-		fprintf(stderr, "error running function `channel_clicked': %s\n", lua_tostring(L, -1));
-		exit(1);
-	}
-	assert(lua_gettop(L) == 0);
+		if (lua_pcall(L, 1, 0, 0) != 0) {
+			fprintf(stderr, "error running function `channel_clicked': %s\n", lua_tostring(L, -1));
+			exit(1);
+		}
+		assert(lua_gettop(L) == 0);
+	});
 }
 
-int Theme::set_theme_menu(lua_State *L)
+int Theme::set_theme_menu(LuaState *state, lua_State *L)
 {
-	for (const Theme::MenuEntry &entry : theme_menu) {
-		luaL_unref(L, LUA_REGISTRYINDEX, entry.lua_ref);
+	for (int ref : state->theme_menu_refs) {
+		luaL_unref(L, LUA_REGISTRYINDEX, ref);
 	}
-	theme_menu.clear();
+	state->theme_menu_refs.clear();
 
+	vector<MenuEntry> new_menu;
 	int num_elements = lua_gettop(L);
 	for (int i = 1; i <= num_elements; ++i) {
 		lua_rawgeti(L, i, 1);
@@ -1512,13 +1887,19 @@ int Theme::set_theme_menu(lua_State *L)
 		luaL_checktype(L, -1, LUA_TFUNCTION);
 		int ref = luaL_ref(L, LUA_REGISTRYINDEX);
 
-		theme_menu.push_back(MenuEntry{ text, ref });
+		state->theme_menu_refs.push_back(ref);
+		new_menu.push_back(MenuEntry{ text, ref });
 	}
 	lua_pop(L, num_elements);
 	assert(lua_gettop(L) == 0);
 
-	if (theme_menu_callback != nullptr) {
-		theme_menu_callback();
+	// Only the primary's menu is shown; the other Lua states just keep
+	// their callbacks, so that they can be called along with the primary's.
+	if (state->index == 0) {
+		theme_menu = move(new_menu);
+		if (theme_menu_callback != nullptr) {
+			theme_menu_callback();
+		}
 	}
 
 	return 0;
@@ -1526,10 +1907,28 @@ int Theme::set_theme_menu(lua_State *L)
 
 void Theme::theme_menu_entry_clicked(int lua_ref)
 {
-	lock_guard<mutex> lock(m);
-	lua_rawgeti(L, LUA_REGISTRYINDEX, lua_ref);
-	if (lua_pcall(L, 0, 0, 0) != 0) {
-		fprintf(stderr, "error running menu callback: %s\n", lua_tostring(L, -1));
-		exit(1);
+	// <lua_ref> is from the primary's menu; find the same entry in the others.
+	size_t entry_num;
+	{
+		lock_guard<mutex> lock(lua_states[0]->m);
+		const vector<int> &refs = lua_states[0]->theme_menu_refs;
+		auto it = find(refs.begin(), refs.end(), lua_ref);
+		if (it == refs.end()) {
+			// The menu has changed since it was shown.
+			return;
+		}
+		entry_num = distance(refs.begin(), it);
 	}
+
+	for_each_lua_state([entry_num](LuaState *state) {
+		if (entry_num >= state->theme_menu_refs.size()) {
+			return;
+		}
+		lua_State *L = state->L;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, state->theme_menu_refs[entry_num]);
+		if (lua_pcall(L, 0, 0, 0) != 0) {
+			fprintf(stderr, "error running menu callback: %s\n", lua_tostring(L, -1));
+			exit(1);
+		}
+	});
 }
@@ -5,8 +5,10 @@
 #include <movit/flat_input.h>
 #include <movit/ycbcr_input.h>
 #include <stdbool.h>
+#include <atomic>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
@@ -19,6 +21,7 @@
 class CEFCapture;
 class FFmpegCapture;
 class LiveInputWrapper;
+class LuaRefWithDeleter;
 struct InputState;
 
 namespace movit {
@@ -29,9 +32,75 @@ class ResourcePool;
 
 class Theme {
 public:
-	Theme(const std::string &filename, const std::vector<std::string> &search_dirs, movit::ResourcePool *resource_pool, unsigned num_cards);
+	Theme(const std::string &filename, const std::vector<std::string> &search_dirs, movit::ResourcePool *resource_pool, unsigned num_cards, unsigned num_lua_states = 1);
 	~Theme();
 
+	// What get_chain() can look at when choosing a chain for a signal;
+	// the same as what the theme can ask InputStateInfo for, minus the subtitle.
+	struct SignalProperties {
+		unsigned width, height;
+		bool interlaced, has_signal, is_connected;
+		unsigned frame_rate_nom, frame_rate_den;
+
+		bool operator==(const SignalProperties &other) const
+		{
+			return width == other.width && height == other.height &&
+				interlaced == other.interlaced && has_signal == other.has_signal &&
+				is_connected == other.is_connected &&
+				frame_rate_nom == other.frame_rate_nom && frame_rate_den == other.frame_rate_den;
+		}
+	};
+
+	// A choice of chain (and prepare function) made by the theme's get_chain(),
+	// kept if the theme also returned what the choice depends on. Until one of
+	// those changes, we reuse it instead of calling get_chain() again;
+	// see get_chain() in theme.lua for the details.
+	struct CachedChainDecision {
+		unsigned width, height;
+		double valid_until;  // The choice holds for t < valid_until.
+		std::vector<std::pair<unsigned, SignalProperties>> signals;  // Card index and what it looked like.
+		movit::EffectChain *chain = nullptr;
+		std::shared_ptr<LuaRefWithDeleter> funcref;
+	};
+
+	// A copy of the theme, running in its own Lua interpreter. With more than
+	// one (see --theme-lua-states), each channel is tied to one of them
+	// (the live channel gets the first one to itself), so that getting and
+	// setting up the chain for one channel does not have to wait for the others.
+	//
+	// Calls that change the theme's state (transition_clicked(), channel_clicked(),
+	// set_wb() and menu entries) are made on all of them, in the same order,
+	// so as long as the theme is deterministic, they stay in sync; calls that
+	// only ask for something go to the last one, which has the fewest channels.
+	// Signal mappings live on the C++ side and are shared. Inputs (VideoInput,
+	// HTMLInput) are only created by the first one, the primary; the others get
+	// the same objects, in the same order, and calls on them that have side
+	// effects (rewind() and so on) are only carried out when they come from
+	// the primary. The menu is also taken from the primary.
+	//
+	// Public only so that the Lua bindings in theme.cpp can get at it.
+	struct LuaState {
+		unsigned index;  // 0 is the primary.
+		std::mutex m;
+		lua_State *L;  // Protected by <m>.
+		const InputState *input_state = nullptr;  // Protected by <m>. Only set temporarily, during chain setup.
+
+		// How many of each input this state has asked for; protected by <m>.
+		unsigned num_video_inputs = 0, num_html_inputs = 0;
+
+		// Every EffectChain this state has made, numbered in order of creation,
+		// so that we can check that the states choose the same chains.
+		// Protected by <m>.
+		std::unordered_map<const movit::EffectChain *, unsigned> chain_numbers;
+		unsigned num_chains_created = 0;
+
+		std::vector<int> theme_menu_refs;  // Protected by <m>. The callbacks for the current menu, in order.
+
+		// Indexed by channel number. Protected by <m>, but must be freed
+		// without holding it (the LuaRefWithDeleter takes it).
+		std::map<unsigned, CachedChainDecision> cached_chain_decisions;
+	};
+
 	struct Chain {
 		movit::EffectChain *chain;
 		std::function<void()> setup_chain;
@@ -43,12 +112,24 @@ public:
 
 	Chain get_chain(unsigned num, float t, unsigned width, unsigned height, const InputState &input_state);
 
+	// For checking that the Lua states agree (see test_theme_lua_states.cpp):
+	// Which chain Lua state <state_index> picks for channel <num>, numbered
+	// in the order the state created its chains. Without <use_cache>,
+	// the theme is always asked, and the state's cache is left alone.
+	unsigned get_num_lua_states() const { return lua_states.size(); }
+	unsigned get_lua_state_index_for_channel(unsigned channel) { return get_lua_state_for_channel(channel)->index; }
+	unsigned get_chain_number(unsigned state_index, unsigned num, float t, unsigned width, unsigned height, const InputState &input_state, bool use_cache);
+
 	int get_num_channels() const { return num_channels; }
 	int map_signal(int signal_num);
 	void set_signal_mapping(int signal_num, int card_num);
 	std::string get_channel_name(unsigned channel);
 	int get_channel_signal(unsigned channel);
 	bool get_supports_set_wb(unsigned channel);
+	bool get_channel_needs_full_resolution(unsigned channel) const
+	{
+		return channel < channel_needs_full_resolution.size() && channel_needs_full_resolution[channel];
+	}
 	void set_wb(unsigned channel, double r, double g, double b);
 	std::string get_channel_color(unsigned channel);
 
@@ -85,12 +166,14 @@ public:
 
 	void register_video_signal_connection(movit::EffectChain *chain, LiveInputWrapper *live_input, FFmpegCapture *capture)
 	{
+		std::lock_guard<std::mutex> lock(signal_connections_m);
 		video_signal_connections[chain].emplace_back(VideoSignalConnection { live_input, capture });
 	}
 
 #ifdef HAVE_CEF
 	void register_html_signal_connection(movit::EffectChain *chain, LiveInputWrapper *live_input, CEFCapture *capture)
 	{
+		std::lock_guard<std::mutex> lock(signal_connections_m);
 		html_signal_connections[chain].emplace_back(CEFSignalConnection { live_input, capture });
 	}
 #endif
@@ -110,23 +193,37 @@ public:
 	}
 
 private:
-	void register_constants();
-	void register_class(const char *class_name, const luaL_Reg *funcs);
-	int set_theme_menu(lua_State *L);
+	void register_constants(lua_State *L);
+	void register_class(LuaState *state, const char *class_name, const luaL_Reg *funcs);
+	int set_theme_menu(LuaState *state, lua_State *L);
+	Chain get_chain(LuaState *state, unsigned num, float t, unsigned width, unsigned height, const InputState &input_state, bool use_cache);
+	void read_chain_dependencies(lua_State *L, unsigned num, const InputState &input_state, CachedChainDecision *decision);
+	bool chain_decision_still_valid(const CachedChainDecision &decision, float t, unsigned width, unsigned height, const InputState &input_state);
+	LuaState *get_lua_state_for_channel(unsigned channel);
+	LuaState *get_lua_state_for_queries() { return lua_states.back().get(); }
+
+	// Takes each state's lock in turn. Since <func> is assumed to change
+	// the theme's state, all cached chain decisions are dropped.
+	void for_each_lua_state(const std::function<void(LuaState *)> &func);
+	void check_lua_states_agree();
 
 	std::string theme_path;
 
-	std::mutex m;
-	lua_State *L;  // Protected by <m>.
-	const InputState *input_state = nullptr;  // Protected by <m>. Only set temporarily, during chain setup.
+	std::vector<std::unique_ptr<LuaState>> lua_states;  // Never empty.
 	movit::ResourcePool *resource_pool;
 	int num_channels;
 	unsigned num_cards;
 
+	// Channels that should be rendered at full resolution even for display,
+	// indexed by channel number (as in get_chain()). Set once at startup.
+	std::vector<bool> channel_needs_full_resolution;
+
 	std::mutex map_m;
 	std::map<int, int> signal_to_card_mapping;  // Protected by <map_m>.
 
 	std::vector<FFmpegCapture *> video_inputs;
+
+	std::mutex signal_connections_m;  // Protects video_signal_connections and html_signal_connections.
 	struct VideoSignalConnection {
 		LiveInputWrapper *wrapper;
 		FFmpegCapture *source;
@@ -146,6 +243,9 @@ private:
 	std::vector<MenuEntry> theme_menu;
 	std::function<void()> theme_menu_callback;
 
+	std::atomic<int64_t> metric_chain_decisions_cached{0};
+	std::atomic<int64_t> metric_chain_decisions_lua{0};
+
 	friend class LiveInputWrapper;
 	friend int ThemeMenu_set(lua_State *L);
 };
@@ -160,7 +260,7 @@ public:
 	// Note: <override_bounce> is irrelevant for PixelFormat_8BitBGRA.
 	LiveInputWrapper(Theme *theme, movit::EffectChain *chain, bmusb::PixelFormat pixel_format, bool override_bounce, bool deinterlace, bool user_connectable);
 
-	bool connect_signal(int signal_num);  // Must be called with the theme's <m> lock held, since it accesses theme->input_state. Returns false on error.
+	bool connect_signal(int signal_num, const InputState *input_state);  // <input_state> is from the calling Lua state, whose lock must be held. Returns false on error.
 	void connect_signal_raw(int signal_num, const InputState &input_state);
 	movit::Effect *get_effect() const
 	{
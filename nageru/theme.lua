@@ -384,6 +384,17 @@ function supports_set_wb(channel)
 	return is_plain_signal(channel - 2)
 end
 
+-- API ENTRY POINT
+-- Returns if a given channel (starting from 1, the preview) must always be
+-- rendered at the full output resolution. If not (or if this function does
+-- not exist), Nageru is free to render the channel at the size it is shown
+-- on screen, which saves a lot of GPU time on large previews; get_chain()
+-- will then be called with that smaller width and height.
+-- Called only once for each channel, at the start of the program.
+function channel_needs_full_resolution(channel)
+	return false
+end
+
 -- API ENTRY POINT
 -- Gets called with a new gray point when the white balance is changing.
 -- The color is in linear light (not sRGB gamma).
@@ -508,7 +519,7 @@ function get_fade_chain(state, signals, t, width, height, input_resolution)
 	local input1_type = get_input_type(signals, state.transition_dst_signal)
 	local input1_scale = needs_scale(signals, state.transition_dst_signal, width, height)
 	local chain = fade_chains[input0_type][input0_scale][input1_type][input1_scale][true]
-	local prepare = function()
+	local prepare = function(t)
 		if input0_type == "live" or input0_type == "livedeint" then
 			chain.input0.input:connect_signal(state.transition_src_signal)
 			set_neutral_color_from_signal(state, chain.input0.wb_effect, state.transition_src_signal)
@@ -548,7 +559,7 @@ end
 -- for any signal number, and use that to e.g. assist in chain selection.
 --
 -- You should return two objects; the chain itself, and then a
--- function (taking no parameters) that is run just before rendering.
+-- function (taking the current time t) that is run just before rendering.
 -- The function needs to call connect_signal on any inputs, so that
 -- it gets updated video data for the given frame. (You are allowed
 -- to switch which input your input is getting from between frames,
@@ -556,6 +567,27 @@ end
 -- If you want to change any parameters in the chain, this is also
 -- the right place.
 --
+-- You can optionally return a third object, a table saying what your
+-- choice of chain depends on. If you do, Nageru will not call get_chain()
+-- for this channel again, but keep using the same chain and function
+-- (called with the new t each frame), until one of these changes:
+--
+--  - t reaches <valid_until>, if given (e.g. the end of a transition).
+--  - Any of the signals listed in <signals> changes resolution,
+--    interlacing, frame rate or whether it is connected or has signal.
+--  - <width> or <height> changes.
+--  - The theme's state may have changed, i.e. transition_clicked(),
+--    channel_clicked(), set_wb() or a menu entry has been called,
+--    or a signal has been mapped to a different card.
+--
+-- So when doing this, the function must take t as a parameter instead of
+-- using the one given to get_chain(), and anything else you base your
+-- choice on must be covered by the list above.
+--
+-- For channels other than live (num==0), <width> and <height> are the size
+-- the channel is being displayed at, which may be smaller than the output
+-- resolution; see channel_needs_full_resolution().
+--
 -- NOTE: The chain returned must be finalized with the Y'CbCr flag
 -- if and only if num==0.
 function get_chain(num, t, width, height, signals)
@@ -594,38 +626,48 @@ function get_chain(num, t, width, height, signals)
 	end
 	state_copy.neutral_colors = { unpack(state.neutral_colors) }
 
+	-- Everything below looks at both signals (through input_resolution),
+	-- and otherwise only at the state, so the choice can be kept until
+	-- one of them changes.
+	local depends_on = { signals = { INPUT0_SIGNAL_NUM, INPUT1_SIGNAL_NUM } }
+
 	if num == 0 then  -- Live.
 		finish_transitions(t)
+		if state.transition_type ~= NO_TRANSITION then
+			-- finish_transitions() will change the state at the end.
+			depends_on.valid_until = state.transition_end
+		end
 		if state.transition_type == ZOOM_TRANSITION then
 			-- Transition in or out of SBS.
 			local chain = get_sbs_chain(signals, t, width, height, input_resolution)
-			local prepare = function()
+			local prepare = function(t)
 				prepare_sbs_chain(state_copy, chain, calc_zoom_progress(state_copy, t), state_copy.transition_type, state_copy.transition_src_signal, state_copy.transition_dst_signal, width, height, input_resolution)
 			end
-			return chain.chain, prepare
+			return chain.chain, prepare, depends_on
 		elseif state.transition_type == NO_TRANSITION and state.live_signal_num == SBS_SIGNAL_NUM then
 			-- Static SBS view.
 			local chain = get_sbs_chain(signals, t, width, height, input_resolution)
-			local prepare = function()
+			local prepare = function(t)
 				prepare_sbs_chain(state_copy, chain, 0.0, NO_TRANSITION, 0, SBS_SIGNAL_NUM, width, height, input_resolution)
 			end
-			return chain.chain, prepare
+			return chain.chain, prepare, depends_on
 		elseif state.transition_type == FADE_TRANSITION then
-			return get_fade_chain(state_copy, signals, t, width, height, input_resolution)
+			local chain, prepare = get_fade_chain(state_copy, signals, t, width, height, input_resolution)
+			return chain, prepare, depends_on
 		elseif is_plain_signal(state.live_signal_num) then
 			local input_type = get_input_type(signals, state.live_signal_num)
 			local input_scale = needs_scale(signals, state.live_signal_num, width, height)
 			local chain = simple_chains[input_type][input_scale][true]
-			local prepare = function()
+			local prepare = function(t)
 				chain.input:connect_signal(state_copy.live_signal_num)
 				set_scale_parameters_if_needed(chain, width, height)
 				set_neutral_color_from_signal(state_copy, chain.wb_effect, state_copy.live_signal_num)
 			end
-			return chain.chain, prepare
+			return chain.chain, prepare, depends_on
 		elseif state.live_signal_num == STATIC_SIGNAL_NUM then  -- Static picture.
-			local prepare = function()
+			local prepare = function(t)
 			end
-			return static_chain_hq, prepare
+			return static_chain_hq, prepare, depends_on
 		else
 			assert(false)
 		end
@@ -640,26 +682,26 @@ function get_chain(num, t, width, height, signals)
 		local input_type = get_input_type(signals, signal_num)
 		local input_scale = needs_scale(signals, signal_num, width, height)
 		local chain = simple_chains[input_type][input_scale][false]
-		local prepare = function()
+		local prepare = function(t)
 			chain.input:connect_signal(signal_num)
 			set_scale_parameters_if_needed(chain, width, height)
 			set_neutral_color(chain.wb_effect, state_copy.neutral_colors[signal_num + 1])
 		end
-		return chain.chain, prepare
+		return chain.chain, prepare, depends_on
 	end
 	if num == SBS_SIGNAL_NUM + 2 then
 		local input0_type = get_input_type(signals, INPUT0_SIGNAL_NUM)
 		local input1_type = get_input_type(signals, INPUT1_SIGNAL_NUM)
 		local chain = sbs_chains[input0_type][input1_type][false]
-		local prepare = function()
+		local prepare = function(t)
 			prepare_sbs_chain(state_copy, chain, 0.0, NO_TRANSITION, 0, SBS_SIGNAL_NUM, width, height, input_resolution)
 		end
-		return chain.chain, prepare
+		return chain.chain, prepare, depends_on
 	end
 	if num == STATIC_SIGNAL_NUM + 2 then
-		local prepare = function()
+		local prepare = function(t)
 		end
-		return static_chain_lq, prepare
+		return static_chain_lq, prepare, depends_on
 	end
 end
 
@@ -0,0 +1,187 @@
+// Measures how long it takes to scrape a large number of metrics
+// (5000 series by default), and how long add()/remove() take while
+// scrapes are running in another thread. Also checks that the quantiles
+// from Summary stay within the documented error bounds, compared to
+// computing them exactly from all the samples.
+//
+// Usage: benchmark_metrics [NUM_SERIES]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "shared/metrics.h"
+
+#define NUM_SCRAPES 200
+#define NUM_REGISTRATIONS 20000
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// The way Summary used to compute quantiles, from all samples in the window.
+double exact_quantile(const vector<double> &sorted_values, double quantile, double *lower, double *upper)
+{
+	double idx = quantile * (sorted_values.size() - 1);
+	size_t idx_floor = size_t(floor(idx));
+	*lower = *upper = sorted_values[idx_floor];
+	if (idx_floor == sorted_values.size() - 1) {
+		return sorted_values[idx_floor];
+	}
+	double t = idx - idx_floor;
+	*upper = sorted_values[idx_floor + 1];
+	return *lower + t * (*upper - *lower);
+}
+
+// Returns false if any quantile is outside the documented error bounds.
+template<class Distribution>
+bool check_summary_accuracy(const char *name, Distribution distribution, unsigned num_samples)
+{
+	vector<double> quantiles{0.0, 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99, 0.999, 1.0};
+	Summary summary;
+	summary.init(quantiles, 3600.0);  // Long enough that nothing expires while we test.
+
+	mt19937 rng(1234);
+	vector<double> values;
+	for (unsigned i = 0; i < num_samples; ++i) {
+		double val = distribution(rng);
+		values.push_back(val);
+		summary.count_event(val);
+	}
+	sort(values.begin(), values.end());
+
+	vector<double> estimates = summary.get_quantiles();
+	double max_relative_error = 0.0;
+	bool ok = true;
+	for (size_t i = 0; i < quantiles.size(); ++i) {
+		double lower, upper;
+		double exact = exact_quantile(values, quantiles[i], &lower, &upper);
+		double scale = max(max(fabs(lower), fabs(upper)), Summary::min_magnitude);
+		double relative_error = fabs(estimates[i] - exact) / scale;
+		max_relative_error = max(max_relative_error, relative_error);
+		if (relative_error > Summary::relative_accuracy * (1.0 + 1e-9)) {
+			fprintf(stderr, "%s: quantile %g is %g, should be %g (error %.4f%%)\n",
+				name, quantiles[i], estimates[i], exact, relative_error * 100.0);
+			ok = false;
+		}
+	}
+	printf("  %-30s max error %.4f%% (bound %.4f%%): %s\n", name,
+		max_relative_error * 100.0, Summary::relative_accuracy * 100.0, ok ? "OK" : "FAILED");
+	return ok;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	unsigned num_series = (argc >= 2) ? atoi(argv[1]) : 5000;
+
+	printf("Summary accuracy versus exact quantiles:\n");
+	bool ok = true;
+	ok &= check_summary_accuracy("1 sample", uniform_real_distribution<double>(0.001, 0.1), 1);
+	ok &= check_summary_accuracy("uniform latency (1-100 ms)", uniform_real_distribution<double>(0.001, 0.1), 100000);
+	ok &= check_summary_accuracy("lognormal latency", lognormal_distribution<double>(log(0.02), 1.0), 100000);
+	ok &= check_summary_accuracy("frame sizes (bytes)", exponential_distribution<double>(1.0 / 200000.0), 100000);
+	ok &= check_summary_accuracy("margin (around zero)", normal_distribution<double>(0.0, 0.005), 100000);
+
+	Summary summary;
+	summary.init({0.5, 0.99}, 60.0);
+	steady_clock::time_point start = steady_clock::now();
+	for (unsigned i = 0; i < 1000000; ++i) {
+		summary.count_event(i * 1e-6);
+	}
+	printf("Summary::count_event(): %.1f ns per call\n\n",
+		1e9 * duration<double>(steady_clock::now() - start).count() / 1000000);
+
+	// Roughly the mix we see in practice: Mostly plain counters and gauges,
+	// some histograms and a few summaries. (Histograms and summaries count
+	// as one series each here, even though they produce many lines.)
+	unsigned num_histograms = num_series / 20;
+	unsigned num_summaries = num_series / 100;
+	unsigned num_doubles = num_series / 10;
+	unsigned num_int64s = num_series - num_histograms - num_summaries - num_doubles;
+
+	unique_ptr<atomic<int64_t>[]> int64s(new atomic<int64_t>[num_int64s]);
+	unique_ptr<atomic<double>[]> doubles(new atomic<double>[num_doubles]);
+	unique_ptr<Histogram[]> histograms(new Histogram[num_histograms]);
+	unique_ptr<Summary[]> summaries(new Summary[num_summaries]);
+
+	for (unsigned i = 0; i < num_int64s; ++i) {
+		int64s[i] = i * 12345;
+		global_metrics.add(i % 2 ? "benchmark_counter" : "benchmark_gauge",
+			{{ "card", to_string(i % 16) }, { "index", to_string(i) }},
+			&int64s[i], i % 2 ? Metrics::TYPE_COUNTER : Metrics::TYPE_GAUGE);
+	}
+	for (unsigned i = 0; i < num_doubles; ++i) {
+		doubles[i] = i * 0.123;
+		global_metrics.add("benchmark_double", {{ "index", to_string(i) }}, &doubles[i], Metrics::TYPE_GAUGE);
+	}
+	for (unsigned i = 0; i < num_histograms; ++i) {
+		histograms[i].init_geometric(1e-4, 1.0, 30);
+		for (unsigned j = 0; j < 100; ++j) {
+			histograms[i].count_event(j * 1e-3);
+		}
+		global_metrics.add("benchmark_histogram", {{ "index", to_string(i) }}, &histograms[i]);
+	}
+	vector<double> quantiles{0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99};
+	for (unsigned i = 0; i < num_summaries; ++i) {
+		summaries[i].init(quantiles, 60.0);
+		for (unsigned j = 0; j < 1000; ++j) {
+			summaries[i].count_event(j * 1e-3);
+		}
+		global_metrics.add("benchmark_summary", {{ "index", to_string(i) }}, &summaries[i]);
+	}
+
+	// Warm up (and build the snapshot).
+	size_t bytes = global_metrics.serialize().size();
+
+	start = steady_clock::now();
+	for (unsigned i = 0; i < NUM_SCRAPES; ++i) {
+		global_metrics.serialize();
+	}
+	double scrape_ms = 1e3 * duration<double>(steady_clock::now() - start).count() / NUM_SCRAPES;
+	printf("%u series (%zu bytes): %.3f ms per scrape\n", num_series, bytes, scrape_ms);
+
+	// Now register and unregister while another thread scrapes continuously.
+	atomic<bool> should_quit{false};
+	atomic<unsigned> num_scrapes{0};
+	thread scraper([&should_quit, &num_scrapes]{
+		while (!should_quit) {
+			global_metrics.serialize();
+			++num_scrapes;
+		}
+	});
+
+	atomic<int64_t> extra;
+	vector<double> add_us, remove_us;
+	for (unsigned i = 0; i < NUM_REGISTRATIONS; ++i) {
+		steady_clock::time_point t0 = steady_clock::now();
+		global_metrics.add("benchmark_extra", &extra);
+		steady_clock::time_point t1 = steady_clock::now();
+		global_metrics.remove("benchmark_extra");
+		steady_clock::time_point t2 = steady_clock::now();
+		add_us.push_back(1e6 * duration<double>(t1 - t0).count());
+		remove_us.push_back(1e6 * duration<double>(t2 - t1).count());
+	}
+	should_quit = true;
+	scraper.join();
+
+	sort(add_us.begin(), add_us.end());
+	sort(remove_us.begin(), remove_us.end());
+	printf("During %u concurrent scrapes:\n", num_scrapes.load());
+	printf("  add():    p50 %8.2f us, p99 %8.2f us, max %8.2f us\n",
+		add_us[add_us.size() / 2], add_us[add_us.size() * 99 / 100], add_us.back());
+	printf("  remove(): p50 %8.2f us, p99 %8.2f us, max %8.2f us\n",
+		remove_us[remove_us.size() / 2], remove_us[remove_us.size() * 99 / 100], remove_us.back());
+
+	return ok ? 0 : 1;
+}
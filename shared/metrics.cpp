@@ -2,26 +2,81 @@
 
 #include <assert.h>
 #include <math.h>
+#include <stdio.h>
 
 #include <algorithm>
+#include <charconv>
 #include <chrono>
-#include <locale>
-#include <sstream>
 
 using namespace std;
 using namespace std::chrono;
 
 Metrics global_metrics;
-string Metrics::prefix = "nageru";
 
-double get_timestamp_for_metrics()
+namespace {
+
+void append_int64(int64_t val, string *out)
 {
-	return duration<double>(system_clock::now().time_since_epoch()).count();
+	char buf[32];
+	char *end = to_chars(buf, buf + sizeof(buf), val).ptr;
+	out->append(buf, end);
+}
+
+void append_double(double val, string *out)
+{
+	if (isnan(val)) {
+		// Prometheus can't handle “-nan”.
+		*out += "NaN";
+		return;
+	}
+	if (isinf(val)) {
+		*out += (val > 0.0) ? "+Inf" : "-Inf";
+		return;
+	}
+	char buf[64];
+#if __cpp_lib_to_chars >= 201611L
+	// Shortest representation that round-trips; also locale-independent.
+	char *end = to_chars(buf, buf + sizeof(buf), val).ptr;
+	out->append(buf, end);
+#else
+	// Older standard libraries don't have to_chars() for floating-point.
+	// %g is locale-dependent, but we never call setlocale() with LC_NUMERIC.
+	int len = snprintf(buf, sizeof(buf), "%.17g", val);
+	out->append(buf, len);
+#endif
+}
+
+// Appends e.g. “nageru_foo_bucket{card="0",le="0.5"} ” (note the trailing space).
+// <suffix> and <extra_label_name> can be nullptr.
+void append_line_prefix(const string &full_name, const char *suffix, const string &labels,
+                        const char *extra_label_name, double extra_label_val, string *out)
+{
+	*out += full_name;
+	if (suffix != nullptr) {
+		*out += suffix;
+	}
+	if (!labels.empty() || extra_label_name != nullptr) {
+		*out += '{';
+		*out += labels;
+		if (extra_label_name != nullptr) {
+			if (!labels.empty()) {
+				*out += ',';
+			}
+			*out += extra_label_name;
+			*out += "=\"";
+			append_double(extra_label_val, out);
+			*out += '"';
+		}
+		*out += '}';
+	}
+	*out += ' ';
 }
 
-string Metrics::serialize_name(const string &name, const vector<pair<string, string>> &labels)
+}  // namespace
+
+double get_timestamp_for_metrics()
 {
-	return prefix + "_" + name + serialize_labels(labels);
+	return duration<double>(system_clock::now().time_since_epoch()).count();
 }
 
 string Metrics::serialize_labels(const vector<pair<string, string>> &labels)
@@ -40,16 +95,64 @@ string Metrics::serialize_labels(const vector<pair<string, string>> &labels)
 	return "{" + label_str + "}";
 }
 
-void Metrics::add(const string &name, const vector<pair<string, string>> &labels, atomic<int64_t> *location, Metrics::Type type)
+void Metrics::set_prefix(const string &prefix)
 {
-	Metric metric;
-	metric.data_type = DATA_TYPE_INT64;
-	metric.location_int64 = location;
+	lock_guard<mutex> lock(mu);
+	this->prefix = prefix;
+
+	// Re-render everything that was registered before now.
+	for (auto &key_and_metric : metrics) {
+		shared_ptr<Metric> metric(new Metric(*key_and_metric.second));
+		render_metric(key_and_metric.first, types[key_and_metric.first.name], metric.get());
+		key_and_metric.second = move(metric);
+	}
+	snapshot.reset();
+}
+
+void Metrics::render_metric(const MetricKey &key, Type type, Metric *metric) const
+{
+	metric->full_name = prefix + "_" + key.name;
+	if (key.serialized_labels.empty()) {
+		metric->labels.clear();
+	} else {
+		// Strip the braces.
+		metric->labels = key.serialized_labels.substr(1, key.serialized_labels.size() - 2);
+	}
+	metric->line_prefix = metric->full_name + key.serialized_labels + " ";
+	switch (type) {
+	case TYPE_COUNTER:
+		metric->type_header.clear();
+		break;
+	case TYPE_GAUGE:
+		metric->type_header = "# TYPE " + metric->full_name + " gauge\n";
+		break;
+	case TYPE_HISTOGRAM:
+		metric->type_header = "# TYPE " + metric->full_name + " histogram\n";
+		break;
+	case TYPE_SUMMARY:
+		metric->type_header = "# TYPE " + metric->full_name + " summary\n";
+		break;
+	}
+}
+
+void Metrics::add_metric(const string &name, const vector<pair<string, string>> &labels, Type type, Metric metric)
+{
+	MetricKey key(name, labels);
 
 	lock_guard<mutex> lock(mu);
-	metrics.emplace(MetricKey(name, labels), metric);
+	render_metric(key, type, &metric);
+	metrics.emplace(move(key), make_shared<const Metric>(move(metric)));
 	assert(types.count(name) == 0 || types[name] == type);
 	types[name] = type;
+	snapshot.reset();
+}
+
+void Metrics::add(const string &name, const vector<pair<string, string>> &labels, atomic<int64_t> *location, Metrics::Type type)
+{
+	Metric metric;
+	metric.data_type = DATA_TYPE_INT64;
+	metric.location_int64 = location;
+	add_metric(name, labels, type, move(metric));
 }
 
 void Metrics::add(const string &name, const vector<pair<string, string>> &labels, atomic<double> *location, Metrics::Type type)
@@ -57,11 +160,7 @@ void Metrics::add(const string &name, const vector<pair<string, string>> &labels
 	Metric metric;
 	metric.data_type = DATA_TYPE_DOUBLE;
 	metric.location_double = location;
-
-	lock_guard<mutex> lock(mu);
-	metrics.emplace(MetricKey(name, labels), metric);
-	assert(types.count(name) == 0 || types[name] == type);
-	types[name] = type;
+	add_metric(name, labels, type, move(metric));
 }
 
 void Metrics::add(const string &name, const vector<pair<string, string>> &labels, Histogram *location, Laziness laziness)
@@ -70,11 +169,7 @@ void Metrics::add(const string &name, const vector<pair<string, string>> &labels
 	metric.data_type = DATA_TYPE_HISTOGRAM;
 	metric.laziness = laziness;
 	metric.location_histogram = location;
-
-	lock_guard<mutex> lock(mu);
-	metrics.emplace(MetricKey(name, labels), metric);
-	assert(types.count(name) == 0 || types[name] == TYPE_HISTOGRAM);
-	types[name] = TYPE_HISTOGRAM;
+	add_metric(name, labels, TYPE_HISTOGRAM, move(metric));
 }
 
 void Metrics::add(const string &name, const vector<pair<string, string>> &labels, Summary *location, Laziness laziness)
@@ -83,73 +178,81 @@ void Metrics::add(const string &name, const vector<pair<string, string>> &labels
 	metric.data_type = DATA_TYPE_SUMMARY;
 	metric.laziness = laziness;
 	metric.location_summary = location;
-
-	lock_guard<mutex> lock(mu);
-	metrics.emplace(MetricKey(name, labels), metric);
-	assert(types.count(name) == 0 || types[name] == TYPE_SUMMARY);
-	types[name] = TYPE_SUMMARY;
+	add_metric(name, labels, TYPE_SUMMARY, move(metric));
 }
 
 void Metrics::remove(const string &name, const vector<pair<string, string>> &labels)
 {
-	lock_guard<mutex> lock(mu);
+	{
+		lock_guard<mutex> lock(mu);
 
-	auto it = metrics.find(MetricKey(name, labels));
-	assert(it != metrics.end());
+		auto it = metrics.find(MetricKey(name, labels));
+		assert(it != metrics.end());
 
-	// If this is the last metric with this name, remove the type as well.
-	if (!((it != metrics.begin() && prev(it)->first.name == name) ||
-	      (it != metrics.end() && next(it)->first.name == name))) {
-		types.erase(name);
+		// If this is the last metric with this name, remove the type as well.
+		if (!((it != metrics.begin() && prev(it)->first.name == name) ||
+		      (next(it) != metrics.end() && next(it)->first.name == name))) {
+			types.erase(name);
+		}
+
+		metrics.erase(it);
+		snapshot.reset();
 	}
 
-	metrics.erase(it);
+	// A scrape that started before we took the metric out could still be
+	// reading from it, so wait for that to finish before the caller gets
+	// to free it. New scrapes will get a fresh snapshot without it.
+	lock_guard<mutex> lock(serialize_mu);
 }
 
-string Metrics::serialize() const
+shared_ptr<const Metrics::Snapshot> Metrics::get_snapshot() const
 {
-	stringstream ss;
-	ss.imbue(locale("C"));
-	ss.precision(20);
-
 	lock_guard<mutex> lock(mu);
-	auto type_it = types.cbegin();
-	for (const auto &key_and_metric : metrics) {
-		string name = prefix + "_" + key_and_metric.first.name + key_and_metric.first.serialized_labels;
-		const Metric &metric = key_and_metric.second;
+	if (snapshot == nullptr) {
+		// Only copies pointers, so this is cheap even for many metrics.
+		shared_ptr<Snapshot> new_snapshot(new Snapshot);
+		new_snapshot->reserve(metrics.size());
+		const string *last_name = nullptr;
+		for (const auto &key_and_metric : metrics) {
+			bool first_with_name = (last_name == nullptr || *last_name != key_and_metric.first.name);
+			new_snapshot->push_back(SnapshotEntry{ key_and_metric.second, first_with_name });
+			last_name = &key_and_metric.first.name;
+		}
+		snapshot = move(new_snapshot);
+	}
+	return snapshot;
+}
 
-		if (type_it != types.cend() &&
-		    key_and_metric.first.name == type_it->first) {
+string Metrics::serialize() const
+{
+	lock_guard<mutex> lock(serialize_mu);
+	shared_ptr<const Snapshot> snapshot = get_snapshot();
+
+	serialize_buf.clear();
+	for (const SnapshotEntry &entry : *snapshot) {
+		const Metric &metric = *entry.metric;
+		if (entry.first_with_name) {
 			// It's the first time we print out any metric with this name,
 			// so add the type header.
-			if (type_it->second == TYPE_GAUGE) {
-				ss << "# TYPE " + prefix + "_" << type_it->first << " gauge\n";
-			} else if (type_it->second == TYPE_HISTOGRAM) {
-				ss << "# TYPE " + prefix + "_" << type_it->first << " histogram\n";
-			} else if (type_it->second == TYPE_SUMMARY) {
-				ss << "# TYPE " + prefix + "_" << type_it->first << " summary\n";
-			}
-			++type_it;
+			serialize_buf += metric.type_header;
 		}
 
 		if (metric.data_type == DATA_TYPE_INT64) {
-			ss << name << " " << metric.location_int64->load() << "\n";
+			serialize_buf += metric.line_prefix;
+			append_int64(metric.location_int64->load(), &serialize_buf);
+			serialize_buf += '\n';
 		} else if (metric.data_type == DATA_TYPE_DOUBLE) {
-			double val = metric.location_double->load();
-			if (isnan(val)) {
-				// Prometheus can't handle “-nan”.
-				ss << name << " NaN\n";
-			} else {
-				ss << name << " " << val << "\n";
-			}
+			serialize_buf += metric.line_prefix;
+			append_double(metric.location_double->load(), &serialize_buf);
+			serialize_buf += '\n';
 		} else if (metric.data_type == DATA_TYPE_HISTOGRAM) {
-			ss << metric.location_histogram->serialize(metric.laziness, key_and_metric.first.name, key_and_metric.first.labels);
+			metric.location_histogram->serialize(metric.laziness, metric.full_name, metric.labels, &serialize_buf);
 		} else {
-			ss << metric.location_summary->serialize(metric.laziness, key_and_metric.first.name, key_and_metric.first.labels);
+			metric.location_summary->serialize(metric.laziness, metric.full_name, metric.labels, &serialize_buf);
 		}
 	}
 
-	return ss.str();
+	return serialize_buf;
 }
 
 void Histogram::init(const vector<double> &bucket_vals)
@@ -194,7 +297,7 @@ void Histogram::count_event(double val)
 	sum = sum + val;
 }
 
-string Histogram::serialize(Metrics::Laziness laziness, const string &name, const vector<pair<string, string>> &labels) const
+void Histogram::serialize(Metrics::Laziness laziness, const string &full_name, const string &labels, string *out) const
 {
 	// Check if the histogram is empty and should not be serialized.
 	if (laziness == Metrics::PRINT_WHEN_NONEMPTY && count_after_last_bucket.load() == 0) {
@@ -206,128 +309,244 @@ string Histogram::serialize(Metrics::Laziness laziness, const string &name, cons
 			}
 		}
 		if (empty) {
-			return "";
+			return;
 		}
 	}
 
-	stringstream ss;
-	ss.imbue(locale("C"));
-	ss.precision(20);
-
 	int64_t count = 0;
 	for (size_t bucket_idx = 0; bucket_idx < num_buckets; ++bucket_idx) {
-		stringstream le_ss;
-		le_ss.imbue(locale("C"));
-		le_ss.precision(20);
-		le_ss << buckets[bucket_idx].val;
-		vector<pair<string, string>> bucket_labels = labels;
-		bucket_labels.emplace_back("le", le_ss.str());
-
 		count += buckets[bucket_idx].count.load();
-		ss << Metrics::serialize_name(name + "_bucket", bucket_labels) << " " << count << "\n";
+		append_line_prefix(full_name, "_bucket", labels, "le", buckets[bucket_idx].val, out);
+		append_int64(count, out);
+		*out += '\n';
 	}
 
 	count += count_after_last_bucket.load();
 
-	ss << Metrics::serialize_name(name + "_sum", labels) << " " << sum.load() << "\n";
-	ss << Metrics::serialize_name(name + "_count", labels) << " " << count << "\n";
+	append_line_prefix(full_name, "_sum", labels, nullptr, 0.0, out);
+	append_double(sum.load(), out);
+	*out += '\n';
+	append_line_prefix(full_name, "_count", labels, nullptr, 0.0, out);
+	append_int64(count, out);
+	*out += '\n';
+}
 
-	return ss.str();
+Summary::~Summary()
+{
+	if (slots == nullptr) {
+		return;
+	}
+	for (unsigned slot_idx = 0; slot_idx <= num_sub_windows; ++slot_idx) {
+		for (int page = 0; page < num_pages; ++page) {
+			delete[] slots[slot_idx].pages[page].load();
+		}
+	}
 }
 
 void Summary::init(const vector<double> &quantiles, double window_seconds)
 {
 	this->quantiles = quantiles;
-	window = duration<double>(window_seconds);
+	sub_window = max(duration_cast<steady_clock::duration>(duration<double>(window_seconds / num_sub_windows)),
+		steady_clock::duration(1));
+
+	// Bucket <key> contains (gamma^(key - 1), gamma^key], and is represented
+	// by the value that has the same relative error to both ends.
+	gamma = (1.0 + relative_accuracy) / (1.0 - relative_accuracy);
+	inv_log_gamma = 1.0 / log(gamma);
+	min_key = lrint(ceil(log(min_magnitude) * inv_log_gamma));
+	int max_key = lrint(ceil(log(max_magnitude) * inv_log_gamma));
+	keys_per_sign = max_key - min_key + 1;
+	num_buckets = keys_per_sign * 2 + 1;
+	num_pages = (num_buckets + buckets_per_page - 1) / buckets_per_page;
+
+	slots.reset(new Slot[num_sub_windows + 1]);
+	for (unsigned slot_idx = 0; slot_idx <= num_sub_windows; ++slot_idx) {
+		slots[slot_idx].pages.reset(new atomic<atomic<uint32_t> *>[num_pages]);
+		for (int page = 0; page < num_pages; ++page) {
+			slots[slot_idx].pages[page] = nullptr;
+		}
+	}
 }
 
-void Summary::count_event(double val)
+int Summary::bucket_index(double val) const
 {
-	steady_clock::time_point now = steady_clock::now();
-	steady_clock::time_point cutoff = now - duration_cast<steady_clock::duration>(window);
+	double magnitude = min(fabs(val), max_magnitude);
+	if (!(magnitude >= min_magnitude)) {  // Also catches NaN.
+		return keys_per_sign;
+	}
+	int key = lrint(ceil(log(magnitude) * inv_log_gamma));
+	key = min(max(key, min_key), min_key + keys_per_sign - 1);
+	if (val > 0.0) {
+		return keys_per_sign + 1 + (key - min_key);
+	} else {
+		return keys_per_sign - 1 - (key - min_key);
+	}
+}
 
-	lock_guard<mutex> lock(mu);
-	values.emplace_back(now, val);
-	while (!values.empty() && values.front().first < cutoff) {
-		values.pop_front();
+double Summary::bucket_value(int bucket_idx) const
+{
+	if (bucket_idx == keys_per_sign) {
+		return 0.0;
 	}
+	int key = (bucket_idx > keys_per_sign) ? bucket_idx - keys_per_sign - 1 + min_key : keys_per_sign - 1 - bucket_idx + min_key;
+	double magnitude = 2.0 * pow(gamma, key) / (gamma + 1.0);
+	return (bucket_idx > keys_per_sign) ? magnitude : -magnitude;
+}
 
-	// Non-atomic add, but that's fine, since there are no concurrent writers.
-	sum = sum + val;
-	++count;
+int64_t Summary::current_epoch() const
+{
+	return steady_clock::now().time_since_epoch() / sub_window;
 }
 
-string Summary::serialize(Metrics::Laziness laziness, const string &name, const vector<pair<string, string>> &labels)
+void Summary::start_epoch(Slot *slot, int64_t epoch)
 {
-	steady_clock::time_point now = steady_clock::now();
-	steady_clock::time_point cutoff = now - duration_cast<steady_clock::duration>(window);
+	lock_guard<mutex> lock(epoch_mu);
+	if (slot->epoch.load() >= epoch) {
+		// Someone else got here first (or we were delayed for so long
+		// that the slot has been reused again; just count the sample there).
+		return;
+	}
 
-	vector<double> values_copy;
-	{
-		lock_guard<mutex> lock(mu);
-		while (!values.empty() && values.front().first < cutoff) {
-			values.pop_front();
-		}
-		values_copy.reserve(values.size());
-		for (const auto &time_and_value : values) {
-			values_copy.push_back(time_and_value.second);
+	// Readers will skip the slot until we are done clearing it.
+	slot->epoch.store(-1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	for (int page = 0; page < num_pages; ++page) {
+		atomic<uint32_t> *buckets = slot->pages[page].load(memory_order_acquire);
+		if (buckets != nullptr) {
+			for (unsigned i = 0; i < buckets_per_page; ++i) {
+				buckets[i].store(0, memory_order_relaxed);
+			}
 		}
 	}
+	slot->epoch.store(epoch, memory_order_release);
+}
 
-	vector<pair<double, double>> answers;
-	if (values_copy.size() == 0) {
-		if (laziness == Metrics::PRINT_WHEN_NONEMPTY) {
-			return "";
-		}
-		for (double quantile : quantiles) {
-			answers.emplace_back(quantile, 0.0 / 0.0);
-		}
-	} else if (values_copy.size() == 1) {
-		for (double quantile : quantiles) {
-			answers.emplace_back(quantile, values_copy[0]);
+void Summary::count_event(double val)
+{
+	if (slots != nullptr) {
+		int64_t epoch = current_epoch();
+		Slot *slot = &slots[epoch % (num_sub_windows + 1)];
+		if (slot->epoch.load(memory_order_acquire) != epoch) {
+			start_epoch(slot, epoch);
 		}
-	} else {
-		// We could probably do repeated nth_element, but the constant factor
-		// gets a bit high, so just sorting probably is about as fast.
-		sort(values_copy.begin(), values_copy.end());
-		for (double quantile : quantiles) {
-			double idx = quantile * (values_copy.size() - 1);
-			size_t idx_floor = size_t(floor(idx));
-			const double v0 = values_copy[idx_floor];
-
-			if (idx_floor == values_copy.size() - 1) {
-				answers.emplace_back(quantile, values_copy[idx_floor]);
+
+		int bucket_idx = bucket_index(val);
+		atomic<atomic<uint32_t> *> *page = &slot->pages[bucket_idx / buckets_per_page];
+		atomic<uint32_t> *buckets = page->load(memory_order_acquire);
+		if (buckets == nullptr) {
+			atomic<uint32_t> *new_buckets = new atomic<uint32_t>[buckets_per_page]();
+			if (page->compare_exchange_strong(buckets, new_buckets, memory_order_acq_rel)) {
+				buckets = new_buckets;
 			} else {
-				// Linear interpolation.
-				double t = idx - idx_floor;
-				const double v1 = values_copy[idx_floor + 1];
-				answers.emplace_back(quantile, v0 + t * (v1 - v0));
+				// Someone else allocated it in the meantime; use theirs.
+				delete[] new_buckets;
 			}
 		}
+		buckets[bucket_idx % buckets_per_page].fetch_add(1, memory_order_relaxed);
 	}
 
-	stringstream ss;
-	ss.imbue(locale("C"));
-	ss.precision(20);
+	double old_sum = sum.load();
+	while (!sum.compare_exchange_weak(old_sum, old_sum + val))
+		;
+	++count;
+}
 
-	for (const auto &quantile_and_value : answers) {
-		stringstream quantile_ss;
-		quantile_ss.imbue(locale("C"));
-		quantile_ss.precision(3);
-		quantile_ss << quantile_and_value.first;
-		vector<pair<string, string>> quantile_labels = labels;
-		quantile_labels.emplace_back("quantile", quantile_ss.str());
+vector<double> Summary::get_quantiles(int64_t *num_samples)
+{
+	lock_guard<mutex> lock(serialize_mu);
+
+	// Collect the non-empty buckets from all sub-windows in the window.
+	scratch.clear();
+	if (slots != nullptr) {
+		int64_t epoch = current_epoch();
+		for (unsigned slot_idx = 0; slot_idx <= num_sub_windows; ++slot_idx) {
+			const Slot &slot = slots[slot_idx];
+			int64_t slot_epoch = slot.epoch.load(memory_order_acquire);
+			if (slot_epoch < epoch - int64_t(num_sub_windows) || slot_epoch > epoch) {
+				continue;
+			}
+			size_t old_size = scratch.size();
+			for (int page = 0; page < num_pages; ++page) {
+				const atomic<uint32_t> *buckets = slot.pages[page].load(memory_order_acquire);
+				if (buckets == nullptr) {
+					continue;
+				}
+				for (unsigned i = 0; i < buckets_per_page; ++i) {
+					uint32_t bucket_count = buckets[i].load(memory_order_relaxed);
+					if (bucket_count != 0) {
+						scratch.emplace_back(page * buckets_per_page + i, bucket_count);
+					}
+				}
+			}
+			atomic_thread_fence(memory_order_acquire);
+			if (slot.epoch.load(memory_order_relaxed) != slot_epoch) {
+				// It was cleared for reuse while we were reading it.
+				scratch.resize(old_size);
+			}
+		}
+	}
+	sort(scratch.begin(), scratch.end());
 
-		double val = quantile_and_value.second;;
-		if (isnan(val)) {
-			// Prometheus can't handle “-nan”.
-			ss << Metrics::serialize_name(name, quantile_labels) << " NaN\n";
+	uint64_t total = 0;
+	for (const auto &bucket_and_count : scratch) {
+		total += bucket_and_count.second;
+	}
+	if (num_samples != nullptr) {
+		*num_samples = total;
+	}
+
+	// Finds the (estimated) value of the sample with the given rank (0-based).
+	auto value_at_rank = [this](uint64_t rank) {
+		uint64_t seen = 0;
+		for (const auto &bucket_and_count : scratch) {
+			seen += bucket_and_count.second;
+			if (seen > rank) {
+				return bucket_value(bucket_and_count.first);
+			}
+		}
+		return bucket_value(scratch.back().first);
+	};
+
+	// Same interpolation as we'd do if we had all the samples.
+	vector<double> answers;
+	for (double quantile : quantiles) {
+		if (total == 0) {
+			answers.push_back(0.0 / 0.0);
+			continue;
+		}
+		double idx = quantile * (total - 1);
+		uint64_t idx_floor = uint64_t(floor(idx));
+		const double v0 = value_at_rank(idx_floor);
+		if (idx_floor >= total - 1) {
+			answers.push_back(v0);
 		} else {
-			ss << Metrics::serialize_name(name, quantile_labels) << " " << val << "\n";
+			// Linear interpolation.
+			double t = idx - idx_floor;
+			const double v1 = value_at_rank(idx_floor + 1);
+			answers.push_back(v0 + t * (v1 - v0));
 		}
 	}
+	return answers;
+}
+
+void Summary::serialize(Metrics::Laziness laziness, const string &full_name, const string &labels, string *out)
+{
+	int64_t num_samples;
+	vector<double> answers = get_quantiles(&num_samples);
+	if (num_samples == 0 && laziness == Metrics::PRINT_WHEN_NONEMPTY) {
+		return;
+	}
+
+	for (size_t i = 0; i < quantiles.size(); ++i) {
+		append_line_prefix(full_name, nullptr, labels, "quantile", quantiles[i], out);
+		append_double(answers[i], out);
+		*out += '\n';
+	}
 
-	ss << Metrics::serialize_name(name + "_sum", labels) << " " << sum.load() << "\n";
-	ss << Metrics::serialize_name(name + "_count", labels) << " " << count.load() << "\n";
-	return ss.str();
+	append_line_prefix(full_name, "_sum", labels, nullptr, 0.0, out);
+	append_double(sum.load(), out);
+	*out += '\n';
+	append_line_prefix(full_name, "_count", labels, nullptr, 0.0, out);
+	append_int64(count.load(), out);
+	*out += '\n';
 }
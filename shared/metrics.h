@@ -5,10 +5,15 @@
 // It would be better to use a more full-featured Prometheus client library for this,
 // but it would introduce a dependency that is not commonly packaged in distributions,
 // which makes it quite unwieldy. Thus, we'll package our own for the time being.
+//
+// Scrapes are meant to be cheap and to not get in the way of the threads that
+// update or register metrics: The names and labels are rendered once, at
+// registration time, and serialize() works from an immutable snapshot of the
+// registered metrics, so add() never has to wait for a scrape to finish.
+// (remove() does, since the caller will typically free the metric right after.)
 
 #include <atomic>
 #include <chrono>
-#include <deque>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -38,10 +43,7 @@ public:
 		PRINT_WHEN_NONEMPTY,
 	};
 
-	void set_prefix(const std::string &prefix)  // Not thread-safe; must be set before HTTPD starts up.
-	{
-		this->prefix = prefix;
-	}
+	void set_prefix(const std::string &prefix);  // Must be set before HTTPD starts up.
 
 	void add(const std::string &name, std::atomic<int64_t> *location, Type type = TYPE_COUNTER)
 	{
@@ -78,7 +80,6 @@ public:
 	std::string serialize() const;
 
 private:
-	static std::string serialize_name(const std::string &name, const std::vector<std::pair<std::string, std::string>> &labels);
 	static std::string serialize_labels(const std::vector<std::pair<std::string, std::string>> &labels);
 
 	enum DataType {
@@ -106,19 +107,40 @@ private:
 	};
 	struct Metric {
 		DataType data_type;
-		Laziness laziness;  // Only for TYPE_HISTOGRAM.
+		Laziness laziness = PRINT_ALWAYS;  // Only for TYPE_HISTOGRAM.
 		union {
 			std::atomic<int64_t> *location_int64;
 			std::atomic<double> *location_double;
 			Histogram *location_histogram;
 			Summary *location_summary;
 		};
+
+		// Pre-rendered by render_metric().
+		std::string full_name;  // E.g. nageru_foo.
+		std::string labels;  // E.g. card="0",type="bar" (no braces); can be empty.
+		std::string line_prefix;  // E.g. nageru_foo{card="0",type="bar"} followed by a space.
+		std::string type_header;  // E.g. # TYPE nageru_foo gauge (and a newline); empty for counters.
 	};
+	struct SnapshotEntry {
+		std::shared_ptr<const Metric> metric;
+		bool first_with_name;  // If so, print the type header before it.
+	};
+	typedef std::vector<SnapshotEntry> Snapshot;
+
+	void add_metric(const std::string &name, const std::vector<std::pair<std::string, std::string>> &labels, Type type, Metric metric);
+	void render_metric(const MetricKey &key, Type type, Metric *metric) const;  // Under <mu>.
+	std::shared_ptr<const Snapshot> get_snapshot() const;
 
 	mutable std::mutex mu;
-	std::map<std::string, Type> types;  // Ordered the same as metrics.
-	std::map<MetricKey, Metric> metrics;
-	static std::string prefix;
+	std::map<std::string, Type> types;  // Under <mu>. Ordered the same as metrics.
+	std::map<MetricKey, std::shared_ptr<const Metric>> metrics;  // Under <mu>.
+	mutable std::shared_ptr<const Snapshot> snapshot;  // Under <mu>. Rebuilt on demand after changes; nullptr if stale.
+	std::string prefix = "nageru";  // Under <mu>.
+
+	// Held by serialize() while it is using a snapshot, so that remove()
+	// can wait until nobody can be looking at the metric it removed.
+	mutable std::mutex serialize_mu;
+	mutable std::string serialize_buf;  // Under <serialize_mu>. Reused between scrapes.
 
 	friend class Histogram;
 	friend class Summary;
@@ -130,7 +152,9 @@ public:
 	void init_uniform(size_t num_buckets);  // Sets up buckets 0..(N-1).
 	void init_geometric(double min, double max, size_t num_buckets);
 	void count_event(double val);
-	std::string serialize(Metrics::Laziness laziness, const std::string &name, const std::vector<std::pair<std::string, std::string>> &labels) const;
+
+	// Appends to <out>. <labels> are as in Metrics::Metric.
+	void serialize(Metrics::Laziness laziness, const std::string &full_name, const std::string &labels, std::string *out) const;
 
 private:
 	// Bucket <i> counts number of events where val[i - 1] < x <= val[i].
@@ -146,21 +170,79 @@ private:
 	std::atomic<int64_t> count_after_last_bucket{0};
 };
 
-// This is a pretty dumb streaming quantile class, but it's exact, and we don't have
-// too many values (typically one per frame, and one-minute interval), so we don't
-// need anything fancy.
+// A sliding-window summary (quantiles over the last <window_seconds>,
+// plus total sum and count), computed from a sketch in the style of DDSketch:
+// Samples are counted in logarithmically spaced buckets, so memory use is
+// bounded no matter how many events there are, and count_event() is lock-free
+// (it only increments an atomic counter, except when it needs to open a new
+// sub-window or a new page of buckets, which happens rarely).
+//
+// Error bounds, compared to computing the quantiles exactly (with linear
+// interpolation between the two nearest samples) over the same samples:
+//
+//  - For each reported quantile, the error is at most
+//    relative_accuracy * max(|a|, |b|), where a and b are the two samples
+//    that the exact computation would interpolate between. (In particular,
+//    if all samples are positive, the relative error is at most 1%.)
+//  - Samples with magnitude below min_magnitude are counted as zero,
+//    and samples with magnitude above max_magnitude are clamped to it.
+//  - The window is made of num_sub_windows sub-windows, each expiring
+//    as a whole, so the quantiles cover somewhere between the last
+//    <window_seconds> and the last window_seconds * (1 + 1 / num_sub_windows)
+//    seconds.
+//
+// benchmark_metrics checks these bounds against the exact computation.
 class Summary {
 public:
+	static constexpr double relative_accuracy = 0.01;
+	static constexpr double min_magnitude = 1e-9;
+	static constexpr double max_magnitude = 1e9;
+	static constexpr unsigned num_sub_windows = 6;
+
+	Summary() = default;
+	~Summary();
+
 	void init(const std::vector<double> &quantiles, double window_seconds);
 	void count_event(double val);
-	std::string serialize(Metrics::Laziness laziness, const std::string &name, const std::vector<std::pair<std::string, std::string>> &labels);
+
+	// Appends to <out>. <labels> are as in Metrics::Metric.
+	void serialize(Metrics::Laziness laziness, const std::string &full_name, const std::string &labels, std::string *out);
+
+	// Returns the current estimates for the quantiles given to init()
+	// (NaN if there are no samples in the window), and the number of samples
+	// they were computed from. Used by serialize(), and for testing.
+	std::vector<double> get_quantiles(int64_t *num_samples = nullptr);
 
 private:
+	static constexpr unsigned buckets_per_page = 128;
+
+	// One sub-window's worth of bucket counts. Pages are allocated on demand
+	// and then kept (and reused) until we are destroyed.
+	struct Slot {
+		std::atomic<int64_t> epoch{-1};  // Which sub-window this is; -1 while being cleared.
+		std::unique_ptr<std::atomic<std::atomic<uint32_t> *>[]> pages;
+	};
+
+	int bucket_index(double val) const;
+	double bucket_value(int bucket_idx) const;
+	int64_t current_epoch() const;
+	void start_epoch(Slot *slot, int64_t epoch);
+
 	std::vector<double> quantiles;
-	std::chrono::duration<double> window;
+	std::chrono::steady_clock::duration sub_window;
+
+	// Bucket mapping; set by init(). Bucket keys_per_sign is zero, buckets above
+	// are positive values and buckets below are negative values (mirrored),
+	// so that bucket order is the same as value order.
+	double gamma, inv_log_gamma;
+	int min_key, keys_per_sign, num_buckets, num_pages;
+
+	std::unique_ptr<Slot[]> slots;  // num_sub_windows + 1 of them, so that the one being filled never overlaps with a full window.
+	std::mutex epoch_mu;  // Taken when starting a new sub-window, so only one thread clears it.
+
+	std::mutex serialize_mu;  // Protects scratch.
+	std::vector<std::pair<int, uint64_t>> scratch;  // Non-empty buckets, in order.
 
-	mutable std::mutex mu;
-	std::deque<std::pair<std::chrono::steady_clock::time_point, double>> values;
 	std::atomic<double> sum{0.0};
 	std::atomic<int64_t> count{0};
 };
@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <chrono>
 #include <mutex>
 #include <stdint.h>
 #include <stdio.h>
@@ -14,6 +15,7 @@
 extern "C" {
 #include <libavformat/avio.h>
 #include <libavutil/avutil.h>
+#include <libavutil/buffer.h>
 #include <libavutil/dict.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/mem.h>
@@ -26,6 +28,17 @@ extern "C" {
 #include "shared/timebase.h"
 
 using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// Don't keep more than this around in the packet buffer pool; anything above
+// is freed back to the system as soon as it's released.
+constexpr size_t max_free_packet_buffer_bytes = 64 << 20;
+
+}  // namespace
+
+constexpr milliseconds Mux::background_flush_interval;
 
 struct PacketBefore {
 	PacketBefore(const AVFormatContext *ctx) : ctx(ctx) {}
@@ -133,6 +146,7 @@ Mux::Mux(AVFormatContext *avctx, int width, int height, Codec video_codec, const
 
 	// Make sure the header is written before the constructor exits.
 	avio_flush(avctx->pb);
+	last_flush = steady_clock::now();
 
 	if (write_strategy == WRITE_BACKGROUND) {
 		writer_thread = thread(&Mux::thread_func, this);
@@ -147,10 +161,13 @@ Mux::~Mux()
 		packet_queue_ready.notify_all();
 		writer_thread.join();
 	}
-	int64_t old_pos = avctx->pb->pos;
+	for (AVPacket *pkt : free_packets) {
+		av_packet_free(&pkt);
+	}
+	int64_t old_pos = avio_tell(avctx->pb);
 	av_write_trailer(avctx);
 	for (MuxMetrics *metric : metrics) {
-		metric->metric_written_bytes += avctx->pb->pos - old_pos;
+		metric->metric_written_bytes += avio_tell(avctx->pb) - old_pos;
 	}
 
 	if (!(avctx->oformat->flags & AVFMT_NOFILE) &&
@@ -162,9 +179,24 @@ Mux::~Mux()
 
 void Mux::add_packet(const AVPacket &pkt, int64_t pts, int64_t dts, AVRational timebase, int stream_index_override)
 {
+	steady_clock::time_point now = steady_clock::now();
+
 	AVPacket pkt_copy;
 	av_init_packet(&pkt_copy);
-	if (av_packet_ref(&pkt_copy, &pkt) < 0) {
+	if (write_strategy == WRITE_BACKGROUND && pkt.buf == nullptr) {
+		// The packet isn't reference-counted, so we need to copy the data
+		// anyway; do it into a pooled buffer instead of having av_packet_ref()
+		// allocate a new one.
+		if (av_packet_copy_props(&pkt_copy, &pkt) < 0) {
+			fprintf(stderr, "av_packet_copy_props() failed\n");
+			exit(1);
+		}
+		pkt_copy.buf = packet_buffer_pool.get(pkt.size + AV_INPUT_BUFFER_PADDING_SIZE);
+		pkt_copy.data = pkt_copy.buf->data;
+		pkt_copy.size = pkt.size;
+		memcpy(pkt_copy.data, pkt.data, pkt.size);
+		memset(pkt_copy.data + pkt.size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+	} else if (av_packet_ref(&pkt_copy, &pkt) < 0) {
 		fprintf(stderr, "av_copy_packet() failed\n");
 		exit(1);
 	}
@@ -180,20 +212,28 @@ void Mux::add_packet(const AVPacket &pkt, int64_t pts, int64_t dts, AVRational t
 	{
 		lock_guard<mutex> lock(mu);
 		if (write_strategy == WriteStrategy::WRITE_BACKGROUND) {
-			packet_queue.push_back(QueuedPacket{ av_packet_clone(&pkt_copy), pts });
+			AVPacket *queued_pkt;
+			if (free_packets.empty()) {
+				queued_pkt = av_packet_alloc();
+			} else {
+				queued_pkt = free_packets.back();
+				free_packets.pop_back();
+			}
+			av_packet_move_ref(queued_pkt, &pkt_copy);
+			packet_queue.push_back(QueuedPacket{ queued_pkt, pts, now });
 			if (plug_count == 0)
 				packet_queue_ready.notify_all();
 		} else if (plug_count > 0) {
-			packet_queue.push_back(QueuedPacket{ av_packet_clone(&pkt_copy), pts });
+			packet_queue.push_back(QueuedPacket{ av_packet_clone(&pkt_copy), pts, now });
 		} else {
-			write_packet_or_die(pkt_copy, pts);
+			write_packet_or_die(pkt_copy, pts, now);
 		}
 	}
 
 	av_packet_unref(&pkt_copy);
 }
 
-void Mux::write_packet_or_die(const AVPacket &pkt, int64_t unscaled_pts)
+void Mux::write_packet_or_die(const AVPacket &pkt, int64_t unscaled_pts, steady_clock::time_point queued_time)
 {
 	for (MuxMetrics *metric : metrics) {
 		if (pkt.stream_index == 0) {
@@ -204,14 +244,27 @@ void Mux::write_packet_or_die(const AVPacket &pkt, int64_t unscaled_pts)
 			assert(false);
 		}
 	}
-	int64_t old_pos = avctx->pb->pos;
+	bool is_keyframe = (pkt.stream_index == 0 && (pkt.flags & AV_PKT_FLAG_KEY));
+
+	// Use avio_tell() rather than pb->pos, since the latter only moves
+	// when the buffer is actually written out.
+	int64_t old_pos = avio_tell(avctx->pb);
 	if (av_interleaved_write_frame(avctx, const_cast<AVPacket *>(&pkt)) < 0) {
 		fprintf(stderr, "av_interleaved_write_frame() failed\n");
 		abort();
 	}
-	avio_flush(avctx->pb);
+
+	steady_clock::time_point now = steady_clock::now();
+	if (write_strategy == WRITE_FOREGROUND) {
+		// Typically a stream, where the other end wants every packet
+		// as soon as possible.
+		flush();
+	} else if (is_keyframe || now - last_flush >= background_flush_interval) {
+		flush();
+	}
 	for (MuxMetrics *metric : metrics) {
-		metric->metric_written_bytes += avctx->pb->pos - old_pos;
+		metric->metric_written_bytes += avio_tell(avctx->pb) - old_pos;
+		metric->metric_write_latency_seconds.count_event(duration<double>(now - queued_time).count());
 	}
 
 	if (pkt.stream_index == 0 && write_callback != nullptr) {
@@ -239,37 +292,134 @@ void Mux::unplug()
 		packet_queue_ready.notify_all();
 	} else {
 		for (QueuedPacket &qp : packet_queue) {
-			write_packet_or_die(*qp.pkt, qp.unscaled_pts);
+			write_packet_or_die(*qp.pkt, qp.unscaled_pts, qp.queued_time);
 			av_packet_free(&qp.pkt);
 		}
 		packet_queue.clear();
 	}
 }
 
+void Mux::flush()
+{
+	steady_clock::time_point start = steady_clock::now();
+	avio_flush(avctx->pb);
+	last_flush = steady_clock::now();
+	for (MuxMetrics *metric : metrics) {
+		++metric->metric_flushes;
+		metric->metric_flush_seconds.count_event(duration<double>(last_flush - start).count());
+	}
+}
+
 void Mux::thread_func()
 {
 	pthread_setname_np(pthread_self(), "Mux");
 
 	unique_lock<mutex> lock(mu);
+	bool maybe_unflushed = false;
 	for ( ;; ) {
-		packet_queue_ready.wait(lock, [this]() {
+		auto have_work = [this]() {
 			return writer_thread_should_quit || (!packet_queue.empty() && plug_count == 0);
-		});
+		};
+		if (maybe_unflushed) {
+			if (!packet_queue_ready.wait_for(lock, background_flush_interval, have_work)) {
+				// Nothing has come in for a while, so don't let
+				// what we have sit in the buffer.
+				lock.unlock();
+				flush();
+				lock.lock();
+				maybe_unflushed = false;
+				continue;
+			}
+		} else {
+			packet_queue_ready.wait(lock, have_work);
+		}
 		if (writer_thread_should_quit && packet_queue.empty()) {
-			// All done.
+			// All done. av_write_trailer() will flush whatever is left.
 			break;
 		}
 
 		assert(!packet_queue.empty() && plug_count == 0);
-		vector<QueuedPacket> packets;
-		swap(packets, packet_queue);
+		swap(packets_being_written, packet_queue);
 
 		lock.unlock();
-		for (QueuedPacket &qp : packets) {
-			write_packet_or_die(*qp.pkt, qp.unscaled_pts);
-			av_packet_free(&qp.pkt);
+		for (QueuedPacket &qp : packets_being_written) {
+			write_packet_or_die(*qp.pkt, qp.unscaled_pts, qp.queued_time);
+			av_packet_unref(qp.pkt);  // Gives the buffer back to the pool.
 		}
+		maybe_unflushed = true;
 		lock.lock();
+
+		for (const QueuedPacket &qp : packets_being_written) {
+			free_packets.push_back(qp.pkt);
+		}
+		packets_being_written.clear();
+	}
+}
+
+Mux::PacketBufferPool::~PacketBufferPool()
+{
+	// All buffers should have been returned by now (the mux is gone).
+	assert(free_buffers.size() == capacities.size());
+	for (const auto &capacity_and_data : free_buffers) {
+		av_free(capacity_and_data.second);
+	}
+}
+
+AVBufferRef *Mux::PacketBufferPool::get(size_t size)
+{
+	uint8_t *data = nullptr;
+	{
+		lock_guard<mutex> lock(mu);
+
+		// Take the smallest buffer that is large enough, unless it's
+		// way too large (we don't want to spend keyframe-sized buffers
+		// on audio packets).
+		auto it = free_buffers.lower_bound(size);
+		if (it != free_buffers.end() && it->first <= size * 4) {
+			data = it->second;
+			free_bytes -= it->first;
+			free_buffers.erase(it);
+		}
+	}
+	if (data == nullptr) {
+		size_t capacity = 4096;
+		while (capacity < size) {
+			capacity *= 2;
+		}
+		data = (uint8_t *)av_malloc(capacity);
+		if (data == nullptr) {
+			fprintf(stderr, "av_malloc() failed\n");
+			exit(1);
+		}
+		lock_guard<mutex> lock(mu);
+		capacities[data] = capacity;
+	}
+
+	AVBufferRef *buf = av_buffer_create(data, size, &PacketBufferPool::release_thunk, this, 0);
+	if (buf == nullptr) {
+		fprintf(stderr, "av_buffer_create() failed\n");
+		exit(1);
+	}
+	return buf;
+}
+
+void Mux::PacketBufferPool::release_thunk(void *opaque, uint8_t *data)
+{
+	((PacketBufferPool *)opaque)->release(data);
+}
+
+void Mux::PacketBufferPool::release(uint8_t *data)
+{
+	lock_guard<mutex> lock(mu);
+	auto it = capacities.find(data);
+	assert(it != capacities.end());
+	size_t capacity = it->second;
+	if (free_bytes + capacity > max_free_packet_buffer_bytes) {
+		capacities.erase(it);
+		av_free(data);
+	} else {
+		free_buffers.emplace(capacity, data);
+		free_bytes += capacity;
 	}
 }
 
@@ -284,4 +434,10 @@ void MuxMetrics::init(const vector<pair<string, string>> &labels)
 	global_metrics.add("mux_stream_bytes", labels_audio, &metric_audio_bytes);
 
 	global_metrics.add("mux_written_bytes", labels, &metric_written_bytes);
+	global_metrics.add("mux_flushes", labels, &metric_flushes);
+
+	metric_write_latency_seconds.init_geometric(1e-5, 10.0, 30);
+	global_metrics.add("mux_write_latency_seconds", labels, &metric_write_latency_seconds);
+	metric_flush_seconds.init_geometric(1e-6, 1.0, 30);
+	global_metrics.add("mux_flush_seconds", labels, &metric_flush_seconds);
 }
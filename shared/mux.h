@@ -10,14 +10,17 @@ extern "C" {
 
 #include <sys/types.h>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
+#include <map>
 #include <mutex>
 #include <string>
 #include <utility>
 #include <thread>
 #include <vector>
 
+#include "shared/metrics.h"
 #include "shared/timebase.h"
 
 struct MuxMetrics {
@@ -25,6 +28,12 @@ struct MuxMetrics {
 	// except that there could be buffered packets that count in audio or video
 	// but not yet in written.
 	std::atomic<int64_t> metric_video_bytes{0}, metric_audio_bytes{0}, metric_written_bytes{0};
+	std::atomic<int64_t> metric_flushes{0};
+
+	// Time from add_packet() until the packet has been handed to the mux
+	// (including any time spent in the background writer's queue),
+	// and time spent in each avio_flush().
+	Histogram metric_write_latency_seconds, metric_flush_seconds;
 
 	// Registers in global_metrics.
 	void init(const std::vector<std::pair<std::string, std::string>> &labels);
@@ -60,8 +69,11 @@ public:
 		// All writes will happen on a separate thread, so add_packet()
 		// won't block. Use this if writing to a file and you might be
 		// holding a mutex (because blocking I/O with a mutex held is
-		// not good). Note that this will clone every packet, so it has
-		// higher overhead.
+		// not good). Note that this will copy every packet (into pooled
+		// buffers), so it has somewhat higher overhead. Writes are batched;
+		// the output is only flushed on video keyframes or every
+		// background_flush_interval, so what is on disk can lag a bit
+		// behind add_packet().
 		WRITE_BACKGROUND,
 	};
 	enum WithSubtitles {
@@ -92,9 +104,33 @@ public:
 	void plug();
 	void unplug();
 
+	// How long WRITE_BACKGROUND can go without flushing if there are no keyframes.
+	static constexpr std::chrono::milliseconds background_flush_interval{100};
+
 private:
+	// Recycles packet data buffers for WRITE_BACKGROUND, so that we don't
+	// need a trip to the allocator for every packet. Buffers go back to
+	// the free list when the last reference to them goes away (normally
+	// in the writer thread, but the mux might hold on to some for interleaving).
+	// Must outlive all packets given to the mux.
+	class PacketBufferPool {
+	public:
+		~PacketBufferPool();
+		AVBufferRef *get(size_t size);
+
+	private:
+		static void release_thunk(void *opaque, uint8_t *data);
+		void release(uint8_t *data);
+
+		std::mutex mu;
+		std::map<uint8_t *, size_t> capacities;  // Under <mu>. All buffers we've allocated.
+		std::multimap<size_t, uint8_t *> free_buffers;  // Under <mu>. By capacity.
+		size_t free_bytes = 0;  // Under <mu>.
+	};
+
 	// If write_strategy == WRITE_FOREGORUND, Must be called with <mu> held.
-	void write_packet_or_die(const AVPacket &pkt, int64_t unscaled_pts);
+	void write_packet_or_die(const AVPacket &pkt, int64_t unscaled_pts, std::chrono::steady_clock::time_point queued_time);
+	void flush();  // Same locking rules as write_packet_or_die().
 	void thread_func();
 
 	WriteStrategy write_strategy;
@@ -104,6 +140,9 @@ private:
 	// These are only in use if write_strategy == WRITE_BACKGROUND.
 	std::atomic<bool> writer_thread_should_quit{false};
 	std::thread writer_thread;
+	PacketBufferPool packet_buffer_pool;
+
+	std::chrono::steady_clock::time_point last_flush;  // Same locking rules as write_packet_or_die().
 
 	AVFormatContext *avctx;  // Protected by <mu>, iff write_strategy == WRITE_BACKGROUND.
 	int plug_count = 0;  // Protected by <mu>.
@@ -113,10 +152,18 @@ private:
 	struct QueuedPacket {
 		AVPacket *pkt;
 		int64_t unscaled_pts;
+		std::chrono::steady_clock::time_point queued_time;
 	};
 	std::vector<QueuedPacket> packet_queue;
 	std::condition_variable packet_queue_ready;
 
+	// Only in use if write_strategy == WRITE_BACKGROUND. The writer thread
+	// swaps packet_queue with this, so that we don't reallocate the vector
+	// for every batch. Likewise, used AVPackets (with no data) are kept
+	// around for reuse.
+	std::vector<QueuedPacket> packets_being_written;  // Only accessed by the writer thread.
+	std::vector<AVPacket *> free_packets;  // Protected by <mu>.
+
 	std::vector<AVStream *> streams;
 	int subtitle_stream_idx = -1;
 
@@ -0,0 +1,234 @@
+#include "shared/sliced_jpeg_encoder.h"
+#include "shared/vector_destination_manager.h"
+
+#include <assert.h>
+#include <jpeglib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+
+// 4:2:2 means 16x8 MCUs.
+constexpr unsigned mcu_width = 16, mcu_height = 8;
+
+// Finds the first byte of entropy-coded data (right after the SOS segment).
+// If <sof_height_pos> is not nullptr, also stores the position of the
+// image height field in the SOFn segment.
+size_t find_scan_start(const vector<uint8_t> &jpeg, size_t *sof_height_pos)
+{
+	size_t pos = 2;  // Skip SOI.
+	while (pos + 4 <= jpeg.size()) {
+		assert(jpeg[pos] == 0xff);
+		uint8_t marker = jpeg[pos + 1];
+		unsigned len = jpeg[pos + 2] * 256 + jpeg[pos + 3];
+		if (marker >= 0xc0 && marker <= 0xc2 && sof_height_pos != nullptr) {
+			*sof_height_pos = pos + 5;  // Marker, length, precision.
+		}
+		if (marker == 0xda) {  // Start of scan (SOS).
+			return pos + 2 + len;
+		}
+		pos += 2 + len;
+	}
+	fprintf(stderr, "libjpeg output had no SOS marker\n");
+	abort();
+}
+
+}  // namespace
+
+SlicedJPEGEncoder::SlicedJPEGEncoder(unsigned num_helper_threads)
+{
+	for (unsigned i = 0; i < num_helper_threads; ++i) {
+		helper_threads.emplace_back(&SlicedJPEGEncoder::helper_thread_func, this);
+	}
+}
+
+SlicedJPEGEncoder::~SlicedJPEGEncoder()
+{
+	{
+		lock_guard<mutex> lock(mu);
+		should_quit = true;
+		queued_jobs_changed.notify_all();
+	}
+	for (thread &t : helper_threads) {
+		t.join();
+	}
+}
+
+unsigned SlicedJPEGEncoder::lines_per_slice(unsigned width, unsigned height, unsigned num_slices)
+{
+	unsigned mcus_per_row = (width + mcu_width - 1) / mcu_width;
+	unsigned mcu_rows = (height + mcu_height - 1) / mcu_height;
+	num_slices = max(min(num_slices, mcu_rows), 1u);
+	unsigned mcu_rows_per_slice = (mcu_rows + num_slices - 1) / num_slices;
+	if (num_slices > 1) {
+		// The restart interval is a 16-bit value.
+		mcu_rows_per_slice = max(min(mcu_rows_per_slice, 65535 / mcus_per_row), 1u);
+	}
+	return mcu_rows_per_slice * mcu_height;
+}
+
+unsigned SlicedJPEGEncoder::actual_num_slices(unsigned width, unsigned height, unsigned num_slices)
+{
+	unsigned lines = lines_per_slice(width, height, num_slices);
+	return (height + lines - 1) / lines;
+}
+
+vector<uint8_t> SlicedJPEGEncoder::encode(unsigned width, unsigned height, unsigned num_slices, int quality, const RowCallback &get_rows)
+{
+	Job job;
+	job.width = width;
+	job.height = height;
+	job.lines_per_slice = lines_per_slice(width, height, num_slices);
+	job.num_slices = actual_num_slices(width, height, num_slices);
+	job.quality = quality;
+	job.get_rows = &get_rows;
+	job.slice_output.resize(job.num_slices);
+
+	if (job.num_slices == 1) {
+		job.encode_slice(0);
+		return move(job.slice_output[0]);
+	}
+
+	{
+		lock_guard<mutex> lock(mu);
+		unsigned num_helpers = min<size_t>(job.num_slices - 1, helper_threads.size());
+		for (unsigned i = 0; i < num_helpers; ++i) {
+			queued_jobs.push_back(&job);
+		}
+		queued_jobs_changed.notify_all();
+	}
+
+	job.run();
+
+	{
+		// We might have done all the work ourselves, so take back any
+		// requests for help that nobody got around to, and then wait
+		// for the helpers that are still working on our slices.
+		unique_lock<mutex> lock(mu);
+		queued_jobs.erase(remove(queued_jobs.begin(), queued_jobs.end(), &job), queued_jobs.end());
+		job_finished.wait(lock, [&job] { return job.num_workers_active == 0; });
+	}
+
+	// Stitch the slices together; headers from the first one
+	// (but with the real height), then scan data from all of them,
+	// separated by RST0..RST7 in turn.
+	size_t sof_height_pos = 0;
+	size_t scan_start = find_scan_start(job.slice_output[0], &sof_height_pos);
+	assert(sof_height_pos != 0);
+
+	vector<uint8_t> ret(job.slice_output[0].begin(), job.slice_output[0].begin() + scan_start);
+	ret[sof_height_pos] = height >> 8;
+	ret[sof_height_pos + 1] = height & 0xff;
+
+	for (unsigned slice_idx = 0; slice_idx < job.num_slices; ++slice_idx) {
+		const vector<uint8_t> &slice = job.slice_output[slice_idx];
+		size_t start = (slice_idx == 0) ? scan_start : find_scan_start(slice, nullptr);
+		size_t end = slice.size() - 2;  // Skip EOI.
+		assert(slice[end] == 0xff && slice[end + 1] == 0xd9);
+		ret.insert(ret.end(), slice.begin() + start, slice.begin() + end);
+		if (slice_idx != job.num_slices - 1) {
+			ret.push_back(0xff);
+			ret.push_back(0xd0 + (slice_idx % 8));
+		}
+	}
+	ret.push_back(0xff);
+	ret.push_back(0xd9);  // EOI.
+	return ret;
+}
+
+void SlicedJPEGEncoder::helper_thread_func()
+{
+	pthread_setname_np(pthread_self(), "JPEG_Slices");
+	for ( ;; ) {
+		Job *job;
+		{
+			unique_lock<mutex> lock(mu);
+			queued_jobs_changed.wait(lock, [this] { return !queued_jobs.empty() || should_quit; });
+			if (should_quit) return;
+			job = queued_jobs.front();
+			queued_jobs.pop_front();
+			++job->num_workers_active;
+		}
+
+		job->run();
+
+		{
+			lock_guard<mutex> lock(mu);
+			--job->num_workers_active;
+			job_finished.notify_all();
+		}
+	}
+}
+
+void SlicedJPEGEncoder::Job::run()
+{
+	for ( ;; ) {
+		unsigned slice_idx = next_slice++;
+		if (slice_idx >= num_slices) {
+			return;
+		}
+		encode_slice(slice_idx);
+	}
+}
+
+void SlicedJPEGEncoder::Job::encode_slice(unsigned slice_idx)
+{
+	unsigned y0 = slice_idx * lines_per_slice;
+	unsigned slice_height = min(lines_per_slice, height - y0);
+
+	VectorDestinationManager dest;
+
+	jpeg_compress_struct cinfo;
+	jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	cinfo.dest = (jpeg_destination_mgr *)&dest;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, /*force_baseline=*/false);
+
+	cinfo.image_width = width;
+	cinfo.image_height = slice_height;
+	cinfo.raw_data_in = true;
+	jpeg_set_colorspace(&cinfo, JCS_YCbCr);
+	cinfo.comp_info[0].h_samp_factor = 2;
+	cinfo.comp_info[0].v_samp_factor = 1;
+	cinfo.comp_info[1].h_samp_factor = 1;
+	cinfo.comp_info[1].v_samp_factor = 1;
+	cinfo.comp_info[2].h_samp_factor = 1;
+	cinfo.comp_info[2].v_samp_factor = 1;
+	cinfo.CCIR601_sampling = true;  // Seems to be mostly ignored by libjpeg, though.
+	cinfo.optimize_coding = false;  // All slices need to share the same Huffman tables.
+	if (num_slices > 1) {
+		// One restart interval per slice; this makes libjpeg write the DRI
+		// marker for us, but since there's only one interval in each
+		// instance, no RSTn markers.
+		unsigned mcus_per_row = (width + mcu_width - 1) / mcu_width;
+		cinfo.restart_interval = mcus_per_row * (lines_per_slice / mcu_height);
+	}
+	jpeg_start_compress(&cinfo, true);
+
+	// This comment marker is private to FFmpeg. It signals limited Y'CbCr range
+	// (and nothing else).
+	jpeg_write_marker(&cinfo, JPEG_COM, (const JOCTET *)"CS=ITU601", strlen("CS=ITU601"));
+
+	JSAMPROW yptr[8], cbptr[8], crptr[8];
+	JSAMPARRAY data[3] = { yptr, cbptr, crptr };
+	for (unsigned y = 0; y < slice_height; y += 8) {
+		(*get_rows)(y0 + y, slice_idx, yptr, cbptr, crptr);
+		jpeg_write_raw_data(&cinfo, data, /*num_lines=*/8);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	slice_output[slice_idx] = move(dest.dest);
+}
@@ -0,0 +1,81 @@
+#ifndef _SLICED_JPEG_ENCODER_H
+#define _SLICED_JPEG_ENCODER_H 1
+
+// Software JPEG encoding of 4:2:2 limited-range Y'CbCr (the format both
+// Nageru's MJPEG export and Futatabi's output use), split into horizontal
+// slices that are entropy-coded in parallel. The slices are separated by
+// restart markers (RSTn), with a matching restart interval (DRI) in the header,
+// so that the result is a single ordinary baseline JPEG that any decoder
+// can read; the only cost is a few extra bytes per slice.
+//
+// Each slice is encoded by its own libjpeg instance, as if it were an image
+// of its own; we then keep the headers from the first one (with the height
+// patched up) and concatenate the entropy-coded data from all of them.
+// This works because a restart marker resets the DC predictors, which is
+// exactly the state a fresh libjpeg instance starts in, and because we
+// always use the standard Huffman tables (no optimize_coding).
+//
+// The encoder is thread-safe; several threads can call encode() at the same
+// time, and will share the pool of helper threads. The calling thread also
+// encodes slices, so with N slices, N - 1 helper threads is enough to keep
+// everything in parallel for a single caller.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <jpeglib.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class SlicedJPEGEncoder {
+public:
+	// Fill in pointers to eight rows (one MCU row) of each plane, starting
+	// at line <y>. The chroma planes are half width. <slice_idx> can be used
+	// to choose scratch space; it is never used by two threads at the same
+	// time within one call to encode().
+	typedef std::function<void(unsigned y, unsigned slice_idx, JSAMPROW *yptr, JSAMPROW *cbptr, JSAMPROW *crptr)> RowCallback;
+
+	explicit SlicedJPEGEncoder(unsigned num_helper_threads);
+	~SlicedJPEGEncoder();
+
+	// Returns a complete JPEG file. num_slices = 1 gives the same output
+	// as a plain libjpeg encode (and does not touch the helper threads);
+	// num_slices may be adjusted somewhat to fit the image and the limits
+	// of the DRI marker.
+	std::vector<uint8_t> encode(unsigned width, unsigned height, unsigned num_slices, int quality, const RowCallback &get_rows);
+
+	// The number of slices encode() will actually use for the given parameters,
+	// for callers that allocate scratch space per slice.
+	static unsigned actual_num_slices(unsigned width, unsigned height, unsigned num_slices);
+
+private:
+	struct Job {
+		unsigned width, height, lines_per_slice, num_slices;
+		int quality;
+		const RowCallback *get_rows;
+		std::vector<std::vector<uint8_t>> slice_output;
+		std::atomic<unsigned> next_slice{0};
+		unsigned num_workers_active = 0;  // Under the encoder's <mu>.
+
+		void run();
+		void encode_slice(unsigned slice_idx);
+	};
+
+	static unsigned lines_per_slice(unsigned width, unsigned height, unsigned num_slices);
+	void helper_thread_func();
+
+	std::mutex mu;
+	std::deque<Job *> queued_jobs;  // Under <mu>. A job can be in here multiple times; once per helper that may help out.
+	std::condition_variable queued_jobs_changed, job_finished;
+	bool should_quit = false;  // Under <mu>.
+
+	std::vector<std::thread> helper_threads;
+};
+
+#endif  // !defined(_SLICED_JPEG_ENCODER_H)
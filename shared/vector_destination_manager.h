@@ -0,0 +1,68 @@
+#ifndef _VECTOR_DESTINATION_MANAGER_H
+#define _VECTOR_DESTINATION_MANAGER_H 1
+
+// A libjpeg destination manager that writes into a growing std::vector.
+// Set cinfo.dest = (jpeg_destination_mgr *)&dest; the finished JPEG
+// is in <dest> after jpeg_finish_compress().
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <jpeglib.h>
+
+#include <type_traits>
+#include <vector>
+
+struct VectorDestinationManager {
+	jpeg_destination_mgr pub;
+	std::vector<uint8_t> dest;
+
+	VectorDestinationManager()
+	{
+		pub.init_destination = init_destination_thunk;
+		pub.empty_output_buffer = empty_output_buffer_thunk;
+		pub.term_destination = term_destination_thunk;
+	}
+
+	static void init_destination_thunk(j_compress_ptr ptr)
+	{
+		((VectorDestinationManager *)(ptr->dest))->init_destination();
+	}
+
+	inline void init_destination()
+	{
+		make_room(0);
+	}
+
+	static boolean empty_output_buffer_thunk(j_compress_ptr ptr)
+	{
+		return ((VectorDestinationManager *)(ptr->dest))->empty_output_buffer();
+	}
+
+	inline bool empty_output_buffer()
+	{
+		make_room(dest.size());  // Should ignore pub.free_in_buffer!
+		return true;
+	}
+
+	inline void make_room(size_t bytes_used)
+	{
+		dest.resize(bytes_used + 4096);
+		dest.resize(dest.capacity());
+		pub.next_output_byte = dest.data() + bytes_used;
+		pub.free_in_buffer = dest.size() - bytes_used;
+	}
+
+	static void term_destination_thunk(j_compress_ptr ptr)
+	{
+		((VectorDestinationManager *)(ptr->dest))->term_destination();
+	}
+
+	inline void term_destination()
+	{
+		dest.resize(dest.size() - pub.free_in_buffer);
+	}
+};
+static_assert(std::is_standard_layout<VectorDestinationManager>::value, "");
+
+#endif  // !defined(_VECTOR_DESTINATION_MANAGER_H)